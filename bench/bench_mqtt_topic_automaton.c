@@ -0,0 +1,184 @@
+/**
+ * Measures matching literal topics against a wildcard-heavy set of
+ * patterns, walking the tree with mqtt_topic_matching_iter against
+ * running an automaton with mqtt_topic_automaton_matching_iter, first
+ * with a fixed set of patterns and then with subscribes and
+ * unsubscribes interleaved with the publishes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mqtt_topic_tree.h"
+
+#define LEVELS 6
+#define VALUES 8
+#define PUBLISHES 200000
+#define TOPICS 1024
+
+/* Patterns subscribed during the churn runs, each unsubscribed again
+ * once this many later ones have been. */
+#define CHURN_WINDOW 64
+#define CHURN_PATTERNS 10000
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void count(void *data, char *topic, mqtt_topic_segment_s *segment) {
+  ++*(long *)data;
+}
+
+/**
+ * random_topic writes a topic of LEVELS levels to buf, each level
+ * being + with probability plus percent, and ending early with #
+ * with probability hash percent.
+ */
+static void random_topic(char *buf, unsigned int *seed, int plus, int hash) {
+  int len = 0;
+
+  for (int level = 0; level < LEVELS; ++level) {
+    if (level > 0) {
+      buf[len++] = '/';
+    }
+    if (level > 0 && rand_r(seed) % 100 < hash) {
+      len += sprintf(buf + len, "#");
+      break;
+    }
+    if (rand_r(seed) % 100 < plus) {
+      len += sprintf(buf + len, "+");
+    } else {
+      len += sprintf(buf + len, "v%d", rand_r(seed) % VALUES);
+    }
+  }
+  buf[len] = '\0';
+}
+
+static void set(void *data, char *topic, mqtt_topic_segment_s *segment) {
+  segment->data = data;
+}
+
+/**
+ * churn_run builds a tree of CHURN_PATTERNS patterns, then matches
+ * PUBLISHES topics against it, either with an automaton or by walking
+ * the tree, subscribing a new pattern and unsubscribing an old one
+ * every interval publishes. matched is set to the number of matches.
+ *
+ * Returns the number of publishes per second.
+ */
+static double churn_run(char topics[][64], int interval, int automaton,
+                        long *matched) {
+  static char window[CHURN_WINDOW][64];
+  mqtt_topic_segment_s *root = mqtt_topic_segment_create();
+  mqtt_topic_automaton_s *a = mqtt_topic_automaton_create(root);
+  mqtt_iter_cb_s cb = { .data = matched, .fn = &count };
+  mqtt_iter_cb_s sub = { .fn = &set };
+  unsigned int seed = 2;
+  int changes = 0;
+  double start;
+  char buf[64];
+
+  for (int i = 0; i < CHURN_PATTERNS; ++i) {
+    random_topic(buf, &seed, 35, 15);
+    sub.data = root;
+    mqtt_topic_update(root, buf, &sub);
+  }
+
+  *matched = 0;
+  start = now();
+  for (int i = 0; i < PUBLISHES; ++i) {
+    if (interval && i % interval == 0) {
+      /* Clearing the data of a pattern unsubscribes it, removing its
+       * segment unless another pattern goes through it. */
+      if (changes >= CHURN_WINDOW) {
+        strcpy(buf, window[changes % CHURN_WINDOW]);
+        sub.data = NULL;
+        mqtt_topic_update(root, buf, &sub);
+      }
+      random_topic(window[changes % CHURN_WINDOW], &seed, 35, 15);
+      strcpy(buf, window[changes % CHURN_WINDOW]);
+      sub.data = root;
+      mqtt_topic_update(root, buf, &sub);
+      ++changes;
+    }
+    if (automaton) {
+      mqtt_topic_automaton_matching_iter(a, topics[i % TOPICS], &cb);
+    } else {
+      strcpy(buf, topics[i % TOPICS]);
+      mqtt_topic_matching_iter(root, buf, &cb);
+    }
+  }
+  start = PUBLISHES / (now() - start);
+
+  mqtt_topic_automaton_destroy(a);
+  mqtt_topic_segment_destroy(root);
+  return start;
+}
+
+int main(int argc, char **argv) {
+  int pattern_counts[] = { 1000, 10000, 50000 };
+  int churn_intervals[] = { 10000, 1000, 100, 10 };
+  static char topics[TOPICS][64];
+  unsigned int seed = 1;
+  char buf[64];
+
+  for (int i = 0; i < TOPICS; ++i) {
+    random_topic(topics[i], &seed, 0, 0);
+  }
+
+  printf("%10s %14s %14s %12s\n", "patterns", "walk/s", "automaton/s",
+         "matches");
+  for (int c = 0; c < sizeof(pattern_counts) / sizeof(pattern_counts[0]);
+       ++c) {
+    mqtt_topic_segment_s *root = mqtt_topic_segment_create(), *segment;
+    mqtt_topic_automaton_s *a = mqtt_topic_automaton_create(root);
+    long walked = 0, run = 0;
+    mqtt_iter_cb_s cb = { .fn = &count };
+    double start, walk_rate, automaton_rate;
+
+    for (int i = 0; i < pattern_counts[c]; ++i) {
+      random_topic(buf, &seed, 35, 15);
+      mqtt_topic_find_or_add(&segment, root, buf, 1);
+      segment->data = root;
+    }
+
+    cb.data = &walked;
+    start = now();
+    for (int i = 0; i < PUBLISHES; ++i) {
+      strcpy(buf, topics[i % TOPICS]);
+      mqtt_topic_matching_iter(root, buf, &cb);
+    }
+    walk_rate = PUBLISHES / (now() - start);
+
+    cb.data = &run;
+    start = now();
+    for (int i = 0; i < PUBLISHES; ++i) {
+      mqtt_topic_automaton_matching_iter(a, topics[i % TOPICS], &cb);
+    }
+    automaton_rate = PUBLISHES / (now() - start);
+
+    printf("%10d %14.0f %14.0f %12ld%s\n", pattern_counts[c], walk_rate,
+           automaton_rate, walked / PUBLISHES,
+           walked == run ? "" : " (mismatch)");
+    mqtt_topic_automaton_destroy(a);
+    mqtt_topic_segment_destroy(root);
+  }
+
+  printf("\n%10s %14s %14s %12s\n", "pubs/change", "walk/s",
+         "automaton/s", "matches");
+  for (int c = 0; c < sizeof(churn_intervals) / sizeof(churn_intervals[0]);
+       ++c) {
+    long walked, run;
+    double walk_rate = churn_run(topics, churn_intervals[c], 0, &walked);
+    double automaton_rate = churn_run(topics, churn_intervals[c], 1, &run);
+
+    printf("%10d %14.0f %14.0f %12ld%s\n", churn_intervals[c], walk_rate,
+           automaton_rate, walked / PUBLISHES,
+           walked == run ? "" : " (mismatch)");
+  }
+  return 0;
+}
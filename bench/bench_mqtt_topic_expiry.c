@@ -0,0 +1,96 @@
+/**
+ * Measures finding expired topics, sweeping the whole tree each cycle
+ * against advancing the expiry wheel.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "mqtt_topic_tree.h"
+
+#define TOPICS 1000000
+#define HORIZON 1000000ul
+#define CYCLES 100
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+typedef struct {
+  unsigned long now;
+  int expired;
+} sweep_s;
+
+static void clear(void *data, char *topic, mqtt_topic_segment_s *segment) {
+  segment->data = NULL;
+}
+
+static void sweep_check(void *data, char *topic,
+                        mqtt_topic_segment_s *segment) {
+  sweep_s *s = data;
+
+  if (segment->data && segment->expiry <= s->now) {
+    segment->data = NULL;
+    ++s->expired;
+  }
+}
+
+static mqtt_topic_segment_s *build(int wheel) {
+  mqtt_topic_segment_s *root = mqtt_topic_segment_create(), *segment;
+  unsigned int seed = 1;
+  char buf[64];
+
+  if (wheel) {
+    mqtt_topic_expiry_enable(root, 0);
+  }
+  for (int i = 0; i < TOPICS; ++i) {
+    sprintf(buf, "site/%d/device/%d", i % 1000, i / 1000);
+    mqtt_topic_find_or_add(&segment, root, buf, 1);
+    segment->data = root;
+    /* Sweeps keep their deadlines in the same field, unindexed. */
+    segment->expiry = 1 + rand_r(&seed) % HORIZON;
+    if (wheel) {
+      mqtt_topic_expire_at(segment, segment->expiry);
+    }
+  }
+  return root;
+}
+
+int main(int argc, char **argv) {
+  mqtt_iter_cb_s cb = { .fn = &clear };
+  mqtt_topic_segment_s *root;
+  sweep_s sweep = { 0 };
+  int expired = 0;
+  double start;
+
+  /* Each cycle expires about 1 in 10000 topics, as a cycle of a few
+   * seconds would with expiry intervals of hours. */
+  printf("%10s %10s %14s\n", "index", "expired", "us/cycle");
+
+  root = build(0);
+  cb = (mqtt_iter_cb_s){ .data = &sweep, .fn = &sweep_check };
+  start = now();
+  for (int c = 1; c <= CYCLES; ++c) {
+    sweep.now = c * 100;
+    mqtt_topic_iter(root, &cb);
+  }
+  printf("%10s %10d %14.1f\n", "sweep", sweep.expired,
+         (now() - start) / CYCLES * 1e6);
+  cb = (mqtt_iter_cb_s){ .fn = &clear };
+  mqtt_topic_iter(root, &cb);
+  mqtt_topic_segment_destroy(root);
+
+  root = build(1);
+  start = now();
+  for (int c = 1; c <= CYCLES; ++c) {
+    expired += mqtt_topic_expiry_advance(root, c * 100, &cb);
+  }
+  printf("%10s %10d %14.1f\n", "wheel", expired,
+         (now() - start) / CYCLES * 1e6);
+  mqtt_topic_iter(root, &cb);
+  mqtt_topic_segment_destroy(root);
+  return 0;
+}
@@ -0,0 +1,53 @@
+/**
+ * Measures looking up topics by the number of children per segment,
+ * across the sizes kept in the children tree and in sorted arrays.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "mqtt_topic_tree.h"
+
+#define SEGMENTS 1000000
+#define LOOKUPS 2000000
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+  static const int fanouts[] = { 4, 8, 16, 64, 256, 1024 };
+  mqtt_topic_segment_s *root, *segment;
+  unsigned int seed;
+  char buf[64];
+  double start;
+  long hits;
+
+  printf("%8s %12s %12s\n", "fanout", "lookups/s", "hits");
+  for (int f = 0; f < sizeof(fanouts) / sizeof(fanouts[0]); ++f) {
+    int fanout = fanouts[f], parents = SEGMENTS / fanout;
+
+    root = mqtt_topic_segment_create();
+    for (int p = 0; p < parents; ++p) {
+      for (int c = 0; c < fanout; ++c) {
+        sprintf(buf, "site/%d/sensor-%d", p, c);
+        mqtt_topic_find_or_add(&segment, root, buf, 1);
+      }
+    }
+
+    seed = 1;
+    hits = 0;
+    start = now();
+    for (int i = 0; i < LOOKUPS; ++i) {
+      sprintf(buf, "site/%d/sensor-%d", rand_r(&seed) % parents,
+              rand_r(&seed) % fanout);
+      hits += mqtt_topic_find_or_add(&segment, root, buf, 0) == 0;
+    }
+    printf("%8d %12.0f %12ld\n", fanout, LOOKUPS / (now() - start), hits);
+    mqtt_topic_segment_destroy(root);
+  }
+  return 0;
+}
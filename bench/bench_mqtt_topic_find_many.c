@@ -0,0 +1,74 @@
+/**
+ * Measures looking up topics in a tree much larger than the cache,
+ * one at a time against interleaved in batches.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "mqtt_topic_tree.h"
+
+#define TOPICS 1000000
+#define LOOKUPS 2000000
+#define BATCH 64
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void topic(char *buf, unsigned int *seed) {
+  int n = rand_r(seed) % TOPICS;
+
+  sprintf(buf, "site/%d/rack/%d/unit/%d", n % 1000, n / 1000 % 100, n);
+}
+
+int main(int argc, char **argv) {
+  mqtt_topic_segment_s *root = mqtt_topic_segment_create();
+  mqtt_topic_segment_s *segment, *found[BATCH];
+  static char bufs[BATCH][64];
+  char *topics[BATCH];
+  unsigned int seed = 1;
+  long hits;
+  double start;
+
+  for (int i = 0; i < TOPICS; ++i) {
+    sprintf(bufs[0], "site/%d/rack/%d/unit/%d", i % 1000, i / 1000 % 100, i);
+    mqtt_topic_find_or_add(&segment, root, bufs[0], 1);
+  }
+  for (int i = 0; i < BATCH; ++i) {
+    topics[i] = bufs[i];
+  }
+
+  printf("%12s %12s %12s\n", "lookup", "lookups/s", "hits");
+
+  seed = 1;
+  hits = 0;
+  start = now();
+  for (int i = 0; i < LOOKUPS; i += BATCH) {
+    for (int j = 0; j < BATCH; ++j) {
+      topic(bufs[j], &seed);
+    }
+    for (int j = 0; j < BATCH; ++j) {
+      hits += mqtt_topic_find_or_add(&segment, root, bufs[j], 0) == 0;
+    }
+  }
+  printf("%12s %12.0f %12ld\n", "sequential", LOOKUPS / (now() - start), hits);
+
+  seed = 1;
+  hits = 0;
+  start = now();
+  for (int i = 0; i < LOOKUPS; i += BATCH) {
+    for (int j = 0; j < BATCH; ++j) {
+      topic(bufs[j], &seed);
+    }
+    hits += mqtt_topic_find_many(root, topics, BATCH, found);
+  }
+  printf("%12s %12.0f %12ld\n", "interleaved", LOOKUPS / (now() - start),
+         hits);
+
+  mqtt_topic_segment_destroy(root);
+  return 0;
+}
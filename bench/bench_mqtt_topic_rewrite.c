@@ -0,0 +1,71 @@
+/**
+ * Measures rewriting topics, trying a list of regular expressions in
+ * turn against one walk of a rewrite rule tree.
+ */
+
+#include <regex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mqtt_topic_rewrite.h"
+
+#define RULES 1000
+#define REGEX_REWRITES 20000
+#define TREE_REWRITES 1000000
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+  mqtt_topic_rewrite_s *rw = mqtt_topic_rewrite_create();
+  regex_t *regexes = malloc(RULES * sizeof(*regexes));
+  char buf[128], out[128], pattern[128];
+  unsigned int seed = 1;
+  regmatch_t m[2];
+  long bytes = 0;
+  double start;
+  int rule;
+
+  for (int i = 0; i < RULES; ++i) {
+    sprintf(pattern, "^legacy/%d/([^/]+)/data$", i);
+    regcomp(&regexes[i], pattern, REG_EXTENDED);
+    sprintf(pattern, "legacy/%d/+/data", i);
+    sprintf(buf, "v2/%d/{1}/telemetry", i);
+    mqtt_topic_rewrite_add(rw, pattern, buf);
+  }
+
+  printf("%8s %12s\n", "method", "rewrites/s");
+  start = now();
+  for (int i = 0; i < REGEX_REWRITES; ++i) {
+    rule = rand_r(&seed) % RULES;
+    sprintf(buf, "legacy/%d/sensor%d/data", rule, i);
+    for (int r = 0; r < RULES; ++r) {
+      if (regexec(&regexes[r], buf, 2, m, 0) == 0) {
+        bytes += snprintf(out, sizeof(out), "v2/%d/%.*s/telemetry", r,
+                          (int)(m[1].rm_eo - m[1].rm_so), buf + m[1].rm_so);
+        break;
+      }
+    }
+  }
+  printf("%8s %12.0f\n", "regex", REGEX_REWRITES / (now() - start));
+
+  start = now();
+  for (int i = 0; i < TREE_REWRITES; ++i) {
+    rule = rand_r(&seed) % RULES;
+    sprintf(buf, "legacy/%d/sensor%d/data", rule, i);
+    bytes += mqtt_topic_rewrite_apply(rw, buf, out, sizeof(out));
+  }
+  printf("%8s %12.0f\n", "tree", TREE_REWRITES / (now() - start));
+
+  for (int i = 0; i < RULES; ++i) {
+    regfree(&regexes[i]);
+  }
+  free(regexes);
+  mqtt_topic_rewrite_destroy(rw);
+  return bytes == 0;
+}
@@ -0,0 +1,109 @@
+/**
+ * Measures finding the peers to forward a publish to, matching one
+ * tree per peer against matching a single route table.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mqtt_topic_routes.h"
+
+#define LEVELS 4
+#define VALUES 16
+#define FILTERS_PER_PEER 2000
+#define PUBLISHES 20000
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void hit(void *data, char *topic, mqtt_topic_segment_s *segment) {
+  if (segment->data) {
+    *(int *)data = 1;
+  }
+}
+
+/**
+ * random_topic writes a topic of LEVELS levels to buf, each level
+ * being + with probability plus percent.
+ */
+static void random_topic(char *buf, unsigned int *seed, int plus) {
+  int len = 0;
+
+  for (int level = 0; level < LEVELS; ++level) {
+    if (level > 0) {
+      buf[len++] = '/';
+    }
+    if (rand_r(seed) % 100 < plus) {
+      len += sprintf(buf + len, "+");
+    } else {
+      len += sprintf(buf + len, "v%d", rand_r(seed) % VALUES);
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  int peer_counts[] = { 4, 16, 64, 256 };
+  unsigned int seed = 1;
+  char buf[64];
+
+  printf("%8s %14s %14s %10s\n", "peers", "per-peer/s", "routes/s", "dests");
+  for (int c = 0; c < sizeof(peer_counts) / sizeof(peer_counts[0]); ++c) {
+    int peers = peer_counts[c];
+    mqtt_topic_segment_s **trees = malloc(peers * sizeof(*trees)), *segment;
+    mqtt_topic_routes_s *t = mqtt_topic_routes_create(peers);
+    uint64_t *dest = malloc(mqtt_topic_routes_words(t) * sizeof(*dest));
+    long walked = 0, routed = 0;
+    double start, tree_rate, route_rate;
+    int found;
+
+    for (int p = 0; p < peers; ++p) {
+      trees[p] = mqtt_topic_segment_create();
+      for (int i = 0; i < FILTERS_PER_PEER; ++i) {
+        random_topic(buf, &seed, 20);
+        mqtt_topic_routes_add(t, buf, p);
+        mqtt_topic_find_or_add(&segment, trees[p], buf, 1);
+        segment->data = trees[p];
+      }
+    }
+
+    start = now();
+    for (int i = 0; i < PUBLISHES; ++i) {
+      unsigned int s = i;
+      for (int p = 0; p < peers; ++p) {
+        mqtt_iter_cb_s cb = { .data = &found, .fn = &hit };
+
+        found = 0;
+        random_topic(buf, &s, 0);
+        mqtt_topic_matching_iter(trees[p], buf, &cb);
+        walked += found;
+        s = i;
+      }
+    }
+    tree_rate = PUBLISHES / (now() - start);
+
+    start = now();
+    for (int i = 0; i < PUBLISHES; ++i) {
+      unsigned int s = i;
+
+      random_topic(buf, &s, 0);
+      routed += mqtt_topic_routes_match(t, buf, dest);
+    }
+    route_rate = PUBLISHES / (now() - start);
+
+    printf("%8d %14.0f %14.0f %10.1f%s\n", peers, tree_rate, route_rate,
+           (double)routed / PUBLISHES, walked == routed ? "" : " (mismatch)");
+    for (int p = 0; p < peers; ++p) {
+      mqtt_topic_segment_destroy(trees[p]);
+    }
+    mqtt_topic_routes_destroy(t);
+    free(trees);
+    free(dest);
+  }
+  return 0;
+}
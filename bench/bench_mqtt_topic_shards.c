@@ -0,0 +1,85 @@
+/**
+ * Measures subscribe and unsubscribe throughput of a sharded topic
+ * tree as the number of threads grows, against a single tree behind
+ * one lock (a sharded tree with a single shard).
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mqtt_topic_shards.h"
+
+#define OPS_PER_THREAD 50000
+#define SHARDS 64
+#define MAX_THREADS 64
+
+typedef struct {
+  mqtt_topic_shards_s *tree;
+  int id;
+  int subscribe;
+} worker_s;
+
+static void set_data(void *data, char *topic, mqtt_topic_segment_s *segment) {
+  segment->data = data;
+}
+
+static void *worker(void *arg) {
+  worker_s *w = arg;
+  mqtt_iter_cb_s cb = {
+    .data = w->subscribe ? w : NULL,
+    .fn = &set_data,
+  };
+  char topic[64];
+
+  for (int i = 0; i < OPS_PER_THREAD; ++i) {
+    snprintf(topic, sizeof(topic), "tenant%d/group%d/dev/%d/temp",
+             w->id, i % 64, i);
+    mqtt_topic_shards_update(w->tree, topic, &cb);
+  }
+  return NULL;
+}
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double run(mqtt_topic_shards_s *tree, int threads, int subscribe) {
+  pthread_t tids[MAX_THREADS];
+  worker_s workers[MAX_THREADS];
+  double start = now();
+
+  for (int i = 0; i < threads; ++i) {
+    workers[i] = (worker_s){ .tree = tree, .id = i, .subscribe = subscribe };
+    pthread_create(&tids[i], NULL, &worker, &workers[i]);
+  }
+  for (int i = 0; i < threads; ++i) {
+    pthread_join(tids[i], NULL);
+  }
+  return threads * OPS_PER_THREAD / (now() - start);
+}
+
+int main(int argc, char **argv) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int max_threads = cpus < 4 ? 4 : (cpus > MAX_THREADS ? MAX_THREADS : cpus);
+  int shard_counts[] = { 1, SHARDS };
+
+  printf("%8s %8s %14s %14s\n", "shards", "threads", "subscribe/s",
+         "unsubscribe/s");
+  for (int s = 0; s < 2; ++s) {
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+      /* Shard on tenant and group. */
+      mqtt_topic_shards_s *tree = mqtt_topic_shards_create(shard_counts[s], 2);
+      double sub = run(tree, threads, 1);
+      double unsub = run(tree, threads, 0);
+      printf("%8d %8d %14.0f %14.0f\n", shard_counts[s], threads, sub, unsub);
+      mqtt_topic_shards_destroy(tree);
+    }
+  }
+  printf("(%ld cpus online)\n", cpus);
+  return 0;
+}
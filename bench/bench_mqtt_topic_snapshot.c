@@ -0,0 +1,106 @@
+/**
+ * Measures updates to a concurrent tree while another thread reads
+ * it through snapshots, against updates with no snapshot open, and
+ * how long reading a snapshot of the whole tree takes.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "mqtt_topic_tree.h"
+
+#define TOPICS 200000
+#define UPDATES 2000000
+
+static int values[2];
+static _Atomic int done;
+static _Atomic long snapshots;
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void set(void *data, char *topic, mqtt_topic_segment_s *segment) {
+  segment->data = data;
+}
+
+static void count(void *data, const char *topic, void *value) {
+  ++*(long *)data;
+}
+
+static void *reader(void *arg) {
+  mqtt_topic_snapshot_cb_s cb = { .fn = &count };
+  mqtt_topic_snapshot_s *snapshot;
+  long seen;
+
+  while (!atomic_load(&done)) {
+    seen = 0;
+    cb.data = &seen;
+    snapshot = mqtt_topic_snapshot_begin(arg);
+    mqtt_topic_snapshot_iter(snapshot, &cb);
+    mqtt_topic_snapshot_end(snapshot);
+    atomic_fetch_add(&snapshots, 1);
+  }
+  return NULL;
+}
+
+static double run_updates(mqtt_topic_segment_s *root) {
+  mqtt_iter_cb_s cb = { .fn = &set };
+  unsigned int seed = 1;
+  char buf[64];
+  double start = now();
+
+  for (int i = 0; i < UPDATES; ++i) {
+    sprintf(buf, "client/%d/state", rand_r(&seed) % TOPICS);
+    cb.data = &values[i & 1];
+    mqtt_topic_update(root, buf, &cb);
+  }
+  return UPDATES / (now() - start);
+}
+
+int main(int argc, char **argv) {
+  mqtt_topic_segment_s *root = mqtt_topic_segment_create();
+  mqtt_topic_snapshot_cb_s cb = { .fn = &count };
+  mqtt_topic_snapshot_s *snapshot;
+  mqtt_iter_cb_s set_cb = { .data = &values[0], .fn = &set };
+  pthread_t tid;
+  char buf[64];
+  double start, rate;
+  long seen = 0;
+
+  mqtt_topic_concurrent_enable(root);
+  for (int i = 0; i < TOPICS; ++i) {
+    sprintf(buf, "client/%d/state", i);
+    mqtt_topic_update(root, buf, &set_cb);
+  }
+
+  start = now();
+  snapshot = mqtt_topic_snapshot_begin(root);
+  cb.data = &seen;
+  mqtt_topic_snapshot_iter(snapshot, &cb);
+  mqtt_topic_snapshot_end(snapshot);
+  printf("snapshot of %ld topics: %.1f ms\n", seen, (now() - start) * 1e3);
+
+  printf("updates/s, no snapshot: %.0f\n", run_updates(root));
+
+  pthread_create(&tid, NULL, &reader, root);
+  rate = run_updates(root);
+  atomic_store(&done, 1);
+  pthread_join(tid, NULL);
+  printf("updates/s, snapshots in a loop: %.0f (%ld snapshots read)\n",
+         rate, atomic_load(&snapshots));
+
+  set_cb.data = NULL;
+  for (int i = 0; i < TOPICS; ++i) {
+    sprintf(buf, "client/%d/state", i);
+    mqtt_topic_update(root, buf, &set_cb);
+  }
+  mqtt_epoch_barrier();
+  mqtt_topic_segment_destroy(root);
+  return 0;
+}
@@ -0,0 +1,109 @@
+/**
+ * Measures logging subscriptions, then rebuilding the tree from the
+ * log and from a checkpoint.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mqtt_topic_wal.h"
+
+#define TOPICS 1000000
+#define GROUP 1000
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Subscriptions carry no data of their own here; every segment with
+ * data points at the same marker. */
+static int marker;
+
+static void *load(void *data, const void *payload, size_t len) {
+  return &marker;
+}
+
+static size_t save(void *data, void *value, void *buf, size_t size) {
+  if (size >= 1) {
+    *(char *)buf = 1;
+  }
+  return 1;
+}
+
+static const mqtt_topic_wal_codec_s codec = { .load = &load, .save = &save };
+
+static void topic_of(char *buf, int i) {
+  sprintf(buf, "tenant/%d/device/%d/state", i / 1000, i % 1000);
+}
+
+/**
+ * recover rebuilds a tree from the log at path, returning the time it
+ * took.
+ */
+static double recover(const char *path) {
+  mqtt_topic_segment_s *root = mqtt_topic_segment_create();
+  mqtt_topic_wal_s *w;
+  double start = now(), elapsed;
+
+  w = mqtt_topic_wal_open(path, root, &codec);
+  elapsed = now() - start;
+  if (w == NULL) {
+    fprintf(stderr, "recovery failed\n");
+    exit(1);
+  }
+  mqtt_topic_wal_close(w);
+  mqtt_topic_segment_destroy(root);
+  return elapsed;
+}
+
+int main(int argc, char **argv) {
+  char dir[] = "/tmp/bench_mqtt_topic_wal_XXXXXX", path[64], snap[80];
+  mqtt_topic_segment_s *root = mqtt_topic_segment_create(), *segment;
+  char one = 1, topic[64];
+  mqtt_topic_wal_s *w;
+  double start;
+
+  if (mkdtemp(dir) == NULL) {
+    perror("mkdtemp");
+    return 1;
+  }
+  sprintf(path, "%s/log", dir);
+  sprintf(snap, "%s/log.snap", dir);
+
+  w = mqtt_topic_wal_open(path, root, &codec);
+  start = now();
+  for (int i = 0; i < TOPICS; ++i) {
+    topic_of(topic, i);
+    mqtt_topic_find_or_add(&segment, root, topic, 1);
+    segment->data = &marker;
+    topic_of(topic, i);
+    mqtt_topic_wal_append(w, MQTT_TOPIC_WAL_ADD, topic, &one, 1, NULL);
+    if ((i + 1) % GROUP == 0) {
+      mqtt_topic_wal_commit(w, 0);
+    }
+  }
+  mqtt_topic_wal_commit(w, 0);
+  printf("%-24s %10.0f /s\n", "add and log", TOPICS / (now() - start));
+  mqtt_topic_wal_close(w);
+
+  printf("%-24s %10.3f s\n", "recover from log", recover(path));
+
+  w = mqtt_topic_wal_open(path, root, &codec);
+  start = now();
+  mqtt_topic_wal_checkpoint(w, root, &codec);
+  printf("%-24s %10.3f s\n", "checkpoint", now() - start);
+  mqtt_topic_wal_close(w);
+
+  printf("%-24s %10.3f s\n", "recover from snapshot", recover(path));
+
+  mqtt_topic_segment_destroy(root);
+  unlink(path);
+  unlink(snap);
+  rmdir(dir);
+  return 0;
+}
@@ -0,0 +1,95 @@
+/**
+ * Measures the throughput of threads adding and removing siblings
+ * under one parent in a concurrent topic tree, with the parent's
+ * children in its red-black tree behind the parent's lock, and in a
+ * lock-free map after mqtt_topic_make_wide.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mqtt_topic_tree.h"
+
+#define OPS_PER_THREAD 50000
+#define MAX_THREADS 64
+
+typedef struct {
+  mqtt_topic_segment_s *root;
+  int id;
+  int subscribe;
+} worker_s;
+
+static void set_data(void *data, char *topic, mqtt_topic_segment_s *segment) {
+  segment->data = data;
+}
+
+static void *worker(void *arg) {
+  worker_s *w = arg;
+  mqtt_iter_cb_s cb = {
+    .data = w->subscribe ? w : NULL,
+    .fn = &set_data,
+  };
+  char topic[64];
+
+  for (int i = 0; i < OPS_PER_THREAD; ++i) {
+    snprintf(topic, sizeof(topic), "devices/%d-%d", w->id, i);
+    mqtt_topic_update(w->root, topic, &cb);
+  }
+  return NULL;
+}
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double run(mqtt_topic_segment_s *root, int threads, int subscribe) {
+  pthread_t tids[MAX_THREADS];
+  worker_s workers[MAX_THREADS];
+  double start = now();
+
+  for (int i = 0; i < threads; ++i) {
+    workers[i] = (worker_s){ .root = root, .id = i, .subscribe = subscribe };
+    pthread_create(&tids[i], NULL, &worker, &workers[i]);
+  }
+  for (int i = 0; i < threads; ++i) {
+    pthread_join(tids[i], NULL);
+  }
+  return threads * OPS_PER_THREAD / (now() - start);
+}
+
+int main(int argc, char **argv) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int max_threads = cpus < 4 ? 4 : (cpus > MAX_THREADS ? MAX_THREADS : cpus);
+  mqtt_topic_segment_s *parent;
+  char topic[16];
+
+  printf("%8s %8s %14s %14s\n", "wide", "threads", "subscribe/s",
+         "unsubscribe/s");
+  for (int wide = 0; wide < 2; ++wide) {
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+      mqtt_topic_segment_s *root = mqtt_topic_segment_create();
+      mqtt_topic_concurrent_enable(root);
+      if (wide) {
+        /* Keep the parent alive while it has no children, so it is
+         * wide for the whole run. */
+        snprintf(topic, sizeof(topic), "devices");
+        mqtt_topic_find_or_add(&parent, root, topic, 1);
+        parent->data = root;
+        mqtt_topic_make_wide(parent);
+      }
+      double sub = run(root, threads, 1);
+      double unsub = run(root, threads, 0);
+      printf("%8s %8d %14.0f %14.0f\n", wide ? "yes" : "no", threads, sub,
+             unsub);
+      mqtt_epoch_barrier();
+      mqtt_topic_segment_destroy(root);
+    }
+  }
+  printf("(%ld cpus online)\n", cpus);
+  return 0;
+}
@@ -0,0 +1,50 @@
+#ifndef _MQTT_EPOCH_H_
+#define _MQTT_EPOCH_H_
+
+/**
+ * Epoch-based reclamation for structures that are read without
+ * locks. Memory unlinked from such a structure is retired rather
+ * than freed, and is only released once every thread that could
+ * still be reading it has left its read-side critical section.
+ */
+
+/**
+ * mqtt_epoch_entry_s is embedded in memory awaiting release, which
+ * avoids allocating when memory is retired.
+ */
+typedef struct mqtt_epoch_entry {
+  struct mqtt_epoch_entry *next;
+  unsigned long epoch;
+  void (*fn)(struct mqtt_epoch_entry *entry);
+} mqtt_epoch_entry_s;
+
+/**
+ * mqtt_epoch_enter begins a read-side critical section on the calling
+ * thread. Memory retired by any thread after this call is not
+ * released before the matching call to mqtt_epoch_exit. Critical
+ * sections may nest.
+ */
+void mqtt_epoch_enter(void);
+
+/**
+ * mqtt_epoch_exit ends a critical section begun by mqtt_epoch_enter.
+ */
+void mqtt_epoch_exit(void);
+
+/**
+ * mqtt_epoch_retire arranges for fn(entry) to be called once no
+ * thread can still be reading the memory containing entry, which
+ * must already be unreachable to new readers.
+ */
+void mqtt_epoch_retire(mqtt_epoch_entry_s *entry,
+                       void (*fn)(mqtt_epoch_entry_s *entry));
+
+/**
+ * mqtt_epoch_barrier waits for every thread to leave the critical
+ * sections it is in, then releases everything retired by the calling
+ * thread and by threads that have exited. It must not be called from
+ * inside a critical section.
+ */
+void mqtt_epoch_barrier(void);
+
+#endif
@@ -0,0 +1,100 @@
+#ifndef _MQTT_RB_H_
+#define _MQTT_RB_H_
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+/**
+ * An intrusive red-black tree. Nodes are embedded in the values they
+ * order, so a tree needs no allocation of its own and a lookup reads
+ * each value directly. The tree itself is only a pointer to its root
+ * node, NULL while it is empty.
+ *
+ * The tree does not compare keys: callers walk it themselves to find
+ * a node or the link a new node belongs at.
+ *
+ * Removing a node leaves its own links as they were, so readers that
+ * do not hold the writer's lock can keep walking from a node that has
+ * just been removed, as long as nodes are only freed once no reader
+ * can reach them. Such readers may still see a tree in the middle of
+ * a rotation, and must bound their descent and validate what they
+ * find by other means. Links are atomic so that such reads are well
+ * defined: writers store them with release, so that a node is seen
+ * whole through whichever link leads to it, and readers load them
+ * with the accessors below, which acquire.
+ */
+
+/**
+ * mqtt_rb_node_s is embedded in each value stored in a tree. The
+ * color of the node is kept in the lowest bit of parent_color, which
+ * nodes being at least pointer aligned leaves free.
+ */
+typedef struct mqtt_rb_node {
+  _Atomic(struct mqtt_rb_node *) left;
+  _Atomic(struct mqtt_rb_node *) right;
+  /* The parent node, or 0 at the root, with the lowest bit set if
+   * the node is red. */
+  _Atomic uintptr_t parent_color;
+} mqtt_rb_node_s;
+
+/**
+ * mqtt_rb_left returns the left child of node, or NULL.
+ */
+static inline mqtt_rb_node_s *mqtt_rb_left(mqtt_rb_node_s *node) {
+  return atomic_load_explicit(&node->left, memory_order_acquire);
+}
+
+/**
+ * mqtt_rb_right returns the right child of node, or NULL.
+ */
+static inline mqtt_rb_node_s *mqtt_rb_right(mqtt_rb_node_s *node) {
+  return atomic_load_explicit(&node->right, memory_order_acquire);
+}
+
+/**
+ * mqtt_rb_parent returns the parent of node, or NULL if node is the
+ * root.
+ */
+static inline mqtt_rb_node_s *mqtt_rb_parent(mqtt_rb_node_s *node) {
+  return (mqtt_rb_node_s *)(
+      atomic_load_explicit(&node->parent_color, memory_order_acquire) &
+      ~(uintptr_t)1);
+}
+
+/**
+ * mqtt_rb_root returns the root node of the tree at *h_root, or NULL
+ * if it is empty.
+ */
+static inline mqtt_rb_node_s *
+mqtt_rb_root(_Atomic(mqtt_rb_node_s *) *h_root) {
+  return atomic_load_explicit(h_root, memory_order_acquire);
+}
+
+/**
+ * mqtt_rb_insert links node into the tree rooted at *h_root at link,
+ * which is *h_root itself if the tree is empty, or the empty left or
+ * right link of parent, then rebalances the tree. The fields of the
+ * value holding node are made visible to readers before node is.
+ */
+void mqtt_rb_insert(_Atomic(mqtt_rb_node_s *) *h_root, mqtt_rb_node_s *parent,
+                    _Atomic(mqtt_rb_node_s *) *link, mqtt_rb_node_s *node);
+
+/**
+ * mqtt_rb_remove unlinks node from the tree rooted at *h_root, then
+ * rebalances the tree.
+ */
+void mqtt_rb_remove(_Atomic(mqtt_rb_node_s *) *h_root, mqtt_rb_node_s *node);
+
+/**
+ * mqtt_rb_first returns the first node of the tree with the given
+ * root, or NULL if it is empty.
+ */
+mqtt_rb_node_s *mqtt_rb_first(mqtt_rb_node_s *root);
+
+/**
+ * mqtt_rb_next returns the node following node, or NULL if node is
+ * the last one.
+ */
+mqtt_rb_node_s *mqtt_rb_next(mqtt_rb_node_s *node);
+
+#endif
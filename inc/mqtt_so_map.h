@@ -0,0 +1,113 @@
+#ifndef _MQTT_SO_MAP_H_
+#define _MQTT_SO_MAP_H_
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * A lock-free hash map from strings to intrusive nodes, built as a
+ * split-ordered list: every node sits on a single lock-free linked
+ * list sorted by bit-reversed hash, and buckets are shortcuts into
+ * that list. Doubling the bucket count splits each bucket in two
+ * without moving any node, so the map grows without locking.
+ *
+ * Nodes that have been removed may still be traversed by concurrent
+ * operations. Callers that free them must defer that, for instance
+ * with mqtt_epoch_retire, and must call every function other than
+ * mqtt_so_map_create and mqtt_so_map_destroy from inside an epoch
+ * critical section.
+ */
+
+/**
+ * mqtt_so_node_s is embedded in each value stored in the map. key
+ * must be set before the node is inserted, and must not change while
+ * it is in the map.
+ */
+typedef struct mqtt_so_node {
+  _Atomic uintptr_t next;
+  uint32_t so_key;
+  const char *key;
+} mqtt_so_node_s;
+
+typedef struct mqtt_so_map mqtt_so_map_s;
+
+/**
+ * mqtt_so_map_create creates an empty map.
+ *
+ * Returns NULL if out of memory.
+ */
+mqtt_so_map_s *mqtt_so_map_create(void);
+
+/**
+ * mqtt_so_map_destroy frees a map, calling fn, if it is not NULL,
+ * for every node still in it. It must not be used concurrently.
+ */
+void mqtt_so_map_destroy(mqtt_so_map_s *m, void (*fn)(mqtt_so_node_s *node));
+
+/**
+ * mqtt_so_map_find returns the node whose key is the first len bytes
+ * of key, or NULL if there is none. key need not be NUL-terminated.
+ */
+mqtt_so_node_s *mqtt_so_map_find(mqtt_so_map_s *m, const char *key,
+                                 size_t len);
+
+/**
+ * mqtt_so_map_hash returns the hash the map files the first len bytes
+ * of key under: 32-bit FNV-1a. Callers that look the same key up
+ * again and again can compute it once.
+ */
+uint32_t mqtt_so_map_hash(const char *key, size_t len);
+
+/**
+ * mqtt_so_map_find_hashed is mqtt_so_map_find for a key whose
+ * mqtt_so_map_hash is already known.
+ */
+mqtt_so_node_s *mqtt_so_map_find_hashed(mqtt_so_map_s *m, const char *key,
+                                        size_t len, uint32_t hash);
+
+/**
+ * mqtt_so_map_insert inserts node unless the map already holds its
+ * key.
+ *
+ * Returns node if it was inserted, the node already holding the key
+ * if there is one, or NULL if the map has been closed.
+ */
+mqtt_so_node_s *mqtt_so_map_insert(mqtt_so_map_s *m, mqtt_so_node_s *node);
+
+/**
+ * mqtt_so_map_remove removes node from the map. Once it returns,
+ * node is no longer reachable by operations that start afterwards.
+ *
+ * Returns 0 if node was removed, 1 if it was not in the map.
+ */
+int mqtt_so_map_remove(mqtt_so_map_s *m, mqtt_so_node_s *node);
+
+/**
+ * mqtt_so_map_empty returns 1 if the map holds no nodes, 0 otherwise.
+ */
+int mqtt_so_map_empty(mqtt_so_map_s *m);
+
+/**
+ * mqtt_so_map_close closes the map to further inserts if it is
+ * empty. This lets a map be retired along with its owner without a
+ * concurrent insert being lost.
+ *
+ * Returns 1 if the map was closed, 0 if it was not empty.
+ */
+int mqtt_so_map_close(mqtt_so_map_s *m);
+
+/**
+ * mqtt_so_map_chunk copies up to max nodes into out, in map order,
+ * starting with the first node that follows the key after, or with
+ * the first node if after is NULL. Map order is fixed but otherwise
+ * arbitrary, so calling this repeatedly with the key of the last node
+ * returned visits every node present throughout exactly once, even
+ * while the map changes.
+ *
+ * Returns the number of nodes copied.
+ */
+int mqtt_so_map_chunk(mqtt_so_map_s *m, const char *after,
+                      mqtt_so_node_s **out, int max);
+
+#endif
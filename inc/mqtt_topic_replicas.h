@@ -0,0 +1,76 @@
+#ifndef _MQTT_TOPIC_REPLICAS_H_
+#define _MQTT_TOPIC_REPLICAS_H_
+
+#include "mqtt_topic_tree.h"
+
+/**
+ * mqtt_topic_replicas_s keeps one replica of a topic tree per NUMA
+ * node, so that matchers read memory local to their socket.
+ *
+ * Updates are not applied to the replicas directly. They are
+ * appended to a shared operation log, and each replica replays the
+ * log when it is next matched against, from a thread on its own node.
+ * The replica's segments are therefore allocated, and first touched,
+ * by that node. The only exception is a full log. An update then
+ * brings the replica furthest behind up to date itself, so that a
+ * node with no matchers cannot hold up writers.
+ */
+typedef struct mqtt_topic_replicas mqtt_topic_replicas_s;
+
+/**
+ * mqtt_topic_replicas_node_count returns the number of NUMA nodes
+ * on this system, or 1 if that cannot be determined.
+ */
+int mqtt_topic_replicas_node_count(void);
+
+/**
+ * mqtt_topic_replicas_create creates count replicas of an empty
+ * topic tree, one per node. If count is 0, there is one replica per
+ * node on this system.
+ *
+ * Returns NULL if out of memory.
+ */
+mqtt_topic_replicas_s *mqtt_topic_replicas_create(int count);
+
+/**
+ * mqtt_topic_replicas_destroy destroys the replicas and the log. As
+ * with mqtt_topic_segment_destroy, user data must be freed first.
+ */
+void mqtt_topic_replicas_destroy(mqtt_topic_replicas_s *t);
+
+/**
+ * mqtt_topic_replicas_local_node returns the replica local to the
+ * calling thread: the NUMA node of the CPU it is running on, modulo
+ * the number of replicas. Threads that may migrate between sockets
+ * should be pinned for this to stay meaningful.
+ */
+int mqtt_topic_replicas_local_node(mqtt_topic_replicas_s *t);
+
+/**
+ * mqtt_topic_replicas_update logs setting the data of topic to data
+ * in every replica. If data is NULL, the topic is removed instead, as
+ * with mqtt_topic_segment_remove. Matches that begin after this
+ * returns see the update, on whichever node they run. Updates may be
+ * made from any thread.
+ *
+ * Returns 0 on success, -1 if out of memory.
+ */
+int mqtt_topic_replicas_update(mqtt_topic_replicas_s *t, const char *topic,
+                               void *data);
+
+/**
+ * mqtt_topic_replicas_matching_iter brings the replica of node up to
+ * date with the log, then calls cb for every segment of it that
+ * terminates a topic matching pattern, as mqtt_topic_matching_iter
+ * does, while holding the replica's read lock. It is illegal to
+ * update the replicas from cb.
+ *
+ * Returns 0 on success, or -1 if the replica could not replay the
+ * whole log for lack of memory. In that case the match runs against
+ * the replica as it is, and the remaining updates are replayed on a
+ * later match.
+ */
+int mqtt_topic_replicas_matching_iter(mqtt_topic_replicas_s *t, int node,
+                                      char *pattern, mqtt_iter_cb_s *cb);
+
+#endif
@@ -0,0 +1,115 @@
+#ifndef _MQTT_TOPIC_RETAINED_H_
+#define _MQTT_TOPIC_RETAINED_H_
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+#include "mqtt_epoch.h"
+#include "mqtt_topic_tree.h"
+
+/**
+ * mqtt_topic_payload_s is an immutable, reference-counted message
+ * payload, allocated in one piece with its bytes. The same payload can
+ * be retained in the store, handed to any number of subscribers and
+ * queued for several socket writes at once, without ever being
+ * copied. data and len may be pointed to directly, for instance by an
+ * iovec; the other fields are private.
+ */
+typedef struct mqtt_topic_payload {
+  _Atomic unsigned long refs;
+  mqtt_epoch_entry_s retired;
+  size_t len;
+  unsigned char data[];
+} mqtt_topic_payload_s;
+
+/**
+ * mqtt_topic_payload_create creates a payload holding a copy of the
+ * len bytes at data, with a single reference owned by the caller.
+ *
+ * Returns NULL if out of memory.
+ */
+mqtt_topic_payload_s *mqtt_topic_payload_create(const void *data, size_t len);
+
+/**
+ * mqtt_topic_payload_ref takes another reference to p.
+ *
+ * Returns p.
+ */
+mqtt_topic_payload_s *mqtt_topic_payload_ref(mqtt_topic_payload_s *p);
+
+/**
+ * mqtt_topic_payload_unref releases a reference to p. The last one
+ * retires p with mqtt_epoch_retire rather than freeing it, since
+ * readers of the store may still be looking at it.
+ */
+void mqtt_topic_payload_unref(mqtt_topic_payload_s *p);
+
+/**
+ * mqtt_topic_retained_s holds the retained message of every topic
+ * that has one. The payload pointer is stored as the data of the
+ * topic's segment, so retaining a message costs no allocation beyond
+ * the payload itself.
+ *
+ * The store is built on a concurrent tree and may be used from any
+ * thread. Replacing a message swaps the payload pointer while the
+ * segment is locked. Readers take no locks: they read the pointer
+ * inside an epoch critical section and take a reference to the
+ * payload, which stays valid however the store changes afterwards.
+ */
+typedef struct mqtt_topic_retained mqtt_topic_retained_s;
+
+/**
+ * mqtt_topic_retained_create creates an empty store.
+ *
+ * Returns NULL if out of memory.
+ */
+mqtt_topic_retained_s *mqtt_topic_retained_create(void);
+
+/**
+ * mqtt_topic_retained_destroy destroys a store, releasing its
+ * references to the payloads it holds. It must not be used
+ * concurrently.
+ */
+void mqtt_topic_retained_destroy(mqtt_topic_retained_s *s);
+
+/**
+ * mqtt_topic_retained_set makes p the retained message of topic, which
+ * must not contain wildcards. The store takes its own reference to p.
+ * A NULL or empty payload clears the retained message, removing the
+ * topic from the store, as an empty retained PUBLISH does.
+ *
+ * Returns 0 on success, -1 if out of memory.
+ */
+int mqtt_topic_retained_set(mqtt_topic_retained_s *s, const char *topic,
+                            mqtt_topic_payload_s *p);
+
+/**
+ * mqtt_topic_retained_get returns a reference to the retained message
+ * of topic, which the caller must release, or NULL if there is none.
+ */
+mqtt_topic_payload_s *mqtt_topic_retained_get(mqtt_topic_retained_s *s,
+                                              const char *topic);
+
+/**
+ * mqtt_topic_retained_cb_s holds a callback (fn) called for each
+ * retained message found by mqtt_topic_retained_match. fn is given a
+ * reference to the payload, which it must release once done with it,
+ * for instance once the message has been written to the subscriber's
+ * socket. topic is only valid during the call.
+ */
+typedef struct {
+  void *data;
+  void (*fn)(void *data, const char *topic, mqtt_topic_payload_s *p);
+} mqtt_topic_retained_cb_s;
+
+/**
+ * mqtt_topic_retained_match calls cb for the retained message of every
+ * topic matching filter, as a new subscription to filter would
+ * receive them.
+ *
+ * Returns 0 on success, -1 if out of memory.
+ */
+int mqtt_topic_retained_match(mqtt_topic_retained_s *s, const char *filter,
+                              mqtt_topic_retained_cb_s *cb);
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef _MQTT_TOPIC_REWRITE_H_
+#define _MQTT_TOPIC_REWRITE_H_
+
+#include <stddef.h>
+
+#include "mqtt_topic_tree.h"
+
+/**
+ * mqtt_topic_rewrite_s maps topics to new topics with rules such as
+ * "legacy/+/data" -> "v2/{1}/telemetry", for instance on a bridge.
+ *
+ * The patterns of all rules are kept in a single tree, and each rule's
+ * template is compiled into literal parts and references to the
+ * wildcards of its pattern. Rewriting a topic takes one walk of the
+ * tree, finding the most specific rule along with the parts of the
+ * topic its wildcards bind, then copies those parts and the literals
+ * into place.
+ *
+ * Like the tree itself, a rewriter must not be used from several
+ * threads at once.
+ */
+typedef struct mqtt_topic_rewrite mqtt_topic_rewrite_s;
+
+/* The most wildcards a rule's pattern may hold. */
+#define MQTT_TOPIC_REWRITE_MAX_CAPTURES 32
+
+/**
+ * mqtt_topic_rewrite_create creates a rewriter with no rules.
+ *
+ * Returns NULL if out of memory.
+ */
+mqtt_topic_rewrite_s *mqtt_topic_rewrite_create(void);
+
+/**
+ * mqtt_topic_rewrite_destroy destroys a rewriter.
+ */
+void mqtt_topic_rewrite_destroy(mqtt_topic_rewrite_s *rw);
+
+/**
+ * mqtt_topic_rewrite_add adds a rule rewriting topics that match
+ * pattern to template, replacing any rule with the same pattern. In
+ * template, {n} stands for the part of the topic bound to the n-th
+ * wildcard of pattern, counting from 1; a # binds the rest of the
+ * topic.
+ *
+ * Returns 0 on success, -1 if out of memory, 1 if template refers to
+ * a wildcard pattern does not have or if pattern has more than
+ * MQTT_TOPIC_REWRITE_MAX_CAPTURES wildcards.
+ */
+int mqtt_topic_rewrite_add(mqtt_topic_rewrite_s *rw, const char *pattern,
+                           const char *template);
+
+/**
+ * mqtt_topic_rewrite_remove removes the rule for pattern.
+ *
+ * Returns 0 if the rule was removed, 1 if there was no such rule, -1
+ * if out of memory.
+ */
+int mqtt_topic_rewrite_remove(mqtt_topic_rewrite_s *rw, const char *pattern);
+
+/**
+ * mqtt_topic_rewrite_apply rewrites topic with the most specific rule
+ * whose pattern matches it, as mqtt_topic_best_match ranks them. The
+ * new topic is written to out, with a terminator, if it fits in size
+ * bytes.
+ *
+ * Returns the length of the new topic, whether or not it fit, or -1 if
+ * no rule matches.
+ */
+int mqtt_topic_rewrite_apply(mqtt_topic_rewrite_s *rw, char *topic, char *out,
+                             size_t size);
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef _MQTT_TOPIC_ROUTES_H_
+#define _MQTT_TOPIC_ROUTES_H_
+
+#include <stdint.h>
+
+#include "mqtt_topic_tree.h"
+
+/**
+ * mqtt_topic_routes_s maps topic filters to the peer brokers, or
+ * nodes, that have subscribers for them, so that a publish can be
+ * forwarded to every node with a matching subscriber.
+ *
+ * The filters of all nodes are merged into a single tree. The data of
+ * each segment is the set of nodes subscribed to the filter ending
+ * there, kept as a bitset with one bit per node ID. Matching a topic
+ * walks the tree once and ORs the bitsets of every matching filter
+ * into one destination set, however many nodes there are.
+ *
+ * Like the tree itself, a route table must not be used from several
+ * threads at once.
+ */
+typedef struct mqtt_topic_routes mqtt_topic_routes_s;
+
+/**
+ * mqtt_topic_routes_create creates an empty route table for node IDs
+ * from 0 to max_nodes - 1, or to 63 if max_nodes is not positive.
+ *
+ * Returns NULL if out of memory.
+ */
+mqtt_topic_routes_s *mqtt_topic_routes_create(int max_nodes);
+
+/**
+ * mqtt_topic_routes_destroy destroys a route table.
+ */
+void mqtt_topic_routes_destroy(mqtt_topic_routes_s *t);
+
+/**
+ * mqtt_topic_routes_words returns the number of 64-bit words in the
+ * node sets of t. Bit n % 64 of word n / 64 stands for node n.
+ */
+int mqtt_topic_routes_words(mqtt_topic_routes_s *t);
+
+/**
+ * mqtt_topic_routes_add routes topics matching filter to node. Adding
+ * a route that already exists has no effect.
+ *
+ * Returns 0 on success, -1 if out of memory, 1 if node is out of
+ * range.
+ */
+int mqtt_topic_routes_add(mqtt_topic_routes_s *t, const char *filter,
+                          int node);
+
+/**
+ * mqtt_topic_routes_remove stops routing topics matching filter to
+ * node, removing the filter from the tree once no node has it.
+ *
+ * Returns 0 if the route was removed, 1 if there was no such route
+ * or node is out of range, -1 if out of memory.
+ */
+int mqtt_topic_routes_remove(mqtt_topic_routes_s *t, const char *filter,
+                             int node);
+
+/**
+ * mqtt_topic_routes_remove_node removes every route to node, as when
+ * a peer leaves the cluster, in a single pass over the tree.
+ *
+ * Returns 0 on success, 1 if node is out of range.
+ */
+int mqtt_topic_routes_remove_node(mqtt_topic_routes_s *t, int node);
+
+/**
+ * mqtt_topic_routes_match sets dest, which holds
+ * mqtt_topic_routes_words(t) words, to the set of nodes with a filter
+ * matching topic.
+ *
+ * Returns the number of nodes in dest.
+ */
+int mqtt_topic_routes_match(mqtt_topic_routes_s *t, char *topic,
+                            uint64_t *dest);
+
+#endif
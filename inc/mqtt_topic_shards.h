@@ -0,0 +1,63 @@
+#ifndef _MQTT_TOPIC_SHARDS_H_
+#define _MQTT_TOPIC_SHARDS_H_
+
+#include "mqtt_topic_tree.h"
+
+/**
+ * mqtt_topic_shards_s partitions topics across independent topic
+ * trees, each guarded by its own lock, so that threads working on
+ * different parts of the topic space do not contend.
+ *
+ * A topic is assigned to a shard by hashing its first depth
+ * segments. Topics with a + or # among those segments cannot be
+ * placed by hash, and are kept in one extra wildcard shard instead.
+ * Matching a pattern whose first depth segments are literal visits
+ * only the shard they hash to and the wildcard shard; any other
+ * pattern visits every shard.
+ */
+typedef struct mqtt_topic_shards mqtt_topic_shards_s;
+
+/**
+ * mqtt_topic_shards_create creates a sharded topic tree with count
+ * hashed shards, keyed on the first depth segments of each topic.
+ * count must be at least 1.
+ *
+ * Returns NULL if count is out of range or if out of memory.
+ */
+mqtt_topic_shards_s *mqtt_topic_shards_create(int count, int depth);
+
+/**
+ * mqtt_topic_shards_destroy destroys a sharded topic tree. As with
+ * mqtt_topic_segment_destroy, user data must be freed first.
+ */
+void mqtt_topic_shards_destroy(mqtt_topic_shards_s *t);
+
+/**
+ * mqtt_topic_shards_update finds or adds topic and calls cb with the
+ * segment terminating it while holding the lock of its shard, so that
+ * cb can update the segment's data. Afterwards, the segment is
+ * removed as by mqtt_topic_segment_remove, so clearing the data
+ * removes the topic.
+ *
+ * Returns 0 on success, -1 if out of memory.
+ */
+int mqtt_topic_shards_update(mqtt_topic_shards_s *t, char *topic,
+                             mqtt_iter_cb_s *cb);
+
+/**
+ * mqtt_topic_shards_matching_iter calls cb for every segment that
+ * terminates a topic matching pattern, as mqtt_topic_matching_iter
+ * does, holding the read lock of each shard it visits. It is illegal
+ * to update the sharded tree from cb.
+ */
+void mqtt_topic_shards_matching_iter(mqtt_topic_shards_s *t, char *pattern,
+                                     mqtt_iter_cb_s *cb);
+
+/**
+ * mqtt_topic_shards_iter visits every segment in every shard, holding
+ * the read lock of each shard it visits. It is illegal to update the
+ * sharded tree from cb.
+ */
+void mqtt_topic_shards_iter(mqtt_topic_shards_s *t, mqtt_iter_cb_s *cb);
+
+#endif
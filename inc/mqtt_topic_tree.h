@@ -1,7 +1,13 @@
 #ifndef _MQTT_TOPIC_TREE_H_
 #define _MQTT_TOPIC_TREE_H_
 
-#include "red_black_tree.h"
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mqtt_epoch.h"
+#include "mqtt_rb.h"
+#include "mqtt_so_map.h"
 
 /**
  * Required operations:
@@ -16,19 +22,52 @@
  */
 int mqtt_topic_validate(const char *topic);
 
+/**
+ * mqtt_topic_gc_link_s links segments awaiting deferred collection.
+ */
+typedef struct mqtt_topic_gc_link {
+  struct mqtt_topic_gc_link *prev;
+  struct mqtt_topic_gc_link *next;
+} mqtt_topic_gc_link_s;
+
+/* The size of the string buffer inside each segment, including the
+ * terminator. Longer segment strings are allocated separately. */
+#define MQTT_TOPIC_INLINE_LENGTH 20
+
 /**
  *
  */
 typedef struct mqtt_topic_segment {
-  /* The string for this topic segment. */
+  /* The string for this topic segment, and its length. str points to
+   * inline_str when the string fits there. */
   const char *str;
+  unsigned int len;
+  char inline_str[MQTT_TOPIC_INLINE_LENGTH];
 
   /* The parent segment, or the sentinel segment if this is a
    * top-level segment. */
   struct mqtt_topic_segment *parent;
 
-  /* A tree of child topic segments. */
-  rb_red_blk_tree *children;
+  /* The root of a red-black tree of child topic segments, linked
+   * through their rb_node, or NULL if there are none. A lone child is
+   * a one-node tree, found with a single key comparison, so chains of
+   * single children are not compressed: every level stays a segment
+   * that callers may hold and store data on. */
+  _Atomic(mqtt_rb_node_s *) children;
+
+  /* Set instead of children while a segment has a mid-size number of
+   * children, which are then kept in a sorted array. */
+  _Atomic(struct mqtt_topic_child_array *) child_array;
+
+  /* Membership of the children tree of the parent. */
+  mqtt_rb_node_s rb_node;
+
+  /* Set once the children are kept in a lock-free hash map instead
+   * of the children tree. See mqtt_topic_make_wide. */
+  _Atomic(mqtt_so_map_s *) wide;
+
+  /* Membership of the children map of a wide parent. */
+  mqtt_so_node_s map_node;
 
   /* A child # segment. Not kept in the children tree, for simpler access. */
   //struct mqtt_topic_segment *hash_child;
@@ -37,8 +76,48 @@ typedef struct mqtt_topic_segment {
 
   /* The data associated with the topic terminating with this segment,
    * if any. Management of data memory is the responsibility of the
-   * client. */
-  void *data;
+   * client. Readers of a concurrent tree load it while writers store
+   * it, so it is atomic; plain reads and assignments are sequentially
+   * consistent, and readers may load it with memory_order_acquire. */
+  _Atomic(void *) data;
+
+  /* Earlier values of data still needed by open snapshots, newest
+   * first. See mqtt_topic_snapshot_begin. */
+  _Atomic(struct mqtt_topic_version *) versions;
+
+  /* The hash of the topic terminating with this segment, and the XOR
+   * of those hashes over the segments of its subtree that hold data,
+   * itself included. Both are 0 unless mqtt_topic_digest_enable was
+   * called. digest_data is set while the path hash of the segment is
+   * counted in the digests. */
+  uint64_t path_hash;
+  _Atomic uint64_t digest;
+  int digest_data;
+
+  union {
+    /* Pending collection list membership and the time the segment
+     * was last found empty, when deferred collection is enabled. */
+    struct {
+      mqtt_topic_gc_link_s gc_link;
+      unsigned long gc_stamp;
+    };
+    /* Once a segment of a concurrent tree is removed, the state kept
+     * until no reader can still reach it. */
+    mqtt_epoch_entry_s retired;
+  };
+
+  /* Membership of the expiry wheel, and the tick at which the topic
+   * expires while it is a member. See mqtt_topic_expire_at. */
+  mqtt_topic_gc_link_s expiry_link;
+  unsigned long expiry;
+
+  /* Locks children against other writers, and tells readers when it
+   * has changed. See mqtt_topic_concurrent_enable. */
+  _Atomic unsigned long version;
+
+  /* Counts children added and removed, unlike version whether or not
+   * the segment was locked for it. See mqtt_topic_automaton_s. */
+  _Atomic unsigned long children_changes;
 } mqtt_topic_segment_s;
 
 /**
@@ -72,6 +151,23 @@ int mqtt_topic_find_or_add(mqtt_topic_segment_s **h_segment,
                            mqtt_topic_segment_s *root,
                            char *topic, int create);
 
+/**
+ * mqtt_topic_find_many looks up n literal topics at once, storing in
+ * h_segments[i] the segment terminating topics[i], or NULL, as
+ * mqtt_topic_find_or_add would with create == 0. Rather than following
+ * each lookup's chain of dependent cache misses to the end in turn,
+ * several lookups are kept in flight and moved on a step at a time,
+ * each step prefetching what the lookup reads next, so that the
+ * misses of different lookups overlap. This pays off once the tree is
+ * much larger than the cache, for instance when matching a queue of
+ * publishes. In a concurrent tree, the topics are looked up one by
+ * one.
+ *
+ * Returns the number of topics found.
+ */
+int mqtt_topic_find_many(mqtt_topic_segment_s *root, char **topics, int n,
+                         mqtt_topic_segment_s **h_segments);
+
 /**
  * mqtt_topic_segment_remove removes a segment from the topic tree if
  * data is NULL and it has no children, recursively removing childless
@@ -83,6 +179,56 @@ int mqtt_topic_find_or_add(mqtt_topic_segment_s **h_segment,
  */
 int mqtt_topic_segment_remove(mqtt_topic_segment_s *segment);
 
+/**
+ * mqtt_topic_gc_enable switches a tree to deferred collection. Once
+ * enabled, mqtt_topic_segment_remove no longer frees empty segments;
+ * it marks them pending instead, and they stay in the tree until
+ * mqtt_topic_gc_sweep finds them still empty at least max_age ticks
+ * later. A pending segment that is reused in the meantime, by adding
+ * a topic below it or by setting its data, is not collected, and
+ * clients that unsubscribe and resubscribe in a loop keep the same
+ * segments instead of freeing and reallocating them.
+ *
+ * Pending segments remain visible to lookups and iteration until
+ * they are collected.
+ */
+void mqtt_topic_gc_enable(mqtt_topic_segment_s *root, unsigned long max_age);
+
+/**
+ * mqtt_topic_gc_sweep advances the collection clock of root to now
+ * and frees up to budget segments that have been pending for at least
+ * max_age ticks, along with ancestors left empty by their removal.
+ * Ticks are in whatever unit the caller passes as now, which must not
+ * decrease between calls. Calling this periodically with a small
+ * budget amortizes the cost of collection.
+ *
+ * Returns the number of segments freed.
+ */
+int mqtt_topic_gc_sweep(mqtt_topic_segment_s *root, unsigned long now,
+                        int budget);
+
+/**
+ * mqtt_topic_concurrent_enable lets several threads use the tree
+ * under root at once. It must be called while the tree is still
+ * empty, before it is shared. Writers then lock only the segment
+ * whose children they change, so writers in unrelated subtrees
+ * proceed in parallel, while readers take no locks at all: they note
+ * the version of each segment before reading its children and retry
+ * if it changed in the meantime. Removed segments are retired with
+ * mqtt_epoch_retire instead of being freed, so readers never see
+ * freed memory.
+ *
+ * In a concurrent tree, mqtt_topic_find_or_add, mqtt_topic_update,
+ * mqtt_topic_segment_remove, mqtt_topic_iter, the snapshot functions
+ * and the matching functions may be called from any thread. A
+ * segment returned by mqtt_topic_find_or_add stays valid only until
+ * the caller leaves the critical section it was found in (see
+ * mqtt_epoch_enter), and segment data must only be changed from
+ * mqtt_topic_update. All other functions, deferred collection
+ * included, still need exclusive access to the tree.
+ */
+void mqtt_topic_concurrent_enable(mqtt_topic_segment_s *root);
+
 /**
  * mqtt_iter_cb_s holds a callback (fn) called for each matching topic
  * encountered in a call to mqtt_topic_matching_iter.
@@ -92,6 +238,178 @@ typedef struct {
   void (*fn)(void* data, char *topic, mqtt_topic_segment_s *segment);
 } mqtt_iter_cb_s;
 
+/**
+ * mqtt_topic_results_s collects the segments found by a match or an
+ * iteration in an array, rather than passing them to a callback one
+ * at a time, so they can be processed in a loop, sorted, or handed
+ * to another thread as a batch. The array grows as needed and is
+ * kept when the results are cleared, so results reused across calls
+ * stop allocating once large enough. In a concurrent tree, the
+ * segments collected stay valid only until the caller leaves the
+ * critical section they were collected in (see mqtt_epoch_enter).
+ */
+typedef struct {
+  mqtt_topic_segment_s **segments;
+  size_t count;
+  size_t capacity;
+
+  /* Set if a segment could not be added for lack of memory. */
+  int failed;
+} mqtt_topic_results_s;
+
+/**
+ * mqtt_topic_results_init initializes empty results.
+ */
+void mqtt_topic_results_init(mqtt_topic_results_s *r);
+
+/**
+ * mqtt_topic_results_clear empties results, keeping their array.
+ */
+void mqtt_topic_results_clear(mqtt_topic_results_s *r);
+
+/**
+ * mqtt_topic_results_free frees the array of results, leaving them
+ * empty.
+ */
+void mqtt_topic_results_free(mqtt_topic_results_s *r);
+
+/**
+ * mqtt_topic_results_cb returns a callback that appends each segment
+ * it is given to r, without making a call per segment. It may be
+ * passed to mqtt_topic_iter and to the matching functions.
+ */
+mqtt_iter_cb_s mqtt_topic_results_cb(mqtt_topic_results_s *r);
+
+/**
+ * mqtt_topic_matching_collect appends to r every segment that
+ * terminates a topic matching pattern, as mqtt_topic_matching_iter
+ * would pass them to a callback.
+ *
+ * Returns 0 on success, -1 if out of memory, in which case some
+ * segments may be missing from r.
+ */
+int mqtt_topic_matching_collect(mqtt_topic_segment_s *root, char *pattern,
+                                mqtt_topic_results_s *r);
+
+/**
+ * mqtt_topic_pred_s holds a predicate (fn) evaluated for segments
+ * visited by mqtt_topic_remove_if. fn returns nonzero if the segment
+ * should be removed.
+ */
+typedef struct {
+  void *data;
+  int (*fn)(void *data, char *topic, mqtt_topic_segment_s *segment);
+} mqtt_topic_pred_s;
+
+/**
+ * mqtt_topic_has_children returns 1 if segment has at least one
+ * child, whichever way its children are kept, 0 otherwise.
+ */
+int mqtt_topic_has_children(mqtt_topic_segment_s *segment);
+
+/**
+ * mqtt_topic_make_wide switches segment to keeping its children in a
+ * lock-free hash map rather than a red-black tree, for segments such
+ * as "devices" under which many threads add siblings at once. Adding
+ * or removing a child of a wide segment then takes no lock on it,
+ * only a few compare-and-swaps on the map. The children of a wide
+ * segment are visited in no particular order. A segment stays wide
+ * until it is removed. This may be called while other threads use
+ * the tree.
+ *
+ * Returns:
+ *  0 if segment is wide.
+ *  -1 if out of memory.
+ *  1 if segment already has children, or has been removed.
+ */
+int mqtt_topic_make_wide(mqtt_topic_segment_s *segment);
+
+/**
+ * mqtt_topic_update finds or adds topic and calls cb with the segment
+ * terminating it, then removes the segment as by
+ * mqtt_topic_segment_remove, so clearing the data removes the topic.
+ * In a concurrent tree, the segment is locked while cb runs, so it
+ * cannot be removed before cb sets its data. cb must not use the
+ * tree.
+ *
+ * Returns 0 on success, -1 if out of memory.
+ */
+int mqtt_topic_update(mqtt_topic_segment_s *root, char *topic,
+                      mqtt_iter_cb_s *cb);
+
+/**
+ * mqtt_topic_remove_prefix removes the segment terminating prefix
+ * along with every segment below it, then removes childless
+ * ancestors whose data field is NULL, as mqtt_topic_segment_remove
+ * does. prefix is looked up literally, as in mqtt_topic_find_or_add,
+ * except that a trailing "/#" is ignored: "tenant/42/#" removes the
+ * same topics as "tenant/42". A prefix of "#" empties the tree.
+ *
+ * If cb is not NULL, it is called for every removed segment before
+ * any memory is released, so that user data can be freed. The
+ * removed segments are freed together once the tree is consistent
+ * again.
+ *
+ * Returns:
+ *  0 if the prefix was removed.
+ *  1 if the prefix could not be found.
+ */
+int mqtt_topic_remove_prefix(mqtt_topic_segment_s *root,
+                             char *prefix, mqtt_iter_cb_s *cb);
+
+/**
+ * mqtt_topic_remove_if visits the tree in a single pass, removing
+ * every segment for which pred holds along with all segments below
+ * it. pred is not evaluated below a removed segment. Ancestors of
+ * removed segments are removed as well if they are left childless
+ * with a NULL data field. If cb is not NULL, it is called for every
+ * removed segment, as in mqtt_topic_remove_prefix.
+ *
+ * It is illegal to modify the tree from pred or cb.
+ */
+void mqtt_topic_remove_if(mqtt_topic_segment_s *root,
+                          mqtt_topic_pred_s *pred, mqtt_iter_cb_s *cb);
+
+/**
+ * mqtt_topic_expiry_enable gives the tree under root an expiry index,
+ * a hierarchical timer wheel whose clock starts at now, for topics
+ * that must go at a deadline such as MQTT 5 message and session
+ * expiry. Deadlines are kept in the segments themselves, so that
+ * finding the topics that expire costs time in proportion to their
+ * number rather than to the size of the tree. Ticks are in whatever
+ * unit the caller passes, as for mqtt_topic_gc_sweep.
+ *
+ * Returns 0 on success, -1 if out of memory.
+ */
+int mqtt_topic_expiry_enable(mqtt_topic_segment_s *root, unsigned long now);
+
+/**
+ * mqtt_topic_expire_at sets the deadline of the topic terminating
+ * with segment to deadline, replacing any deadline it had. A
+ * deadline of 0 cancels it. A segment that is removed loses its
+ * deadline.
+ *
+ * Returns 0 on success, 1 if the tree has no expiry index.
+ */
+int mqtt_topic_expire_at(mqtt_topic_segment_s *segment,
+                         unsigned long deadline);
+
+/**
+ * mqtt_topic_expiry_advance advances the expiry clock of root to now,
+ * which must not decrease between calls, and expires every topic
+ * whose deadline is at or before it. Each one is first passed to cb,
+ * if it is not NULL, which should release the data of the segment and
+ * set it to NULL. The segment is then removed as by
+ * mqtt_topic_segment_remove. cb may also set a new deadline instead,
+ * which is only acted on by a later call even if it has passed
+ * already. A topic whose data is left set stays due, and is passed to
+ * cb again by the next call.
+ *
+ * Returns the number of topics whose data was cleared.
+ */
+int mqtt_topic_expiry_advance(mqtt_topic_segment_s *root, unsigned long now,
+                              mqtt_iter_cb_s *cb);
+
 /**
  * mqtt_topic_matching_iter calls cb for every segment that terminates
  * a topic that matches pattern. A pattern is a topic that may contain
@@ -116,10 +434,390 @@ typedef struct {
 void mqtt_topic_matching_iter(mqtt_topic_segment_s *root,
                               char *pattern, mqtt_iter_cb_s *cb);
 
+/**
+ * mqtt_topic_generation returns a counter that changes whenever a
+ * segment is added to or removed from the tree under root. Changes to
+ * segment data do not affect it.
+ */
+unsigned long mqtt_topic_generation(mqtt_topic_segment_s *root);
+
+/**
+ * mqtt_topic_digest_enable starts keeping a digest of every subtree
+ * of the tree under root: a hash of the set of topics in it that
+ * hold data, which does not depend on the order they were added in.
+ * Segments without data, such as those only leading to other topics,
+ * do not count. Setting or clearing the data of a segment then
+ * updates the digests of its ancestors, at a cost proportional to its
+ * depth. The digests only see data changed from mqtt_topic_update, or
+ * cleared before mqtt_topic_segment_remove is called on the segment.
+ * This may be called on a tree that is not empty, but needs exclusive
+ * access to it.
+ */
+void mqtt_topic_digest_enable(mqtt_topic_segment_s *root);
+
+/**
+ * mqtt_topic_digest returns the digest of the subtree below and
+ * including segment. Two trees, or subtrees at the same topic, with
+ * the same digest hold the same topics, barring a 64-bit hash
+ * collision, so nodes keeping copies of a tree can compare digests
+ * level by level and only exchange the subtrees that differ.
+ */
+uint64_t mqtt_topic_digest(mqtt_topic_segment_s *segment);
+
+/* Kinds of difference reported by mqtt_topic_diff. */
+#define MQTT_TOPIC_DIFF_ADDED 1
+#define MQTT_TOPIC_DIFF_REMOVED 2
+
+/**
+ * mqtt_topic_diff_cb_s holds a callback (fn) called for each
+ * difference found by mqtt_topic_diff.
+ */
+typedef struct {
+  void *data;
+  void (*fn)(void *data, int kind, char *topic,
+             mqtt_topic_segment_s *segment);
+} mqtt_topic_diff_cb_s;
+
+/**
+ * mqtt_topic_diff compares the topics holding data in the trees under
+ * from and to, calling cb with the changes that turn the first into
+ * the second. MQTT_TOPIC_DIFF_ADDED is reported, with the segment of
+ * to, for every topic that holds data only in to.
+ * MQTT_TOPIC_DIFF_REMOVED is reported, with the segment of from, for
+ * every topic that holds data only in from. Segments without data
+ * are never reported, and the data itself is not compared.
+ *
+ * If both trees have digests enabled, subtrees whose digests match
+ * are skipped without being visited, so the cost follows the size of
+ * the change rather than that of the trees. Otherwise every segment
+ * is compared.
+ *
+ * It is illegal to modify either tree from cb.
+ */
+void mqtt_topic_diff(mqtt_topic_segment_s *from, mqtt_topic_segment_s *to,
+                     mqtt_topic_diff_cb_s *cb);
+
+/**
+ * mqtt_topic_covers returns 1 if filter a covers filter b, that is if
+ * every topic matching b also matches a, 0 otherwise. A # covers its
+ * parent topic and every level below it, a + covers any single level
+ * but a #, and any other level covers only itself. As in matching,
+ * wildcards at the first level do not cover $-prefixed topics.
+ */
+int mqtt_topic_covers(const char *a, const char *b);
+
+/**
+ * mqtt_topic_covering_iter calls cb for every segment under root that
+ * terminates a filter covering filter, as mqtt_topic_covers tells, for
+ * instance the grants that allow a subscription. filter itself is
+ * reported if it is in the tree.
+ *
+ * It is illegal to modify the tree from cb.
+ */
+void mqtt_topic_covering_iter(mqtt_topic_segment_s *root, char *filter,
+                              mqtt_iter_cb_s *cb);
+
+/**
+ * mqtt_topic_covered_iter calls cb for every segment under root that
+ * terminates a filter covered by filter, for instance the
+ * subscriptions a new a/# makes redundant. filter itself is reported
+ * if it is in the tree.
+ *
+ * It is illegal to modify the tree from cb.
+ */
+void mqtt_topic_covered_iter(mqtt_topic_segment_s *root, char *filter,
+                             mqtt_iter_cb_s *cb);
+
+/**
+ * mqtt_topic_minimal_cover calls cb for the smallest set of segments
+ * with data whose filters cover every segment with data under root:
+ * those not covered by another one. A bridge forwarding these
+ * forwards a/# once, rather than along with every a/... below it.
+ * Of filters that cover each other, such as # and +/#, only one is
+ * reported.
+ *
+ * It is illegal to modify the tree from cb.
+ *
+ * Returns 0 on success, -1 if out of memory.
+ */
+int mqtt_topic_minimal_cover(mqtt_topic_segment_s *root, mqtt_iter_cb_s *cb);
+
+/**
+ * mqtt_topic_prepared_s is a literal topic prepared for repeated
+ * matching against a tree, for instance the topic behind an MQTT 5
+ * topic alias. It holds the topic already split into segments,
+ * along with the chain of segments the topic resolves to and the +
+ * and # siblings found at each level.
+ */
+typedef struct mqtt_topic_prepared mqtt_topic_prepared_s;
+
+/**
+ * mqtt_topic_prepare prepares a literal topic for matching against
+ * the tree under root. A prepared topic remains usable as the tree
+ * changes: it is resolved again, without splitting or hashing the
+ * topic, the first time it is matched after mqtt_topic_generation
+ * changes. It must be destroyed before root.
+ *
+ * Returns NULL if topic contains wildcards or if out of memory.
+ */
+mqtt_topic_prepared_s *mqtt_topic_prepare(mqtt_topic_segment_s *root,
+                                          const char *topic);
+
+/**
+ * mqtt_topic_prepared_destroy frees a prepared topic.
+ */
+void mqtt_topic_prepared_destroy(mqtt_topic_prepared_s *p);
+
+/**
+ * mqtt_topic_prepared_matching_iter calls cb for every segment that
+ * terminates a topic matching the prepared topic, exactly as
+ * mqtt_topic_matching_iter would for the original topic string.
+ */
+void mqtt_topic_prepared_matching_iter(mqtt_topic_prepared_s *p,
+                                       mqtt_iter_cb_s *cb);
+
+/**
+ * mqtt_topic_pattern_s is a topic pattern compiled for repeated
+ * matching, for instance a subscription matched against the topics
+ * with retained messages. It holds the pattern split into segments,
+ * each already classified as a literal, + or #, along with its
+ * length and, for a literal, the hash that wide segments and child
+ * arrays find it by. Unlike a prepared topic, a compiled pattern is
+ * not tied to a tree.
+ */
+typedef struct mqtt_topic_pattern mqtt_topic_pattern_s;
+
+/**
+ * mqtt_topic_pattern_compile compiles pattern, which is copied.
+ *
+ * Returns NULL if out of memory.
+ */
+mqtt_topic_pattern_s *mqtt_topic_pattern_compile(const char *pattern);
+
+/**
+ * mqtt_topic_pattern_destroy frees a compiled pattern.
+ */
+void mqtt_topic_pattern_destroy(mqtt_topic_pattern_s *p);
+
+/**
+ * mqtt_topic_pattern_matching_iter calls cb for every segment that
+ * terminates a topic matching the compiled pattern p, exactly as
+ * mqtt_topic_matching_iter would for the original pattern string.
+ */
+void mqtt_topic_pattern_matching_iter(mqtt_topic_segment_s *root,
+                                      mqtt_topic_pattern_s *p,
+                                      mqtt_iter_cb_s *cb);
+
+/**
+ * mqtt_topic_automaton_s matches literal topics, such as the topics
+ * of publishes, against the patterns in a tree, such as
+ * subscriptions. Where mqtt_topic_matching_iter follows every + and #
+ * branch that can match in turn, an automaton follows all of them at
+ * once: each of its states is a set of segments that a prefix of the
+ * topic leads to, so a topic is matched in one pass over its levels.
+ * States are built as topics first reach them and memoized. When
+ * mqtt_topic_generation changes, the states built on segments whose
+ * children have changed are forgotten, to be built again from the new
+ * tree as they are needed, while the rest are kept. While the tree
+ * changes too often for those states to pay for being built again,
+ * literal topics are matched by walking the tree as well.
+ */
+typedef struct mqtt_topic_automaton mqtt_topic_automaton_s;
+
+/**
+ * mqtt_topic_automaton_create creates an automaton for the tree under
+ * root, which must outlive it. An automaton must not be used by more
+ * than one thread at a time.
+ *
+ * Returns NULL if out of memory.
+ */
+mqtt_topic_automaton_s *mqtt_topic_automaton_create(
+    mqtt_topic_segment_s *root);
+
+/**
+ * mqtt_topic_automaton_destroy frees an automaton.
+ */
+void mqtt_topic_automaton_destroy(mqtt_topic_automaton_s *a);
+
+/**
+ * mqtt_topic_automaton_matching_iter calls cb for every segment that
+ * terminates a topic matching topic, as mqtt_topic_matching_iter
+ * would, but in no particular order. Topics that contain wildcards
+ * are matched by walking the tree.
+ *
+ * Returns 0 on success, -1 if out of memory.
+ */
+int mqtt_topic_automaton_matching_iter(mqtt_topic_automaton_s *a,
+                                       const char *topic,
+                                       mqtt_iter_cb_s *cb);
+
+/**
+ * mqtt_topic_fused_s matches a literal topic against several trees in
+ * a single walk, for instance an ACL tree and a subscription tree for
+ * each publish. The trees are moved down one topic level at a time,
+ * so the topic is split and each level hashed once. Some of the trees
+ * may be gates: the other trees are only walked once every gate has a
+ * match with data, catching up on the levels the gates have walked,
+ * and the walk stops at the first level at which a gate is left
+ * without a match, so an unauthorized publish costs no routing walk.
+ *
+ * A fused matcher keeps its working state between matches, so it
+ * should be reused, but it must not be used by several threads at
+ * once.
+ */
+typedef struct mqtt_topic_fused mqtt_topic_fused_s;
+
+/**
+ * mqtt_topic_fused_create creates a fused matcher with no trees.
+ *
+ * Returns NULL if out of memory.
+ */
+mqtt_topic_fused_s *mqtt_topic_fused_create(void);
+
+/**
+ * mqtt_topic_fused_destroy frees a fused matcher.
+ */
+void mqtt_topic_fused_destroy(mqtt_topic_fused_s *f);
+
+/**
+ * mqtt_topic_fused_add adds the tree under root to f, with cb to be
+ * called for its matches, which may be NULL for a gate whose matches
+ * are not needed. If gate is set, the tree gates the others.
+ *
+ * Returns 0 on success, -1 if out of memory.
+ */
+int mqtt_topic_fused_add(mqtt_topic_fused_s *f, mqtt_topic_segment_s *root,
+                         mqtt_iter_cb_s *cb, int gate);
+
+/**
+ * mqtt_topic_fused_matching_iter matches topic against every tree of
+ * f, calling the callback of each tree for every segment that
+ * terminates a topic matching topic, as mqtt_topic_matching_iter
+ * would. topic must not contain wildcards. The matches of a gate are
+ * reported as they are found; those of other trees only once every
+ * gate has granted, and not at all if one denies.
+ *
+ * Returns 0 if every gate granted, 1 if one denied, -1 if out of
+ * memory.
+ */
+int mqtt_topic_fused_matching_iter(mqtt_topic_fused_s *f, char *topic);
+
+/**
+ * mqtt_topic_span_s locates the part of a topic bound to a wildcard
+ * of a matching pattern, as an offset and a length in characters.
+ */
+typedef struct {
+  unsigned int offset;
+  unsigned int len;
+} mqtt_topic_span_s;
+
+/**
+ * mqtt_topic_best_match returns the segment with data whose pattern
+ * is the most specific match for topic, which must not contain
+ * wildcards, or NULL if no pattern with data matches. Patterns are
+ * ranked level by level: a literal level beats a +, which beats a #.
+ * As in MQTT, wildcards at the first level do not match $-prefixed
+ * topics.
+ *
+ * The parts of topic bound to the wildcards of the pattern, in order,
+ * are stored in spans, up to max_spans of them; a + binds one level,
+ * and a # the rest of the topic, which is empty if it matches its
+ * parent topic. The number of wildcards is stored in *h_n_spans. The
+ * whole match costs a single walk, backtracking only where a more
+ * specific branch fails further down.
+ */
+mqtt_topic_segment_s *mqtt_topic_best_match(mqtt_topic_segment_s *root,
+                                            char *topic,
+                                            mqtt_topic_span_s *spans,
+                                            int max_spans, int *h_n_spans);
+
 /**
  * mqtt_topic_iter visits every segment in a topic tree. It is illegal
- * to call mqtt_topic_remove_segment on a segment from cb.
+ * to call mqtt_topic_remove_segment on a segment from cb. To read a
+ * consistent view of a tree that others keep changing, use a
+ * snapshot instead.
  */
 void mqtt_topic_iter(mqtt_topic_segment_s *root, mqtt_iter_cb_s *cb);
 
+/**
+ * mqtt_topic_scan visits the segment terminating prefix and every
+ * segment below it in scan order, and stops after limit segments, so
+ * that a large tree can be read a page at a time. prefix is looked up
+ * as in mqtt_topic_remove_prefix; NULL or "#" scans the whole tree.
+ *
+ * Scan order visits a segment before its children, and children in
+ * key order, so topics sort level by level: "a" < "a/b" < "a/c" <
+ * "ab". Children of a wide segment are visited in map order instead.
+ *
+ * If after is not NULL, the scan resumes past that topic, usually the
+ * last one of the previous page. after need not be in the tree any
+ * more; the scan descends straight to where it would be, so each page
+ * costs a lookup plus its own length. If end is not NULL, the scan
+ * stops at the first topic that does not sort before it. Both prefix
+ * and after are modified during the call but restored before it
+ * returns. A limit of 0 or less visits every segment in range.
+ *
+ * It is illegal to modify the tree from cb.
+ *
+ * Returns the number of segments visited.
+ */
+int mqtt_topic_scan(mqtt_topic_segment_s *root, char *prefix, char *after,
+                    const char *end, int limit, mqtt_iter_cb_s *cb);
+
+/**
+ * mqtt_topic_snapshot_s pins the data of a tree as it was at one
+ * point in time. See mqtt_topic_snapshot_begin.
+ */
+typedef struct mqtt_topic_snapshot mqtt_topic_snapshot_s;
+
+/**
+ * mqtt_topic_snapshot_cb_s holds a callback (fn) called for each topic
+ * of a snapshot by mqtt_topic_snapshot_iter, with the data the topic
+ * held when the snapshot began. topic is only valid during the call.
+ */
+typedef struct {
+  void *data;
+  void (*fn)(void *data, const char *topic, void *value);
+} mqtt_topic_snapshot_cb_s;
+
+/**
+ * mqtt_topic_snapshot_begin pins the data of every topic under root,
+ * so that it can be read with mqtt_topic_snapshot_iter while the tree
+ * keeps changing, for instance to persist subscriptions without
+ * pausing them.
+ *
+ * While a snapshot is open, mqtt_topic_update keeps the value a
+ * segment held before each change in a version record, one per
+ * segment for all the snapshots that began before the change, and
+ * segments that still hold such a value are left in the tree when
+ * they empty. Records are dropped by the next change to their segment
+ * once no open snapshot needs them, and the segments left in place
+ * are removed when the last snapshot ends, so snapshots should not be
+ * kept open for longer than needed.
+ *
+ * Snapshots only see changes made with mqtt_topic_update, so segment
+ * data must not be changed in any other way while one is open, and
+ * no function that needs exclusive access to the tree may be called
+ * until all have ended. All snapshots must end before the tree is
+ * destroyed.
+ *
+ * Returns the snapshot, or NULL if out of memory.
+ */
+mqtt_topic_snapshot_s *mqtt_topic_snapshot_begin(mqtt_topic_segment_s *root);
+
+/**
+ * mqtt_topic_snapshot_iter calls cb for every topic that held data
+ * when snapshot began, whatever changes were made since. It may be
+ * called any number of times until the snapshot ends. cb must not
+ * use the tree.
+ */
+void mqtt_topic_snapshot_iter(mqtt_topic_snapshot_s *snapshot,
+                              mqtt_topic_snapshot_cb_s *cb);
+
+/**
+ * mqtt_topic_snapshot_end releases snapshot, along with the versions
+ * and segments only it still needed.
+ */
+void mqtt_topic_snapshot_end(mqtt_topic_snapshot_s *snapshot);
+
 #endif
@@ -0,0 +1,121 @@
+#ifndef _MQTT_TOPIC_WAL_H_
+#define _MQTT_TOPIC_WAL_H_
+
+#include <stddef.h>
+
+#include "mqtt_topic_tree.h"
+
+/**
+ * mqtt_topic_wal_s is an append-only log of changes to a topic tree,
+ * from which the tree can be rebuilt after a crash.
+ *
+ * Records are appended to a memory buffer and reach the disk when
+ * they are committed. Commits group together: one committer writes
+ * and syncs everything appended so far, while those that come in
+ * meanwhile wait for it and are then either done or write the next
+ * group. A checkpoint writes the whole tree to a snapshot next to the
+ * log and empties the log, which keeps recovery from growing with
+ * the tree's history.
+ *
+ * Every record sets the state of a topic outright, so replaying a
+ * record more than once has no further effect. A crash between a
+ * snapshot and the log being emptied is therefore harmless.
+ */
+typedef struct mqtt_topic_wal mqtt_topic_wal_s;
+
+/**
+ * Record types.
+ *
+ * MQTT_TOPIC_WAL_ADD adds a topic. If the record has a payload, it
+ * becomes the topic's data.
+ *
+ * MQTT_TOPIC_WAL_SET replaces the data of a topic, adding the topic
+ * if need be. An empty payload sets data to NULL but keeps the topic.
+ *
+ * MQTT_TOPIC_WAL_REMOVE sets the data of a topic to NULL, then
+ * removes it as mqtt_topic_segment_remove does.
+ */
+#define MQTT_TOPIC_WAL_ADD 1
+#define MQTT_TOPIC_WAL_SET 2
+#define MQTT_TOPIC_WAL_REMOVE 3
+
+/**
+ * mqtt_topic_wal_codec_s converts segment data to and from record
+ * payloads.
+ *
+ * load returns the data for a payload of len bytes, or NULL if out of
+ * memory. release, if not NULL, frees data replaced or removed during
+ * replay. save writes the payload for a segment's data to buf if it
+ * fits in size bytes, and returns its length either way; it is only
+ * called for data that is not NULL, and only by checkpoints.
+ */
+typedef struct {
+  void *data;
+  void *(*load)(void *data, const void *payload, size_t len);
+  void (*release)(void *data, void *value);
+  size_t (*save)(void *data, void *value, void *buf, size_t size);
+} mqtt_topic_wal_codec_s;
+
+/**
+ * mqtt_topic_wal_open opens the log at path for appending, creating
+ * it if it does not exist. The snapshot at path with ".snap" appended,
+ * if any, is first loaded into root, which should be empty, and the
+ * log is replayed on top of it. Records are replayed in batches,
+ * reusing the segments of the previous record's topic, so snapshots,
+ * which are written in scan order, load with little more than one
+ * segment creation per segment. A record left incomplete by a crash
+ * ends the log, and is discarded.
+ *
+ * Returns NULL on an I/O error, if out of memory, or if codec->load
+ * fails. root may then hold part of what was replayed.
+ */
+mqtt_topic_wal_s *mqtt_topic_wal_open(const char *path,
+                                      mqtt_topic_segment_s *root,
+                                      const mqtt_topic_wal_codec_s *codec);
+
+/**
+ * mqtt_topic_wal_close commits whatever was appended and closes the
+ * log.
+ *
+ * Returns 0 on success, -1 if the final commit failed.
+ */
+int mqtt_topic_wal_close(mqtt_topic_wal_s *w);
+
+/**
+ * mqtt_topic_wal_append appends a record of the given type for topic,
+ * with a payload of len bytes, which may be 0. The record is not
+ * durable until committed; if h_lsn is not NULL, it receives the
+ * record's sequence number for mqtt_topic_wal_commit. Appends may be
+ * made from any thread, and should follow the change to the tree in
+ * the same order as the changes themselves.
+ *
+ * Returns 0 on success, -1 if out of memory or if the log has failed.
+ */
+int mqtt_topic_wal_append(mqtt_topic_wal_s *w, int type, const char *topic,
+                          const void *payload, size_t len,
+                          unsigned long *h_lsn);
+
+/**
+ * mqtt_topic_wal_commit waits until the record with sequence number
+ * lsn, and every record before it, is on disk. An lsn of 0 commits
+ * everything appended so far.
+ *
+ * Returns 0 on success, -1 on an I/O error. Once a write has failed,
+ * the log stays failed.
+ */
+int mqtt_topic_wal_commit(mqtt_topic_wal_s *w, unsigned long lsn);
+
+/**
+ * mqtt_topic_wal_checkpoint writes every segment of root with data,
+ * and every childless one, to a new snapshot, then empties the log.
+ * root must reflect every record appended so far, and must not change
+ * until this returns. Records appended but not yet committed are
+ * committed by the snapshot.
+ *
+ * Returns 0 on success, -1 on an I/O error or if out of memory. The
+ * previous snapshot and the log are left as they were on failure.
+ */
+int mqtt_topic_wal_checkpoint(mqtt_topic_wal_s *w, mqtt_topic_segment_s *root,
+                              const mqtt_topic_wal_codec_s *codec);
+
+#endif
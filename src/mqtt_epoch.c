@@ -0,0 +1,191 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+#include "mqtt_epoch.h"
+
+/* A thread tries to advance the epoch and release what it has
+ * retired every this many retirements. */
+#define RECLAIM_INTERVAL 64
+
+/**
+ * _thread_s is the reclamation state of one thread. It lives in
+ * thread-local storage and is on the registry from the thread's
+ * first use of this module until it exits.
+ */
+typedef struct _thread {
+  /* The global epoch observed on entering the outermost critical
+   * section, or 0 outside of one. */
+  _Atomic unsigned long active;
+  int nesting;
+  int registered;
+  int since_reclaim;
+
+  /* Memory retired by this thread and not yet released. */
+  mqtt_epoch_entry_s *retired;
+
+  struct _thread *next;
+} _thread_s;
+
+/* Starts at 1 so that 0 can mean "not in a critical section". */
+static _Atomic unsigned long global_epoch = 1;
+
+/* Protects the registry, and the memory left behind by threads that
+ * exited before it could be released. */
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static _thread_s *registry = NULL;
+static mqtt_epoch_entry_s *orphans = NULL;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t key;
+
+static _Thread_local _thread_s self;
+
+/**
+ * _release calls the release function of every entry in list that
+ * no thread can still be reading, and returns the rest.
+ */
+static mqtt_epoch_entry_s *_release(mqtt_epoch_entry_s *list) {
+  unsigned long now = atomic_load(&global_epoch);
+  mqtt_epoch_entry_s **link = &list, *entry;
+
+  while ((entry = *link) != NULL) {
+    /* Readers that could have found entry entered no later than the
+     * epoch it was retired in, and the epoch only advances past the
+     * one after that once they have all left. */
+    if (entry->epoch + 2 <= now) {
+      *link = entry->next;
+      entry->fn(entry);
+    } else {
+      link = &entry->next;
+    }
+  }
+  return list;
+}
+
+/**
+ * _thread_exit unregisters an exiting thread, handing whatever it
+ * retired over to the threads that remain.
+ */
+static void _thread_exit(void *arg) {
+  _thread_s *t = arg, **link;
+  mqtt_epoch_entry_s *tail;
+
+  pthread_mutex_lock(&registry_lock);
+  for (link = &registry; *link != t; link = &(*link)->next) {
+  }
+  *link = t->next;
+
+  if (t->retired) {
+    for (tail = t->retired; tail->next; tail = tail->next) {
+    }
+    tail->next = orphans;
+    orphans = t->retired;
+    t->retired = NULL;
+  }
+  pthread_mutex_unlock(&registry_lock);
+  t->registered = 0;
+}
+
+static void _key_create(void) {
+  pthread_key_create(&key, &_thread_exit);
+}
+
+static _thread_s *_self(void) {
+  if (!self.registered) {
+    pthread_once(&key_once, &_key_create);
+    pthread_mutex_lock(&registry_lock);
+    self.next = registry;
+    registry = &self;
+    pthread_mutex_unlock(&registry_lock);
+    pthread_setspecific(key, &self);
+    self.registered = 1;
+  }
+  return &self;
+}
+
+/**
+ * _try_advance advances the global epoch if every thread in a
+ * critical section has observed the current one. If wait is 0, it
+ * gives up rather than wait for the registry.
+ *
+ * Returns 1 if the epoch advanced, 0 otherwise.
+ */
+static int _try_advance(int wait) {
+  unsigned long epoch = atomic_load(&global_epoch), active;
+  _thread_s *t;
+  int advanced = 0;
+
+  if (wait) {
+    pthread_mutex_lock(&registry_lock);
+  } else if (pthread_mutex_trylock(&registry_lock) != 0) {
+    return 0;
+  }
+
+  for (t = registry; t; t = t->next) {
+    active = atomic_load(&t->active);
+    if (active != 0 && active != epoch) {
+      goto exit;
+    }
+  }
+  advanced = atomic_compare_exchange_strong(&global_epoch, &epoch, epoch + 1);
+
+  /* Releasing orphans here keeps them from piling up once the
+   * threads that retired them are gone. */
+  orphans = _release(orphans);
+
+exit:
+  pthread_mutex_unlock(&registry_lock);
+  return advanced;
+}
+
+void mqtt_epoch_enter(void) {
+  _thread_s *t = _self();
+
+  if (t->nesting++ == 0) {
+    atomic_store(&t->active, atomic_load(&global_epoch));
+    /* Make the thread visible as active before it reads anything. */
+    atomic_thread_fence(memory_order_seq_cst);
+  }
+}
+
+void mqtt_epoch_exit(void) {
+  _thread_s *t = &self;
+
+  if (--t->nesting == 0) {
+    atomic_store_explicit(&t->active, 0, memory_order_release);
+  }
+}
+
+void mqtt_epoch_retire(mqtt_epoch_entry_s *entry,
+                       void (*fn)(mqtt_epoch_entry_s *entry)) {
+  _thread_s *t = _self();
+
+  entry->fn = fn;
+  entry->epoch = atomic_load(&global_epoch);
+  entry->next = t->retired;
+  t->retired = entry;
+
+  if (++t->since_reclaim >= RECLAIM_INTERVAL) {
+    t->since_reclaim = 0;
+    _try_advance(0);
+    t->retired = _release(t->retired);
+  }
+}
+
+void mqtt_epoch_barrier(void) {
+  _thread_s *t = _self();
+  unsigned long target = atomic_load(&global_epoch) + 2;
+
+  while (atomic_load(&global_epoch) < target) {
+    if (!_try_advance(1)) {
+      sched_yield();
+    }
+  }
+  t->retired = _release(t->retired);
+
+  pthread_mutex_lock(&registry_lock);
+  orphans = _release(orphans);
+  pthread_mutex_unlock(&registry_lock);
+}
@@ -0,0 +1,283 @@
+#include <stdatomic.h>
+#include <stddef.h>
+
+#include "mqtt_rb.h"
+
+/* Set in parent_color if the node is red. NULL links are black. */
+#define RED 1u
+
+/* The writer holds the tree to itself, so it reads links relaxed. It
+ * stores them with release, as readers may reach a node through any
+ * link a rotation moves it to, not only the one it was published at,
+ * and must see its fields wherever they find it. */
+
+static mqtt_rb_node_s *_left(mqtt_rb_node_s *node) {
+  return atomic_load_explicit(&node->left, memory_order_relaxed);
+}
+
+static mqtt_rb_node_s *_right(mqtt_rb_node_s *node) {
+  return atomic_load_explicit(&node->right, memory_order_relaxed);
+}
+
+static uintptr_t _parent_color(mqtt_rb_node_s *node) {
+  return atomic_load_explicit(&node->parent_color, memory_order_relaxed);
+}
+
+static mqtt_rb_node_s *_parent(mqtt_rb_node_s *node) {
+  return (mqtt_rb_node_s *)(_parent_color(node) & ~(uintptr_t)RED);
+}
+
+static void _store(_Atomic(mqtt_rb_node_s *) *link, mqtt_rb_node_s *node) {
+  atomic_store_explicit(link, node, memory_order_release);
+}
+
+static void _set_parent_color(mqtt_rb_node_s *node, uintptr_t parent_color) {
+  atomic_store_explicit(&node->parent_color, parent_color,
+                        memory_order_relaxed);
+}
+
+static int _is_red(mqtt_rb_node_s *node) {
+  return node != NULL && (_parent_color(node) & RED);
+}
+
+static void _set_red(mqtt_rb_node_s *node) {
+  _set_parent_color(node, _parent_color(node) | RED);
+}
+
+static void _set_black(mqtt_rb_node_s *node) {
+  _set_parent_color(node, _parent_color(node) & ~(uintptr_t)RED);
+}
+
+static void _set_parent(mqtt_rb_node_s *node, mqtt_rb_node_s *parent) {
+  _set_parent_color(node, (uintptr_t)parent | (_parent_color(node) & RED));
+}
+
+/**
+ * _replace_child points the link to old, in parent or at the root if
+ * parent is NULL, at new instead.
+ */
+static void _replace_child(_Atomic(mqtt_rb_node_s *) *h_root,
+                           mqtt_rb_node_s *parent, mqtt_rb_node_s *old,
+                           mqtt_rb_node_s *new) {
+  if (parent == NULL) {
+    _store(h_root, new);
+  } else if (_left(parent) == old) {
+    _store(&parent->left, new);
+  } else {
+    _store(&parent->right, new);
+  }
+}
+
+static void _rotate_left(_Atomic(mqtt_rb_node_s *) *h_root,
+                         mqtt_rb_node_s *x) {
+  mqtt_rb_node_s *y = _right(x), *parent = _parent(x);
+
+  _store(&x->right, _left(y));
+  if (_left(y)) {
+    _set_parent(_left(y), x);
+  }
+  _store(&y->left, x);
+  _set_parent(y, parent);
+  _replace_child(h_root, parent, x, y);
+  _set_parent(x, y);
+}
+
+static void _rotate_right(_Atomic(mqtt_rb_node_s *) *h_root,
+                          mqtt_rb_node_s *x) {
+  mqtt_rb_node_s *y = _left(x), *parent = _parent(x);
+
+  _store(&x->left, _right(y));
+  if (_right(y)) {
+    _set_parent(_right(y), x);
+  }
+  _store(&y->right, x);
+  _set_parent(y, parent);
+  _replace_child(h_root, parent, x, y);
+  _set_parent(x, y);
+}
+
+/* The algorithms below are from _Introduction_To_Algorithms_, with
+ * NULL links standing in for the nil sentinel. */
+
+void mqtt_rb_insert(_Atomic(mqtt_rb_node_s *) *h_root, mqtt_rb_node_s *parent,
+                    _Atomic(mqtt_rb_node_s *) *link, mqtt_rb_node_s *node) {
+  mqtt_rb_node_s *grandparent, *uncle;
+
+  atomic_store_explicit(&node->left, NULL, memory_order_relaxed);
+  atomic_store_explicit(&node->right, NULL, memory_order_relaxed);
+  _set_parent_color(node, (uintptr_t)parent | RED);
+  /* Readers must not find node before its fields. */
+  _store(link, node);
+
+  while (_is_red(parent = _parent(node))) {
+    /* A red parent is never the root. */
+    grandparent = _parent(parent);
+    if (parent == _left(grandparent)) {
+      uncle = _right(grandparent);
+      if (_is_red(uncle)) {
+        _set_black(parent);
+        _set_black(uncle);
+        _set_red(grandparent);
+        node = grandparent;
+        continue;
+      }
+      if (node == _right(parent)) {
+        _rotate_left(h_root, parent);
+        node = parent;
+        parent = _parent(node);
+      }
+      _set_black(parent);
+      _set_red(grandparent);
+      _rotate_right(h_root, grandparent);
+    } else {
+      uncle = _left(grandparent);
+      if (_is_red(uncle)) {
+        _set_black(parent);
+        _set_black(uncle);
+        _set_red(grandparent);
+        node = grandparent;
+        continue;
+      }
+      if (node == _left(parent)) {
+        _rotate_right(h_root, parent);
+        node = parent;
+        parent = _parent(node);
+      }
+      _set_black(parent);
+      _set_red(grandparent);
+      _rotate_left(h_root, grandparent);
+    }
+  }
+  _set_black(atomic_load_explicit(h_root, memory_order_relaxed));
+}
+
+/**
+ * _remove_fixup restores the red-black properties once a black node
+ * has been spliced out from above x, which may be NULL, and whose
+ * parent is parent.
+ */
+static void _remove_fixup(_Atomic(mqtt_rb_node_s *) *h_root,
+                          mqtt_rb_node_s *x, mqtt_rb_node_s *parent) {
+  mqtt_rb_node_s *sibling;
+
+  while (x != atomic_load_explicit(h_root, memory_order_relaxed) &&
+         !_is_red(x)) {
+    if (x == _left(parent)) {
+      sibling = _right(parent);
+      if (_is_red(sibling)) {
+        _set_black(sibling);
+        _set_red(parent);
+        _rotate_left(h_root, parent);
+        sibling = _right(parent);
+      }
+      if (!_is_red(_left(sibling)) && !_is_red(_right(sibling))) {
+        _set_red(sibling);
+        x = parent;
+        parent = _parent(x);
+        continue;
+      }
+      if (!_is_red(_right(sibling))) {
+        _set_black(_left(sibling));
+        _set_red(sibling);
+        _rotate_right(h_root, sibling);
+        sibling = _right(parent);
+      }
+      _set_parent_color(sibling,
+                        (uintptr_t)parent | (_parent_color(parent) & RED));
+      _set_black(parent);
+      _set_black(_right(sibling));
+      _rotate_left(h_root, parent);
+    } else {
+      sibling = _left(parent);
+      if (_is_red(sibling)) {
+        _set_black(sibling);
+        _set_red(parent);
+        _rotate_right(h_root, parent);
+        sibling = _left(parent);
+      }
+      if (!_is_red(_left(sibling)) && !_is_red(_right(sibling))) {
+        _set_red(sibling);
+        x = parent;
+        parent = _parent(x);
+        continue;
+      }
+      if (!_is_red(_left(sibling))) {
+        _set_black(_right(sibling));
+        _set_red(sibling);
+        _rotate_left(h_root, sibling);
+        sibling = _left(parent);
+      }
+      _set_parent_color(sibling,
+                        (uintptr_t)parent | (_parent_color(parent) & RED));
+      _set_black(parent);
+      _set_black(_left(sibling));
+      _rotate_right(h_root, parent);
+    }
+    x = atomic_load_explicit(h_root, memory_order_relaxed);
+    break;
+  }
+  if (x) {
+    _set_black(x);
+  }
+}
+
+void mqtt_rb_remove(_Atomic(mqtt_rb_node_s *) *h_root, mqtt_rb_node_s *node) {
+  mqtt_rb_node_s *parent = _parent(node), *successor, *x;
+  int red = _is_red(node);
+
+  if (_left(node) == NULL || _right(node) == NULL) {
+    x = _left(node) ? _left(node) : _right(node);
+    _replace_child(h_root, parent, node, x);
+    if (x) {
+      _set_parent(x, parent);
+    }
+  } else {
+    /* Splice the successor out of its place and into that of node,
+     * leaving the links of node itself untouched. */
+    for (successor = _right(node); _left(successor); ) {
+      successor = _left(successor);
+    }
+    red = _is_red(successor);
+    x = _right(successor);
+    if (_parent(successor) == node) {
+      parent = successor;
+    } else {
+      parent = _parent(successor);
+      _store(&parent->left, x);
+      if (x) {
+        _set_parent(x, parent);
+      }
+      _store(&successor->right, _right(node));
+      _set_parent(_right(node), successor);
+    }
+    _store(&successor->left, _left(node));
+    _set_parent(_left(node), successor);
+    _set_parent_color(successor, _parent_color(node));
+    _replace_child(h_root, _parent(node), node, successor);
+  }
+  if (!red) {
+    _remove_fixup(h_root, x, parent);
+  }
+}
+
+mqtt_rb_node_s *mqtt_rb_first(mqtt_rb_node_s *root) {
+  if (root == NULL) {
+    return NULL;
+  }
+  while (mqtt_rb_left(root)) {
+    root = mqtt_rb_left(root);
+  }
+  return root;
+}
+
+mqtt_rb_node_s *mqtt_rb_next(mqtt_rb_node_s *node) {
+  mqtt_rb_node_s *parent;
+
+  if (mqtt_rb_right(node)) {
+    return mqtt_rb_first(mqtt_rb_right(node));
+  }
+  while ((parent = mqtt_rb_parent(node)) && node == mqtt_rb_right(parent)) {
+    node = parent;
+  }
+  return parent;
+}
@@ -0,0 +1,359 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "mqtt_so_map.h"
+
+/* Set in the next link of a node that has been removed but may not
+ * yet be unlinked from the list. */
+#define MARK 1u
+
+/* The number of nodes per bucket at which the buckets double. */
+#define LOAD_FACTOR 2
+
+/* Bucket 0 is the map's head node. Beyond it, level k of the bucket
+ * directory holds buckets [2^(k-1), 2^k), allocated on first use. */
+#define MAX_LEVELS 32
+#define MAX_BUCKETS (1ul << (MAX_LEVELS - 1))
+
+/* count holds the number of nodes in its upper bits, and CLOSED in
+ * its lowest. */
+#define CLOSED 1ul
+#define COUNT_STEP 2ul
+
+typedef _Atomic(mqtt_so_node_s *) _bucket_t;
+
+struct mqtt_so_map {
+  /* The number of buckets, a power of two. */
+  _Atomic unsigned long size;
+  _Atomic unsigned long count;
+  _Atomic(_bucket_t *) levels[MAX_LEVELS];
+
+  /* The first node of the list, and the dummy node of bucket 0. */
+  mqtt_so_node_s head;
+};
+
+static mqtt_so_node_s *_ptr(uintptr_t link) {
+  return (mqtt_so_node_s *)(link & ~(uintptr_t)MARK);
+}
+
+uint32_t mqtt_so_map_hash(const char *key, size_t len) {
+  uint32_t hash = 2166136261u; /* FNV-1a */
+
+  for (size_t i = 0; i < len; ++i) {
+    hash = (hash ^ (unsigned char)key[i]) * 16777619u;
+  }
+  return hash;
+}
+
+static uint32_t _reverse(uint32_t x) {
+  x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+  x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+  x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+  x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+  return (x >> 16) | (x << 16);
+}
+
+/**
+ * The list is sorted on split-order keys: the bit-reversed bucket
+ * index for dummy nodes, which is even, and the bit-reversed hash
+ * with the low bit set for other nodes. Every node then follows the
+ * dummy of its bucket, whatever the number of buckets.
+ */
+static uint32_t _regular_key(uint32_t hash) {
+  return _reverse(hash) | 1u;
+}
+
+/**
+ * _cmp orders node against a position in the list, as strcmp would
+ * order its key against the first len bytes of key. key is NULL for
+ * dummy nodes, which never share a split-order key with other nodes.
+ */
+static int _cmp(mqtt_so_node_s *node, uint32_t so_key, const char *key,
+                size_t len) {
+  int cmp;
+
+  if (node->so_key != so_key) {
+    return node->so_key < so_key ? -1 : 1;
+  }
+  if (key == NULL) {
+    return 0;
+  }
+  cmp = strncmp(node->key, key, len);
+  return cmp ? cmp : node->key[len] != '\0';
+}
+
+/**
+ * _find searches the list from head for the first node at or after
+ * the given position, unlinking removed nodes on the way. It returns
+ * the node in *h_cur, or NULL if there is none, and the link that
+ * points to it in *h_prev.
+ *
+ * Returns 1 if the node found is at the position, 0 otherwise.
+ */
+static int _find(mqtt_so_node_s *head, uint32_t so_key, const char *key,
+                 size_t len, _Atomic uintptr_t **h_prev,
+                 mqtt_so_node_s **h_cur) {
+  _Atomic uintptr_t *prev;
+  mqtt_so_node_s *cur;
+  uintptr_t next, expected;
+  int cmp;
+
+retry:
+  prev = &head->next;
+  cur = _ptr(atomic_load(prev));
+  for (;;) {
+    if (cur == NULL) {
+      cmp = 1;
+      break;
+    }
+    next = atomic_load(&cur->next);
+    if (atomic_load(prev) != (uintptr_t)cur) {
+      goto retry;
+    }
+    if (next & MARK) {
+      expected = (uintptr_t)cur;
+      if (!atomic_compare_exchange_strong(prev, &expected, next & ~MARK)) {
+        goto retry;
+      }
+      cur = _ptr(next);
+      continue;
+    }
+    cmp = _cmp(cur, so_key, key, len);
+    if (cmp >= 0) {
+      break;
+    }
+    prev = &cur->next;
+    cur = _ptr(next);
+  }
+
+  *h_prev = prev;
+  *h_cur = cur;
+  return cmp == 0;
+}
+
+/**
+ * _bucket_slot returns the directory slot of bucket b, which must not
+ * be 0, or NULL if its level of the directory cannot be allocated.
+ */
+static _bucket_t *_bucket_slot(mqtt_so_map_s *m, unsigned long b) {
+  int level = 64 - __builtin_clzl(b);
+  unsigned long base = 1ul << (level - 1);
+  _bucket_t *table = atomic_load(&m->levels[level]), *expected = NULL;
+
+  if (table == NULL) {
+    table = calloc(base, sizeof(_bucket_t));
+    if (table == NULL) {
+      return NULL;
+    }
+    if (!atomic_compare_exchange_strong(&m->levels[level], &expected, table)) {
+      free(table);
+      table = expected;
+    }
+  }
+  return &table[b - base];
+}
+
+/**
+ * _bucket returns the dummy node of bucket b, adding it to the list
+ * first if need be. Buckets are split from the bucket that held their
+ * nodes before the last doubling: b without its highest bit.
+ */
+static mqtt_so_node_s *_bucket(mqtt_so_map_s *m, unsigned long b) {
+  mqtt_so_node_s *parent, *dummy, *cur;
+  _Atomic uintptr_t *prev;
+  uintptr_t expected;
+  _bucket_t *slot;
+
+  if (b == 0) {
+    return &m->head;
+  }
+  slot = _bucket_slot(m, b);
+  if (slot && (dummy = atomic_load(slot)) != NULL) {
+    return dummy;
+  }
+
+  parent = _bucket(m, b & ~(1ul << (63 - __builtin_clzl(b))));
+  if (slot == NULL || (dummy = malloc(sizeof(*dummy))) == NULL) {
+    /* Searching from the parent bucket is slower, but just as
+     * correct. */
+    return parent;
+  }
+  dummy->so_key = _reverse(b);
+  dummy->key = NULL;
+
+  for (;;) {
+    if (_find(parent, dummy->so_key, NULL, 0, &prev, &cur)) {
+      /* Another thread added it first. */
+      free(dummy);
+      dummy = cur;
+      break;
+    }
+    atomic_store(&dummy->next, (uintptr_t)cur);
+    expected = (uintptr_t)cur;
+    if (atomic_compare_exchange_strong(prev, &expected, (uintptr_t)dummy)) {
+      break;
+    }
+  }
+  atomic_store(slot, dummy);
+  return dummy;
+}
+
+static mqtt_so_node_s *_bucket_of(mqtt_so_map_s *m, uint32_t hash) {
+  return _bucket(m, hash & (atomic_load(&m->size) - 1));
+}
+
+mqtt_so_map_s *mqtt_so_map_create(void) {
+  mqtt_so_map_s *m = calloc(1, sizeof(*m));
+
+  if (m == NULL) {
+    return NULL;
+  }
+  atomic_init(&m->size, 2);
+  return m;
+}
+
+void mqtt_so_map_destroy(mqtt_so_map_s *m, void (*fn)(mqtt_so_node_s *node)) {
+  mqtt_so_node_s *cur, *next;
+
+  for (cur = _ptr(atomic_load(&m->head.next)); cur; cur = next) {
+    next = _ptr(atomic_load(&cur->next));
+    if (cur->key == NULL) {
+      free(cur);
+    } else if (fn) {
+      fn(cur);
+    }
+  }
+  for (int i = 0; i < MAX_LEVELS; ++i) {
+    free(atomic_load(&m->levels[i]));
+  }
+  free(m);
+}
+
+mqtt_so_node_s *mqtt_so_map_find(mqtt_so_map_s *m, const char *key,
+                                 size_t len) {
+  return mqtt_so_map_find_hashed(m, key, len, mqtt_so_map_hash(key, len));
+}
+
+mqtt_so_node_s *mqtt_so_map_find_hashed(mqtt_so_map_s *m, const char *key,
+                                        size_t len, uint32_t hash) {
+  _Atomic uintptr_t *prev;
+  mqtt_so_node_s *cur;
+
+  if (_find(_bucket_of(m, hash), _regular_key(hash), key, len, &prev,
+            &cur)) {
+    return cur;
+  }
+  return NULL;
+}
+
+mqtt_so_node_s *mqtt_so_map_insert(mqtt_so_map_s *m, mqtt_so_node_s *node) {
+  size_t len = strlen(node->key);
+  uint32_t hash = mqtt_so_map_hash(node->key, len);
+  unsigned long count, size;
+  mqtt_so_node_s *head, *cur;
+  _Atomic uintptr_t *prev;
+  uintptr_t expected;
+
+  /* Count the node in up front, so the map cannot be closed while it
+   * is being inserted. */
+  count = atomic_load(&m->count);
+  do {
+    if (count & CLOSED) {
+      return NULL;
+    }
+  } while (!atomic_compare_exchange_weak(&m->count, &count,
+                                         count + COUNT_STEP));
+
+  node->so_key = _regular_key(hash);
+  head = _bucket_of(m, hash);
+  for (;;) {
+    if (_find(head, node->so_key, node->key, len, &prev, &cur)) {
+      atomic_fetch_sub(&m->count, COUNT_STEP);
+      return cur;
+    }
+    atomic_store(&node->next, (uintptr_t)cur);
+    expected = (uintptr_t)cur;
+    if (atomic_compare_exchange_strong(prev, &expected, (uintptr_t)node)) {
+      break;
+    }
+  }
+
+  count = count / COUNT_STEP + 1;
+  size = atomic_load(&m->size);
+  if (count > size * LOAD_FACTOR && size < MAX_BUCKETS) {
+    atomic_compare_exchange_strong(&m->size, &size, size * 2);
+  }
+  return node;
+}
+
+int mqtt_so_map_remove(mqtt_so_map_s *m, mqtt_so_node_s *node) {
+  size_t len = strlen(node->key);
+  uint32_t hash = mqtt_so_map_hash(node->key, len);
+  mqtt_so_node_s *head = _bucket_of(m, hash), *cur;
+  _Atomic uintptr_t *prev;
+  uintptr_t next, expected;
+
+  for (;;) {
+    if (!_find(head, node->so_key, node->key, len, &prev, &cur) ||
+        cur != node) {
+      return 1;
+    }
+    next = atomic_load(&node->next);
+    if (next & MARK) {
+      continue;
+    }
+    if (atomic_compare_exchange_strong(&node->next, &next, next | MARK)) {
+      break;
+    }
+  }
+
+  /* node is removed; make sure it is also unlinked before returning,
+   * leaving it to _find if another thread got in the way. */
+  expected = (uintptr_t)node;
+  if (!atomic_compare_exchange_strong(prev, &expected, next)) {
+    _find(head, node->so_key, node->key, len, &prev, &cur);
+  }
+  atomic_fetch_sub(&m->count, COUNT_STEP);
+  return 0;
+}
+
+int mqtt_so_map_empty(mqtt_so_map_s *m) {
+  return atomic_load(&m->count) < COUNT_STEP;
+}
+
+int mqtt_so_map_close(mqtt_so_map_s *m) {
+  unsigned long expected = 0;
+
+  return atomic_compare_exchange_strong(&m->count, &expected, CLOSED);
+}
+
+int mqtt_so_map_chunk(mqtt_so_map_s *m, const char *after,
+                      mqtt_so_node_s **out, int max) {
+  mqtt_so_node_s *cur;
+  _Atomic uintptr_t *prev;
+  uintptr_t next;
+  uint32_t hash;
+  size_t len;
+  int n = 0;
+
+  if (after == NULL) {
+    cur = _ptr(atomic_load(&m->head.next));
+  } else {
+    len = strlen(after);
+    hash = mqtt_so_map_hash(after, len);
+    if (_find(_bucket_of(m, hash), _regular_key(hash), after, len, &prev,
+              &cur)) {
+      cur = _ptr(atomic_load(&cur->next));
+    }
+  }
+
+  /* Links of removed nodes still lead forward, so the walk can pass
+   * through them. */
+  for (; cur != NULL && n < max; cur = _ptr(next)) {
+    next = atomic_load(&cur->next);
+    if (cur->key != NULL && !(next & MARK)) {
+      out[n++] = cur;
+    }
+  }
+  return n;
+}
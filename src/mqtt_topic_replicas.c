@@ -0,0 +1,321 @@
+/* For sched_getcpu. */
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mqtt_topic_replicas.h"
+
+#define CACHE_LINE_SIZE 64
+
+/* The number of updates the log holds before writers must wait for
+ * the slowest replica. */
+#define LOG_SIZE 1024
+
+/* Beyond any machine we expect to run on. */
+#define MAX_CPUS 4096
+
+/**
+ * _op_s is an update in the log. topic is owned by the log.
+ */
+typedef struct {
+  char *topic;
+  void *data;
+} _op_s;
+
+/**
+ * A replica is padded to a cache line so that replicas on different
+ * nodes do not share one.
+ */
+typedef struct {
+  _Alignas(CACHE_LINE_SIZE) pthread_rwlock_t lock;
+  mqtt_topic_segment_s *root;
+
+  /* The number of log entries replayed into root. Only changes under
+   * the write lock. */
+  _Atomic unsigned long applied;
+} _replica_s;
+
+struct mqtt_topic_replicas {
+  int count;
+  _replica_s *replicas;
+
+  /* Serializes appends to the log. */
+  pthread_mutex_t log_lock;
+  _op_s log[LOG_SIZE];
+
+  /* The number of entries ever appended to the log. Entry i is in
+   * log[i % LOG_SIZE] until every replica has replayed it. */
+  _Atomic unsigned long tail;
+
+  /* The node of each CPU, or NULL if unknown. */
+  short *cpu_nodes;
+};
+
+/**
+ * _read_cpulist reads a sysfs list such as "0-3,8-11" from path,
+ * calling fn with each number in it.
+ *
+ * Returns 0 on success, -1 if the file could not be read.
+ */
+static int _read_cpulist(const char *path, void (*fn)(void *data, int n),
+                         void *data) {
+  FILE *f = fopen(path, "r");
+  int lo, hi, c;
+
+  if (f == NULL) {
+    return -1;
+  }
+  while (fscanf(f, "%d", &lo) == 1) {
+    hi = lo;
+    if ((c = fgetc(f)) == '-') {
+      if (fscanf(f, "%d", &hi) != 1) {
+        break;
+      }
+      c = fgetc(f);
+    }
+    for (int n = lo; n <= hi; ++n) {
+      fn(data, n);
+    }
+    if (c != ',') {
+      break;
+    }
+  }
+  fclose(f);
+  return 0;
+}
+
+static void _max_node(void *data, int n) {
+  int *max = data;
+
+  if (n > *max) {
+    *max = n;
+  }
+}
+
+int mqtt_topic_replicas_node_count(void) {
+  int max = 0;
+
+  _read_cpulist("/sys/devices/system/node/online", &_max_node, &max);
+  return max + 1;
+}
+
+typedef struct {
+  short *cpu_nodes;
+  short node;
+} _cpu_map_s;
+
+static void _map_cpu(void *data, int cpu) {
+  _cpu_map_s *map = data;
+
+  if (cpu >= 0 && cpu < MAX_CPUS) {
+    map->cpu_nodes[cpu] = map->node;
+  }
+}
+
+/**
+ * _cpu_nodes returns a table of the node of each CPU, or NULL if
+ * that is unknown.
+ */
+static short *_cpu_nodes(void) {
+  _cpu_map_s map = { .cpu_nodes = calloc(MAX_CPUS, sizeof(short)) };
+  int nodes = mqtt_topic_replicas_node_count();
+  char path[64];
+
+  if (map.cpu_nodes == NULL) {
+    return NULL;
+  }
+  for (map.node = 0; map.node < nodes; ++map.node) {
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+             map.node);
+    if (_read_cpulist(path, &_map_cpu, &map) != 0 && map.node == 0) {
+      free(map.cpu_nodes);
+      return NULL;
+    }
+  }
+  return map.cpu_nodes;
+}
+
+mqtt_topic_replicas_s *mqtt_topic_replicas_create(int count) {
+  mqtt_topic_replicas_s *t;
+  int i;
+
+  if (count <= 0) {
+    count = mqtt_topic_replicas_node_count();
+  }
+  t = calloc(1, sizeof(*t));
+  if (t == NULL) {
+    return NULL;
+  }
+  t->count = count;
+  t->replicas = aligned_alloc(CACHE_LINE_SIZE, count * sizeof(_replica_s));
+  if (t->replicas == NULL) {
+    free(t);
+    return NULL;
+  }
+  t->cpu_nodes = _cpu_nodes();
+  pthread_mutex_init(&t->log_lock, NULL);
+
+  for (i = 0; i < count; ++i) {
+    t->replicas[i].root = mqtt_topic_segment_create();
+    if (t->replicas[i].root == NULL) {
+      goto fail;
+    }
+    pthread_rwlock_init(&t->replicas[i].lock, NULL);
+    atomic_init(&t->replicas[i].applied, 0);
+  }
+  return t;
+
+fail:
+  while (i-- > 0) {
+    pthread_rwlock_destroy(&t->replicas[i].lock);
+    mqtt_topic_segment_destroy(t->replicas[i].root);
+  }
+  pthread_mutex_destroy(&t->log_lock);
+  free(t->cpu_nodes);
+  free(t->replicas);
+  free(t);
+  return NULL;
+}
+
+void mqtt_topic_replicas_destroy(mqtt_topic_replicas_s *t) {
+  for (int i = 0; i < t->count; ++i) {
+    pthread_rwlock_destroy(&t->replicas[i].lock);
+    mqtt_topic_segment_destroy(t->replicas[i].root);
+  }
+  for (int i = 0; i < LOG_SIZE; ++i) {
+    free(t->log[i].topic);
+  }
+  pthread_mutex_destroy(&t->log_lock);
+  free(t->cpu_nodes);
+  free(t->replicas);
+  free(t);
+}
+
+int mqtt_topic_replicas_local_node(mqtt_topic_replicas_s *t) {
+  int cpu = sched_getcpu();
+
+  if (t->cpu_nodes == NULL || cpu < 0 || cpu >= MAX_CPUS) {
+    return 0;
+  }
+  return t->cpu_nodes[cpu] % t->count;
+}
+
+/**
+ * _apply applies an update to the tree under root.
+ *
+ * Returns 0 on success, -1 if out of memory.
+ */
+static int _apply(mqtt_topic_segment_s *root, _op_s *op) {
+  mqtt_topic_segment_s *segment;
+  char *topic = strdup(op->topic);
+  int rc;
+
+  if (topic == NULL) {
+    return -1;
+  }
+  rc = mqtt_topic_find_or_add(&segment, root, topic, op->data != NULL);
+  if (rc == 0) {
+    segment->data = op->data;
+    rc = mqtt_topic_segment_remove(segment);
+  } else if (rc == 1) {
+    /* Removing a topic that is not there. */
+    rc = 0;
+  }
+  free(topic);
+  return rc;
+}
+
+/**
+ * _replica_sync replays the entries of the log that r has not yet
+ * applied.
+ *
+ * Returns 0 on success, -1 if out of memory.
+ */
+static int _replica_sync(mqtt_topic_replicas_s *t, _replica_s *r) {
+  unsigned long applied, tail;
+  int rc = 0;
+
+  pthread_rwlock_wrlock(&r->lock);
+  tail = atomic_load_explicit(&t->tail, memory_order_acquire);
+  for (applied = atomic_load(&r->applied); applied < tail; ++applied) {
+    rc = _apply(r->root, &t->log[applied % LOG_SIZE]);
+    if (rc != 0) {
+      break;
+    }
+  }
+  /* Releases the entries replayed to writers waiting to reuse them. */
+  atomic_store_explicit(&r->applied, applied, memory_order_release);
+  pthread_rwlock_unlock(&r->lock);
+  return rc;
+}
+
+/**
+ * _slowest returns the replica that has applied the fewest entries.
+ */
+static _replica_s *_slowest(mqtt_topic_replicas_s *t) {
+  _replica_s *slowest = &t->replicas[0];
+
+  for (int i = 1; i < t->count; ++i) {
+    if (atomic_load(&t->replicas[i].applied) < atomic_load(&slowest->applied)) {
+      slowest = &t->replicas[i];
+    }
+  }
+  return slowest;
+}
+
+int mqtt_topic_replicas_update(mqtt_topic_replicas_s *t, const char *topic,
+                               void *data) {
+  char *copy = strdup(topic);
+  unsigned long tail;
+  _replica_s *slowest;
+  _op_s *op;
+
+  if (copy == NULL) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&t->log_lock);
+  tail = atomic_load(&t->tail);
+  for (;;) {
+    slowest = _slowest(t);
+    if (tail - atomic_load_explicit(&slowest->applied,
+                                    memory_order_acquire) < LOG_SIZE) {
+      break;
+    }
+    /* The log is full. */
+    if (_replica_sync(t, slowest) != 0) {
+      pthread_mutex_unlock(&t->log_lock);
+      free(copy);
+      return -1;
+    }
+  }
+
+  /* Every replica has replayed the entry this replaces. */
+  op = &t->log[tail % LOG_SIZE];
+  free(op->topic);
+  op->topic = copy;
+  op->data = data;
+  atomic_store_explicit(&t->tail, tail + 1, memory_order_release);
+  pthread_mutex_unlock(&t->log_lock);
+  return 0;
+}
+
+int mqtt_topic_replicas_matching_iter(mqtt_topic_replicas_s *t, int node,
+                                      char *pattern, mqtt_iter_cb_s *cb) {
+  _replica_s *r = &t->replicas[node % t->count];
+  int rc = 0;
+
+  if (atomic_load(&r->applied) != atomic_load(&t->tail)) {
+    rc = _replica_sync(t, r);
+  }
+
+  pthread_rwlock_rdlock(&r->lock);
+  mqtt_topic_matching_iter(r->root, pattern, cb);
+  pthread_rwlock_unlock(&r->lock);
+  return rc;
+}
@@ -0,0 +1,177 @@
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mqtt_topic_retained.h"
+
+struct mqtt_topic_retained {
+  mqtt_topic_segment_s *root;
+};
+
+mqtt_topic_payload_s *mqtt_topic_payload_create(const void *data,
+                                                size_t len) {
+  mqtt_topic_payload_s *p = malloc(sizeof(*p) + len);
+
+  if (p == NULL) {
+    return NULL;
+  }
+  atomic_init(&p->refs, 1);
+  p->len = len;
+  memcpy(p->data, data, len);
+  return p;
+}
+
+mqtt_topic_payload_s *mqtt_topic_payload_ref(mqtt_topic_payload_s *p) {
+  atomic_fetch_add(&p->refs, 1);
+  return p;
+}
+
+static void _payload_reclaim(mqtt_epoch_entry_s *entry) {
+  free((char *)entry - offsetof(mqtt_topic_payload_s, retired));
+}
+
+void mqtt_topic_payload_unref(mqtt_topic_payload_s *p) {
+  if (atomic_fetch_sub(&p->refs, 1) == 1) {
+    mqtt_epoch_retire(&p->retired, &_payload_reclaim);
+  }
+}
+
+/**
+ * _payload_try_ref takes a reference to a payload found in the store,
+ * unless its last reference is already gone. That only happens once
+ * the store has replaced it, so the reader saw an older message and
+ * may skip it.
+ *
+ * Returns 1 if a reference was taken, 0 otherwise.
+ */
+static int _payload_try_ref(mqtt_topic_payload_s *p) {
+  unsigned long refs = atomic_load(&p->refs);
+
+  do {
+    if (refs == 0) {
+      return 0;
+    }
+  } while (!atomic_compare_exchange_weak(&p->refs, &refs, refs + 1));
+  return 1;
+}
+
+mqtt_topic_retained_s *mqtt_topic_retained_create(void) {
+  mqtt_topic_retained_s *s = malloc(sizeof(*s));
+
+  if (s == NULL) {
+    return NULL;
+  }
+  s->root = mqtt_topic_segment_create();
+  if (s->root == NULL) {
+    free(s);
+    return NULL;
+  }
+  mqtt_topic_concurrent_enable(s->root);
+  return s;
+}
+
+static void _release(void *data, char *topic, mqtt_topic_segment_s *segment) {
+  if (segment->data) {
+    mqtt_topic_payload_unref(segment->data);
+    segment->data = NULL;
+  }
+}
+
+void mqtt_topic_retained_destroy(mqtt_topic_retained_s *s) {
+  mqtt_iter_cb_s cb = { .fn = &_release };
+
+  mqtt_topic_iter(s->root, &cb);
+  mqtt_topic_segment_destroy(s->root);
+  free(s);
+}
+
+typedef struct {
+  mqtt_topic_payload_s *payload;
+  mqtt_topic_payload_s *old;
+} _swap_s;
+
+static void _swap(void *data, char *topic, mqtt_topic_segment_s *segment) {
+  _swap_s *sw = data;
+
+  /* Readers load the payload without the lock, so it is swapped in
+   * whole, fields and all. */
+  sw->old = atomic_exchange_explicit(&segment->data, sw->payload,
+                                     memory_order_acq_rel);
+}
+
+int mqtt_topic_retained_set(mqtt_topic_retained_s *s, const char *topic,
+                            mqtt_topic_payload_s *p) {
+  _swap_s sw = { .payload = (p && p->len > 0) ? p : NULL };
+  mqtt_iter_cb_s cb = { .data = &sw, .fn = &_swap };
+  char *buf;
+  int rc;
+
+  buf = strdup(topic);
+  if (buf == NULL) {
+    return -1;
+  }
+  if (sw.payload) {
+    mqtt_topic_payload_ref(sw.payload);
+  }
+  rc = mqtt_topic_update(s->root, buf, &cb);
+  free(buf);
+  if (rc != 0) {
+    if (sw.payload) {
+      mqtt_topic_payload_unref(sw.payload);
+    }
+    return rc;
+  }
+  /* Readers that found the old payload before the swap either took
+   * their reference already or will fail to; either way it outlives
+   * them. */
+  if (sw.old) {
+    mqtt_topic_payload_unref(sw.old);
+  }
+  return 0;
+}
+
+mqtt_topic_payload_s *mqtt_topic_retained_get(mqtt_topic_retained_s *s,
+                                              const char *topic) {
+  mqtt_topic_payload_s *p = NULL;
+  mqtt_topic_segment_s *segment;
+  char *buf;
+
+  buf = strdup(topic);
+  if (buf == NULL) {
+    return NULL;
+  }
+  mqtt_epoch_enter();
+  if (mqtt_topic_find_or_add(&segment, s->root, buf, 0) == 0) {
+    p = atomic_load_explicit(&segment->data, memory_order_acquire);
+    if (p && !_payload_try_ref(p)) {
+      p = NULL;
+    }
+  }
+  mqtt_epoch_exit();
+  free(buf);
+  return p;
+}
+
+static void _deliver(void *data, char *topic, mqtt_topic_segment_s *segment) {
+  mqtt_topic_retained_cb_s *cb = data;
+  mqtt_topic_payload_s *p =
+      atomic_load_explicit(&segment->data, memory_order_acquire);
+
+  if (p && _payload_try_ref(p)) {
+    cb->fn(cb->data, topic, p);
+  }
+}
+
+int mqtt_topic_retained_match(mqtt_topic_retained_s *s, const char *filter,
+                              mqtt_topic_retained_cb_s *cb) {
+  mqtt_iter_cb_s match = { .data = cb, .fn = &_deliver };
+  char *buf;
+
+  buf = strdup(filter);
+  if (buf == NULL) {
+    return -1;
+  }
+  mqtt_topic_matching_iter(s->root, buf, &match);
+  free(buf);
+  return 0;
+}
@@ -0,0 +1,225 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "mqtt_topic_rewrite.h"
+
+struct mqtt_topic_rewrite {
+  mqtt_topic_segment_s *root;
+};
+
+/**
+ * _part_s is a part of a compiled template: either len characters of
+ * the template text from offset, or, if capture is not negative, the
+ * part of the topic bound to that wildcard.
+ */
+typedef struct {
+  int capture;
+  unsigned int offset;
+  unsigned int len;
+} _part_s;
+
+/**
+ * _rule_s is a compiled template, allocated in one piece with its
+ * parts and a copy of its text.
+ */
+typedef struct {
+  int n_parts;
+  const char *text;
+  _part_s parts[];
+} _rule_s;
+
+mqtt_topic_rewrite_s *mqtt_topic_rewrite_create(void) {
+  mqtt_topic_rewrite_s *rw = malloc(sizeof(*rw));
+
+  if (rw == NULL) {
+    return NULL;
+  }
+  rw->root = mqtt_topic_segment_create();
+  if (rw->root == NULL) {
+    free(rw);
+    return NULL;
+  }
+  return rw;
+}
+
+static void _free_rule(void *data, char *topic,
+                       mqtt_topic_segment_s *segment) {
+  free(segment->data);
+  segment->data = NULL;
+}
+
+void mqtt_topic_rewrite_destroy(mqtt_topic_rewrite_s *rw) {
+  mqtt_iter_cb_s cb = { .fn = &_free_rule };
+
+  mqtt_topic_iter(rw->root, &cb);
+  mqtt_topic_segment_destroy(rw->root);
+  free(rw);
+}
+
+/**
+ * _wildcards returns the number of wildcard levels in pattern.
+ */
+static int _wildcards(const char *pattern) {
+  const char *level = pattern;
+  int n = 0;
+
+  for (;;) {
+    if ((level[0] == '+' || level[0] == '#') &&
+        (level[1] == '/' || level[1] == '\0')) {
+      ++n;
+    }
+    level = strchr(level, '/');
+    if (level == NULL) {
+      return n;
+    }
+    ++level;
+  }
+}
+
+/**
+ * _compile splits template into parts, with references checked against
+ * the number of wildcards.
+ *
+ * Returns NULL if out of memory, or if template refers to a wildcard
+ * that does not exist, in which case *h_invalid is set.
+ */
+static _rule_s *_compile(const char *template, int wildcards,
+                         int *h_invalid) {
+  size_t len = strlen(template);
+  const char *p, *end;
+  _rule_s *rule;
+  _part_s *part;
+  long capture;
+  char *text;
+
+  /* A template of len characters has at most len + 1 parts. */
+  rule = malloc(sizeof(*rule) + (len + 1) * sizeof(_part_s) + len + 1);
+  if (rule == NULL) {
+    return NULL;
+  }
+  text = (char *)&rule->parts[len + 1];
+  memcpy(text, template, len + 1);
+  rule->text = text;
+  rule->n_parts = 0;
+
+  for (p = text; *p;) {
+    part = &rule->parts[rule->n_parts];
+    if (p[0] == '{' && p[1] >= '1' && p[1] <= '9') {
+      capture = strtol(p + 1, (char **)&end, 10);
+      if (*end == '}') {
+        if (capture > wildcards) {
+          free(rule);
+          *h_invalid = 1;
+          return NULL;
+        }
+        part->capture = capture - 1;
+        ++rule->n_parts;
+        p = end + 1;
+        continue;
+      }
+    }
+    /* Extend the literal part in progress, or start one. */
+    if (rule->n_parts > 0 && part[-1].capture < 0) {
+      ++part[-1].len;
+    } else {
+      part->capture = -1;
+      part->offset = p - text;
+      part->len = 1;
+      ++rule->n_parts;
+    }
+    ++p;
+  }
+  return rule;
+}
+
+int mqtt_topic_rewrite_add(mqtt_topic_rewrite_s *rw, const char *pattern,
+                           const char *template) {
+  int wildcards = _wildcards(pattern), invalid = 0, rc;
+  mqtt_topic_segment_s *segment;
+  _rule_s *rule;
+  char *buf;
+
+  if (wildcards > MQTT_TOPIC_REWRITE_MAX_CAPTURES) {
+    return 1;
+  }
+  rule = _compile(template, wildcards, &invalid);
+  if (rule == NULL) {
+    return invalid ? 1 : -1;
+  }
+  buf = strdup(pattern);
+  if (buf == NULL) {
+    free(rule);
+    return -1;
+  }
+  rc = mqtt_topic_find_or_add(&segment, rw->root, buf, 1);
+  free(buf);
+  if (rc != 0) {
+    free(rule);
+    return rc;
+  }
+  free(segment->data);
+  segment->data = rule;
+  return 0;
+}
+
+int mqtt_topic_rewrite_remove(mqtt_topic_rewrite_s *rw, const char *pattern) {
+  mqtt_topic_segment_s *segment;
+  char *buf;
+  int rc;
+
+  buf = strdup(pattern);
+  if (buf == NULL) {
+    return -1;
+  }
+  rc = mqtt_topic_find_or_add(&segment, rw->root, buf, 0);
+  free(buf);
+  if (rc != 0) {
+    return rc;
+  }
+  if (segment->data == NULL) {
+    return 1;
+  }
+  free(segment->data);
+  segment->data = NULL;
+  return mqtt_topic_segment_remove(segment);
+}
+
+int mqtt_topic_rewrite_apply(mqtt_topic_rewrite_s *rw, char *topic, char *out,
+                             size_t size) {
+  mqtt_topic_span_s spans[MQTT_TOPIC_REWRITE_MAX_CAPTURES];
+  mqtt_topic_segment_s *segment;
+  const char *src;
+  size_t len = 0;
+  _rule_s *rule;
+  _part_s *part;
+  int n_spans;
+
+  segment = mqtt_topic_best_match(rw->root, topic, spans,
+                                  MQTT_TOPIC_REWRITE_MAX_CAPTURES, &n_spans);
+  if (segment == NULL) {
+    return -1;
+  }
+  rule = segment->data;
+  for (int i = 0; i < rule->n_parts; ++i) {
+    part = &rule->parts[i];
+    len += part->capture < 0 ? part->len : spans[part->capture].len;
+  }
+  if (len >= size) {
+    return len;
+  }
+
+  len = 0;
+  for (int i = 0; i < rule->n_parts; ++i) {
+    part = &rule->parts[i];
+    if (part->capture < 0) {
+      memcpy(out + len, rule->text + part->offset, part->len);
+      len += part->len;
+    } else {
+      src = topic + spans[part->capture].offset;
+      memcpy(out + len, src, spans[part->capture].len);
+      len += spans[part->capture].len;
+    }
+  }
+  out[len] = '\0';
+  return len;
+}
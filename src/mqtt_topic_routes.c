@@ -0,0 +1,194 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "mqtt_topic_routes.h"
+
+struct mqtt_topic_routes {
+  mqtt_topic_segment_s *root;
+
+  /* Node IDs run from 0 to max_nodes - 1. */
+  int max_nodes;
+
+  /* The number of words in every node set. */
+  int words;
+};
+
+typedef struct {
+  uint64_t *dest;
+  int words;
+} _match_s;
+
+mqtt_topic_routes_s *mqtt_topic_routes_create(int max_nodes) {
+  mqtt_topic_routes_s *t = malloc(sizeof(*t));
+
+  if (t == NULL) {
+    return NULL;
+  }
+  t->root = mqtt_topic_segment_create();
+  if (t->root == NULL) {
+    free(t);
+    return NULL;
+  }
+  t->max_nodes = max_nodes > 0 ? max_nodes : 64;
+  t->words = (t->max_nodes + 63) / 64;
+  return t;
+}
+
+static void _free_set(void *data, char *topic, mqtt_topic_segment_s *segment) {
+  free(segment->data);
+  segment->data = NULL;
+}
+
+void mqtt_topic_routes_destroy(mqtt_topic_routes_s *t) {
+  mqtt_iter_cb_s cb = { .fn = &_free_set };
+
+  mqtt_topic_iter(t->root, &cb);
+  mqtt_topic_segment_destroy(t->root);
+  free(t);
+}
+
+int mqtt_topic_routes_words(mqtt_topic_routes_s *t) {
+  return t->words;
+}
+
+/**
+ * _set_is_empty returns 1 if the node set holds no node.
+ */
+static int _set_is_empty(const uint64_t *set, int words) {
+  for (int i = 0; i < words; ++i) {
+    if (set[i]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+int mqtt_topic_routes_add(mqtt_topic_routes_s *t, const char *filter,
+                          int node) {
+  mqtt_topic_segment_s *segment;
+  uint64_t *set;
+  char *buf;
+  int rc;
+
+  if (node < 0 || node >= t->max_nodes) {
+    return 1;
+  }
+  buf = strdup(filter);
+  if (buf == NULL) {
+    return -1;
+  }
+  rc = mqtt_topic_find_or_add(&segment, t->root, buf, 1);
+  free(buf);
+  if (rc != 0) {
+    return rc;
+  }
+
+  set = segment->data;
+  if (set == NULL) {
+    set = calloc(t->words, sizeof(*set));
+    if (set == NULL) {
+      /* Do not leave the filter's segments behind. */
+      mqtt_topic_segment_remove(segment);
+      return -1;
+    }
+    segment->data = set;
+  }
+  set[node / 64] |= 1ull << (node % 64);
+  return 0;
+}
+
+int mqtt_topic_routes_remove(mqtt_topic_routes_s *t, const char *filter,
+                             int node) {
+  mqtt_topic_segment_s *segment;
+  uint64_t *set, bit = 1ull << (node % 64);
+  char *buf;
+  int rc;
+
+  if (node < 0 || node >= t->max_nodes) {
+    return 1;
+  }
+  buf = strdup(filter);
+  if (buf == NULL) {
+    return -1;
+  }
+  rc = mqtt_topic_find_or_add(&segment, t->root, buf, 0);
+  free(buf);
+  if (rc != 0) {
+    return rc;
+  }
+
+  set = segment->data;
+  if (set == NULL || !(set[node / 64] & bit)) {
+    return 1;
+  }
+  set[node / 64] &= ~bit;
+  if (_set_is_empty(set, t->words)) {
+    free(set);
+    segment->data = NULL;
+    return mqtt_topic_segment_remove(segment);
+  }
+  return 0;
+}
+
+typedef struct {
+  int node;
+  int words;
+} _remove_node_s;
+
+/**
+ * _clear_node takes the node out of the set of segment, and selects
+ * segments left with no set and no children for removal. Segments
+ * whose children all go are then removed along with them.
+ */
+static int _clear_node(void *data, char *topic,
+                       mqtt_topic_segment_s *segment) {
+  _remove_node_s *r = data;
+  uint64_t *set = segment->data;
+
+  if (set) {
+    set[r->node / 64] &= ~(1ull << (r->node % 64));
+    if (_set_is_empty(set, r->words)) {
+      free(set);
+      segment->data = NULL;
+    }
+  }
+  return segment->data == NULL && !mqtt_topic_has_children(segment);
+}
+
+int mqtt_topic_routes_remove_node(mqtt_topic_routes_s *t, int node) {
+  _remove_node_s r = { .node = node, .words = t->words };
+  mqtt_topic_pred_s pred = { .data = &r, .fn = &_clear_node };
+
+  if (node < 0 || node >= t->max_nodes) {
+    return 1;
+  }
+  mqtt_topic_remove_if(t->root, &pred, NULL);
+  return 0;
+}
+
+static void _merge_set(void *data, char *topic,
+                       mqtt_topic_segment_s *segment) {
+  _match_s *m = data;
+  const uint64_t *set = segment->data;
+
+  if (set == NULL) {
+    return;
+  }
+  for (int i = 0; i < m->words; ++i) {
+    m->dest[i] |= set[i];
+  }
+}
+
+int mqtt_topic_routes_match(mqtt_topic_routes_s *t, char *topic,
+                            uint64_t *dest) {
+  _match_s m = { .dest = dest, .words = t->words };
+  mqtt_iter_cb_s cb = { .data = &m, .fn = &_merge_set };
+  int count = 0;
+
+  memset(dest, 0, t->words * sizeof(*dest));
+  mqtt_topic_matching_iter(t->root, topic, &cb);
+  for (int i = 0; i < t->words; ++i) {
+    count += __builtin_popcountll(dest[i]);
+  }
+  return count;
+}
@@ -0,0 +1,146 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mqtt_topic_shards.h"
+
+#define CACHE_LINE_SIZE 64
+
+/**
+ * A shard is padded to a cache line so that taking one shard's lock
+ * does not disturb its neighbours.
+ */
+typedef struct {
+  _Alignas(CACHE_LINE_SIZE) pthread_rwlock_t lock;
+  mqtt_topic_segment_s *root;
+} _shard_s;
+
+struct mqtt_topic_shards {
+  /* The number of hashed shards. shards[count] is the wildcard
+   * shard. */
+  int count;
+  int depth;
+  _shard_s *shards;
+};
+
+/**
+ * _shard_index returns the index of the shard holding topic: a hash
+ * of its first t->depth segments, or t->count if one of them is a
+ * wildcard.
+ */
+static int _shard_index(mqtt_topic_shards_s *t, const char *topic) {
+  uint32_t hash = 2166136261u; /* FNV-1a */
+  const char *seg = topic, *c;
+  int level = 0;
+
+  for (c = topic; ; ++c) {
+    if (*c == '/' || *c == '\0') {
+      if (c - seg == 1 && (*seg == '+' || *seg == '#')) {
+        return t->count;
+      }
+      if (*c == '\0' || ++level == t->depth) {
+        break;
+      }
+      seg = c + 1;
+    }
+    hash = (hash ^ (unsigned char)*c) * 16777619u;
+  }
+  return hash % t->count;
+}
+
+mqtt_topic_shards_s *mqtt_topic_shards_create(int count, int depth) {
+  mqtt_topic_shards_s *t;
+  int i;
+
+  if (count <= 0) {
+    return NULL;
+  }
+  t = malloc(sizeof(*t));
+  if (t == NULL) {
+    return NULL;
+  }
+  t->count = count;
+  t->depth = depth;
+  t->shards = aligned_alloc(CACHE_LINE_SIZE, (count + 1) * sizeof(_shard_s));
+  if (t->shards == NULL) {
+    free(t);
+    return NULL;
+  }
+
+  for (i = 0; i <= count; ++i) {
+    t->shards[i].root = mqtt_topic_segment_create();
+    if (t->shards[i].root == NULL) {
+      goto fail;
+    }
+    pthread_rwlock_init(&t->shards[i].lock, NULL);
+  }
+  return t;
+
+fail:
+  while (i-- > 0) {
+    pthread_rwlock_destroy(&t->shards[i].lock);
+    mqtt_topic_segment_destroy(t->shards[i].root);
+  }
+  free(t->shards);
+  free(t);
+  return NULL;
+}
+
+void mqtt_topic_shards_destroy(mqtt_topic_shards_s *t) {
+  for (int i = 0; i <= t->count; ++i) {
+    pthread_rwlock_destroy(&t->shards[i].lock);
+    mqtt_topic_segment_destroy(t->shards[i].root);
+  }
+  free(t->shards);
+  free(t);
+}
+
+int mqtt_topic_shards_update(mqtt_topic_shards_s *t, char *topic,
+                             mqtt_iter_cb_s *cb) {
+  _shard_s *shard = &t->shards[_shard_index(t, topic)];
+  mqtt_topic_segment_s *segment;
+  int rc;
+
+  pthread_rwlock_wrlock(&shard->lock);
+  rc = mqtt_topic_find_or_add(&segment, shard->root, topic, 1);
+  if (rc == 0) {
+    cb->fn(cb->data, topic, segment);
+    rc = mqtt_topic_segment_remove(segment);
+  }
+  pthread_rwlock_unlock(&shard->lock);
+
+  return rc;
+}
+
+static void _shard_matching_iter(_shard_s *shard, char *pattern,
+                                 mqtt_iter_cb_s *cb) {
+  pthread_rwlock_rdlock(&shard->lock);
+  mqtt_topic_matching_iter(shard->root, pattern, cb);
+  pthread_rwlock_unlock(&shard->lock);
+}
+
+void mqtt_topic_shards_matching_iter(mqtt_topic_shards_s *t, char *pattern,
+                                     mqtt_iter_cb_s *cb) {
+  int i = _shard_index(t, pattern);
+
+  if (i == t->count) {
+    for (i = 0; i <= t->count; ++i) {
+      _shard_matching_iter(&t->shards[i], pattern, cb);
+    }
+    return;
+  }
+
+  /* Topics in other hashed shards differ from pattern somewhere in
+   * their first depth segments, so only wildcards can match. */
+  _shard_matching_iter(&t->shards[i], pattern, cb);
+  _shard_matching_iter(&t->shards[t->count], pattern, cb);
+}
+
+void mqtt_topic_shards_iter(mqtt_topic_shards_s *t, mqtt_iter_cb_s *cb) {
+  for (int i = 0; i <= t->count; ++i) {
+    pthread_rwlock_rdlock(&t->shards[i].lock);
+    mqtt_topic_iter(t->shards[i].root, cb);
+    pthread_rwlock_unlock(&t->shards[i].lock);
+  }
+}
@@ -1,22 +1,52 @@
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "mqtt_topic_tree.h"
 
 /* This length includes the terminator. */
 #define MAX_TOPIC_LENGTH 65536
 
-static char scratch_topic[MAX_TOPIC_LENGTH] = { '\0' };
-static int scratch_topic_length = 0;
+/* Each thread builds topic strings in its own scratch buffer, so
+ * separate trees can be used from separate threads. */
+static _Thread_local char scratch_topic[MAX_TOPIC_LENGTH] = { '\0' };
+static _Thread_local int scratch_topic_length = 0;
+
+/**
+ * scratch_topic_push_len appends a segment of len characters to the
+ * scratch topic.
+ */
+static void scratch_topic_push_len(const char *seg, int len, int first) {
+  if (!first) {
+    scratch_topic[scratch_topic_length++] = '/';
+  }
+  memcpy(scratch_topic + scratch_topic_length, seg, len);
+  scratch_topic_length += len;
+  scratch_topic[scratch_topic_length] = '\0';
+}
 
 /**
  *
  */
 static void scratch_topic_push(const char *seg, int first) {
-    sprintf(scratch_topic + scratch_topic_length, "%s%s",
-            (first ? "" : "/"), seg);
-    scratch_topic_length += strlen(seg) + 1 - first;
+  scratch_topic_push_len(seg, strlen(seg), first);
+}
+
+/**
+ * scratch_topic_set replaces the scratch topic with topic.
+ */
+static void scratch_topic_set(const char *topic) {
+  scratch_topic_length = strlen(topic);
+  memcpy(scratch_topic, topic, scratch_topic_length + 1);
 }
 
 /**
@@ -30,374 +60,4228 @@ static void scratch_topic_pop() {
   scratch_topic[scratch_topic_length] = '\0';
 }
 
-static int rb_cmp(const void *a, const void *b) {
-  int cmp = strcmp((char *)a, (char *)b);
-  if (cmp < 0) {
-    return -1;
-  } else if (cmp > 0) {
-    return 1;
-  } else {
-    return 0;
+/**
+ * scratch_topic_set_segment replaces the scratch topic with the topic
+ * terminating with s.
+ */
+static void scratch_topic_set_segment(mqtt_topic_segment_s *s) {
+  mqtt_topic_segment_s *p;
+  int len = -1;
+
+  for (p = s; p->parent; p = p->parent) {
+    len += p->len + 1;
+  }
+  if (len < 0) {
+    len = 0;
+  }
+  scratch_topic_length = len;
+  scratch_topic[len] = '\0';
+  for (p = s; p->parent; p = p->parent) {
+    len -= p->len;
+    memcpy(scratch_topic + len, p->str, p->len);
+    if (len > 0) {
+      scratch_topic[--len] = '/';
+    }
   }
 }
 
-static void rb_destroy_key(void *a) {
-  free(a);
-}
+static void _results_push(mqtt_topic_results_s *r,
+                          mqtt_topic_segment_s *segment) {
+  mqtt_topic_segment_s **segments;
+  size_t capacity;
 
-static void rb_destroy_info(void *a) {
-  mqtt_topic_segment_destroy((mqtt_topic_segment_s *)a);
+  if (r->count == r->capacity) {
+    capacity = r->capacity ? 2 * r->capacity : 16;
+    segments = realloc(r->segments, capacity * sizeof(*segments));
+    if (segments == NULL) {
+      r->failed = 1;
+      return;
+    }
+    r->segments = segments;
+    r->capacity = capacity;
+  }
+  r->segments[r->count++] = segment;
 }
 
-static rb_red_blk_tree *create_rb_tree() {
-  return RBTreeCreate(&rb_cmp, &rb_destroy_key, &rb_destroy_info, NULL, NULL);
+/**
+ * _report passes a segment found by a walk to cb, whose topic is the
+ * scratch topic, or appends it to the results behind a callback made
+ * by mqtt_topic_results_cb.
+ */
+static void _report(mqtt_iter_cb_s *cb, mqtt_topic_segment_s *segment) {
+  if (cb->fn == NULL) {
+    _results_push(cb->data, segment);
+  } else {
+    cb->fn(cb->data, scratch_topic, segment);
+  }
 }
 
-mqtt_topic_segment_s *mqtt_topic_segment_create() {
-  mqtt_topic_segment_s *s;
+/**
+ * _key_cmp compares the string of s with key, which is len characters
+ * long. Strings order as strcmp would order them, but the stored
+ * lengths spare looking for terminators.
+ */
+static int _key_cmp(const mqtt_topic_segment_s *s, const char *key,
+                    unsigned int len) {
+  int cmp = memcmp(s->str, key, s->len < len ? s->len : len);
 
-  s = malloc(sizeof(mqtt_topic_segment_s));
-  if (s == NULL) {
-    return NULL;
+  if (cmp == 0) {
+    return s->len == len ? 0 : (s->len < len ? -1 : 1);
   }
+  return cmp;
+}
 
-  memset(s, 0, sizeof(*s));
-  s->children = create_rb_tree();
-  if (s->children == NULL) {
-    free(s);
+/**
+ * _rb_segment returns the segment containing a children tree node,
+ * or NULL if node is NULL.
+ */
+static mqtt_topic_segment_s *_rb_segment(mqtt_rb_node_s *node) {
+  if (node == NULL) {
     return NULL;
   }
-
-  return s;
+  return (mqtt_topic_segment_s *)((char *)node -
+                                  offsetof(mqtt_topic_segment_s, rb_node));
 }
 
-void mqtt_topic_segment_destroy(mqtt_topic_segment_s *s) {
-  if (s == NULL) return;
+/* Children move from the children tree to a sorted array once the
+ * tree holds ARRAY_MIN of them, and back once the array would grow
+ * past ARRAY_MAX or shrink below ARRAY_MIN / 2. Past ARRAY_MAX,
+ * copying the array on every change costs more than it saves. */
+#define ARRAY_MIN 8
+#define ARRAY_MAX 256
 
-  RBTreeDestroy(s->children);
-  free(s);
-}
+/* The number of fingerprints compared at once. */
+#define FP_GROUP 16
 
-int mqtt_topic_segment_remove(mqtt_topic_segment_s *s) {
-  mqtt_topic_segment_s *parent = s->parent;
-  /* The sentinel segment cannot be removed, as it isn't a part of the
-   * topic tree. It can only destroyed. */
-  if (parent == NULL) {
-    return 0;
-  }
+/**
+ * mqtt_topic_child_array holds children in key order, along with a
+ * one-byte fingerprint of each key. A lookup compares the fingerprint
+ * of its key with FP_GROUP of them at a time, and only compares whole
+ * keys on a match, so it touches one child on average rather than
+ * the log2(n) a search of the tree would.
+ *
+ * Arrays never change once published: writers replace them whole, so
+ * readers need no more than the version of the parent to be sure of
+ * what they read.
+ */
+struct mqtt_topic_child_array {
+  mqtt_epoch_entry_s retired;
+  unsigned int count;
+  mqtt_topic_segment_s **children;
+  /* Padded with zeroes to a multiple of FP_GROUP, and followed by
+   * the children pointers. */
+  uint8_t fps[];
+};
 
-  /* Do not remove segments with user data or with remaining
-   * children. */
-  if (s->data || s->children->root->left != s->children->nil) {
-    return 0;
-  }
+typedef struct mqtt_topic_child_array _child_array_s;
 
-  rb_red_blk_tree *tree = parent->children;
-  /* node must be found. */
-  rb_red_blk_node *node = RBExactQuery(tree, (void *)s->str);
-  RBDelete(tree, node);
+/**
+ * mqtt_topic_root_s holds the state shared by a whole tree. Only the
+ * sentinel segment returned by mqtt_topic_segment_create is allocated
+ * as a mqtt_topic_root_s, so segment must remain the first member.
+ */
+typedef struct {
+  mqtt_topic_segment_s segment;
 
-  return mqtt_topic_segment_remove(parent);
-}
+  /* Deferred collection settings. See mqtt_topic_gc_enable. The
+   * root's own gc_link heads the list of pending segments. */
+  int gc_deferred;
+  unsigned long gc_max_age;
+  unsigned long gc_now;
+
+  /* Incremented whenever a segment is added to or removed from the
+   * tree. See mqtt_topic_generation. */
+  _Atomic unsigned long generation;
+
+  /* Set by mqtt_topic_concurrent_enable. */
+  int concurrent;
+
+  /* Set by mqtt_topic_digest_enable. */
+  int digest;
+
+  /* The expiry wheel, once mqtt_topic_expiry_enable is called. */
+  struct _wheel *expiry;
+
+  /* Open snapshots, oldest first, and the segments left in place for
+   * them, both guarded by snapshot_lock. snapshot_seq is the pin of
+   * the latest snapshot to begin, and snapshot_min that of the oldest
+   * still open, or ULONG_MAX if there is none. snapshots_used is set
+   * once the first snapshot begins. See mqtt_topic_snapshot_begin. */
+  pthread_mutex_t snapshot_lock;
+  mqtt_topic_gc_link_s snapshots;
+  mqtt_topic_gc_link_s snapshot_pending;
+  _Atomic unsigned long snapshot_seq;
+  _Atomic unsigned long snapshot_min;
+  _Atomic int snapshots_open;
+  _Atomic int snapshots_used;
+} mqtt_topic_root_s;
 
 /**
- * mqtt_topic_validate returns 1 if topic is a valid MQTT topic, 0
- * otherwise.
- *
- * Assuming a topic of at least one character, the following finite
- * state machine describes valid topics, where all states are accepting:
- *  Start:
- *    # -> Hash
- *    + -> Plus
- *    / -> Start
- *    [^+#/] -> Literal
- *  Hash:
- *    NO TRANSITIONS
- *  Plus:
- *    / -> Start
- *  Literal:
- *    [^+#/] -> Literal
- *    / -> Start
+ * mqtt_topic_version holds the value data of a segment had before a
+ * change made while snapshots were open. It is read by the snapshots
+ * with a pin of at most seq, the pin of the latest snapshot to begin
+ * before the change, unless a newer record also qualifies.
  */
-int mqtt_topic_validate(const char *topic) {
-  enum {
-    START,
-    HASH,
-    PLUS,
-    LITERAL,
-  } state = START;
+struct mqtt_topic_version {
+  mqtt_epoch_entry_s retired;
+  /* Published and cut off by writers while snapshots walk them. */
+  _Atomic(struct mqtt_topic_version *) older;
+  unsigned long seq;
+  void *data;
+};
 
-  if (topic[0] == '\0') {
-    return 0;
-  }
-
-  for (; topic[0]; ++topic) {
-    char c = topic[0];
-    switch (state) {
-      case START:
-      {
-        switch (c) {
-          case '#':
-            state = HASH;
-            break;
-          case '+':
-            state = PLUS;
-            break;
-          case '/':
-            break;
-          default:
-            state = LITERAL;
-            break;
-        }
-        break;
-      }
-      case HASH:
-      {
-        return 0; /* '#' must be the final character. */
-      }
-      case PLUS:
-      {
-        if (c != '/') {
-          return 0;
-        }
-        state = START;
-        break;
-      }
-      case LITERAL:
-      {
-        if (c == '+' || c == '#') {
-          return 0;
-        } else if (c == '/') {
-          state = START;
-        }
-        break;
-      }
-    }
-  }
-  return 1;
-}
+typedef struct mqtt_topic_version _version_s;
 
-int mqtt_topic_find_or_add(mqtt_topic_segment_s **h_segment,
-                           mqtt_topic_segment_s *root,
-                           char *topic, int create) {
-  int rc;
-  char *next_segment = topic, *rest, *sep;
-  mqtt_topic_segment_s *new_segment;
-  rb_red_blk_node *child;
+struct mqtt_topic_snapshot {
+  /* Membership of the list of open snapshots. Kept first, so that
+   * the link is the snapshot. */
+  mqtt_topic_gc_link_s link;
+  mqtt_topic_root_s *tree;
+  unsigned long pin;
+};
 
-  if (topic == NULL) {
-    *h_segment = root;
-    return 0;
+/**
+ * _root_of returns the tree state for the tree containing s.
+ */
+static mqtt_topic_root_s *_root_of(mqtt_topic_segment_s *s) {
+  while (s->parent) {
+    s = s->parent;
   }
+  return (mqtt_topic_root_s *)s;
+}
 
-  *h_segment = NULL;
+/**
+ * _generation_bump records a structural change to tree. It must come
+ * after the change is visible and before any removed memory is
+ * retired, so a reader that still sees the old generation is sure
+ * to be inside a critical section that began before the retirement.
+ */
+static void _generation_bump(mqtt_topic_root_s *tree) {
+  atomic_fetch_add(&tree->generation, 1);
+}
 
-  sep = strchr(topic, '/');
-  if (sep == NULL) {
-    rest = NULL;
-  } else {
-    sep[0] = '\0';
-    rest = sep + 1;
-  }
+/**
+ * _path_hash returns the hash of the topic formed by the key of len
+ * characters below parent. It is never 0, so that segments with a
+ * hash are those of trees with digests.
+ */
+static uint64_t _path_hash(const mqtt_topic_segment_s *parent,
+                           const char *key, unsigned int len) {
+  uint64_t h = parent->path_hash ^ 14695981039346656037ull; /* FNV-1a */
 
-  child = RBExactQuery(root->children, next_segment);
-  if (child != NULL) {
-    rc = mqtt_topic_find_or_add(h_segment,
-                                (mqtt_topic_segment_s *)child->info,
-                                rest, create);
-    goto exit;
+  for (unsigned int i = 0; i < len; ++i) {
+    h = (h ^ (unsigned char)key[i]) * 1099511628211ull;
   }
+  /* The splitmix64 finalizer, as FNV leaves the high bits weak. */
+  h ^= h >> 30;
+  h *= 0xbf58476d1ce4e5b9ull;
+  h ^= h >> 27;
+  h *= 0x94d049bb133111ebull;
+  h ^= h >> 31;
+  return h | 1;
+}
 
-  if (!create) {
-    rc = 1;
-    goto exit;
+/**
+ * _digest_update folds h into the digests of s and its ancestors. As
+ * XOR commutes, concurrent updates along the same ancestors need no
+ * ordering, and once they are done every digest is the same as if
+ * they had been made one at a time.
+ */
+static void _digest_update(mqtt_topic_segment_s *s, uint64_t h) {
+  for (; s != NULL; s = s->parent) {
+    atomic_fetch_xor_explicit(&s->digest, h, memory_order_relaxed);
   }
+}
 
-  new_segment = mqtt_topic_segment_create();
-  if (new_segment == NULL) {
-    rc = -1;
-    goto exit;
+/**
+ * _digest_sync counts the path hash of s, which the caller must have
+ * locked, in the digests if s holds data, or stops counting it if it
+ * does not.
+ */
+static void _digest_sync(mqtt_topic_segment_s *s) {
+  if (s->path_hash && s->digest_data != (s->data != NULL)) {
+    s->digest_data = !s->digest_data;
+    _digest_update(s, s->path_hash);
   }
+}
 
-  new_segment->parent = root;
-
-  char *key = strdup(next_segment);
-  if (key == NULL){
-    rc = -1;
-    mqtt_topic_segment_destroy(new_segment);
-    goto exit;
+/**
+ * _enter and _leave bracket every public operation on a concurrent
+ * tree with an epoch critical section.
+ */
+static void _enter(mqtt_topic_root_s *tree) {
+  if (tree->concurrent) {
+    mqtt_epoch_enter();
   }
+}
 
-  new_segment->str = key;
-
-  child = RBTreeInsert(root->children, key, new_segment);
-  if (child == NULL) {
-    rc = -1;
-    free(key);
-    mqtt_topic_segment_destroy(new_segment);
-    goto exit;
+static void _leave(mqtt_topic_root_s *tree) {
+  if (tree->concurrent) {
+    mqtt_epoch_exit();
   }
+}
 
-  rc = mqtt_topic_find_or_add(h_segment, new_segment, rest, create);
-  if (rc != 0) {
-    free(key);
-    mqtt_topic_segment_destroy(new_segment);
-    goto exit;
-  }
+/*
+ * Segment versions. The low bit of a version is set while a writer
+ * holds the segment locked, the next bit once the segment has been
+ * removed from the tree, and the rest counts changes to its
+ * children. Versions are maintained whether or not the tree is
+ * concurrent; without contention they cost a few uncontended
+ * atomics per change.
+ */
+#define VERSION_LOCKED 1ul
+#define VERSION_OBSOLETE 2ul
+#define VERSION_STEP 4ul
 
-exit:
+/**
+ * _read_begin waits until s is unlocked and returns its version, to
+ * be checked with _read_validate once its children have been read.
+ */
+static unsigned long _read_begin(mqtt_topic_segment_s *s) {
+  unsigned long version;
 
-  if (sep) {
-    *sep = '/';
+  while ((version = atomic_load_explicit(&s->version, memory_order_acquire))
+         & VERSION_LOCKED) {
+    sched_yield();
   }
+  return version;
+}
 
-  return rc;
+/**
+ * _read_validate returns 1 if nothing has changed the children of s
+ * since _read_begin returned version, 0 if what was read must be
+ * discarded.
+ */
+static int _read_validate(mqtt_topic_segment_s *s, unsigned long version) {
+  atomic_thread_fence(memory_order_acquire);
+  return atomic_load_explicit(&s->version, memory_order_relaxed) == version;
 }
 
 /**
+ * _write_upgrade locks s if it is still at version, so that what was
+ * read under that version can be acted on.
  *
+ * Returns 1 if s was locked, 0 if it changed.
  */
-static void _red_black_cb_all(rb_red_blk_tree *tree,
-                              rb_red_blk_node *node,
-                              int first, int ignore_sys,
-                              mqtt_iter_cb_s *cb);
+static int _write_upgrade(mqtt_topic_segment_s *s, unsigned long version) {
+  return atomic_compare_exchange_strong(&s->version, &version,
+                                        version | VERSION_LOCKED);
+}
 
 /**
- *
+ * _write_lock locks s, returning the version it was locked at. The
+ * caller must check VERSION_OBSOLETE, but must unlock s either way.
  */
-static void _segment_cb_all(mqtt_topic_segment_s *segment,
-                            mqtt_iter_cb_s *cb) {
-  cb->fn(cb->data, scratch_topic, segment);
-  _red_black_cb_all(segment->children, segment->children->root,
-                    /* ignore_sys value is irrelevant here, since we
-                     * must be beyond the first level. */
-                    0, 0,
-                    cb);
+static unsigned long _write_lock(mqtt_topic_segment_s *s) {
+  unsigned long version;
+
+  do {
+    version = _read_begin(s);
+  } while (!_write_upgrade(s, version));
+  return version;
 }
 
-static void _red_black_cb_all(rb_red_blk_tree *tree,
-                              rb_red_blk_node *node,
-                              int first, int ignore_sys,
-                              mqtt_iter_cb_s *cb) {
-  int skip_node;
+static void _write_unlock(mqtt_topic_segment_s *s) {
+  atomic_fetch_add_explicit(&s->version, VERSION_STEP - VERSION_LOCKED,
+                            memory_order_release);
+}
 
-  if (node == tree->nil) {
-    return;
+/**
+ * _write_unlock_obsolete unlocks s, marking it removed.
+ */
+static void _write_unlock_obsolete(mqtt_topic_segment_s *s) {
+  atomic_fetch_add_explicit(&s->version,
+                            VERSION_STEP + VERSION_OBSOLETE - VERSION_LOCKED,
+                            memory_order_release);
+}
+
+static mqtt_topic_segment_s *_segment_create(size_t size) {
+  mqtt_topic_segment_s *s;
+
+  s = malloc(size);
+  if (s == NULL) {
+    return NULL;
   }
 
-  /* Ignore $-prefixed keys only if this is the first level and the
-   * ignore_sys flag is set. */
-  skip_node = node == tree->root || (
-      first && ignore_sys &&
-      ((char *)node->key)[0] == '$'
-    );
+  memset(s, 0, size);
+  return s;
+}
 
-  _red_black_cb_all(tree, node->left, first, ignore_sys, cb);
+mqtt_topic_segment_s *mqtt_topic_segment_create() {
+  mqtt_topic_segment_s *s = _segment_create(sizeof(mqtt_topic_root_s));
+  mqtt_topic_root_s *tree = (mqtt_topic_root_s *)s;
 
-  if (!skip_node) {
-    scratch_topic_push((char *)node->key, first);
-    _segment_cb_all((mqtt_topic_segment_s *)node->info, cb);
-    scratch_topic_pop();
+  if (s == NULL) {
+    return NULL;
   }
-
-  _red_black_cb_all(tree, node->right, first, ignore_sys, cb);
+  if (pthread_mutex_init(&tree->snapshot_lock, NULL) != 0) {
+    free(s);
+    return NULL;
+  }
+  s->gc_link.prev = s->gc_link.next = &s->gc_link;
+  tree->snapshots.prev = tree->snapshots.next = &tree->snapshots;
+  tree->snapshot_pending.prev = tree->snapshot_pending.next =
+      &tree->snapshot_pending;
+  atomic_store(&tree->snapshot_min, ULONG_MAX);
+  return s;
 }
 
 /**
- *
+ * _gc_unlink removes s from the list of segments pending collection,
+ * if it is on it.
  */
-static void _red_black_match_all(rb_red_blk_tree *tree,
-                                 rb_red_blk_node *node,
-                                 char *rest,
-                                 int first,
-                                 mqtt_iter_cb_s *cb) {
-  if (node == tree->nil) {
+static void _gc_unlink(mqtt_topic_segment_s *s) {
+  if (s->gc_link.next == NULL) {
     return;
   }
+  s->gc_link.prev->next = s->gc_link.next;
+  s->gc_link.next->prev = s->gc_link.prev;
+  s->gc_link.prev = s->gc_link.next = NULL;
+}
+
+/**
+ * _gc_link marks s pending collection as of stamp, placing it on the
+ * pending list just before at.
+ */
+static void _gc_link(mqtt_topic_gc_link_s *at, mqtt_topic_segment_s *s,
+                     unsigned long stamp) {
+  _gc_unlink(s);
+  s->gc_stamp = stamp;
+  s->gc_link.prev = at->prev;
+  s->gc_link.next = at;
+  at->prev->next = &s->gc_link;
+  at->prev = &s->gc_link;
+}
 
-  _red_black_match_all(tree, node->left, rest, first, cb);
+/**
+ * _gc_segment returns the segment containing a pending list link.
+ */
+static mqtt_topic_segment_s *_gc_segment(mqtt_topic_gc_link_s *link) {
+  return (mqtt_topic_segment_s *)((char *)link -
+                                  offsetof(mqtt_topic_segment_s, gc_link));
+}
 
-  if (node != tree->root && (!first || ((char *)node->key)[0] != '$')) {
-    scratch_topic_push((char *)node->key, first);
-    mqtt_topic_matching_iter((mqtt_topic_segment_s *)node->info, rest, cb);
-    scratch_topic_pop();
+/**
+ * _expiry_unlink takes s out of the expiry wheel, if it is in it.
+ */
+static void _expiry_unlink(mqtt_topic_segment_s *s) {
+  if (s->expiry_link.next == NULL) {
+    return;
   }
-
-  _red_black_match_all(tree, node->right, rest, first, cb);
+  s->expiry_link.prev->next = s->expiry_link.next;
+  s->expiry_link.next->prev = s->expiry_link.prev;
+  s->expiry_link.prev = s->expiry_link.next = NULL;
 }
 
-void mqtt_topic_matching_iter(mqtt_topic_segment_s *root,
-                              char *pattern,
-                              mqtt_iter_cb_s *cb) {
-  char *next_segment = pattern, *rest, *sep;
-  rb_red_blk_node *child;
+static void _map_node_destroy(mqtt_so_node_s *node);
 
-  if (pattern == NULL) {
-    cb->fn(cb->data, scratch_topic, root);
-    child = RBExactQuery(root->children, "#");
-    if (child) {
-      /* A # matches its parent topic. */
-      scratch_topic_push("#", (root->parent == NULL ? 1 : 0));
-      cb->fn(cb->data, scratch_topic, child->info);
-      scratch_topic_pop();
-    }
+/**
+ * _rb_destroy destroys every segment in the children tree below
+ * node.
+ */
+static void _rb_destroy(mqtt_rb_node_s *node) {
+  if (node == NULL) {
     return;
   }
+  _rb_destroy(mqtt_rb_left(node));
+  _rb_destroy(mqtt_rb_right(node));
+  mqtt_topic_segment_destroy(_rb_segment(node));
+}
 
-  sep = strchr(pattern, '/');
-  if (sep == NULL) {
-    rest = NULL;
-  } else {
-    *sep = '\0';
-    rest = sep + 1;
-  }
+void mqtt_topic_segment_destroy(mqtt_topic_segment_s *s) {
+  _child_array_s *array;
+  _version_s *v;
+  mqtt_so_map_s *map;
+
+  if (s == NULL) return;
+
+  map = atomic_load(&s->wide);
+  if (map) {
+    mqtt_so_map_destroy(map, &_map_node_destroy);
+  }
+  array = atomic_load_explicit(&s->child_array, memory_order_relaxed);
+  if (array) {
+    for (unsigned int i = 0; i < array->count; ++i) {
+      mqtt_topic_segment_destroy(array->children[i]);
+    }
+    free(array);
+  }
+  _rb_destroy(mqtt_rb_root(&s->children));
+  if (s->str != s->inline_str) {
+    free((char *)s->str);
+  }
+  v = atomic_load_explicit(&s->versions, memory_order_relaxed);
+  for (_version_s *older; v; v = older) {
+    older = atomic_load_explicit(&v->older, memory_order_relaxed);
+    free(v);
+  }
+  /* Children unlink themselves from the root's pending lists above,
+   * so the root is only ever unlinked once those lists are empty. */
+  if (s->parent) {
+    _gc_unlink(s);
+    _expiry_unlink(s);
+  } else {
+    free(((mqtt_topic_root_s *)s)->expiry);
+    pthread_mutex_destroy(&((mqtt_topic_root_s *)s)->snapshot_lock);
+  }
+  free(s);
+}
+
+/**
+ * _map_segment returns the segment containing a children map node,
+ * or NULL if node is NULL.
+ */
+static mqtt_topic_segment_s *_map_segment(mqtt_so_node_s *node) {
+  if (node == NULL) {
+    return NULL;
+  }
+  return (mqtt_topic_segment_s *)((char *)node -
+                                  offsetof(mqtt_topic_segment_s, map_node));
+}
+
+static void _map_node_destroy(mqtt_so_node_s *node) {
+  mqtt_topic_segment_destroy(_map_segment(node));
+}
+
+/**
+ * _has_children returns 1 if s, which must not be wide, has children.
+ */
+static int _has_children(mqtt_topic_segment_s *s) {
+  return mqtt_rb_root(&s->children) != NULL ||
+         atomic_load_explicit(&s->child_array, memory_order_acquire) != NULL;
+}
+
+int mqtt_topic_has_children(mqtt_topic_segment_s *segment) {
+  mqtt_so_map_s *map = atomic_load(&segment->wide);
+
+  if (map) {
+    return !mqtt_so_map_empty(map);
+  }
+  return _has_children(segment);
+}
+
+/**
+ * _data returns the data of s, as a reader that may not hold the lock
+ * of s loads it.
+ */
+static void *_data(mqtt_topic_segment_s *s) {
+  return atomic_load_explicit(&s->data, memory_order_acquire);
+}
+
+/**
+ * _segment_is_empty returns 1 if s holds no data and has no children.
+ */
+static int _segment_is_empty(mqtt_topic_segment_s *s) {
+  return _data(s) == NULL && !mqtt_topic_has_children(s);
+}
+
+/* Deeper than any red-black tree that fits in memory. */
+#define RB_MAX_HEIGHT 128
+
+/**
+ * _hash_fingerprint folds the hash that wide segments file a key
+ * under into its fingerprint, so a key hashed once serves both.
+ */
+static uint8_t _hash_fingerprint(uint32_t hash) {
+  return hash ^ hash >> 8 ^ hash >> 16 ^ hash >> 24;
+}
+
+static uint8_t _fingerprint(const char *key, unsigned int len) {
+  return _hash_fingerprint(mqtt_so_map_hash(key, len));
+}
+
+/**
+ * _array_create allocates an array for count children, leaving its
+ * fingerprints and children to be filled in.
+ */
+static _child_array_s *_array_create(unsigned int count) {
+  size_t fps_size = (count + FP_GROUP - 1) / FP_GROUP * FP_GROUP;
+  _child_array_s *a = malloc(sizeof(*a) + fps_size +
+                             count * sizeof(mqtt_topic_segment_s *));
+
+  if (a == NULL) {
+    return NULL;
+  }
+  a->count = count;
+  a->children = (mqtt_topic_segment_s **)(a->fps + fps_size);
+  memset(a->fps + count, 0, fps_size - count);
+  return a;
+}
+
+static void _array_set(_child_array_s *a, unsigned int i,
+                       mqtt_topic_segment_s *child) {
+  a->children[i] = child;
+  a->fps[i] = _fingerprint(child->str, child->len);
+}
+
+/**
+ * _array_hit returns the index of the first fingerprint of a at or
+ * after from that equals fp, or -1 if there is none.
+ */
+static int _array_hit(const _child_array_s *a, uint8_t fp,
+                      unsigned int from) {
+#ifdef __SSE2__
+  __m128i needle = _mm_set1_epi8((char)fp);
+  unsigned int base = from / FP_GROUP * FP_GROUP, mask;
+
+  for (; base < a->count; base += FP_GROUP) {
+    mask = _mm_movemask_epi8(_mm_cmpeq_epi8(
+        _mm_loadu_si128((const __m128i *)(a->fps + base)), needle));
+    if (base < from) {
+      mask &= ~0u << (from - base);
+    }
+    if (mask) {
+      base += __builtin_ctz(mask);
+      return base < a->count ? (int)base : -1;
+    }
+  }
+#else
+  for (; from < a->count; ++from) {
+    if (a->fps[from] == fp) {
+      return from;
+    }
+  }
+#endif
+  return -1;
+}
+
+/**
+ * _array_find returns the index of the child of a with the given key,
+ * which is len characters long and has fingerprint fp, or -1.
+ */
+static int _array_find(const _child_array_s *a, const char *key,
+                       unsigned int len, uint8_t fp) {
+  for (int i = _array_hit(a, fp, 0); i >= 0; i = _array_hit(a, fp, i + 1)) {
+    if (_key_cmp(a->children[i], key, len) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/**
+ * _array_after returns the index of the first child of a whose key
+ * follows key, which is len characters long.
+ */
+static unsigned int _array_after(const _child_array_s *a, const char *key,
+                                 unsigned int len) {
+  unsigned int lo = 0, hi = a->count, mid;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (_key_cmp(a->children[mid], key, len) > 0) {
+      hi = mid;
+    } else {
+      lo = mid + 1;
+    }
+  }
+  return lo;
+}
+
+static void _array_reclaim(mqtt_epoch_entry_s *entry) {
+  free((char *)entry - offsetof(_child_array_s, retired));
+}
+
+/**
+ * _array_retire frees an array replaced in s, once no reader can
+ * still reach it.
+ */
+static void _array_retire(mqtt_topic_segment_s *s, _child_array_s *a) {
+  if (!_root_of(s)->concurrent) {
+    free(a);
+    return;
+  }
+  mqtt_epoch_retire(&a->retired, &_array_reclaim);
+}
+
+/**
+ * _tree_insert links child into the children tree of s.
+ */
+static void _tree_insert(mqtt_topic_segment_s *s, mqtt_topic_segment_s *child) {
+  _Atomic(mqtt_rb_node_s *) *link = &s->children;
+  mqtt_rb_node_s *parent = NULL;
+
+  while (mqtt_rb_root(link)) {
+    parent = mqtt_rb_root(link);
+    link = _key_cmp(_rb_segment(parent), child->str, child->len) > 0
+               ? &parent->left
+               : &parent->right;
+  }
+  mqtt_rb_insert(&s->children, parent, link, &child->rb_node);
+}
+
+/**
+ * _tree_to_array moves the children of s, of which there are count,
+ * from its children tree to an array. If out of memory, they are left
+ * in the tree, which works just as well.
+ */
+static void _tree_to_array(mqtt_topic_segment_s *s, unsigned int count) {
+  _child_array_s *a = _array_create(count);
+  mqtt_rb_node_s *node = mqtt_rb_first(mqtt_rb_root(&s->children));
+
+  if (a == NULL) {
+    return;
+  }
+  for (unsigned int i = 0; i < count; ++i, node = mqtt_rb_next(node)) {
+    _array_set(a, i, _rb_segment(node));
+  }
+  /* Readers look for the array first. */
+  atomic_store_explicit(&s->child_array, a, memory_order_release);
+  atomic_store_explicit(&s->children, NULL, memory_order_relaxed);
+}
+
+/**
+ * _array_to_tree moves the children of s, except skip if it is not
+ * NULL, from its array back to its children tree.
+ */
+static void _array_to_tree(mqtt_topic_segment_s *s,
+                           mqtt_topic_segment_s *skip) {
+  _child_array_s *a =
+      atomic_load_explicit(&s->child_array, memory_order_relaxed);
+
+  /* Linking the tree only touches the rb_node of the children, which
+   * readers of the array do not look at. */
+  for (unsigned int i = 0; i < a->count; ++i) {
+    if (a->children[i] != skip) {
+      _tree_insert(s, a->children[i]);
+    }
+  }
+  atomic_store_explicit(&s->child_array, NULL, memory_order_release);
+  _array_retire(s, a);
+}
+
+/**
+ * _array_insert replaces the array of s with one that also holds
+ * child, or moves the children of s back to its tree along with child
+ * if the array would grow too large or is out of memory.
+ */
+static void _array_insert(mqtt_topic_segment_s *s,
+                          mqtt_topic_segment_s *child) {
+  _child_array_s *a =
+      atomic_load_explicit(&s->child_array, memory_order_relaxed);
+  _child_array_s *b = NULL;
+  unsigned int at;
+
+  if (a->count < ARRAY_MAX) {
+    b = _array_create(a->count + 1);
+  }
+  if (b == NULL) {
+    _array_to_tree(s, NULL);
+    _tree_insert(s, child);
+    return;
+  }
+  at = _array_after(a, child->str, child->len);
+  memcpy(b->fps, a->fps, at);
+  memcpy(b->children, a->children, at * sizeof(*a->children));
+  _array_set(b, at, child);
+  memcpy(b->fps + at + 1, a->fps + at, a->count - at);
+  memcpy(b->children + at + 1, a->children + at,
+         (a->count - at) * sizeof(*a->children));
+  atomic_store_explicit(&s->child_array, b, memory_order_release);
+  _array_retire(s, a);
+}
+
+/**
+ * _array_remove replaces the array of s with one without child, or
+ * moves the other children of s back to its tree if the array would
+ * shrink too small or is out of memory.
+ */
+static void _array_remove(mqtt_topic_segment_s *s,
+                          mqtt_topic_segment_s *child) {
+  _child_array_s *a =
+      atomic_load_explicit(&s->child_array, memory_order_relaxed);
+  _child_array_s *b = NULL;
+  unsigned int at;
+
+  if (a->count - 1 >= ARRAY_MIN / 2) {
+    b = _array_create(a->count - 1);
+  }
+  if (b == NULL) {
+    _array_to_tree(s, child);
+    return;
+  }
+  at = _array_after(a, child->str, child->len) - 1;
+  memcpy(b->fps, a->fps, at);
+  memcpy(b->children, a->children, at * sizeof(*a->children));
+  memcpy(b->fps + at, a->fps + at + 1, b->count - at);
+  memcpy(b->children + at, a->children + at + 1,
+         (b->count - at) * sizeof(*a->children));
+  atomic_store_explicit(&s->child_array, b, memory_order_release);
+  _array_retire(s, a);
+}
+
+/**
+ * _tree_lookup returns the child of s with the given key, which is
+ * len characters long, from the children tree of s, or NULL.
+ */
+static mqtt_topic_segment_s *_tree_lookup(mqtt_topic_segment_s *s,
+                                          const char *key,
+                                          unsigned int len) {
+  mqtt_rb_node_s *node = mqtt_rb_root(&s->children);
+  int cmp;
+
+  /* Only a tree changing under us can be deeper. */
+  for (int depth = 0; node != NULL && depth < RB_MAX_HEIGHT; ++depth) {
+    cmp = _key_cmp(_rb_segment(node), key, len);
+    if (cmp == 0) {
+      return _rb_segment(node);
+    }
+    node = cmp > 0 ? mqtt_rb_left(node) : mqtt_rb_right(node);
+  }
+  return NULL;
+}
+
+/**
+ * _child_lookup returns the child of s with the given key, which is
+ * len characters long, or NULL. s must not be wide. Like any read of
+ * the children, the result is only meaningful once the version of s
+ * it was read under has been validated.
+ */
+static mqtt_topic_segment_s *_child_lookup(mqtt_topic_segment_s *s,
+                                           const char *key,
+                                           unsigned int len) {
+  _child_array_s *a =
+      atomic_load_explicit(&s->child_array, memory_order_acquire);
+  int i;
+
+  if (a) {
+    i = _array_find(a, key, len, _fingerprint(key, len));
+    return i >= 0 ? a->children[i] : NULL;
+  }
+  return _tree_lookup(s, key, len);
+}
+
+/**
+ * _child_lookup_hashed is _child_lookup for a key whose
+ * mqtt_so_map_hash is already known.
+ */
+static mqtt_topic_segment_s *_child_lookup_hashed(mqtt_topic_segment_s *s,
+                                                  const char *key,
+                                                  unsigned int len,
+                                                  uint32_t hash) {
+  _child_array_s *a =
+      atomic_load_explicit(&s->child_array, memory_order_acquire);
+  int i;
+
+  if (a) {
+    i = _array_find(a, key, len, _hash_fingerprint(hash));
+    return i >= 0 ? a->children[i] : NULL;
+  }
+  return _tree_lookup(s, key, len);
+}
+
+/**
+ * _children_changed counts a change to the children of s, once it is
+ * visible to readers. Automata tell from the count which of their
+ * states still hold.
+ */
+static void _children_changed(mqtt_topic_segment_s *s) {
+  atomic_fetch_add_explicit(&s->children_changes, 1, memory_order_release);
+}
+
+/**
+ * _child_detach unlinks s from the children of its parent, leaving
+ * it ready for _segment_free. In a concurrent tree, the caller must
+ * hold the lock of a parent that is not wide.
+ */
+static void _child_detach(mqtt_topic_segment_s *s) {
+  mqtt_topic_segment_s *parent = s->parent;
+  mqtt_so_map_s *map = atomic_load(&parent->wide), *wide;
+
+  if (map) {
+    mqtt_so_map_remove(map, &s->map_node);
+  } else if (atomic_load_explicit(&parent->child_array,
+                                  memory_order_relaxed)) {
+    _array_remove(parent, s);
+  } else {
+    mqtt_rb_remove(&parent->children, &s->rb_node);
+  }
+  _children_changed(parent);
+
+  /* A segment detached along with its subtree takes the digest of
+   * the subtree away. A childless one only takes its own hash, as its
+   * digest may lack updates still on their way up from descendants
+   * removed concurrently, which reach the ancestors by themselves. */
+  if (s->path_hash) {
+    wide = atomic_load(&s->wide);
+    if (wide ? mqtt_so_map_empty(wide) : !_has_children(s)) {
+      if (s->digest_data) {
+        _digest_update(parent, s->path_hash);
+      }
+    } else {
+      _digest_update(parent, atomic_load(&s->digest));
+    }
+  }
+
+  /* The reclamation state shares space with gc_link. */
+  _gc_unlink(s);
+  _expiry_unlink(s);
+}
+
+/**
+ * _segment_free releases a segment detached with _child_detach,
+ * along with its subtree.
+ */
+static void _segment_free(mqtt_topic_segment_s *s) {
+  /* gc_link must read as unlinked when the segment is destroyed. */
+  s->gc_link.prev = s->gc_link.next = NULL;
+  mqtt_topic_segment_destroy(s);
+}
+
+static void _segment_reclaim(mqtt_epoch_entry_s *entry) {
+  _segment_free((mqtt_topic_segment_s *)(
+      (char *)entry - offsetof(mqtt_topic_segment_s, retired)));
+}
+
+/**
+ * _segment_retire releases a segment of tree detached with
+ * _child_detach, as _segment_free does, once no reader can still
+ * reach it.
+ */
+static void _segment_retire(mqtt_topic_root_s *tree, mqtt_topic_segment_s *s) {
+  if (!tree->concurrent) {
+    _segment_free(s);
+    return;
+  }
+  mqtt_epoch_retire(&s->retired, &_segment_reclaim);
+}
+
+/**
+ * _snapshot_defer places s, locked and empty, on the list of segments
+ * to remove once the last snapshot ends, unless none is open any more.
+ *
+ * Returns 1 if s was deferred, 0 if it can be removed now.
+ */
+static int _snapshot_defer(mqtt_topic_root_s *tree, mqtt_topic_segment_s *s) {
+  int deferred;
+
+  /* Snapshots end under the lock, so one that is still open will
+   * find s on the list. */
+  pthread_mutex_lock(&tree->snapshot_lock);
+  deferred = atomic_load(&tree->snapshots_open) > 0;
+  if (deferred && s->gc_link.next == NULL) {
+    _gc_link(&tree->snapshot_pending, s, 0);
+  }
+  pthread_mutex_unlock(&tree->snapshot_lock);
+  return deferred;
+}
+
+/**
+ * _snapshot_undefer takes s off the list of segments deferred by
+ * _snapshot_defer, if it is on it, before it is detached.
+ */
+static void _snapshot_undefer(mqtt_topic_root_s *tree,
+                              mqtt_topic_segment_s *s) {
+  /* Deferred collection uses the same link without snapshots. */
+  if (tree->gc_deferred || !atomic_load(&tree->snapshots_used)) {
+    return;
+  }
+  pthread_mutex_lock(&tree->snapshot_lock);
+  _gc_unlink(s);
+  pthread_mutex_unlock(&tree->snapshot_lock);
+}
+
+/**
+ * _segment_remove implements mqtt_topic_segment_remove for a segment
+ * of tree.
+ */
+static int _segment_remove(mqtt_topic_root_s *tree, mqtt_topic_segment_s *s) {
+  mqtt_topic_segment_s *parent;
+  mqtt_so_map_s *map;
+  int locked;
+
+  /* The sentinel segment cannot be removed, as it isn't a part of the
+   * topic tree. It can only destroyed. */
+  for (; (parent = s->parent) != NULL; s = parent) {
+    /* Do not remove segments with user data or with remaining
+     * children. This is checked again below, under the locks. */
+    if (!_segment_is_empty(s)) {
+      break;
+    }
+
+    /* Writers that hold two locks take the parent first. A parent
+     * that has been removed no longer holds s. A wide parent needs
+     * no lock, and cannot be removed while it holds s. */
+    locked = atomic_load(&parent->wide) == NULL;
+    if (locked && (_write_lock(parent) & VERSION_OBSOLETE)) {
+      _write_unlock(parent);
+      break;
+    }
+    if ((_write_lock(s) & VERSION_OBSOLETE) || !_segment_is_empty(s)) {
+      goto unlock;
+    }
+
+    if (tree->gc_deferred) {
+      /* Leave the segment in place until a sweep finds it has stayed
+       * empty for long enough. Its ancestors cannot be empty yet. */
+      _gc_link(&tree->segment.gc_link, s, tree->gc_now);
+      goto unlock;
+    }
+
+    /* An open snapshot may still read the earlier data of s, so leave
+     * it in place until the last snapshot ends. */
+    if (atomic_load_explicit(&s->versions, memory_order_relaxed) &&
+        _snapshot_defer(tree, s)) {
+      goto unlock;
+    }
+
+    /* Closing the map of a wide segment keeps children from being
+     * added to it once it is gone. This fails if one was added since
+     * the check above. */
+    map = atomic_load(&s->wide);
+    if (map && !mqtt_so_map_close(map)) {
+      goto unlock;
+    }
+
+    _snapshot_undefer(tree, s);
+    _child_detach(s);
+    _write_unlock_obsolete(s);
+    if (locked) {
+      _write_unlock(parent);
+    }
+    _generation_bump(tree);
+    _segment_retire(tree, s);
+  }
+  return 0;
+
+unlock:
+  _write_unlock(s);
+  if (locked) {
+    _write_unlock(parent);
+  }
+  return 0;
+}
+
+/**
+ * _segment_sync brings the digests up to date with the data of s,
+ * which may have been changed directly.
+ */
+static void _segment_sync(mqtt_topic_root_s *tree, mqtt_topic_segment_s *s) {
+  if (!tree->digest || s->parent == NULL) {
+    return;
+  }
+  if (!(_write_lock(s) & VERSION_OBSOLETE)) {
+    _digest_sync(s);
+  }
+  _write_unlock(s);
+}
+
+int mqtt_topic_segment_remove(mqtt_topic_segment_s *s) {
+  mqtt_topic_root_s *tree = _root_of(s);
+  int rc;
+
+  _enter(tree);
+  _segment_sync(tree, s);
+  rc = _segment_remove(tree, s);
+  _leave(tree);
+  return rc;
+}
+
+/**
+ * mqtt_topic_validate returns 1 if topic is a valid MQTT topic, 0
+ * otherwise.
+ *
+ * Assuming a topic of at least one character, the following finite
+ * state machine describes valid topics, where all states are accepting:
+ *  Start:
+ *    # -> Hash
+ *    + -> Plus
+ *    / -> Start
+ *    [^+#/] -> Literal
+ *  Hash:
+ *    NO TRANSITIONS
+ *  Plus:
+ *    / -> Start
+ *  Literal:
+ *    [^+#/] -> Literal
+ *    / -> Start
+ */
+int mqtt_topic_validate(const char *topic) {
+  enum {
+    START,
+    HASH,
+    PLUS,
+    LITERAL,
+  } state = START;
+
+  if (topic[0] == '\0') {
+    return 0;
+  }
+
+  for (; topic[0]; ++topic) {
+    char c = topic[0];
+    switch (state) {
+      case START:
+      {
+        switch (c) {
+          case '#':
+            state = HASH;
+            break;
+          case '+':
+            state = PLUS;
+            break;
+          case '/':
+            break;
+          default:
+            state = LITERAL;
+            break;
+        }
+        break;
+      }
+      case HASH:
+      {
+        return 0; /* '#' must be the final character. */
+      }
+      case PLUS:
+      {
+        if (c != '/') {
+          return 0;
+        }
+        state = START;
+        break;
+      }
+      case LITERAL:
+      {
+        if (c == '+' || c == '#') {
+          return 0;
+        } else if (c == '/') {
+          state = START;
+        }
+        break;
+      }
+    }
+  }
+  return 1;
+}
+
+/**
+ * _child_insert adds child, which must not be present, to the
+ * children of s, which must not be wide. In a concurrent tree, the
+ * caller must hold the lock of s.
+ */
+static void _child_insert(mqtt_topic_segment_s *s,
+                          mqtt_topic_segment_s *child) {
+  mqtt_rb_node_s *node;
+  unsigned int count = 0;
+
+  if (atomic_load_explicit(&s->child_array, memory_order_relaxed)) {
+    _array_insert(s, child);
+    return;
+  }
+  _tree_insert(s, child);
+
+  /* Trees only become arrays as they reach ARRAY_MIN children, which
+   * keeps the count short. Trees left behind by a large array stay
+   * trees until they shrink and grow again. */
+  node = mqtt_rb_first(mqtt_rb_root(&s->children));
+  for (; node && count <= ARRAY_MIN; node = mqtt_rb_next(node)) {
+    ++count;
+  }
+  if (count == ARRAY_MIN) {
+    _tree_to_array(s, count);
+  }
+}
+
+/**
+ * _child_segment returns the child of s with the given key, which is
+ * len characters long, or NULL if s is NULL or has no such child.
+ */
+static mqtt_topic_segment_s *_child_segment(mqtt_topic_segment_s *s,
+                                            const char *key,
+                                            unsigned int len) {
+  mqtt_topic_segment_s *child;
+  unsigned long version;
+
+  mqtt_so_map_s *map;
+
+  if (s == NULL) {
+    return NULL;
+  }
+  do {
+    version = _read_begin(s);
+    map = atomic_load(&s->wide);
+    if (map) {
+      return _map_segment(mqtt_so_map_find(map, key, len));
+    }
+    child = _child_lookup(s, key, len);
+  } while (!_read_validate(s, version));
+  return child;
+}
+
+/**
+ * _child_segment_hashed is _child_segment for a key whose
+ * mqtt_so_map_hash is already known.
+ */
+static mqtt_topic_segment_s *_child_segment_hashed(mqtt_topic_segment_s *s,
+                                                   const char *key,
+                                                   unsigned int len,
+                                                   uint32_t hash) {
+  mqtt_topic_segment_s *child;
+  unsigned long version;
+  mqtt_so_map_s *map;
+
+  if (s == NULL) {
+    return NULL;
+  }
+  do {
+    version = _read_begin(s);
+    map = atomic_load(&s->wide);
+    if (map) {
+      return _map_segment(mqtt_so_map_find_hashed(map, key, len, hash));
+    }
+    child = _child_lookup_hashed(s, key, len, hash);
+  } while (!_read_validate(s, version));
+  return child;
+}
+
+/**
+ * _child_create allocates a segment for key that is not yet linked
+ * into a tree.
+ */
+static mqtt_topic_segment_s *_child_create(const char *key,
+                                           unsigned int len) {
+  mqtt_topic_segment_s *s = _segment_create(sizeof(mqtt_topic_segment_s));
+  char *str;
+
+  if (s == NULL) {
+    return NULL;
+  }
+  str = s->inline_str;
+  if (len >= MQTT_TOPIC_INLINE_LENGTH) {
+    str = malloc(len + 1);
+    if (str == NULL) {
+      mqtt_topic_segment_destroy(s);
+      return NULL;
+    }
+  }
+  memcpy(str, key, len);
+  str[len] = '\0';
+  s->str = str;
+  s->len = len;
+  s->map_node.key = s->str;
+  return s;
+}
+
+/**
+ * _find_or_add implements mqtt_topic_find_or_add below root, which
+ * need not be the sentinel segment of tree.
+ *
+ * Each level is looked up optimistically. A missing child is added
+ * by locking its parent, which only succeeds if the parent is still
+ * at the version the lookup was made under, so two writers cannot
+ * both add the same child. Children of wide segments are looked up
+ * and added through the lock-free map instead.
+ */
+static int _find_or_add(mqtt_topic_root_s *tree,
+                        mqtt_topic_segment_s **h_segment,
+                        mqtt_topic_segment_s *root,
+                        char *topic, int create) {
+  mqtt_topic_segment_s *segment, *child;
+  mqtt_topic_segment_s *new_segment = NULL, *added = NULL;
+  char *next_segment, *sep = NULL;
+  unsigned long version;
+  mqtt_so_map_s *map;
+  unsigned int len;
+  int rc = 0;
+
+  *h_segment = NULL;
+
+restart:
+  if (new_segment) {
+    mqtt_topic_segment_destroy(new_segment);
+    new_segment = NULL;
+  }
+  segment = root;
+  for (next_segment = topic; next_segment != NULL; segment = child) {
+    sep = strchr(next_segment, '/');
+    if (sep) {
+      *sep = '\0';
+      len = sep - next_segment;
+    } else {
+      len = strlen(next_segment);
+    }
+
+  retry:
+    version = _read_begin(segment);
+    if (version & VERSION_OBSOLETE) {
+      /* segment was removed since it was found. */
+      if (sep) {
+        *sep = '/';
+      }
+      goto restart;
+    }
+    map = atomic_load(&segment->wide);
+    if (map) {
+      child = _map_segment(mqtt_so_map_find(map, next_segment, len));
+    } else {
+      child = _child_lookup(segment, next_segment, len);
+      if (!_read_validate(segment, version)) {
+        goto retry;
+      }
+    }
+
+    if (child == NULL) {
+      if (!create) {
+        rc = 1;
+        goto exit;
+      }
+      if (new_segment == NULL) {
+        new_segment = _child_create(next_segment, len);
+        if (new_segment == NULL) {
+          rc = -1;
+          goto exit;
+        }
+      }
+      new_segment->parent = segment;
+      if (tree->digest) {
+        new_segment->path_hash = _path_hash(segment, next_segment, len);
+      }
+      if (map) {
+        child = _map_segment(mqtt_so_map_insert(map, &new_segment->map_node));
+        if (child == NULL) {
+          /* The map was closed, as segment is being removed. */
+          if (sep) {
+            *sep = '/';
+          }
+          goto restart;
+        }
+      } else {
+        if (!_write_upgrade(segment, version)) {
+          goto retry;
+        }
+        _child_insert(segment, new_segment);
+        _write_unlock(segment);
+        child = new_segment;
+      }
+      if (child == new_segment) {
+        _children_changed(segment);
+        _generation_bump(tree);
+        added = new_segment;
+        new_segment = NULL;
+      }
+    }
+    if (new_segment) {
+      /* Another writer added the child first. */
+      mqtt_topic_segment_destroy(new_segment);
+      new_segment = NULL;
+    }
+
+    if (sep) {
+      *sep = '/';
+      next_segment = sep + 1;
+      sep = NULL;
+    } else {
+      next_segment = NULL;
+    }
+  }
+  *h_segment = segment;
+
+exit:
+  if (sep) {
+    *sep = '/';
+  }
+  if (new_segment) {
+    mqtt_topic_segment_destroy(new_segment);
+  }
+  if (rc != 0 && added) {
+    /* Do not leave behind the start of a topic that could not be
+     * added in full. */
+    _segment_remove(tree, added);
+  }
+  return rc;
+}
+
+int mqtt_topic_find_or_add(mqtt_topic_segment_s **h_segment,
+                           mqtt_topic_segment_s *root,
+                           char *topic, int create) {
+  mqtt_topic_root_s *tree = _root_of(root);
+  int rc;
+
+  _enter(tree);
+  rc = _find_or_add(tree, h_segment, root, topic, create);
+  _leave(tree);
+  return rc;
+}
+
+static void _version_reclaim(mqtt_epoch_entry_s *entry) {
+  free((char *)entry - offsetof(_version_s, retired));
+}
+
+/**
+ * _versions_trim drops the version records of s, locked, that no
+ * snapshot with a pin of min or more needs.
+ */
+static void _versions_trim(mqtt_topic_root_s *tree, mqtt_topic_segment_s *s,
+                           unsigned long min) {
+  _Atomic(_version_s *) *link = &s->versions;
+  _version_s *v, *older;
+
+  while ((v = atomic_load_explicit(link, memory_order_relaxed)) &&
+         v->seq >= min) {
+    link = &v->older;
+  }
+  if (v == NULL) {
+    return;
+  }
+  /* Snapshots still walking past the cut reach records that are only
+   * reclaimed once they are done. */
+  atomic_store_explicit(link, NULL, memory_order_release);
+  for (; v; v = older) {
+    older = atomic_load_explicit(&v->older, memory_order_relaxed);
+    if (tree->concurrent) {
+      mqtt_epoch_retire(&v->retired, &_version_reclaim);
+    } else {
+      free(v);
+    }
+  }
+}
+
+int mqtt_topic_update(mqtt_topic_segment_s *root, char *topic,
+                      mqtt_iter_cb_s *cb) {
+  mqtt_topic_root_s *tree = _root_of(root);
+  mqtt_topic_segment_s *segment;
+  _version_s *v = NULL, *newest;
+  unsigned long seq = 0, min = ULONG_MAX;
+  void *old;
+  int rc;
+
+  _enter(tree);
+  for (;;) {
+    rc = _find_or_add(tree, &segment, root, topic, 1);
+    if (rc != 0) {
+      goto exit;
+    }
+    if (!(_write_lock(segment) & VERSION_OBSOLETE)) {
+      break;
+    }
+    /* Removed between being found and being locked. */
+    _write_unlock(segment);
+  }
+
+  /* The change counts as made now, before any snapshot beginning
+   * from here on. The open snapshots need the current data kept,
+   * unless an earlier change already kept it for all of them. */
+  if (atomic_load(&tree->snapshots_open) > 0) {
+    seq = atomic_load(&tree->snapshot_seq);
+    min = atomic_load(&tree->snapshot_min);
+  }
+  newest = atomic_load_explicit(&segment->versions, memory_order_relaxed);
+  if (seq != 0 && (newest == NULL || newest->seq != seq)) {
+    v = malloc(sizeof(_version_s));
+    if (v == NULL) {
+      _write_unlock(segment);
+      _segment_remove(tree, segment);
+      rc = -1;
+      goto exit;
+    }
+  }
+
+  old = segment->data;
+  cb->fn(cb->data, topic, segment);
+  if (v && segment->data != old) {
+    atomic_store_explicit(&v->older, newest, memory_order_relaxed);
+    v->seq = seq;
+    v->data = old;
+    /* Readers must not find v before its fields. */
+    atomic_store_explicit(&segment->versions, v, memory_order_release);
+    newest = v;
+  } else {
+    free(v);
+  }
+  if (newest) {
+    _versions_trim(tree, segment, min);
+  }
+  _digest_sync(segment);
+  _write_unlock(segment);
+  rc = _segment_remove(tree, segment);
+
+exit:
+  _leave(tree);
+  return rc;
+}
+
+int mqtt_topic_make_wide(mqtt_topic_segment_s *segment) {
+  mqtt_so_map_s *map;
+  int rc = 0;
+
+  if (atomic_load(&segment->wide)) {
+    return 0;
+  }
+  map = mqtt_so_map_create();
+  if (map == NULL) {
+    return -1;
+  }
+
+  /* Readers of the children tree retry when the version changes, and
+   * find the map when they do. */
+  if (_write_lock(segment) & VERSION_OBSOLETE) {
+    rc = 1;
+  } else if (atomic_load(&segment->wide) == NULL) {
+    if (_has_children(segment)) {
+      rc = 1;
+    } else {
+      atomic_store(&segment->wide, map);
+      map = NULL;
+    }
+  }
+  _write_unlock(segment);
+
+  if (map) {
+    mqtt_so_map_destroy(map, NULL);
+  }
+  return rc;
+}
+
+void mqtt_topic_concurrent_enable(mqtt_topic_segment_s *root) {
+  ((mqtt_topic_root_s *)root)->concurrent = 1;
+}
+
+/* The most children copied out of a segment at once while its
+ * children are iterated. */
+#define CHILD_CHUNK 16
+
+/**
+ * _children_chunk copies up to CHILD_CHUNK children of s into chunk,
+ * in key order, or in map order if s is wide, starting with the first
+ * child whose key follows after, which is after_len characters long
+ * and terminated, or with the first child if after is NULL.
+ *
+ * Returns the number of children copied.
+ */
+static int _children_chunk(mqtt_topic_segment_s *s,
+                           const char *after, unsigned int after_len,
+                           mqtt_topic_segment_s **chunk) {
+  mqtt_rb_node_s *stack[RB_MAX_HEIGHT], *node;
+  mqtt_so_node_s *nodes[CHILD_CHUNK];
+  unsigned long version;
+  mqtt_so_map_s *map;
+  _child_array_s *a;
+  unsigned int i;
+  int depth, n;
+
+retry:
+  version = _read_begin(s);
+  map = atomic_load(&s->wide);
+  if (map) {
+    n = mqtt_so_map_chunk(map, after, nodes, CHILD_CHUNK);
+    for (int i = 0; i < n; ++i) {
+      chunk[i] = _map_segment(nodes[i]);
+    }
+    return n;
+  }
+  depth = n = 0;
+
+  a = atomic_load_explicit(&s->child_array, memory_order_acquire);
+  if (a) {
+    i = after ? _array_after(a, after, after_len) : 0;
+    for (; i < a->count && n < CHILD_CHUNK; ++i) {
+      chunk[n++] = a->children[i];
+    }
+    if (!_read_validate(s, version)) {
+      goto retry;
+    }
+    return n;
+  }
+
+  /* Stack the nodes following after on the path down to it. */
+  for (node = mqtt_rb_root(&s->children); node != NULL; ) {
+    if (depth == RB_MAX_HEIGHT) {
+      /* Only a tree changing under us can be this deep. */
+      goto retry;
+    }
+    if (after == NULL || _key_cmp(_rb_segment(node), after, after_len) > 0) {
+      stack[depth++] = node;
+      node = mqtt_rb_left(node);
+    } else {
+      node = mqtt_rb_right(node);
+    }
+  }
+
+  while (depth > 0 && n < CHILD_CHUNK) {
+    node = stack[--depth];
+    chunk[n++] = _rb_segment(node);
+    for (node = mqtt_rb_right(node); node; node = mqtt_rb_left(node)) {
+      if (depth == RB_MAX_HEIGHT) {
+        goto retry;
+      }
+      stack[depth++] = node;
+    }
+  }
+
+  if (!_read_validate(s, version)) {
+    goto retry;
+  }
+  return n;
+}
+
+/**
+ * _child_iter_s iterates the children of a segment in order a chunk
+ * at a time. Each chunk is a consistent snapshot, and the next
+ * chunk resumes after the last key seen, so children may be added or
+ * removed concurrently and no child present throughout is missed or
+ * visited twice.
+ */
+typedef struct {
+  mqtt_topic_segment_s *segment;
+  mqtt_topic_segment_s *chunk[CHILD_CHUNK];
+  int n;
+  int i;
+} _child_iter_s;
+
+static void _child_iter_init(_child_iter_s *it, mqtt_topic_segment_s *s) {
+  it->segment = s;
+  it->n = _children_chunk(s, NULL, 0, it->chunk);
+  it->i = 0;
+}
+
+/**
+ * _child_iter_init_after starts iterating the children of s that
+ * follow the key after, which need not be that of a child.
+ */
+static void _child_iter_init_after(_child_iter_s *it, mqtt_topic_segment_s *s,
+                                   const char *after, unsigned int len) {
+  it->segment = s;
+  it->n = _children_chunk(s, after, len, it->chunk);
+  it->i = 0;
+}
+
+/**
+ * _child_iter_next returns the next child, or NULL when there are no
+ * more.
+ */
+static mqtt_topic_segment_s *_child_iter_next(_child_iter_s *it) {
+  if (it->i == it->n) {
+    if (it->n < CHILD_CHUNK) {
+      return NULL;
+    }
+    it->n = _children_chunk(it->segment, it->chunk[it->n - 1]->str,
+                            it->chunk[it->n - 1]->len, it->chunk);
+    it->i = 0;
+    if (it->n == 0) {
+      return NULL;
+    }
+  }
+  return it->chunk[it->i++];
+}
+
+/**
+ * _children_cb_all calls cb for every segment below segment. If first
+ * is set, the children of segment start the topic, and $-prefixed
+ * ones are skipped if ignore_sys is also set.
+ */
+static void _children_cb_all(mqtt_topic_segment_s *segment,
+                             int first, int ignore_sys,
+                             mqtt_iter_cb_s *cb);
+
+/**
+ *
+ */
+static void _segment_cb_all(mqtt_topic_segment_s *segment,
+                            mqtt_iter_cb_s *cb) {
+  _report(cb, segment);
+  /* ignore_sys value is irrelevant here, since we must be beyond the
+   * first level. */
+  _children_cb_all(segment, 0, 0, cb);
+}
+
+static void _children_cb_all(mqtt_topic_segment_s *segment,
+                             int first, int ignore_sys,
+                             mqtt_iter_cb_s *cb) {
+  mqtt_topic_segment_s *child;
+  _child_iter_s it;
+
+  _child_iter_init(&it, segment);
+  while ((child = _child_iter_next(&it)) != NULL) {
+    /* Ignore $-prefixed keys only if this is the first level and the
+     * ignore_sys flag is set. */
+    if (first && ignore_sys && child->str[0] == '$') {
+      continue;
+    }
+    scratch_topic_push_len(child->str, child->len, first);
+    _segment_cb_all(child, cb);
+    scratch_topic_pop();
+  }
+}
+
+static void _matching_iter(mqtt_topic_segment_s *root, char *pattern,
+                           mqtt_iter_cb_s *cb);
+
+/**
+ *
+ */
+static void _children_match_all(mqtt_topic_segment_s *segment, char *rest,
+                                mqtt_iter_cb_s *cb) {
+  int first = (segment->parent == NULL ? 1 : 0);
+  mqtt_topic_segment_s *child;
+  _child_iter_s it;
+
+  _child_iter_init(&it, segment);
+  while ((child = _child_iter_next(&it)) != NULL) {
+    if (!first || child->str[0] != '$') {
+      scratch_topic_push_len(child->str, child->len, first);
+      _matching_iter(child, rest, cb);
+      scratch_topic_pop();
+    }
+  }
+}
+
+static void _matching_iter(mqtt_topic_segment_s *root, char *pattern,
+                           mqtt_iter_cb_s *cb) {
+  char *next_segment = pattern, *rest, *sep;
+  mqtt_topic_segment_s *child;
+
+  if (pattern == NULL) {
+    _report(cb, root);
+    child = _child_segment(root, "#", 1);
+    if (child) {
+      /* A # matches its parent topic. */
+      scratch_topic_push("#", (root->parent == NULL ? 1 : 0));
+      _report(cb, child);
+      scratch_topic_pop();
+    }
+    return;
+  }
+
+  sep = strchr(pattern, '/');
+  if (sep == NULL) {
+    rest = NULL;
+  } else {
+    *sep = '\0';
+    rest = sep + 1;
+  }
 
   if (strcmp(next_segment, "+") == 0) {
     /* Continue as though we matched all segments at the next level. */
-    _red_black_match_all(root->children, root->children->root, rest,
-                         (root->parent == NULL ? 1 : 0), cb);
+    _children_match_all(root, rest, cb);
+    goto exit;
+  } else if (strcmp(next_segment, "#") == 0) {
+    if (root->parent /* i.e., this isn't the sentinel */) {
+      /* A # matches its parent topic. */
+      _report(cb, root);
+    }
+
+    /* Call the callback for all segments below this level. */
+    _children_cb_all(root, (root->parent == NULL ? 1 : 0), 1, cb);
+    goto exit;
+  } else {
+    /* Check for wildcard topics, which also match pattern. */
+    child = _child_segment(root, "+", 1);
+    if (child) {
+      scratch_topic_push("+", (root->parent == NULL ? 1 : 0));
+      _matching_iter(child, rest, cb);
+      scratch_topic_pop();
+    }
+    child = _child_segment(root, "#", 1);
+    if (child) {
+      scratch_topic_push("#", (root->parent == NULL ? 1 : 0));
+      _report(cb, child);
+      scratch_topic_pop();
+    }
+  }
+
+  child = _child_segment(root, next_segment, strlen(next_segment));
+  if (child) {
+    scratch_topic_push(next_segment, (root->parent == NULL ? 1 : 0));
+    _matching_iter(child, rest, cb);
+    scratch_topic_pop();
+    goto exit;
+  }
+
+exit:
+  if (sep) {
+    *sep = '/';
+  }
+}
+
+void mqtt_topic_matching_iter(mqtt_topic_segment_s *root,
+                              char *pattern,
+                              mqtt_iter_cb_s *cb) {
+  mqtt_topic_root_s *tree = _root_of(root);
+
+  _enter(tree);
+  _matching_iter(root, pattern, cb);
+  _leave(tree);
+}
+
+void mqtt_topic_results_init(mqtt_topic_results_s *r) {
+  memset(r, 0, sizeof(*r));
+}
+
+void mqtt_topic_results_clear(mqtt_topic_results_s *r) {
+  r->count = 0;
+  r->failed = 0;
+}
+
+void mqtt_topic_results_free(mqtt_topic_results_s *r) {
+  free(r->segments);
+  mqtt_topic_results_init(r);
+}
+
+mqtt_iter_cb_s mqtt_topic_results_cb(mqtt_topic_results_s *r) {
+  return (mqtt_iter_cb_s){ .data = r, .fn = NULL };
+}
+
+int mqtt_topic_matching_collect(mqtt_topic_segment_s *root, char *pattern,
+                                mqtt_topic_results_s *r) {
+  mqtt_iter_cb_s cb = mqtt_topic_results_cb(r);
+
+  mqtt_topic_matching_iter(root, pattern, &cb);
+  return r->failed ? -1 : 0;
+}
+
+void mqtt_topic_iter(mqtt_topic_segment_s *root, mqtt_iter_cb_s *cb) {
+  mqtt_topic_root_s *tree = _root_of(root);
+
+  _enter(tree);
+  _children_cb_all(root, 1, 0, cb);
+  _leave(tree);
+}
+
+mqtt_topic_snapshot_s *mqtt_topic_snapshot_begin(mqtt_topic_segment_s *root) {
+  mqtt_topic_root_s *tree = _root_of(root);
+  mqtt_topic_snapshot_s *snapshot = malloc(sizeof(mqtt_topic_snapshot_s));
+
+  if (snapshot == NULL) {
+    return NULL;
+  }
+  snapshot->tree = tree;
+
+  pthread_mutex_lock(&tree->snapshot_lock);
+  atomic_store(&tree->snapshots_used, 1);
+  /* Pins only grow, so appending keeps the oldest snapshot first. */
+  snapshot->pin = atomic_fetch_add(&tree->snapshot_seq, 1) + 1;
+  snapshot->link.prev = tree->snapshots.prev;
+  snapshot->link.next = &tree->snapshots;
+  tree->snapshots.prev->next = &snapshot->link;
+  tree->snapshots.prev = &snapshot->link;
+  if (atomic_fetch_add(&tree->snapshots_open, 1) == 0) {
+    atomic_store(&tree->snapshot_min, snapshot->pin);
+  }
+  pthread_mutex_unlock(&tree->snapshot_lock);
+  return snapshot;
+}
+
+/**
+ * _snapshot_data returns the data s held as of pin.
+ */
+static void *_snapshot_data(mqtt_topic_segment_s *s, unsigned long pin) {
+  unsigned long version;
+  _version_s *v;
+  void *data;
+
+  do {
+    version = _read_begin(s);
+    data = _data(s);
+    v = atomic_load_explicit(&s->versions, memory_order_acquire);
+    for (; v && v->seq >= pin;
+         v = atomic_load_explicit(&v->older, memory_order_acquire)) {
+      data = v->data;
+    }
+  } while (!_read_validate(s, version));
+  return data;
+}
+
+typedef struct {
+  unsigned long pin;
+  mqtt_topic_snapshot_cb_s *cb;
+} _snapshot_iter_s;
+
+static void _snapshot_visit(void *data, char *topic,
+                            mqtt_topic_segment_s *segment) {
+  _snapshot_iter_s *iter = data;
+  void *value = _snapshot_data(segment, iter->pin);
+
+  if (value != NULL) {
+    iter->cb->fn(iter->cb->data, topic, value);
+  }
+}
+
+void mqtt_topic_snapshot_iter(mqtt_topic_snapshot_s *snapshot,
+                              mqtt_topic_snapshot_cb_s *cb) {
+  _snapshot_iter_s iter = { .pin = snapshot->pin, .cb = cb };
+  mqtt_iter_cb_s iter_cb = { .data = &iter, .fn = &_snapshot_visit };
+
+  /* Segments holding data as of the pin stay in the tree until the
+   * snapshot ends, so the walk finds them all. */
+  mqtt_topic_iter(&snapshot->tree->segment, &iter_cb);
+}
+
+void mqtt_topic_snapshot_end(mqtt_topic_snapshot_s *snapshot) {
+  mqtt_topic_root_s *tree = snapshot->tree;
+  mqtt_topic_gc_link_s pending = { &pending, &pending };
+  mqtt_topic_segment_s *s;
+
+  pthread_mutex_lock(&tree->snapshot_lock);
+  snapshot->link.prev->next = snapshot->link.next;
+  snapshot->link.next->prev = snapshot->link.prev;
+  atomic_store(&tree->snapshot_min,
+               tree->snapshots.next == &tree->snapshots
+                   ? ULONG_MAX
+                   : ((mqtt_topic_snapshot_s *)tree->snapshots.next)->pin);
+  /* Take the deferred segments off the tree's list, so that any a
+   * new snapshot defers again are left for it. */
+  if (atomic_fetch_sub(&tree->snapshots_open, 1) == 1 &&
+      tree->snapshot_pending.next != &tree->snapshot_pending) {
+    pending = tree->snapshot_pending;
+    pending.next->prev = pending.prev->next = &pending;
+    tree->snapshot_pending.prev = tree->snapshot_pending.next =
+        &tree->snapshot_pending;
+  }
+  pthread_mutex_unlock(&tree->snapshot_lock);
+  free(snapshot);
+
+  _enter(tree);
+  for (;;) {
+    pthread_mutex_lock(&tree->snapshot_lock);
+    s = pending.next == &pending ? NULL : _gc_segment(pending.next);
+    if (s) {
+      _gc_unlink(s);
+    }
+    pthread_mutex_unlock(&tree->snapshot_lock);
+    if (s == NULL) {
+      break;
+    }
+    /* Still in the tree, as detaching s takes it off the list first,
+     * and not freed before leaving the critical section if it is
+     * detached from here on. */
+    _segment_remove(tree, s);
+  }
+  _leave(tree);
+}
+
+/* Results of a scan step. */
+#define SCAN_MORE 0
+#define SCAN_FULL 1
+#define SCAN_END 2
+
+typedef struct {
+  const char *end;
+  int limit;
+  int count;
+  mqtt_iter_cb_s *cb;
+} _scan_s;
+
+/**
+ * _topic_rank maps the characters of a topic so that comparing the
+ * ranks orders topics level by level: the end of the topic sorts
+ * first, then the level separator, then everything else.
+ */
+static int _topic_rank(char c) {
+  return c == '\0' ? 0 : c == '/' ? 1 : (unsigned char)c + 1;
+}
+
+/**
+ * _topic_cmp compares two topics in scan order.
+ */
+static int _topic_cmp(const char *a, const char *b) {
+  int ra, rb;
+
+  for (;; ++a, ++b) {
+    ra = _topic_rank(*a);
+    rb = _topic_rank(*b);
+    if (ra != rb) {
+      return ra < rb ? -1 : 1;
+    }
+    if (ra == 0) {
+      return 0;
+    }
+  }
+}
+
+static int _scan_children(_scan_s *scan, mqtt_topic_segment_s *segment,
+                          char *after);
+
+/**
+ * _scan_visit reports segment, whose topic is the scratch topic, then
+ * scans below it.
+ */
+static int _scan_visit(_scan_s *scan, mqtt_topic_segment_s *segment) {
+  if (scan->end && _topic_cmp(scratch_topic, scan->end) >= 0) {
+    return SCAN_END;
+  }
+  _report(scan->cb, segment);
+  if (++scan->count == scan->limit) {
+    return SCAN_FULL;
+  }
+  return _scan_children(scan, segment, NULL);
+}
+
+/**
+ * _scan_children scans the children of segment and what lies below
+ * them, or only the part that follows after, relative to segment, if
+ * it is not NULL.
+ *
+ * Returns SCAN_MORE if the scan should go on with the next sibling of
+ * segment, SCAN_FULL once the limit is reached, or SCAN_END once a
+ * topic past the end was found, in which case the siblings that
+ * follow are past the end too unless they are in map order.
+ */
+static int _scan_children(_scan_s *scan, mqtt_topic_segment_s *segment,
+                          char *after) {
+  int first = (segment->parent == NULL ? 1 : 0);
+  int sorted = (atomic_load(&segment->wide) == NULL);
+  mqtt_topic_segment_s *child;
+  char *sep = NULL, *rest = NULL;
+  unsigned int len;
+  _child_iter_s it;
+  int rc;
+
+  if (after == NULL) {
+    _child_iter_init(&it, segment);
+  } else {
+    sep = strchr(after, '/');
+    if (sep) {
+      *sep = '\0';
+      rest = sep + 1;
+    }
+    len = strlen(after);
+
+    /* What follows after below its first level comes first. That
+     * level itself was visited already. */
+    child = _child_segment(segment, after, len);
+    if (child) {
+      scratch_topic_push_len(after, len, first);
+      rc = _scan_children(scan, child, rest);
+      scratch_topic_pop();
+      if (rc == SCAN_FULL || (rc == SCAN_END && sorted)) {
+        goto exit;
+      }
+    }
+    _child_iter_init_after(&it, segment, after, len);
+  }
+
+  rc = SCAN_MORE;
+  while ((child = _child_iter_next(&it)) != NULL) {
+    scratch_topic_push_len(child->str, child->len, first);
+    rc = _scan_visit(scan, child);
+    scratch_topic_pop();
+    if (rc == SCAN_FULL || (rc == SCAN_END && sorted)) {
+      break;
+    }
+    rc = SCAN_MORE;
+  }
+
+exit:
+  if (sep) {
+    *sep = '/';
+  }
+  return rc;
+}
+
+int mqtt_topic_scan(mqtt_topic_segment_s *root, char *prefix, char *after,
+                    const char *end, int limit, mqtt_iter_cb_s *cb) {
+  _scan_s scan = { .end = end, .limit = limit, .count = 0, .cb = cb };
+  mqtt_topic_root_s *tree = _root_of(root);
+  mqtt_topic_segment_s *segment = root;
+  char *sep = NULL;
+  size_t len;
+
+  _enter(tree);
+  if (prefix == NULL || strcmp(prefix, "#") == 0) {
+    scratch_topic_set("");
+    _scan_children(&scan, root, after);
+    goto exit;
+  }
+
+  len = strlen(prefix);
+  if (len >= 2 && strcmp(prefix + len - 2, "/#") == 0) {
+    sep = prefix + len - 2;
+    *sep = '\0';
+    len -= 2;
+  }
+  if (mqtt_topic_find_or_add(&segment, root, prefix, 0) != 0) {
+    goto exit;
+  }
+
+  scratch_topic_set(prefix);
+  if (after == NULL || _topic_cmp(after, prefix) < 0) {
+    _scan_visit(&scan, segment);
+  } else if (strncmp(after, prefix, len) == 0 &&
+             (after[len] == '\0' || after[len] == '/')) {
+    _scan_children(&scan, segment, after[len] ? after + len + 1 : NULL);
+  }
+  /* Otherwise after is past the whole prefix. */
+
+exit:
+  if (sep) {
+    *sep = '/';
+  }
+  _leave(tree);
+  return scan.count;
+}
+
+/**
+ * _batch_push adds a segment detached with _child_detach to a batch
+ * of segments awaiting release. Batched segments are chained through
+ * their reclamation entries, which are otherwise unused outside of
+ * concurrent trees.
+ */
+static void _batch_push(mqtt_epoch_entry_s **batch, mqtt_topic_segment_s *s) {
+  s->retired.next = *batch;
+  *batch = &s->retired;
+}
+
+/**
+ * _batch_free releases every segment in a batch, along with its
+ * subtree.
+ */
+static void _batch_free(mqtt_epoch_entry_s *batch) {
+  mqtt_epoch_entry_s *next;
+
+  for (; batch != NULL; batch = next) {
+    next = batch->next;
+    _segment_reclaim(batch);
+  }
+}
+
+static int _pred_all(void *data, char *topic, mqtt_topic_segment_s *segment) {
+  return 1;
+}
+
+/**
+ * _remove_if walks the children of segment in order, detaching every
+ * child for which pred holds, along with its subtree. Children that
+ * are left without data or children once their own subtrees have
+ * been walked are detached as well, so ancestors of removed subtrees
+ * are cleaned up on the way back up. Detached segments are added to
+ * batch rather than freed.
+ *
+ * Returns 1 if anything below segment was detached, 0 otherwise.
+ */
+static int _remove_if(mqtt_topic_segment_s *segment,
+                      mqtt_topic_pred_s *pred,
+                      mqtt_iter_cb_s *cb,
+                      mqtt_epoch_entry_s **batch) {
+  mqtt_topic_segment_s *child;
+  int first = (segment->parent == NULL ? 1 : 0);
+  int removed = 0, detach;
+  _child_iter_s it;
+
+  /* Detached children stay allocated until the batch is freed, so
+   * the iterator can still resume after their keys. */
+  _child_iter_init(&it, segment);
+  while ((child = _child_iter_next(&it)) != NULL) {
+    scratch_topic_push_len(child->str, child->len, first);
+    if (pred->fn(pred->data, scratch_topic, child)) {
+      if (cb) {
+        _segment_cb_all(child, cb);
+      }
+      detach = 1;
+    } else {
+      detach = _remove_if(child, pred, cb, batch) && _segment_is_empty(child);
+    }
+    scratch_topic_pop();
+
+    if (detach) {
+      _child_detach(child);
+      _batch_push(batch, child);
+      removed = 1;
+    }
+  }
+  return removed;
+}
+
+void mqtt_topic_remove_if(mqtt_topic_segment_s *root,
+                          mqtt_topic_pred_s *pred,
+                          mqtt_iter_cb_s *cb) {
+  mqtt_epoch_entry_s *batch = NULL;
+
+  scratch_topic_set("");
+  if (_remove_if(root, pred, cb, &batch)) {
+    _generation_bump((mqtt_topic_root_s *)root);
+  }
+  _batch_free(batch);
+}
+
+int mqtt_topic_remove_prefix(mqtt_topic_segment_s *root,
+                             char *prefix,
+                             mqtt_iter_cb_s *cb) {
+  mqtt_topic_pred_s all = { .data = NULL, .fn = &_pred_all };
+  mqtt_topic_segment_s *segment, *parent;
+  mqtt_epoch_entry_s *batch = NULL;
+  size_t len = strlen(prefix);
+  char *sep = NULL;
+  int rc;
+
+  if (strcmp(prefix, "#") == 0) {
+    mqtt_topic_remove_if(root, &all, cb);
+    return 0;
+  }
+
+  /* A trailing # also matches its parent topic, so "a/b/#" removes
+   * exactly what "a/b" does. */
+  if (len >= 2 && strcmp(prefix + len - 2, "/#") == 0) {
+    sep = prefix + len - 2;
+    *sep = '\0';
+  }
+
+  rc = mqtt_topic_find_or_add(&segment, root, prefix, 0);
+  if (rc != 0) {
+    goto exit;
+  }
+
+  if (cb) {
+    scratch_topic_set(prefix);
+    _segment_cb_all(segment, cb);
+  }
+
+  parent = segment->parent;
+  _child_detach(segment);
+  _batch_push(&batch, segment);
+  _generation_bump((mqtt_topic_root_s *)root);
+
+  /* Clean up the ancestors once, now that the whole subtree is gone. */
+  rc = mqtt_topic_segment_remove(parent);
+  _batch_free(batch);
+
+exit:
+  if (sep) {
+    *sep = '/';
+  }
+  return rc;
+}
+
+void mqtt_topic_gc_enable(mqtt_topic_segment_s *root, unsigned long max_age) {
+  mqtt_topic_root_s *r = (mqtt_topic_root_s *)root;
+
+  r->gc_deferred = 1;
+  r->gc_max_age = max_age;
+}
+
+int mqtt_topic_gc_sweep(mqtt_topic_segment_s *root, unsigned long now,
+                        int budget) {
+  mqtt_topic_root_s *r = (mqtt_topic_root_s *)root;
+  mqtt_topic_gc_link_s *head = &root->gc_link;
+  mqtt_topic_segment_s *s, *parent;
+  mqtt_epoch_entry_s *batch = NULL;
+  unsigned long stamp;
+  int collected = 0;
+
+  if (now > r->gc_now) {
+    r->gc_now = now;
+  }
+
+  while (head->next != head && collected < budget) {
+    s = _gc_segment(head->next);
+    stamp = s->gc_stamp;
+    /* The list is kept in stamp order, so nothing behind s is old
+     * enough either. */
+    if (r->gc_now - stamp < r->gc_max_age) {
+      break;
+    }
+    _gc_unlink(s);
+
+    /* Segments that were reused since they were marked are simply
+     * dropped from the list. Otherwise, collect s and any ancestors
+     * it was keeping alive. */
+    while (s != root && _segment_is_empty(s)) {
+      if (collected == budget) {
+        /* Out of budget: leave s at the head of the list, eligible
+         * for the next sweep. */
+        _gc_link(head->next, s, stamp);
+        break;
+      }
+      parent = s->parent;
+      _child_detach(s);
+      _batch_push(&batch, s);
+      ++collected;
+      s = parent;
+    }
+  }
+
+  if (collected) {
+    _generation_bump(r);
+  }
+  _batch_free(batch);
+  return collected;
+}
+
+/*
+ * The expiry wheel is hierarchical: level l has WHEEL_SLOTS slots of
+ * WHEEL_SLOTS^l ticks each. A deadline is placed on the lowest level
+ * that spans it from the current time, and its slot is moved down a
+ * level when the wheel reaches it, until it expires from level 0.
+ * Deadlines beyond the top level are placed as far as it reaches and
+ * placed again when their slot comes up.
+ */
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 8
+#define WHEEL_SPAN (1ul << (WHEEL_BITS * WHEEL_LEVELS))
+
+typedef struct _wheel {
+  unsigned long now;
+
+  /* Deadlines that have been reached but not yet expired. */
+  mqtt_topic_gc_link_s due;
+
+  /* A bit per slot that may hold deadlines. Bits are cleared when the
+   * wheel reaches their slot, not when the slot empties otherwise. */
+  uint64_t occupied[WHEEL_LEVELS];
+  mqtt_topic_gc_link_s slots[WHEEL_LEVELS][WHEEL_SLOTS];
+} _wheel_s;
+
+/**
+ * _expiry_link places s on a wheel list just before at.
+ */
+static void _expiry_link(mqtt_topic_gc_link_s *at, mqtt_topic_segment_s *s) {
+  s->expiry_link.prev = at->prev;
+  s->expiry_link.next = at;
+  at->prev->next = &s->expiry_link;
+  at->prev = &s->expiry_link;
+}
+
+/**
+ * _expiry_segment returns the segment containing a wheel list link.
+ */
+static mqtt_topic_segment_s *_expiry_segment(mqtt_topic_gc_link_s *link) {
+  return (mqtt_topic_segment_s *)((char *)link -
+                                  offsetof(mqtt_topic_segment_s, expiry_link));
+}
+
+static void _wheel_insert(_wheel_s *w, mqtt_topic_segment_s *s) {
+  unsigned long deadline = s->expiry, delta;
+  int level, slot;
+
+  if (deadline <= w->now) {
+    _expiry_link(&w->due, s);
+    return;
+  }
+  delta = deadline - w->now;
+  for (level = 0; level < WHEEL_LEVELS - 1; ++level) {
+    if (delta < 1ul << (WHEEL_BITS * (level + 1))) {
+      break;
+    }
+  }
+  if (delta >= WHEEL_SPAN) {
+    deadline = w->now + WHEEL_SPAN - 1;
+  }
+  slot = (deadline >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+  _expiry_link(&w->slots[level][slot], s);
+  w->occupied[level] |= 1ull << slot;
+}
+
+/**
+ * _wheel_cascade places the deadlines of a slot the wheel has reached
+ * again, on lower levels or on the due list.
+ */
+static void _wheel_cascade(_wheel_s *w, int level, int slot) {
+  mqtt_topic_gc_link_s *head = &w->slots[level][slot];
+  mqtt_topic_segment_s *s;
+
+  w->occupied[level] &= ~(1ull << slot);
+  while (head->next != head) {
+    s = _expiry_segment(head->next);
+    _expiry_unlink(s);
+    _wheel_insert(w, s);
+  }
+}
+
+/**
+ * _wheel_next returns the first time after the wheel's current time
+ * at which it has a slot to process, or the current time if it holds
+ * no deadlines. Only the lowest occupied level and the next boundary
+ * of the level above it matter: lower levels are empty, and higher
+ * ones only move deadlines down at those boundaries.
+ */
+static unsigned long _wheel_next(_wheel_s *w) {
+  unsigned long cur, next, boundary;
+  int level, shift, from;
+  uint64_t bits;
+
+  for (level = 0; level < WHEEL_LEVELS; ++level) {
+    if (w->occupied[level]) {
+      break;
+    }
+  }
+  if (level == WHEEL_LEVELS) {
+    return w->now;
+  }
+
+  shift = WHEEL_BITS * level;
+  cur = w->now >> shift;
+  from = (cur + 1) & (WHEEL_SLOTS - 1);
+  bits = w->occupied[level];
+  if (from) {
+    bits = (bits >> from) | (bits << (WHEEL_SLOTS - from));
+  }
+  next = (cur + 1 + __builtin_ctzll(bits)) << shift;
+  if (level < WHEEL_LEVELS - 1) {
+    boundary = ((w->now >> (shift + WHEEL_BITS)) + 1) << (shift + WHEEL_BITS);
+    if (boundary < next) {
+      next = boundary;
+    }
+  }
+  return next;
+}
+
+/**
+ * _expiry_splice moves every segment on the wheel list from to just
+ * before at, leaving from empty.
+ */
+static void _expiry_splice(mqtt_topic_gc_link_s *at,
+                           mqtt_topic_gc_link_s *from) {
+  if (from->next == from) {
+    return;
+  }
+  from->next->prev = at->prev;
+  from->prev->next = at;
+  at->prev->next = from->next;
+  at->prev = from->prev;
+  from->prev = from->next = from;
+}
+
+/**
+ * _expire_list expires every segment on a wheel list, returning how
+ * many had their data cleared. Segments that still hold data and a
+ * deadline once cb returns, or that cb made due again, are placed on
+ * kept instead, to wait for the next advance.
+ */
+static int _expire_list(mqtt_topic_root_s *tree, mqtt_topic_gc_link_s *head,
+                        mqtt_topic_gc_link_s *kept, mqtt_iter_cb_s *cb) {
+  _wheel_s *w = tree->expiry;
+  mqtt_topic_gc_link_s batch = { &batch, &batch };
+  mqtt_topic_segment_s *s;
+  int expired = 0;
+
+  /* Take the whole list first, so that cb cannot add to it. */
+  _expiry_splice(&batch, head);
+
+  /* Removing s can remove ancestors further down the list, which
+   * unlink themselves, so the list is only ever read at its head. */
+  while (batch.next != &batch) {
+    s = _expiry_segment(batch.next);
+    _expiry_unlink(s);
+    if (cb) {
+      scratch_topic_set_segment(s);
+      _report(cb, s);
+    }
+    if (s->expiry_link.next != NULL) {
+      /* Given a new deadline. One already reached is on the due list,
+       * which this advance may drain again. */
+      if (s->expiry <= w->now) {
+        _expiry_unlink(s);
+        _expiry_link(kept, s);
+      }
+      continue;
+    }
+    if (s->data != NULL) {
+      /* Still due, unless cb cancelled the deadline. */
+      if (s->expiry) {
+        _expiry_link(kept, s);
+      }
+      continue;
+    }
+    _segment_sync(tree, s);
+    _segment_remove(tree, s);
+    ++expired;
+  }
+  return expired;
+}
+
+int mqtt_topic_expiry_enable(mqtt_topic_segment_s *root, unsigned long now) {
+  mqtt_topic_root_s *tree = (mqtt_topic_root_s *)root;
+  _wheel_s *w;
+
+  if (tree->expiry) {
+    return 0;
+  }
+  w = malloc(sizeof(*w));
+  if (w == NULL) {
+    return -1;
+  }
+  memset(w->occupied, 0, sizeof(w->occupied));
+  w->now = now;
+  w->due.prev = w->due.next = &w->due;
+  for (int level = 0; level < WHEEL_LEVELS; ++level) {
+    for (int slot = 0; slot < WHEEL_SLOTS; ++slot) {
+      w->slots[level][slot].prev = w->slots[level][slot].next =
+          &w->slots[level][slot];
+    }
+  }
+  tree->expiry = w;
+  return 0;
+}
+
+int mqtt_topic_expire_at(mqtt_topic_segment_s *segment,
+                         unsigned long deadline) {
+  _wheel_s *w = _root_of(segment)->expiry;
+
+  if (w == NULL || segment->parent == NULL) {
+    return 1;
+  }
+  _expiry_unlink(segment);
+  segment->expiry = deadline;
+  if (deadline) {
+    _wheel_insert(w, segment);
+  }
+  return 0;
+}
+
+int mqtt_topic_expiry_advance(mqtt_topic_segment_s *root, unsigned long now,
+                              mqtt_iter_cb_s *cb) {
+  mqtt_topic_root_s *tree = (mqtt_topic_root_s *)root;
+  _wheel_s *w = tree->expiry;
+  mqtt_topic_gc_link_s kept = { &kept, &kept };
+  unsigned long next;
+  int expired;
+
+  if (w == NULL) {
+    return 0;
+  }
+  expired = _expire_list(tree, &w->due, &kept, cb);
+  while (w->now < now) {
+    next = _wheel_next(w);
+    if (next == w->now || next > now) {
+      w->now = now;
+      break;
+    }
+    w->now = next;
+    for (int level = WHEEL_LEVELS - 1; level > 0; --level) {
+      if ((next & ((1ul << (WHEEL_BITS * level)) - 1)) == 0) {
+        _wheel_cascade(w, level,
+                       (next >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1));
+      }
+    }
+    w->occupied[0] &= ~(1ull << (next & (WHEEL_SLOTS - 1)));
+    expired += _expire_list(tree, &w->due, &kept, cb);
+    expired += _expire_list(tree, &w->slots[0][next & (WHEEL_SLOTS - 1)],
+                            &kept, cb);
+  }
+  _expiry_splice(&w->due, &kept);
+  scratch_topic_set("");
+  return expired;
+}
+
+unsigned long mqtt_topic_generation(mqtt_topic_segment_s *root) {
+  return atomic_load(&((mqtt_topic_root_s *)root)->generation);
+}
+
+/**
+ * _digest_init computes the hashes of the segments below s, and the
+ * digest of s.
+ */
+static void _digest_init(mqtt_topic_segment_s *s) {
+  mqtt_topic_segment_s *child;
+  uint64_t digest;
+  _child_iter_s it;
+
+  s->digest_data = s->data != NULL;
+  digest = s->digest_data ? s->path_hash : 0;
+
+  _child_iter_init(&it, s);
+  while ((child = _child_iter_next(&it)) != NULL) {
+    child->path_hash = _path_hash(s, child->str, child->len);
+    _digest_init(child);
+    digest ^= atomic_load(&child->digest);
+  }
+  atomic_store(&s->digest, digest);
+}
+
+void mqtt_topic_digest_enable(mqtt_topic_segment_s *root) {
+  mqtt_topic_root_s *tree = (mqtt_topic_root_s *)root;
+
+  if (!tree->digest) {
+    _digest_init(root);
+    tree->digest = 1;
+  }
+}
+
+uint64_t mqtt_topic_digest(mqtt_topic_segment_s *segment) {
+  return atomic_load(&segment->digest);
+}
+
+typedef struct {
+  mqtt_topic_diff_cb_s *cb;
+  /* Set if matching digests can be trusted. */
+  int skip;
+} _diff_s;
+
+static void _diff_report(_diff_s *d, int kind, mqtt_topic_segment_s *s) {
+  d->cb->fn(d->cb->data, kind, scratch_topic, s);
+}
+
+/**
+ * _diff_subtree reports every segment holding data in the subtree of
+ * s, s included, as being of kind.
+ */
+static void _diff_subtree(_diff_s *d, int kind, mqtt_topic_segment_s *s) {
+  mqtt_topic_segment_s *child;
+  _child_iter_s it;
+
+  if (s->data != NULL) {
+    _diff_report(d, kind, s);
+  }
+  _child_iter_init(&it, s);
+  while ((child = _child_iter_next(&it)) != NULL) {
+    scratch_topic_push_len(child->str, child->len, 0);
+    _diff_subtree(d, kind, child);
+    scratch_topic_pop();
+  }
+}
+
+/**
+ * _diff_children compares the children of from and to, segments at
+ * the same topic.
+ */
+static void _diff_children(_diff_s *d, mqtt_topic_segment_s *from,
+                           mqtt_topic_segment_s *to) {
+  int first = (to->parent == NULL ? 1 : 0);
+  mqtt_topic_segment_s *child, *other;
+  _child_iter_s it;
+
+  _child_iter_init(&it, to);
+  while ((child = _child_iter_next(&it)) != NULL) {
+    other = _child_segment(from, child->str, child->len);
+    if (other && d->skip &&
+        atomic_load(&other->digest) == atomic_load(&child->digest)) {
+      continue;
+    }
+    scratch_topic_push_len(child->str, child->len, first);
+    if (other) {
+      if (child->data != NULL && other->data == NULL) {
+        _diff_report(d, MQTT_TOPIC_DIFF_ADDED, child);
+      } else if (child->data == NULL && other->data != NULL) {
+        _diff_report(d, MQTT_TOPIC_DIFF_REMOVED, other);
+      }
+      _diff_children(d, other, child);
+    } else {
+      _diff_subtree(d, MQTT_TOPIC_DIFF_ADDED, child);
+    }
+    scratch_topic_pop();
+  }
+
+  _child_iter_init(&it, from);
+  while ((child = _child_iter_next(&it)) != NULL) {
+    if (_child_segment(to, child->str, child->len) == NULL) {
+      scratch_topic_push_len(child->str, child->len, first);
+      _diff_subtree(d, MQTT_TOPIC_DIFF_REMOVED, child);
+      scratch_topic_pop();
+    }
+  }
+}
+
+void mqtt_topic_diff(mqtt_topic_segment_s *from, mqtt_topic_segment_s *to,
+                     mqtt_topic_diff_cb_s *cb) {
+  mqtt_topic_root_s *from_tree = _root_of(from), *to_tree = _root_of(to);
+  _diff_s d = { .cb = cb, .skip = from_tree->digest && to_tree->digest };
+
+  _enter(from_tree);
+  _enter(to_tree);
+  if (!d.skip || atomic_load(&from->digest) != atomic_load(&to->digest)) {
+    scratch_topic_set("");
+    _diff_children(&d, from, to);
+  }
+  _leave(to_tree);
+  _leave(from_tree);
+}
+
+/**
+ * The kinds of segment in a split topic or pattern.
+ */
+typedef enum {
+  TOKEN_LITERAL,
+  TOKEN_PLUS,
+  TOKEN_HASH,
+} _token_type_e;
+
+/**
+ * _token_s is one segment of a topic or pattern that has been split
+ * ahead of time, so matching needs neither strchr nor strcmp to find
+ * and classify it, nor to hash it to look it up.
+ */
+typedef struct {
+  _token_type_e type;
+  int len;
+  char *str;
+  /* The mqtt_so_map_hash of a literal, which also gives its
+   * fingerprint in child arrays. */
+  uint32_t hash;
+} _token_s;
+
+/**
+ * _topic_depth returns the number of segments in topic.
+ */
+static int _topic_depth(const char *topic) {
+  int depth = 1;
+
+  for (; *topic; ++topic) {
+    depth += (*topic == '/');
+  }
+  return depth;
+}
+
+/**
+ * _tokenized_alloc allocates size bytes followed by the depth tokens
+ * of topic and the strings they point to, returning the tokens in
+ * *h_tokens.
+ */
+static void *_tokenized_alloc(const char *topic, int depth, size_t size,
+                              _token_s **h_tokens) {
+  size_t len = strlen(topic);
+  _token_s *tokens;
+  char *buf, *sep;
+  void *p;
+
+  p = malloc(size + depth * sizeof(_token_s) + len + 1);
+  if (p == NULL) {
+    return NULL;
+  }
+
+  tokens = (_token_s *)((char *)p + size);
+  buf = (char *)&tokens[depth];
+  memcpy(buf, topic, len + 1);
+
+  for (int i = 0; i < depth; ++i, buf = sep + 1) {
+    sep = strchr(buf, '/');
+    if (sep) {
+      *sep = '\0';
+    } else {
+      sep = buf + strlen(buf);
+    }
+    tokens[i].str = buf;
+    tokens[i].len = sep - buf;
+    if (strcmp(buf, "+") == 0) {
+      tokens[i].type = TOKEN_PLUS;
+    } else if (strcmp(buf, "#") == 0) {
+      tokens[i].type = TOKEN_HASH;
+    } else {
+      tokens[i].type = TOKEN_LITERAL;
+      tokens[i].hash = mqtt_so_map_hash(buf, tokens[i].len);
+    }
+  }
+
+  *h_tokens = tokens;
+  return p;
+}
+
+static void _match_tokens(mqtt_topic_segment_s *segment,
+                          _token_s *tokens, int n,
+                          mqtt_iter_cb_s *cb);
+
+/**
+ *
+ */
+static void _children_match_all_tokens(mqtt_topic_segment_s *segment,
+                                       _token_s *tokens, int n,
+                                       int first,
+                                       mqtt_iter_cb_s *cb) {
+  mqtt_topic_segment_s *child;
+  _child_iter_s it;
+
+  _child_iter_init(&it, segment);
+  while ((child = _child_iter_next(&it)) != NULL) {
+    if (!first || child->str[0] != '$') {
+      scratch_topic_push_len(child->str, child->len, first);
+      _match_tokens(child, tokens, n, cb);
+      scratch_topic_pop();
+    }
+  }
+}
+
+/**
+ * _match_tokens calls cb for every segment at or below segment that
+ * terminates a topic matching the pattern whose remaining n segments
+ * are in tokens. It is equivalent to mqtt_topic_matching_iter for a
+ * pattern that has already been split into segments.
+ */
+static void _match_tokens(mqtt_topic_segment_s *segment,
+                          _token_s *tokens, int n,
+                          mqtt_iter_cb_s *cb) {
+  int first = (segment->parent == NULL ? 1 : 0);
+  mqtt_topic_segment_s *child;
+
+  if (n == 0) {
+    _report(cb, segment);
+    child = _child_segment(segment, "#", 1);
+    if (child) {
+      /* A # matches its parent topic. */
+      scratch_topic_push_len("#", 1, first);
+      _report(cb, child);
+      scratch_topic_pop();
+    }
+    return;
+  }
+
+  switch (tokens->type) {
+    case TOKEN_PLUS:
+      /* Continue as though we matched all segments at the next level. */
+      _children_match_all_tokens(segment, tokens + 1, n - 1, first, cb);
+      return;
+    case TOKEN_HASH:
+      if (!first) {
+        /* A # matches its parent topic. */
+        _report(cb, segment);
+      }
+      _children_cb_all(segment, first, 1, cb);
+      return;
+    case TOKEN_LITERAL:
+      break;
+  }
+
+  /* Check for wildcard topics, which also match the pattern. */
+  child = _child_segment(segment, "+", 1);
+  if (child) {
+    scratch_topic_push_len("+", 1, first);
+    _match_tokens(child, tokens + 1, n - 1, cb);
+    scratch_topic_pop();
+  }
+  child = _child_segment(segment, "#", 1);
+  if (child) {
+    scratch_topic_push_len("#", 1, first);
+    _report(cb, child);
+    scratch_topic_pop();
+  }
+  child = _child_segment_hashed(segment, tokens->str, tokens->len,
+                                tokens->hash);
+  if (child) {
+    scratch_topic_push_len(tokens->str, tokens->len, first);
+    _match_tokens(child, tokens + 1, n - 1, cb);
+    scratch_topic_pop();
+  }
+}
+
+/**
+ * A level of a prepared topic: the segment terminating the topic up
+ * to and including this level, and the + and # siblings of that
+ * segment. Any of these may be NULL.
+ */
+typedef struct {
+  mqtt_topic_segment_s *literal;
+  mqtt_topic_segment_s *plus;
+  mqtt_topic_segment_s *hash;
+} _prepared_level_s;
+
+struct mqtt_topic_prepared {
+  mqtt_topic_segment_s *root;
+
+  /* The tree generation the levels were resolved against. */
+  unsigned long generation;
+
+  /* The # child of the final segment of the topic, if any. */
+  mqtt_topic_segment_s *hash;
+
+  int depth;
+  _token_s *tokens;
+  _prepared_level_s levels[];
+};
+
+/**
+ * _prepared_resolve looks up the segments of every level of p in
+ * the current tree.
+ */
+static void _prepared_resolve(mqtt_topic_prepared_s *p) {
+  mqtt_topic_segment_s *parent = p->root;
+
+  /* Read first, so that a removal made while resolving forces the
+   * next match to resolve again. */
+  p->generation = mqtt_topic_generation(p->root);
+  for (int i = 0; i < p->depth; ++i) {
+    p->levels[i].plus = _child_segment(parent, "+", 1);
+    p->levels[i].hash = _child_segment(parent, "#", 1);
+    p->levels[i].literal = _child_segment_hashed(
+        parent, p->tokens[i].str, p->tokens[i].len, p->tokens[i].hash);
+    parent = p->levels[i].literal;
+  }
+  p->hash = _child_segment(parent, "#", 1);
+}
+
+mqtt_topic_prepared_s *mqtt_topic_prepare(mqtt_topic_segment_s *root,
+                                          const char *topic) {
+  mqtt_topic_prepared_s *p;
+  _token_s *tokens;
+  int depth = _topic_depth(topic);
+
+  if (strpbrk(topic, "+#")) {
+    return NULL;
+  }
+
+  /* Split the topic once, here, rather than on every match. */
+  p = _tokenized_alloc(topic, depth,
+                       sizeof(*p) + depth * sizeof(_prepared_level_s),
+                       &tokens);
+  if (p == NULL) {
+    return NULL;
+  }
+
+  p->root = root;
+  p->depth = depth;
+  p->tokens = tokens;
+  _enter(_root_of(root));
+  _prepared_resolve(p);
+  _leave(_root_of(root));
+  return p;
+}
+
+void mqtt_topic_prepared_destroy(mqtt_topic_prepared_s *p) {
+  free(p);
+}
+
+void mqtt_topic_prepared_matching_iter(mqtt_topic_prepared_s *p,
+                                       mqtt_iter_cb_s *cb) {
+  mqtt_topic_root_s *tree = _root_of(p->root);
+  _prepared_level_s *level;
+  _token_s *token;
+  int i;
+
+  /* In a concurrent tree, the levels are only safe to use if no
+   * segment was removed before the critical section began, which the
+   * generation confirms. */
+  _enter(tree);
+  if (p->generation != mqtt_topic_generation(p->root)) {
+    _prepared_resolve(p);
+  }
+
+  scratch_topic_set("");
+  for (i = 0; i < p->depth; ++i) {
+    level = &p->levels[i];
+    token = &p->tokens[i];
+    if (level->plus) {
+      scratch_topic_push_len("+", 1, (i == 0 ? 1 : 0));
+      _match_tokens(level->plus, token + 1, p->depth - i - 1, cb);
+      scratch_topic_pop();
+    }
+    if (level->hash) {
+      scratch_topic_push_len("#", 1, (i == 0 ? 1 : 0));
+      _report(cb, level->hash);
+      scratch_topic_pop();
+    }
+    if (level->literal == NULL) {
+      break;
+    }
+    scratch_topic_push_len(token->str, token->len, (i == 0 ? 1 : 0));
+  }
+
+  if (i == p->depth) {
+    _report(cb, p->levels[i - 1].literal);
+    if (p->hash) {
+      /* A # matches its parent topic. */
+      scratch_topic_push_len("#", 1, 0);
+      _report(cb, p->hash);
+    }
+  }
+  scratch_topic_set("");
+  _leave(tree);
+}
+
+struct mqtt_topic_pattern {
+  int depth;
+  _token_s *tokens;
+};
+
+mqtt_topic_pattern_s *mqtt_topic_pattern_compile(const char *pattern) {
+  mqtt_topic_pattern_s *p;
+  _token_s *tokens;
+  int depth = _topic_depth(pattern);
+
+  p = _tokenized_alloc(pattern, depth, sizeof(*p), &tokens);
+  if (p == NULL) {
+    return NULL;
+  }
+
+  p->depth = depth;
+  p->tokens = tokens;
+  return p;
+}
+
+void mqtt_topic_pattern_destroy(mqtt_topic_pattern_s *p) {
+  free(p);
+}
+
+void mqtt_topic_pattern_matching_iter(mqtt_topic_segment_s *root,
+                                      mqtt_topic_pattern_s *p,
+                                      mqtt_iter_cb_s *cb) {
+  mqtt_topic_root_s *tree = _root_of(root);
+
+  _enter(tree);
+  scratch_topic_set("");
+  _match_tokens(root, p->tokens, p->depth, cb);
+  _leave(tree);
+}
+
+/*
+ * Matching automata. A state stands for the set of segments that the
+ * levels of a literal topic read so far lead to, where a tree walk
+ * would follow each along its own branch: the literal child and the +
+ * child of every segment in the previous set. States are built the
+ * first time a topic reaches them and memoized, along with the
+ * transitions between them, so matching a topic takes one step per
+ * level once the states it passes through are known.
+ *
+ * A state records how many times the children of its members have
+ * changed as it is built. Once the tree changes, only the states
+ * whose members have had children added or removed since are
+ * dropped, along with those that can no longer be reached but
+ * through them, so a subscribe or unsubscribe costs the states
+ * around it rather than the whole automaton.
+ */
+
+/* The number of memoized states above which an automaton starts over
+ * on the next match, so that memory stays bounded. */
+#define AUTOMATON_MAX_STATES 4096
+
+/* How many matches a state must be used for, roughly, to pay for
+ * building it. */
+#define AUTOMATON_PAYBACK 2
+
+/* The number of buckets in the table of states. */
+#define AUTOMATON_BUCKETS 1024
+
+typedef struct _dfa_state _dfa_state_s;
+
+/**
+ * _dfa_edge_s is the transition out of a state on a literal that a
+ * member of the state has a child for. key is the string of such a
+ * child, which remains valid for as long as the state is kept.
+ */
+typedef struct _dfa_edge {
+  const char *key;
+  unsigned int len;
+  uint32_t hash;
+  /* NULL until the transition is first taken. */
+  _dfa_state_s *next;
+  /* Chains the edges of the state that lead somewhere. */
+  struct _dfa_edge *taken;
+} _dfa_edge_s;
+
+struct _dfa_state {
+  /* The segments of the set, sorted by address, followed by their +
+   * and # children. */
+  mqtt_topic_segment_s **members;
+  mqtt_topic_segment_s **pluses;
+  mqtt_topic_segment_s **hashes;
+  int n_members;
+  int n_pluses;
+  int n_hashes;
+
+  /* An open-addressed table of edges, with one slot more than mask,
+   * or NULL if no member has a literal child. */
+  _dfa_edge_s *edges;
+  uint32_t edges_mask;
+  _dfa_edge_s *taken;
+
+  /* The state reached on any other literal: the set of pluses. NULL
+   * until first needed. */
+  _dfa_state_s *other;
+
+  /* The children_changes of the members when the state was built. */
+  unsigned long *changes;
+
+  /* Chains the states in a bucket of the automaton. */
+  uint32_t hash;
+  _dfa_state_s *next;
+
+  /* Where _dfa_prune has got to with the state. */
+  enum { DFA_UNSEEN, DFA_SEEN, DFA_KEPT } mark;
+};
+
+struct mqtt_topic_automaton {
+  mqtt_topic_segment_s *root;
+
+  /* The tree generation the states were built against. */
+  unsigned long generation;
+
+  _dfa_state_s *buckets[AUTOMATON_BUCKETS];
+  int n_states;
+
+  /* The generation last seen by a match, how many matches have seen
+   * it, and how many saw each generation before it, on average. */
+  unsigned long seen;
+  int quiet, between;
+  /* How many states the last _dfa_prune dropped. */
+  int dropped;
+
+  /* The states a match passes through, one per level and one for the
+   * start, kept here to avoid allocating on every match. */
+  _dfa_state_s **path;
+  int path_size;
+};
+
+static uint32_t _dfa_hash_bytes(uint32_t hash, const void *p, size_t len) {
+  const unsigned char *b = p;
+
+  for (size_t i = 0; i < len; ++i) {
+    hash = (hash ^ b[i]) * 16777619u; /* FNV-1a */
+  }
+  return hash;
+}
+
+static int _dfa_cmp_ptr(const void *a, const void *b) {
+  uintptr_t pa = (uintptr_t)*(void *const *)a;
+  uintptr_t pb = (uintptr_t)*(void *const *)b;
+
+  return pa < pb ? -1 : pa > pb;
+}
+
+static void _dfa_state_free(_dfa_state_s *state) {
+  free(state->edges);
+  free(state);
+}
+
+/**
+ * _dfa_reset forgets every state of a.
+ */
+static void _dfa_reset(mqtt_topic_automaton_s *a) {
+  _dfa_state_s *state, *next;
+
+  for (int i = 0; i < AUTOMATON_BUCKETS; ++i) {
+    for (state = a->buckets[i]; state; state = next) {
+      next = state->next;
+      _dfa_state_free(state);
+    }
+    a->buckets[i] = NULL;
+  }
+  a->n_states = 0;
+}
+
+/**
+ * _dfa_edge returns the edge of state for key, which is len
+ * characters long and hashes to hash, or the empty slot where it
+ * belongs if there is none.
+ */
+static _dfa_edge_s *_dfa_edge(_dfa_state_s *state, const char *key,
+                              unsigned int len, uint32_t hash) {
+  _dfa_edge_s *edge = &state->edges[hash & state->edges_mask];
+
+  while (edge->key && !(edge->hash == hash && edge->len == len &&
+                        memcmp(edge->key, key, len) == 0)) {
+    edge = (edge == &state->edges[state->edges_mask] ? state->edges
+                                                    : edge + 1);
+  }
+  return edge;
+}
+
+/**
+ * _dfa_edges builds the table of edges of state, with one edge for
+ * every literal child of its members.
+ *
+ * Returns 0 on success, -1 if out of memory.
+ */
+static int _dfa_edges(_dfa_state_s *state) {
+  mqtt_topic_segment_s *child;
+  _child_iter_s it;
+  _dfa_edge_s *edge;
+  uint32_t size = 0, n = 0, added = 0, hash;
+
+  for (int pass = 0; pass < 2; ++pass) {
+    for (int i = 0; i < state->n_members; ++i) {
+      _child_iter_init(&it, state->members[i]);
+      while ((child = _child_iter_next(&it)) != NULL) {
+        if (child->len == 1 &&
+            (child->str[0] == '+' || child->str[0] == '#')) {
+          continue;
+        }
+        if (pass == 0) {
+          ++n;
+          continue;
+        }
+        if (added == n) {
+          /* Children were added since they were counted, which the
+           * changes of the member record, so this state will be
+           * dropped once the generation changes. */
+          break;
+        }
+        hash = mqtt_so_map_hash(child->str, child->len);
+        edge = _dfa_edge(state, child->str, child->len, hash);
+        if (edge->key == NULL) {
+          *edge = (_dfa_edge_s){
+            .key = child->str, .len = child->len, .hash = hash,
+          };
+          ++added;
+        }
+      }
+    }
+    if (pass == 0) {
+      if (n == 0) {
+        return 0;
+      }
+      /* At most half full. */
+      for (size = 2; size < 2 * n; size *= 2) {
+      }
+      state->edges = calloc(size, sizeof(_dfa_edge_s));
+      if (state->edges == NULL) {
+        return -1;
+      }
+      state->edges_mask = size - 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * _dfa_intern returns the state for the set of n segments in members,
+ * which must be sorted by address, building it if need be.
+ *
+ * Returns NULL if out of memory.
+ */
+static _dfa_state_s *_dfa_intern(mqtt_topic_automaton_s *a,
+                                 mqtt_topic_segment_s **members, int n) {
+  uint32_t hash = _dfa_hash_bytes(2166136261u, members, n * sizeof(*members));
+  _dfa_state_s **bucket = &a->buckets[hash % AUTOMATON_BUCKETS], *state;
+  mqtt_topic_segment_s *child;
+  int i;
+
+  for (state = *bucket; state; state = state->next) {
+    if (state->hash == hash && state->n_members == n &&
+        memcmp(state->members, members, n * sizeof(*members)) == 0) {
+      return state;
+    }
+  }
+
+  /* Every member has at most one + and one # child. */
+  state = calloc(1, sizeof(*state) + n * sizeof(*state->changes) +
+                        3 * n * sizeof(*members));
+  if (state == NULL) {
+    return NULL;
+  }
+  state->changes = (unsigned long *)(state + 1);
+  state->members = (mqtt_topic_segment_s **)(state->changes + n);
+  state->pluses = state->members + n;
+  state->hashes = state->pluses + n;
+  memcpy(state->members, members, n * sizeof(*members));
+  state->n_members = n;
+  /* The counts are read before the children they cover, so that any
+   * change the state misses shows in them. */
+  for (i = 0; i < n; ++i) {
+    state->changes[i] = atomic_load_explicit(&members[i]->children_changes,
+                                             memory_order_acquire);
+  }
+  for (i = 0; i < n; ++i) {
+    child = _child_segment(members[i], "+", 1);
+    if (child) {
+      state->pluses[state->n_pluses++] = child;
+    }
+    child = _child_segment(members[i], "#", 1);
+    if (child) {
+      state->hashes[state->n_hashes++] = child;
+    }
+  }
+  qsort(state->pluses, state->n_pluses, sizeof(*members), &_dfa_cmp_ptr);
+  if (_dfa_edges(state) != 0) {
+    _dfa_state_free(state);
+    return NULL;
+  }
+
+  state->hash = hash;
+  state->next = *bucket;
+  *bucket = state;
+  ++a->n_states;
+  return state;
+}
+
+/**
+ * _dfa_step returns the state that state leads to on the literal
+ * key, which is len characters long, building it if need be.
+ *
+ * Returns NULL if out of memory.
+ */
+static _dfa_state_s *_dfa_step(mqtt_topic_automaton_s *a,
+                               _dfa_state_s *state,
+                               const char *key, unsigned int len) {
+  mqtt_topic_segment_s **set, *child;
+  uint32_t hash;
+  _dfa_edge_s *edge = NULL;
+  int n = 0;
+
+  if (state->edges) {
+    hash = mqtt_so_map_hash(key, len);
+    edge = _dfa_edge(state, key, len, hash);
+    if (edge->key == NULL) {
+      edge = NULL;
+    } else if (edge->next) {
+      return edge->next;
+    }
+  }
+
+  if (edge == NULL) {
+    /* No member has a child for key, so only + children match. */
+    if (state->other == NULL) {
+      state->other = _dfa_intern(a, state->pluses, state->n_pluses);
+    }
+    return state->other;
+  }
+
+  set = malloc((state->n_members + state->n_pluses) * sizeof(*set));
+  if (set == NULL) {
+    return NULL;
+  }
+  for (int i = 0; i < state->n_members; ++i) {
+    child = _child_segment_hashed(state->members[i], key, len, hash);
+    if (child) {
+      set[n++] = child;
+    }
+  }
+  memcpy(set + n, state->pluses, state->n_pluses * sizeof(*set));
+  n += state->n_pluses;
+  qsort(set, n, sizeof(*set), &_dfa_cmp_ptr);
+  edge->next = _dfa_intern(a, set, n);
+  free(set);
+  if (edge->next) {
+    edge->taken = state->taken;
+    state->taken = edge;
+  }
+  return edge->next;
+}
+
+/**
+ * _dfa_unchanged returns 1 if no member of state has changed since
+ * the state was built.
+ */
+static int _dfa_unchanged(_dfa_state_s *state) {
+  for (int i = 0; i < state->n_members; ++i) {
+    if (atomic_load_explicit(&state->members[i]->children_changes,
+                             memory_order_acquire) != state->changes[i]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/**
+ * _dfa_seen marks state, if there is one and it is not yet marked,
+ * and pushes it on stack at depth.
+ */
+static void _dfa_seen(_dfa_state_s *state, _dfa_state_s **stack,
+                      int *depth) {
+  if (state && state->mark == DFA_UNSEEN) {
+    state->mark = DFA_SEEN;
+    stack[(*depth)++] = state;
+  }
+}
+
+/**
+ * _dfa_prune drops the states of a that have changed, and those that
+ * are only reached through them, once the tree generation changes.
+ * Kept states are reached from the start state through unchanged
+ * states only, so their members are still in the tree: a member of
+ * an unchanged state still has the children it had, and so on down.
+ * The members of other states may be gone, and are never read.
+ */
+static void _dfa_prune(mqtt_topic_automaton_s *a) {
+  uint32_t hash = _dfa_hash_bytes(2166136261u, &a->root, sizeof(a->root));
+  _dfa_state_s **stack, **link, *state;
+  _dfa_edge_s **h_edge, *edge;
+  int depth = 0;
+
+  a->dropped = 0;
+  if (a->n_states == 0) {
+    return;
+  }
+  stack = malloc(a->n_states * sizeof(*stack));
+  if (stack == NULL) {
+    _dfa_reset(a);
+    return;
+  }
+
+  for (state = a->buckets[hash % AUTOMATON_BUCKETS]; state;
+       state = state->next) {
+    if (state->n_members == 1 && state->members[0] == a->root) {
+      _dfa_seen(state, stack, &depth);
+    }
+  }
+  while (depth > 0) {
+    state = stack[--depth];
+    if (!_dfa_unchanged(state)) {
+      continue;
+    }
+    state->mark = DFA_KEPT;
+    for (edge = state->taken; edge; edge = edge->taken) {
+      _dfa_seen(edge->next, stack, &depth);
+    }
+    _dfa_seen(state->other, stack, &depth);
+  }
+  free(stack);
+
+  /* Transitions into dropped states are taken again from scratch. */
+  for (int b = 0; b < AUTOMATON_BUCKETS; ++b) {
+    for (state = a->buckets[b]; state; state = state->next) {
+      if (state->mark != DFA_KEPT) {
+        continue;
+      }
+      for (h_edge = &state->taken; (edge = *h_edge) != NULL; ) {
+        if (edge->next->mark == DFA_KEPT) {
+          h_edge = &edge->taken;
+        } else {
+          edge->next = NULL;
+          *h_edge = edge->taken;
+        }
+      }
+      if (state->other && state->other->mark != DFA_KEPT) {
+        state->other = NULL;
+      }
+    }
+  }
+  for (int b = 0; b < AUTOMATON_BUCKETS; ++b) {
+    for (link = &a->buckets[b]; (state = *link) != NULL; ) {
+      if (state->mark == DFA_KEPT) {
+        state->mark = DFA_UNSEEN;
+        link = &state->next;
+      } else {
+        *link = state->next;
+        _dfa_state_free(state);
+        --a->n_states;
+        ++a->dropped;
+      }
+    }
+  }
+}
+
+static void _dfa_report(mqtt_topic_segment_s **segments, int n,
+                        mqtt_iter_cb_s *cb) {
+  for (int i = 0; i < n; ++i) {
+    if (cb->fn) {
+      /* Results need no topic. */
+      scratch_topic_set_segment(segments[i]);
+    }
+    _report(cb, segments[i]);
+  }
+}
+
+mqtt_topic_automaton_s *mqtt_topic_automaton_create(
+    mqtt_topic_segment_s *root) {
+  mqtt_topic_automaton_s *a = calloc(1, sizeof(*a));
+
+  if (a == NULL) {
+    return NULL;
+  }
+  a->root = root;
+  a->generation = mqtt_topic_generation(root);
+  a->seen = a->generation;
+  return a;
+}
+
+void mqtt_topic_automaton_destroy(mqtt_topic_automaton_s *a) {
+  _dfa_reset(a);
+  free(a->path);
+  free(a);
+}
+
+/**
+ * _dfa_path runs a over the levels of topic, recording the states it
+ * passes through in a->path.
+ *
+ * Returns the number of states recorded, or -1 if out of memory.
+ */
+static int _dfa_path(mqtt_topic_automaton_s *a, const char *topic) {
+  int depth = _topic_depth(topic), n = 0;
+  const char *key = topic, *sep;
+  _dfa_state_s *state, **path;
+
+  if (depth + 1 > a->path_size) {
+    path = realloc(a->path, (depth + 1) * sizeof(*path));
+    if (path == NULL) {
+      return -1;
+    }
+    a->path = path;
+    a->path_size = depth + 1;
+  }
+
+  state = _dfa_intern(a, &a->root, 1);
+  while (state) {
+    a->path[n++] = state;
+    if (key == NULL || state->n_members == 0) {
+      return n;
+    }
+    sep = strchr(key, '/');
+    state = _dfa_step(a, state, key, sep ? sep - key : strlen(key));
+    key = sep ? sep + 1 : NULL;
+  }
+  return -1;
+}
+
+int mqtt_topic_automaton_matching_iter(mqtt_topic_automaton_s *a,
+                                       const char *topic,
+                                       mqtt_iter_cb_s *cb) {
+  mqtt_topic_root_s *tree = _root_of(a->root);
+  unsigned long generation;
+  _dfa_state_s *state;
+  char *copy;
+  int n, rc = 0;
+
+  _enter(tree);
+  if (strpbrk(topic, "+#")) {
+    /* Only literal topics are run through the automaton. */
+    goto walk;
+  }
+
+  /* Building a state costs about what the automaton saves on a couple
+   * of matches, so while the tree changes before the states each
+   * change drops would pay for themselves, it is walked instead. */
+  generation = mqtt_topic_generation(a->root);
+  if (generation != a->seen) {
+    a->between = (a->between + a->quiet) / 2;
+    a->quiet = 0;
+    a->seen = generation;
+  }
+  if (a->quiet < INT_MAX) {
+    ++a->quiet;
+  }
+  if (a->quiet < AUTOMATON_PAYBACK * a->dropped &&
+      a->between < AUTOMATON_PAYBACK * a->dropped) {
+    goto walk;
+  }
+
+  /* States hold segments, so they are only safe to use if no segment
+   * was removed before the critical section began. */
+  if (a->n_states > AUTOMATON_MAX_STATES) {
+    _dfa_reset(a);
+  } else if (generation != a->generation) {
+    _dfa_prune(a);
+  }
+  a->generation = generation;
+
+  n = _dfa_path(a, topic);
+  if (n < 0) {
+    goto walk;
+  }
+  /* The # children met on the way match the rest of the topic, and
+   * the members of the final state match the topic itself. */
+  for (int i = 0; i < n; ++i) {
+    state = a->path[i];
+    _dfa_report(state->hashes, state->n_hashes, cb);
+  }
+  state = a->path[n - 1];
+  if (n == _topic_depth(topic) + 1) {
+    _dfa_report(state->members, state->n_members, cb);
+  }
+  scratch_topic_set("");
+  goto exit;
+
+walk:
+  copy = strdup(topic);
+  if (copy == NULL) {
+    rc = -1;
     goto exit;
-  } else if (strcmp(next_segment, "#") == 0) {
-    if (root->parent /* i.e., this isn't the sentinel */) {
-      /* A # matches its parent topic. */
-      cb->fn(cb->data, scratch_topic, root);
+  }
+  scratch_topic_set("");
+  _matching_iter(a->root, copy, cb);
+  free(copy);
+
+exit:
+  _leave(tree);
+  return rc;
+}
+
+int mqtt_topic_covers(const char *a, const char *b) {
+  size_t la, lb;
+  int first = 1;
+
+  while (a != NULL) {
+    la = strcspn(a, "/");
+    if (la == 1 && a[0] == '#') {
+      /* A # covers its parent topic and everything below it, but not
+       * $-prefixed topics at the first level. */
+      return b == NULL || !first || b[0] != '$';
+    }
+    if (b == NULL) {
+      return 0;
     }
+    lb = strcspn(b, "/");
+    if (lb == 1 && b[0] == '#') {
+      /* Only a # covers a #. At the first level, where a # has no
+       * parent topic to match, so does a +/#. */
+      return first && strcmp(a, "+/#") == 0;
+    }
+    if (la == 1 && a[0] == '+') {
+      if (first && b[0] == '$') {
+        return 0;
+      }
+    } else if (la != lb || memcmp(a, b, la) != 0) {
+      return 0;
+    }
+    a = a[la] ? a + la + 1 : NULL;
+    b = b[lb] ? b + lb + 1 : NULL;
+    first = 0;
+  }
+  return b == NULL;
+}
 
-    /* Call the callback for all segments below this level. */
-    _red_black_cb_all(root->children, root->children->root,
-                      (root->parent == NULL ? 1 : 0), 1, cb);
-    goto exit;
+/**
+ * _covering_iter calls cb for every segment below root that
+ * terminates a filter covering filter, the rest of the filter being
+ * matched at root.
+ */
+static void _covering_iter(mqtt_topic_segment_s *root, char *filter,
+                           mqtt_iter_cb_s *cb) {
+  int first = (root->parent == NULL ? 1 : 0);
+  mqtt_topic_segment_s *child;
+  char *rest, *sep;
+
+  child = _child_segment(root, "#", 1);
+  if (child && !(first && filter != NULL && filter[0] == '$')) {
+    scratch_topic_push("#", first);
+    _report(cb, child);
+    scratch_topic_pop();
+  }
+  if (filter == NULL) {
+    _report(cb, root);
+    return;
+  }
+
+  sep = strchr(filter, '/');
+  if (sep == NULL) {
+    rest = NULL;
   } else {
-    /* Check for wildcard topics, which also match pattern. */
-    child = RBExactQuery(root->children, "+");
+    *sep = '\0';
+    rest = sep + 1;
+  }
+
+  if (strcmp(filter, "#") == 0) {
+    /* Besides the # child, already reported, only a +/# at the
+     * first level covers a #. */
+    child = first ? _child_segment(root, "+", 1) : NULL;
+    if (child && (child = _child_segment(child, "#", 1)) != NULL) {
+      scratch_topic_push("+", first);
+      scratch_topic_push("#", 0);
+      _report(cb, child);
+      scratch_topic_pop();
+      scratch_topic_pop();
+    }
+    goto exit;
+  }
+  if (!first || filter[0] != '$') {
+    child = _child_segment(root, "+", 1);
     if (child) {
-      scratch_topic_push("+", (root->parent == NULL ? 1 : 0));
-      mqtt_topic_matching_iter((mqtt_topic_segment_s *)child->info, rest, cb);
+      scratch_topic_push("+", first);
+      _covering_iter(child, rest, cb);
       scratch_topic_pop();
     }
-    child = RBExactQuery(root->children, "#");
+  }
+  if (strcmp(filter, "+") != 0) {
+    child = _child_segment(root, filter, strlen(filter));
     if (child) {
-      scratch_topic_push("#", (root->parent == NULL ? 1 : 0));
-      cb->fn(cb->data, scratch_topic, child->info);
+      scratch_topic_push(filter, first);
+      _covering_iter(child, rest, cb);
       scratch_topic_pop();
     }
   }
 
-  child = RBExactQuery(root->children, next_segment);
-  if (child) {
-    scratch_topic_push(next_segment, (root->parent == NULL ? 1 : 0));
-    mqtt_topic_matching_iter((mqtt_topic_segment_s *)child->info, rest, cb);
-    scratch_topic_pop();
+exit:
+  if (sep) {
+    *sep = '/';
+  }
+}
+
+/**
+ * _covered_iter calls cb for every segment below root that terminates
+ * a filter covered by filter, the rest of the filter being matched at
+ * root.
+ */
+static void _covered_iter(mqtt_topic_segment_s *root, char *filter,
+                          mqtt_iter_cb_s *cb) {
+  int first = (root->parent == NULL ? 1 : 0);
+  mqtt_topic_segment_s *child;
+  char *rest, *sep;
+  _child_iter_s it;
+
+  if (filter == NULL) {
+    _report(cb, root);
+    return;
+  }
+
+  sep = strchr(filter, '/');
+  if (sep == NULL) {
+    rest = NULL;
+  } else {
+    *sep = '\0';
+    rest = sep + 1;
+  }
+
+  if (strcmp(filter, "#") == 0) {
+    if (!first) {
+      _report(cb, root);
+    }
+    _children_cb_all(root, first, 1, cb);
+  } else if (strcmp(filter, "+") == 0) {
+    /* A + covers every level but a #, which spans several. */
+    _child_iter_init(&it, root);
+    while ((child = _child_iter_next(&it)) != NULL) {
+      if ((child->len == 1 && child->str[0] == '#') ||
+          (first && child->str[0] == '$')) {
+        continue;
+      }
+      scratch_topic_push_len(child->str, child->len, first);
+      _covered_iter(child, rest, cb);
+      scratch_topic_pop();
+    }
+  } else {
+    child = _child_segment(root, filter, strlen(filter));
+    if (child) {
+      scratch_topic_push(filter, first);
+      _covered_iter(child, rest, cb);
+      scratch_topic_pop();
+    }
+  }
+
+  if (sep) {
+    *sep = '/';
+  }
+}
+
+void mqtt_topic_covering_iter(mqtt_topic_segment_s *root, char *filter,
+                              mqtt_iter_cb_s *cb) {
+  mqtt_topic_root_s *tree = _root_of(root);
+
+  _enter(tree);
+  scratch_topic_set("");
+  _covering_iter(root, filter, cb);
+  _leave(tree);
+}
+
+void mqtt_topic_covered_iter(mqtt_topic_segment_s *root, char *filter,
+                             mqtt_iter_cb_s *cb) {
+  mqtt_topic_root_s *tree = _root_of(root);
+
+  _enter(tree);
+  scratch_topic_set("");
+  _covered_iter(root, filter, cb);
+  _leave(tree);
+}
+
+typedef struct {
+  mqtt_topic_segment_s *self;
+  const char *topic;
+  int redundant;
+} _cover_check_s;
+
+/**
+ * _cover_check is called for every filter covering the one being
+ * checked. Two distinct filters may cover each other, as # and +/#
+ * do; of those, only the segment with the lower address is kept.
+ */
+static void _cover_check(void *data, char *topic,
+                         mqtt_topic_segment_s *segment) {
+  _cover_check_s *c = data;
+
+  if (segment == c->self || segment->data == NULL || c->redundant) {
+    return;
+  }
+  if (!mqtt_topic_covers(c->topic, topic) ||
+      (uintptr_t)segment < (uintptr_t)c->self) {
+    c->redundant = 1;
+  }
+}
+
+int mqtt_topic_minimal_cover(mqtt_topic_segment_s *root, mqtt_iter_cb_s *cb) {
+  mqtt_topic_root_s *tree = _root_of(root);
+  mqtt_topic_results_s all;
+  mqtt_iter_cb_s collect = mqtt_topic_results_cb(&all), check;
+  _cover_check_s c;
+  char *buf;
+  int rc = 0;
+
+  mqtt_topic_results_init(&all);
+  buf = malloc(2 * MAX_TOPIC_LENGTH);
+  if (buf == NULL) {
+    return -1;
+  }
+
+  _enter(tree);
+  scratch_topic_set("");
+  _children_cb_all(root, 1, 0, &collect);
+  if (all.failed) {
+    rc = -1;
     goto exit;
   }
 
+  /* Each filter is checked against the filters covering it, matched
+   * on a copy since the walk splits it in place. */
+  check = (mqtt_iter_cb_s){ .data = &c, .fn = &_cover_check };
+  for (int i = 0; i < all.count; ++i) {
+    if (all.segments[i]->data == NULL) {
+      continue;
+    }
+    scratch_topic_set_segment(all.segments[i]);
+    strcpy(buf, scratch_topic);
+    strcpy(buf + MAX_TOPIC_LENGTH, scratch_topic);
+    c = (_cover_check_s){ .self = all.segments[i], .topic = buf };
+    scratch_topic_set("");
+    _covering_iter(root, buf + MAX_TOPIC_LENGTH, &check);
+    if (!c.redundant) {
+      scratch_topic_set_segment(all.segments[i]);
+      _report(cb, all.segments[i]);
+    }
+  }
+  scratch_topic_set("");
+
 exit:
+  _leave(tree);
+  mqtt_topic_results_free(&all);
+  free(buf);
+  return rc;
+}
+
+/**
+ * _fused_tree_s is the state of one tree walked by a fused match: the
+ * segments matching the levels walked so far.
+ */
+typedef struct {
+  mqtt_topic_segment_s *root;
+  mqtt_iter_cb_s *cb;
+  int gate;
+  int granted;
+
+  /* Gates are walked from the first level, the other trees only once
+   * every gate has granted. */
+  int walking;
+  mqtt_topic_results_s frontier;
+  mqtt_topic_results_s next;
+} _fused_tree_s;
+
+struct mqtt_topic_fused {
+  _fused_tree_s *trees;
+  int n;
+
+  /* The number of gates that have not granted yet. */
+  int waiting;
+};
+
+mqtt_topic_fused_s *mqtt_topic_fused_create(void) {
+  return calloc(1, sizeof(mqtt_topic_fused_s));
+}
+
+void mqtt_topic_fused_destroy(mqtt_topic_fused_s *f) {
+  for (int i = 0; i < f->n; ++i) {
+    mqtt_topic_results_free(&f->trees[i].frontier);
+    mqtt_topic_results_free(&f->trees[i].next);
+  }
+  free(f->trees);
+  free(f);
+}
+
+int mqtt_topic_fused_add(mqtt_topic_fused_s *f, mqtt_topic_segment_s *root,
+                         mqtt_iter_cb_s *cb, int gate) {
+  _fused_tree_s *trees;
+
+  trees = realloc(f->trees, (f->n + 1) * sizeof(*trees));
+  if (trees == NULL) {
+    return -1;
+  }
+  f->trees = trees;
+  memset(&trees[f->n], 0, sizeof(*trees));
+  trees[f->n].root = root;
+  trees[f->n].cb = cb;
+  trees[f->n].gate = gate != 0;
+  ++f->n;
+  return 0;
+}
+
+/**
+ * _fused_report reports a match in tree t. A match with data in a gate
+ * grants it.
+ */
+static void _fused_report(mqtt_topic_fused_s *f, _fused_tree_s *t,
+                          mqtt_topic_segment_s *s) {
+  if (t->gate && !t->granted && _data(s) != NULL) {
+    t->granted = 1;
+    --f->waiting;
+  }
+  if (t->cb == NULL) {
+    return;
+  }
+  if (t->cb->fn) {
+    scratch_topic_set_segment(s);
+  }
+  _report(t->cb, s);
+}
+
+/**
+ * _fused_level moves tree t past the level key, whose mqtt_so_map_hash
+ * is hash, reporting the # children met on the way, as _matching_iter
+ * does.
+ */
+static void _fused_level(mqtt_topic_fused_s *f, _fused_tree_s *t,
+                         const char *key, unsigned int len, uint32_t hash) {
+  mqtt_topic_results_s swap;
+  mqtt_topic_segment_s *s, *child;
+
+  mqtt_topic_results_clear(&t->next);
+  for (int i = 0; i < t->frontier.count; ++i) {
+    s = t->frontier.segments[i];
+    child = _child_segment(s, "#", 1);
+    if (child) {
+      _fused_report(f, t, child);
+    }
+    child = _child_segment(s, "+", 1);
+    if (child) {
+      _results_push(&t->next, child);
+    }
+    child = _child_segment_hashed(s, key, len, hash);
+    if (child) {
+      _results_push(&t->next, child);
+    }
+  }
+  swap = t->frontier;
+  t->frontier = t->next;
+  t->next = swap;
+}
+
+/**
+ * _fused_catch_up starts walking tree t, which waited for the gates to
+ * grant, moving it past the levels of topic up to end.
+ */
+static void _fused_catch_up(mqtt_topic_fused_s *f, _fused_tree_s *t,
+                            const char *topic, const char *end) {
+  const char *key = topic, *sep;
+
+  t->walking = 1;
+  while (t->frontier.count > 0) {
+    sep = strchr(key, '/');
+    if (sep == NULL || sep > end) {
+      sep = end;
+    }
+    _fused_level(f, t, key, sep - key, mqtt_so_map_hash(key, sep - key));
+    if (sep == end) {
+      break;
+    }
+    key = sep + 1;
+  }
+}
+
+int mqtt_topic_fused_matching_iter(mqtt_topic_fused_s *f, char *topic) {
+  char *key = topic, *sep;
+  mqtt_topic_segment_s *s, *child;
+  _fused_tree_s *t;
+  unsigned int len;
+  uint32_t hash;
+  int active, rc = 0;
+
+  f->waiting = 0;
+  for (int i = 0; i < f->n; ++i) {
+    f->waiting += f->trees[i].gate;
+  }
+  for (int i = 0; i < f->n; ++i) {
+    t = &f->trees[i];
+    _enter(_root_of(t->root));
+    t->granted = 0;
+    t->walking = t->gate || f->waiting == 0;
+    mqtt_topic_results_clear(&t->frontier);
+    mqtt_topic_results_clear(&t->next);
+    _results_push(&t->frontier, t->root);
+  }
+
+  /* The trees being walked are moved one level at a time, so the
+   * topic is split and each level hashed once for all of them. The
+   * other trees wait for the gates, so that an unauthorized publish
+   * costs no routing walk at all, and catch up once they grant. */
+  for (;;) {
+    sep = strchr(key, '/');
+    if (sep) {
+      *sep = '\0';
+    }
+    len = sep ? sep - key : strlen(key);
+    hash = mqtt_so_map_hash(key, len);
+    active = 0;
+    for (int i = 0; i < f->n; ++i) {
+      t = &f->trees[i];
+      if (!t->walking || t->frontier.count == 0) {
+        continue;
+      }
+      _fused_level(f, t, key, len, hash);
+      if (t->gate && !t->granted && t->frontier.count == 0) {
+        rc = 1;
+      }
+      active |= t->frontier.count > 0;
+    }
+    for (int i = 0; i < f->n && rc == 0 && f->waiting == 0; ++i) {
+      t = &f->trees[i];
+      if (!t->walking) {
+        _fused_catch_up(f, t, topic, key + len);
+        active |= t->frontier.count > 0;
+      }
+    }
+    if (sep) {
+      *sep = '/';
+    }
+    if (rc != 0 || !active || sep == NULL) {
+      break;
+    }
+    key = sep + 1;
+  }
+
+  /* The segments reached match the topic itself, as do their #
+   * children. The gates go first, as this may yet grant them. */
+  for (int gate = 1; gate >= 0 && rc == 0; --gate) {
+    for (int i = 0; i < f->n; ++i) {
+      t = &f->trees[i];
+      if (t->gate != gate || (!t->walking && f->waiting > 0)) {
+        continue;
+      }
+      if (!t->walking) {
+        _fused_catch_up(f, t, topic, key + len);
+      }
+      for (int j = 0; j < t->frontier.count; ++j) {
+        s = t->frontier.segments[j];
+        _fused_report(f, t, s);
+        child = _child_segment(s, "#", 1);
+        if (child) {
+          _fused_report(f, t, child);
+        }
+      }
+    }
+  }
+  if (rc == 0 && f->waiting > 0) {
+    rc = 1;
+  }
+
+  for (int i = 0; i < f->n; ++i) {
+    t = &f->trees[i];
+    if (t->frontier.failed || t->next.failed) {
+      rc = -1;
+    }
+    _leave(_root_of(t->root));
+  }
+  scratch_topic_set("");
+  return rc;
+}
+
+typedef struct {
+  char *topic;
+  mqtt_topic_span_s *spans;
+  int max_spans;
+  int n_spans;
+} _best_s;
+
+/**
+ * _best_bind binds the next wildcard of the pattern being tried to
+ * the len characters at key.
+ */
+static void _best_bind(_best_s *b, int n, const char *key, size_t len) {
+  if (n < b->max_spans) {
+    b->spans[n].offset = key - b->topic;
+    b->spans[n].len = len;
+  }
+}
+
+/**
+ * _best_match tries the children of s against the levels of the topic
+ * from key on, most specific first, with n wildcards bound so far. key
+ * is NULL once every level has been matched.
+ */
+static mqtt_topic_segment_s *_best_match(_best_s *b, mqtt_topic_segment_s *s,
+                                         char *key, int n) {
+  int first = (s->parent == NULL ? 1 : 0);
+  mqtt_topic_segment_s *child, *found = NULL;
+  char *sep;
+
+  if (key == NULL) {
+    if (_data(s)) {
+      b->n_spans = n;
+      return s;
+    }
+    /* A # matches its parent topic, binding nothing. */
+    child = _child_segment(s, "#", 1);
+    if (child && _data(child)) {
+      _best_bind(b, n, b->topic + strlen(b->topic), 0);
+      b->n_spans = n + 1;
+      return child;
+    }
+    return NULL;
+  }
+
+  sep = strchr(key, '/');
+  if (sep) {
+    *sep = '\0';
+  }
+  child = _child_segment(s, key, strlen(key));
+  if (child) {
+    found = _best_match(b, child, sep ? sep + 1 : NULL, n);
+  }
+  if (found == NULL && (!first || key[0] != '$')) {
+    child = _child_segment(s, "+", 1);
+    if (child) {
+      _best_bind(b, n, key, strlen(key));
+      found = _best_match(b, child, sep ? sep + 1 : NULL, n + 1);
+    }
+  }
   if (sep) {
     *sep = '/';
   }
+  if (found == NULL && (!first || key[0] != '$')) {
+    child = _child_segment(s, "#", 1);
+    if (child && _data(child)) {
+      _best_bind(b, n, key, strlen(key));
+      b->n_spans = n + 1;
+      found = child;
+    }
+  }
+  return found;
 }
 
-void mqtt_topic_iter(mqtt_topic_segment_s *root, mqtt_iter_cb_s *cb) {
-  _red_black_cb_all(root->children, root->children->root,
-                    1, 0, cb);
+mqtt_topic_segment_s *mqtt_topic_best_match(mqtt_topic_segment_s *root,
+                                            char *topic,
+                                            mqtt_topic_span_s *spans,
+                                            int max_spans, int *h_n_spans) {
+  mqtt_topic_root_s *tree = _root_of(root);
+  _best_s b = { .topic = topic, .spans = spans, .max_spans = max_spans };
+  mqtt_topic_segment_s *found;
+
+  _enter(tree);
+  found = _best_match(&b, root, topic, 0);
+  _leave(tree);
+  *h_n_spans = found ? b.n_spans : 0;
+  return found;
+}
+
+/* The number of lookups mqtt_topic_find_many keeps in flight. */
+#define FIND_GROUP 16
+
+/*
+ * The phases of a lookup in flight. Each phase reads memory that the
+ * previous one prefetched, and prefetches what the next one reads.
+ */
+enum {
+  FIND_LEVEL, /* s is loaded; pick how its children are kept */
+  FIND_NODE,  /* the segment of node is prefetched */
+  FIND_ARRAY, /* array, the children array of s, is prefetched */
+  FIND_HIT,   /* the child at hit in array is prefetched */
+};
+
+/**
+ * _find_s is a lookup in flight: the level key of the topic being
+ * looked for among the children of s, and where in their tree.
+ */
+typedef struct {
+  int index;
+  int phase;
+  char *key;
+  unsigned int len;
+  mqtt_topic_segment_s *s;
+  mqtt_rb_node_s *node;
+  _child_array_s *array;
+  int hit;
+  uint8_t fp;
+} _find_s;
+
+static void _find_start(_find_s *f, int index, mqtt_topic_segment_s *s,
+                        char *key) {
+  char *sep = strchr(key, '/');
+
+  f->index = index;
+  f->phase = FIND_LEVEL;
+  f->s = s;
+  f->key = key;
+  f->len = sep ? sep - key : strlen(key);
+}
+
+/**
+ * _find_step moves a lookup on by one phase, storing its result in
+ * *h_segment once it is over.
+ *
+ * Returns 1 if the lookup is over, 0 otherwise.
+ */
+static int _find_step(_find_s *f, mqtt_topic_segment_s **h_segment) {
+  mqtt_topic_segment_s *child = NULL;
+  mqtt_so_map_s *map;
+  int cmp;
+
+  switch (f->phase) {
+  case FIND_LEVEL:
+    map = atomic_load(&f->s->wide);
+    if (map) {
+      child = _map_segment(mqtt_so_map_find(map, f->key, f->len));
+      goto found;
+    }
+    f->array = atomic_load_explicit(&f->s->child_array, memory_order_acquire);
+    if (f->array) {
+      f->fp = _fingerprint(f->key, f->len);
+      __builtin_prefetch(f->array);
+      __builtin_prefetch(f->array->fps + FP_GROUP);
+      f->phase = FIND_ARRAY;
+      return 0;
+    }
+    f->node = mqtt_rb_root(&f->s->children);
+    goto next;
+
+  case FIND_ARRAY:
+    f->hit = -1;
+    /* Fall through. */
+  case FIND_HIT:
+    if (f->hit >= 0 &&
+        _key_cmp(f->array->children[f->hit], f->key, f->len) == 0) {
+      child = f->array->children[f->hit];
+      goto found;
+    }
+    f->hit = _array_hit(f->array, f->fp, f->hit + 1);
+    if (f->hit < 0) {
+      goto found;
+    }
+    __builtin_prefetch(f->array->children[f->hit]);
+    f->phase = FIND_HIT;
+    return 0;
+
+  case FIND_NODE:
+    cmp = _key_cmp(_rb_segment(f->node), f->key, f->len);
+    if (cmp == 0) {
+      child = _rb_segment(f->node);
+      goto found;
+    }
+    f->node = cmp > 0 ? mqtt_rb_left(f->node) : mqtt_rb_right(f->node);
+    goto next;
+  }
+
+next:
+  if (f->node == NULL) {
+    goto found;
+  }
+  /* Nodes are part of their segments, so the links and short keys
+   * arrive together. */
+  __builtin_prefetch(_rb_segment(f->node));
+  f->phase = FIND_NODE;
+  return 0;
+
+found:
+  if (child == NULL || f->key[f->len] == '\0') {
+    *h_segment = child;
+    return 1;
+  }
+  /* child was just compared, so it is loaded and the next level can
+   * start at once. */
+  _find_start(f, f->index, child, f->key + f->len + 1);
+  return _find_step(f, h_segment);
+}
+
+int mqtt_topic_find_many(mqtt_topic_segment_s *root, char **topics, int n,
+                         mqtt_topic_segment_s **h_segments) {
+  mqtt_topic_root_s *tree = _root_of(root);
+  _find_s group[FIND_GROUP];
+  int next = 0, active = 0, found = 0;
+
+  if (tree->concurrent) {
+    /* Reads must be validated against concurrent writers, which
+     * cannot be done a phase at a time. */
+    for (int i = 0; i < n; ++i) {
+      found += mqtt_topic_find_or_add(&h_segments[i], root, topics[i], 0) == 0;
+    }
+    return found;
+  }
+
+  for (int i = 0; i < FIND_GROUP; ++i) {
+    if (next < n) {
+      _find_start(&group[i], next++, root, topics[i]);
+      ++active;
+    } else {
+      group[i].index = -1;
+    }
+  }
+
+  /* Each pass moves every lookup on by one phase, so the memory each
+   * one prefetched has the rest of the pass to arrive. */
+  while (active > 0) {
+    for (int i = 0; i < FIND_GROUP; ++i) {
+      if (group[i].index < 0 ||
+          !_find_step(&group[i], &h_segments[group[i].index])) {
+        continue;
+      }
+      found += h_segments[group[i].index] != NULL;
+      if (next < n) {
+        _find_start(&group[i], next, root, topics[next]);
+        ++next;
+      } else {
+        group[i].index = -1;
+        --active;
+      }
+    }
+  }
+  return found;
 }
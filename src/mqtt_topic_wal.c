@@ -0,0 +1,756 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "mqtt_topic_wal.h"
+
+/* Appends write the buffer out once it holds this much, so that the
+ * memory held by uncommitted records stays bounded. Checkpoints write
+ * their snapshot in pieces of the same size. */
+#define FLUSH_SIZE (1 << 20)
+
+/* Replay reads the log in pieces of this size. */
+#define READ_SIZE (1 << 20)
+
+/* Replay reuses the segments of up to this many levels of the
+ * previous record's topic. */
+#define PATH_DEPTH 32
+
+/* Records are a type byte, the lengths of the topic and payload as
+ * varints, the topic and payload themselves, then a CRC-32C of all
+ * that. */
+#define VARINT_MAX 10
+#define HEADER_MAX (1 + 2 * VARINT_MAX)
+#define CRC_SIZE 4
+
+/* Lengths beyond these can only come from a corrupt record. */
+#define MAX_TOPIC_SIZE 65535
+#define MAX_PAYLOAD_SIZE (1ul << 30)
+
+typedef struct {
+  unsigned char *data;
+  size_t len;
+  size_t capacity;
+} _buf_s;
+
+struct mqtt_topic_wal {
+  int fd;
+  char *snap_path;
+  char *tmp_path;
+
+  /* Protects everything below. */
+  pthread_mutex_t lock;
+  pthread_cond_t committed;
+
+  /* Records appended since the last write. */
+  _buf_s pending;
+
+  /* The buffer last written by a committer, kept for reuse. */
+  _buf_s spare;
+
+  /* Sequence numbers of the last record appended and of the last one
+   * known to be on disk. */
+  unsigned long appended;
+  unsigned long durable;
+
+  /* Set while a committer or a checkpoint writes. */
+  int committing;
+  int failed;
+};
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void _crc_init(void) {
+  uint32_t c;
+
+  for (uint32_t i = 0; i < 256; ++i) {
+    c = i;
+    for (int k = 0; k < 8; ++k) {
+      c = (c & 1) ? 0x82f63b78u ^ (c >> 1) : c >> 1;
+    }
+    crc_table[i] = c;
+  }
+}
+
+static uint32_t _crc(const unsigned char *p, size_t len) {
+  uint32_t c = ~0u;
+
+  while (len--) {
+    c = crc_table[(c ^ *p++) & 0xff] ^ (c >> 8);
+  }
+  return ~c;
+}
+
+/**
+ * _buf_reserve makes room for n more bytes in b.
+ *
+ * Returns 0 on success, -1 if out of memory.
+ */
+static int _buf_reserve(_buf_s *b, size_t n) {
+  size_t capacity = b->capacity ? b->capacity : 256;
+  unsigned char *data;
+
+  if (b->len + n <= b->capacity) {
+    return 0;
+  }
+  while (capacity < b->len + n) {
+    capacity *= 2;
+  }
+  data = realloc(b->data, capacity);
+  if (data == NULL) {
+    return -1;
+  }
+  b->data = data;
+  b->capacity = capacity;
+  return 0;
+}
+
+static size_t _varint_put(unsigned char *p, size_t v) {
+  size_t n = 0;
+
+  while (v >= 0x80) {
+    p[n++] = (v & 0x7f) | 0x80;
+    v >>= 7;
+  }
+  p[n++] = v;
+  return n;
+}
+
+/**
+ * _varint_get decodes a varint from the bytes in [p, end).
+ *
+ * Returns the number of bytes it takes, 0 if it is incomplete, or -1
+ * if it is too long to be valid.
+ */
+static int _varint_get(const unsigned char *p, const unsigned char *end,
+                       size_t *v) {
+  size_t value = 0;
+
+  for (int n = 0; n < VARINT_MAX; ++n) {
+    if (p + n == end) {
+      return 0;
+    }
+    value |= (size_t)(p[n] & 0x7f) << (7 * n);
+    if (!(p[n] & 0x80)) {
+      *v = value;
+      return n + 1;
+    }
+  }
+  return -1;
+}
+
+/**
+ * _encode appends a record to b.
+ *
+ * Returns 0 on success, -1 if out of memory.
+ */
+static int _encode(_buf_s *b, int type, const char *topic, size_t topic_len,
+                   const void *payload, size_t len) {
+  unsigned char *record;
+  uint32_t crc;
+  size_t n;
+
+  if (_buf_reserve(b, HEADER_MAX + topic_len + len + CRC_SIZE) != 0) {
+    return -1;
+  }
+  record = b->data + b->len;
+  n = 0;
+  record[n++] = type;
+  n += _varint_put(record + n, topic_len);
+  n += _varint_put(record + n, len);
+  memcpy(record + n, topic, topic_len);
+  n += topic_len;
+  if (len > 0) {
+    memcpy(record + n, payload, len);
+    n += len;
+  }
+  crc = _crc(record, n);
+  for (int i = 0; i < CRC_SIZE; ++i) {
+    record[n++] = crc >> (8 * i);
+  }
+  b->len += n;
+  return 0;
+}
+
+typedef struct {
+  int type;
+  const char *topic;
+  size_t topic_len;
+  const unsigned char *payload;
+  size_t len;
+} _record_s;
+
+/**
+ * _decode decodes the record at the start of [p, end).
+ *
+ * Returns the number of bytes it takes, 0 if it is incomplete, or -1
+ * if it is corrupt.
+ */
+static long _decode(const unsigned char *p, const unsigned char *end,
+                    _record_s *rec) {
+  const unsigned char *q = p + 1;
+  uint32_t crc = 0;
+  int n;
+
+  if (p == end) {
+    return 0;
+  }
+  rec->type = p[0];
+  if (rec->type < MQTT_TOPIC_WAL_ADD || rec->type > MQTT_TOPIC_WAL_REMOVE) {
+    return -1;
+  }
+  if ((n = _varint_get(q, end, &rec->topic_len)) <= 0) {
+    return n;
+  }
+  q += n;
+  if ((n = _varint_get(q, end, &rec->len)) <= 0) {
+    return n;
+  }
+  q += n;
+  if (rec->topic_len > MAX_TOPIC_SIZE || rec->len > MAX_PAYLOAD_SIZE) {
+    return -1;
+  }
+  if ((size_t)(end - q) < rec->topic_len + rec->len + CRC_SIZE) {
+    return 0;
+  }
+  rec->topic = (const char *)q;
+  rec->payload = q + rec->topic_len;
+  q += rec->topic_len + rec->len;
+  for (int i = 0; i < CRC_SIZE; ++i) {
+    crc |= (uint32_t)q[i] << (8 * i);
+  }
+  if (crc != _crc(p, q - p)) {
+    return -1;
+  }
+  return q + CRC_SIZE - p;
+}
+
+static int _write_all(int fd, const unsigned char *p, size_t len) {
+  ssize_t n;
+
+  while (len > 0) {
+    n = write(fd, p, len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/**
+ * _replay_s is the state of a replay. It keeps the segments along the
+ * previous record's topic, so that a record for a nearby topic only
+ * looks up the levels that differ.
+ */
+typedef struct {
+  mqtt_topic_segment_s *root;
+  const mqtt_topic_wal_codec_s *codec;
+
+  /* The topics of the current and previous records. */
+  _buf_s topic;
+  _buf_s prev;
+
+  /* path[i] is the segment for level i of prev, for the first depth
+   * levels. */
+  mqtt_topic_segment_s *path[PATH_DEPTH];
+  int depth;
+} _replay_s;
+
+static void _release(_replay_s *r, void *value) {
+  if (value && r->codec->release) {
+    r->codec->release(r->codec->data, value);
+  }
+}
+
+/**
+ * _replay_segment finds or adds the segment for topic, starting from
+ * the deepest level it shares with the previous topic.
+ *
+ * Returns 0 on success, -1 if out of memory.
+ */
+static int _replay_segment(_replay_s *r, char *topic,
+                           mqtt_topic_segment_s **h_segment) {
+  const char *prev = (const char *)r->prev.data;
+  mqtt_topic_segment_s *segment;
+  int shared = 0, depth;
+  size_t start = 0;
+  char a, b;
+  int rc;
+
+  for (size_t i = 0; shared < r->depth; ++i) {
+    a = prev[i];
+    b = topic[i];
+    if ((a == '\0' || a == '/') && (b == '\0' || b == '/')) {
+      ++shared;
+      if (b == '\0') {
+        /* topic is an ancestor of prev, or prev itself. */
+        *h_segment = r->path[shared - 1];
+        r->depth = shared;
+        return 0;
+      }
+      start = i + 1;
+      if (a == '\0') {
+        break;
+      }
+    } else if (a != b) {
+      break;
+    }
+  }
+
+  rc = mqtt_topic_find_or_add(&segment, shared ? r->path[shared - 1] : r->root,
+                              topic + start, 1);
+  if (rc != 0) {
+    return rc;
+  }
+
+  depth = shared + 1;
+  for (const char *c = topic + start; *c; ++c) {
+    depth += (*c == '/');
+  }
+  *h_segment = segment;
+  for (int level = depth; level > shared; --level) {
+    if (level <= PATH_DEPTH) {
+      r->path[level - 1] = segment;
+    }
+    segment = segment->parent;
+  }
+  r->depth = depth < PATH_DEPTH ? depth : PATH_DEPTH;
+  return 0;
+}
+
+/**
+ * _replay_record applies a record to the tree.
+ *
+ * Returns 0 on success, -1 if out of memory.
+ */
+static int _replay_record(_replay_s *r, const _record_s *rec) {
+  mqtt_topic_segment_s *segment;
+  void *value = NULL;
+  _buf_s swap;
+  int rc;
+
+  r->topic.len = 0;
+  if (_buf_reserve(&r->topic, rec->topic_len + 1) != 0) {
+    return -1;
+  }
+  memcpy(r->topic.data, rec->topic, rec->topic_len);
+  r->topic.data[rec->topic_len] = '\0';
+
+  if (rec->type == MQTT_TOPIC_WAL_REMOVE) {
+    /* Removal may free segments on the cached path. */
+    r->depth = 0;
+    if (mqtt_topic_find_or_add(&segment, r->root, (char *)r->topic.data,
+                               0) != 0) {
+      return 0;
+    }
+    _release(r, segment->data);
+    segment->data = NULL;
+    return mqtt_topic_segment_remove(segment);
+  }
+
+  if (rec->len > 0) {
+    value = r->codec->load(r->codec->data, rec->payload, rec->len);
+    if (value == NULL) {
+      return -1;
+    }
+  }
+  rc = _replay_segment(r, (char *)r->topic.data, &segment);
+  if (rc != 0) {
+    _release(r, value);
+    return rc;
+  }
+  if (rec->len > 0 || rec->type == MQTT_TOPIC_WAL_SET) {
+    _release(r, segment->data);
+    segment->data = value;
+  }
+
+  swap = r->prev;
+  r->prev = r->topic;
+  r->topic = swap;
+  return 0;
+}
+
+/**
+ * _replay_file replays the records in the file at path, stopping at
+ * the first one that is incomplete or corrupt. The length of the
+ * records replayed is stored in *h_valid.
+ *
+ * Returns 0 on success, including if there is no file at path, -1 on
+ * an I/O error or if out of memory.
+ */
+static int _replay_file(_replay_s *r, const char *path, off_t *h_valid) {
+  _buf_s in = { 0 };
+  size_t pos = 0;
+  _record_s rec;
+  int fd, rc = 0;
+  ssize_t n;
+  long used;
+
+  *h_valid = 0;
+  fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return errno == ENOENT ? 0 : -1;
+  }
+  if (_buf_reserve(&in, READ_SIZE) != 0) {
+    close(fd);
+    return -1;
+  }
+
+  for (;;) {
+    while ((used = _decode(in.data + pos, in.data + in.len, &rec)) > 0) {
+      if ((rc = _replay_record(r, &rec)) != 0) {
+        goto exit;
+      }
+      pos += used;
+      *h_valid += used;
+    }
+    if (used < 0) {
+      break;
+    }
+
+    memmove(in.data, in.data + pos, in.len - pos);
+    in.len -= pos;
+    pos = 0;
+    if (_buf_reserve(&in, READ_SIZE) != 0) {
+      rc = -1;
+      goto exit;
+    }
+    n = read(fd, in.data + in.len, READ_SIZE);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      rc = -1;
+      goto exit;
+    }
+    if (n == 0) {
+      /* Whatever is left was cut short. */
+      break;
+    }
+    in.len += n;
+  }
+
+exit:
+  free(in.data);
+  close(fd);
+  return rc;
+}
+
+static char *_path_with(const char *path, const char *suffix) {
+  char *s = malloc(strlen(path) + strlen(suffix) + 1);
+
+  if (s) {
+    sprintf(s, "%s%s", path, suffix);
+  }
+  return s;
+}
+
+static void _wal_free(mqtt_topic_wal_s *w) {
+  if (w->fd >= 0) {
+    close(w->fd);
+  }
+  pthread_mutex_destroy(&w->lock);
+  pthread_cond_destroy(&w->committed);
+  free(w->pending.data);
+  free(w->spare.data);
+  free(w->snap_path);
+  free(w->tmp_path);
+  free(w);
+}
+
+mqtt_topic_wal_s *mqtt_topic_wal_open(const char *path,
+                                      mqtt_topic_segment_s *root,
+                                      const mqtt_topic_wal_codec_s *codec) {
+  _replay_s r = { .root = root, .codec = codec };
+  mqtt_topic_wal_s *w;
+  off_t valid;
+  int rc;
+
+  pthread_once(&crc_once, &_crc_init);
+
+  w = calloc(1, sizeof(*w));
+  if (w == NULL) {
+    return NULL;
+  }
+  w->fd = -1;
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->committed, NULL);
+  w->snap_path = _path_with(path, ".snap");
+  w->tmp_path = _path_with(path, ".snap.tmp");
+  if (w->snap_path == NULL || w->tmp_path == NULL) {
+    goto fail;
+  }
+
+  rc = _replay_file(&r, w->snap_path, &valid);
+  if (rc == 0) {
+    rc = _replay_file(&r, path, &valid);
+  }
+  free(r.topic.data);
+  free(r.prev.data);
+  if (rc != 0) {
+    goto fail;
+  }
+
+  w->fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (w->fd < 0) {
+    goto fail;
+  }
+  /* Drop a torn record, so that appends follow the last whole one. */
+  if (ftruncate(w->fd, valid) != 0) {
+    goto fail;
+  }
+  return w;
+
+fail:
+  _wal_free(w);
+  return NULL;
+}
+
+/**
+ * _commit_locked waits until lsn is durable, writing the pending
+ * records if no one else is. It is called with w->lock held.
+ */
+static int _commit_locked(mqtt_topic_wal_s *w, unsigned long lsn) {
+  unsigned long upto;
+  _buf_s group;
+  int rc;
+
+  if (lsn == 0 || lsn > w->appended) {
+    lsn = w->appended;
+  }
+  while (w->durable < lsn && !w->failed) {
+    if (w->committing) {
+      pthread_cond_wait(&w->committed, &w->lock);
+      continue;
+    }
+
+    /* Take every record appended so far as one group, leaving an
+     * empty buffer for appends made while it is written. */
+    w->committing = 1;
+    upto = w->appended;
+    group = w->pending;
+    w->pending = w->spare;
+    w->spare = (_buf_s){ 0 };
+    pthread_mutex_unlock(&w->lock);
+
+    rc = _write_all(w->fd, group.data, group.len);
+    if (rc == 0) {
+      rc = fdatasync(w->fd);
+    }
+
+    pthread_mutex_lock(&w->lock);
+    group.len = 0;
+    w->spare = group;
+    w->committing = 0;
+    if (rc == 0) {
+      w->durable = upto;
+    } else {
+      w->failed = 1;
+    }
+    pthread_cond_broadcast(&w->committed);
+  }
+  return w->failed ? -1 : 0;
+}
+
+int mqtt_topic_wal_close(mqtt_topic_wal_s *w) {
+  int rc;
+
+  pthread_mutex_lock(&w->lock);
+  rc = _commit_locked(w, 0);
+  pthread_mutex_unlock(&w->lock);
+  _wal_free(w);
+  return rc;
+}
+
+int mqtt_topic_wal_append(mqtt_topic_wal_s *w, int type, const char *topic,
+                          const void *payload, size_t len,
+                          unsigned long *h_lsn) {
+  int rc = -1;
+
+  pthread_mutex_lock(&w->lock);
+  if (w->failed ||
+      _encode(&w->pending, type, topic, strlen(topic), payload, len) != 0) {
+    goto exit;
+  }
+  ++w->appended;
+  if (h_lsn) {
+    *h_lsn = w->appended;
+  }
+  rc = 0;
+  if (w->pending.len >= FLUSH_SIZE && !w->committing) {
+    rc = _commit_locked(w, w->appended);
+  }
+
+exit:
+  pthread_mutex_unlock(&w->lock);
+  return rc;
+}
+
+int mqtt_topic_wal_commit(mqtt_topic_wal_s *w, unsigned long lsn) {
+  int rc;
+
+  pthread_mutex_lock(&w->lock);
+  rc = _commit_locked(w, lsn);
+  pthread_mutex_unlock(&w->lock);
+  return rc;
+}
+
+typedef struct {
+  const mqtt_topic_wal_codec_s *codec;
+  int fd;
+  int failed;
+  _buf_s out;
+  _buf_s payload;
+} _snapshot_s;
+
+static void _snapshot_segment(void *data, char *topic,
+                              mqtt_topic_segment_s *segment) {
+  _snapshot_s *snap = data;
+  const mqtt_topic_wal_codec_s *codec = snap->codec;
+  size_t len = 0;
+
+  /* Intermediate segments come back with the topics below them. */
+  if (snap->failed ||
+      (segment->data == NULL && mqtt_topic_has_children(segment))) {
+    return;
+  }
+  if (segment->data) {
+    len = codec->save(codec->data, segment->data, snap->payload.data,
+                      snap->payload.capacity);
+    if (len > snap->payload.capacity) {
+      if (_buf_reserve(&snap->payload, len) != 0) {
+        snap->failed = 1;
+        return;
+      }
+      codec->save(codec->data, segment->data, snap->payload.data, len);
+    }
+  }
+  if (_encode(&snap->out, MQTT_TOPIC_WAL_ADD, topic, strlen(topic),
+              snap->payload.data, len) != 0) {
+    snap->failed = 1;
+    return;
+  }
+  if (snap->out.len >= FLUSH_SIZE) {
+    if (_write_all(snap->fd, snap->out.data, snap->out.len) != 0) {
+      snap->failed = 1;
+    }
+    snap->out.len = 0;
+  }
+}
+
+/**
+ * _sync_dir makes the directory entries of the directory containing
+ * path durable.
+ */
+static int _sync_dir(const char *path) {
+  const char *slash = strrchr(path, '/');
+  char *dir;
+  int fd, rc;
+
+  if (slash == NULL) {
+    dir = strdup(".");
+  } else {
+    dir = strndup(path, slash == path ? 1 : slash - path);
+  }
+  if (dir == NULL) {
+    return -1;
+  }
+  fd = open(dir, O_RDONLY);
+  free(dir);
+  if (fd < 0) {
+    return -1;
+  }
+  rc = fsync(fd);
+  close(fd);
+  return rc;
+}
+
+/**
+ * _snapshot writes root to a temporary file, then moves it over the
+ * snapshot once it is durable.
+ */
+static int _snapshot(mqtt_topic_wal_s *w, mqtt_topic_segment_s *root,
+                     const mqtt_topic_wal_codec_s *codec) {
+  _snapshot_s snap = { .codec = codec };
+  mqtt_iter_cb_s cb = { .data = &snap, .fn = &_snapshot_segment };
+  int rc = -1;
+
+  snap.fd = open(w->tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (snap.fd < 0) {
+    return -1;
+  }
+  mqtt_topic_iter(root, &cb);
+  if (!snap.failed &&
+      _write_all(snap.fd, snap.out.data, snap.out.len) == 0 &&
+      fsync(snap.fd) == 0) {
+    rc = 0;
+  }
+  close(snap.fd);
+  free(snap.out.data);
+  free(snap.payload.data);
+
+  if (rc == 0 && rename(w->tmp_path, w->snap_path) == 0) {
+    return _sync_dir(w->snap_path);
+  }
+  unlink(w->tmp_path);
+  return -1;
+}
+
+int mqtt_topic_wal_checkpoint(mqtt_topic_wal_s *w, mqtt_topic_segment_s *root,
+                              const mqtt_topic_wal_codec_s *codec) {
+  unsigned long upto;
+  int rc, failed = 0;
+  size_t covered;
+
+  /* Keep committers out while the log is replaced. */
+  pthread_mutex_lock(&w->lock);
+  while (w->committing) {
+    pthread_cond_wait(&w->committed, &w->lock);
+  }
+  if (w->failed) {
+    pthread_mutex_unlock(&w->lock);
+    return -1;
+  }
+  w->committing = 1;
+  upto = w->appended;
+  covered = w->pending.len;
+  pthread_mutex_unlock(&w->lock);
+
+  rc = _snapshot(w, root, codec);
+  if (rc == 0 && (ftruncate(w->fd, 0) != 0 || fdatasync(w->fd) != 0)) {
+    /* The snapshot is in place, but the log may be only partly gone,
+     * so appending to it is no longer safe. */
+    rc = -1;
+    failed = 1;
+  }
+
+  pthread_mutex_lock(&w->lock);
+  w->committing = 0;
+  if (rc == 0) {
+    /* The snapshot holds what the records pending so far would have
+     * written; records appended since stay pending. */
+    if (covered) {
+      memmove(w->pending.data, w->pending.data + covered,
+              w->pending.len - covered);
+      w->pending.len -= covered;
+    }
+    w->durable = upto;
+  } else if (failed) {
+    w->failed = 1;
+  }
+  pthread_cond_broadcast(&w->committed);
+  pthread_mutex_unlock(&w->lock);
+  return rc;
+}
@@ -0,0 +1,111 @@
+#include <stdlib.h>
+
+#include "CuTest.h"
+
+#include "mqtt_rb.h"
+
+#define RB_ITEMS 2000
+
+typedef struct {
+  mqtt_rb_node_s node;
+  int key;
+  int linked;
+} rb_item_s;
+
+static void rb_add(_Atomic(mqtt_rb_node_s *) *h_root, rb_item_s *item) {
+  _Atomic(mqtt_rb_node_s *) *link = h_root;
+  mqtt_rb_node_s *parent = NULL;
+
+  while (mqtt_rb_root(link)) {
+    parent = mqtt_rb_root(link);
+    link = ((rb_item_s *)parent)->key > item->key ? &parent->left
+                                                  : &parent->right;
+  }
+  mqtt_rb_insert(h_root, parent, link, &item->node);
+  item->linked = 1;
+}
+
+/**
+ * rb_check returns the black height of the subtree below node, or -1
+ * if it breaks a red-black property or has a bad parent link.
+ */
+static int rb_check(mqtt_rb_node_s *node, mqtt_rb_node_s *parent) {
+  int red, left, right;
+
+  if (node == NULL) {
+    return 0;
+  }
+  red = atomic_load(&node->parent_color) & 1;
+  if (mqtt_rb_parent(node) != parent ||
+      (red && parent && (atomic_load(&parent->parent_color) & 1))) {
+    return -1;
+  }
+  left = rb_check(mqtt_rb_left(node), node);
+  right = rb_check(mqtt_rb_right(node), node);
+  if (left < 0 || left != right) {
+    return -1;
+  }
+  return left + !red;
+}
+
+/**
+ * rb_count returns the number of nodes in order, or -1 if they are
+ * out of order.
+ */
+static int rb_count(mqtt_rb_node_s *root) {
+  mqtt_rb_node_s *node;
+  int n = 0, last = -1;
+
+  for (node = mqtt_rb_first(root); node; node = mqtt_rb_next(node)) {
+    if (((rb_item_s *)node)->key <= last) {
+      return -1;
+    }
+    last = ((rb_item_s *)node)->key;
+    ++n;
+  }
+  return n;
+}
+
+/**
+ * Test random inserts and removals keep the tree balanced and in
+ * order.
+ */
+void Test_mqtt_rb(CuTest *tc) {
+  rb_item_s *items = calloc(RB_ITEMS, sizeof(rb_item_s));
+  _Atomic(mqtt_rb_node_s *) root = NULL;
+  mqtt_rb_node_s *node;
+  unsigned int seed = 1;
+  int linked = 0, i;
+
+  CuAssertPtrEquals(tc, NULL, mqtt_rb_first(mqtt_rb_root(&root)));
+  for (i = 0; i < RB_ITEMS; ++i) {
+    items[i].key = i;
+  }
+
+  for (int round = 0; round < 20 * RB_ITEMS; ++round) {
+    i = rand_r(&seed) % RB_ITEMS;
+    if (items[i].linked) {
+      mqtt_rb_remove(&root, &items[i].node);
+      items[i].linked = 0;
+      --linked;
+    } else {
+      rb_add(&root, &items[i]);
+      ++linked;
+    }
+    if (round % 97 == 0) {
+      node = mqtt_rb_root(&root);
+      CuAssertTrue(tc, node == NULL || !(atomic_load(&node->parent_color) & 1));
+      CuAssertTrue(tc, rb_check(node, NULL) >= 0);
+      CuAssertIntEquals(tc, linked, rb_count(node));
+    }
+  }
+
+  /* Emptying the tree in key order. */
+  while ((node = mqtt_rb_root(&root))) {
+    mqtt_rb_remove(&root, mqtt_rb_first(node));
+    --linked;
+    CuAssertTrue(tc, rb_check(mqtt_rb_root(&root), NULL) >= 0);
+  }
+  CuAssertIntEquals(tc, 0, linked);
+  free(items);
+}
@@ -0,0 +1,148 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "CuTest.h"
+
+#include "mqtt_so_map.h"
+
+#define MAP_KEYS 5000
+
+typedef struct {
+  mqtt_so_node_s node;
+  char key[16];
+  int seen;
+} map_item_s;
+
+static map_item_s *map_items(int n, int base) {
+  map_item_s *items = calloc(n, sizeof(map_item_s));
+
+  for (int i = 0; i < n; ++i) {
+    sprintf(items[i].key, "k%d", base + i);
+    items[i].node.key = items[i].key;
+  }
+  return items;
+}
+
+/**
+ * _map_visit iterates the map a few nodes at a time, as the topic
+ * tree does, counting the visits to each item.
+ */
+static int map_visit(mqtt_so_map_s *m) {
+  mqtt_so_node_s *out[7];
+  const char *after = NULL;
+  int n, total = 0;
+
+  do {
+    n = mqtt_so_map_chunk(m, after, out, 7);
+    for (int i = 0; i < n; ++i) {
+      ++((map_item_s *)out[i])->seen;
+    }
+    total += n;
+    after = n ? out[n - 1]->key : after;
+  } while (n == 7);
+  return total;
+}
+
+void Test_mqtt_so_map(CuTest *tc) {
+  mqtt_so_map_s *m = mqtt_so_map_create();
+  map_item_s *items = map_items(MAP_KEYS, 0), dup = { .node.key = "k7" };
+  int i;
+
+  CuAssertPtrNotNull(tc, m);
+  CuAssertTrue(tc, mqtt_so_map_empty(m));
+  for (i = 0; i < MAP_KEYS; ++i) {
+    CuAssertPtrEquals(tc, &items[i].node,
+                      mqtt_so_map_insert(m, &items[i].node));
+  }
+  CuAssertPtrEquals(tc, &items[7].node, mqtt_so_map_insert(m, &dup.node));
+  for (i = 0; i < MAP_KEYS; ++i) {
+    CuAssertPtrEquals(tc, &items[i].node,
+                      mqtt_so_map_find(m, items[i].key, strlen(items[i].key)));
+  }
+  CuAssertPtrEquals(tc, NULL, mqtt_so_map_find(m, "nope", 4));
+  /* Only the first len bytes of a key are looked up. */
+  CuAssertPtrEquals(tc, &items[7].node, mqtt_so_map_find(m, "k7/x", 2));
+  CuAssertPtrEquals(tc, NULL, mqtt_so_map_find(m, "k7", 1));
+
+  /* Every node is visited once, in however many chunks. */
+  CuAssertIntEquals(tc, MAP_KEYS, map_visit(m));
+  for (i = 0; i < MAP_KEYS; ++i) {
+    CuAssertIntEquals(tc, 1, items[i].seen);
+  }
+
+  for (i = 0; i < MAP_KEYS; i += 2) {
+    CuAssertIntEquals(tc, 0, mqtt_so_map_remove(m, &items[i].node));
+  }
+  CuAssertIntEquals(tc, 1, mqtt_so_map_remove(m, &items[0].node));
+  CuAssertPtrEquals(tc, NULL, mqtt_so_map_find(m, items[0].key, 2));
+  CuAssertPtrEquals(tc, &items[1].node, mqtt_so_map_find(m, items[1].key, 2));
+  CuAssertIntEquals(tc, MAP_KEYS / 2, map_visit(m));
+
+  /* Only an empty map can be closed, and a closed map takes no
+   * inserts. */
+  CuAssertIntEquals(tc, 0, mqtt_so_map_close(m));
+  for (i = 1; i < MAP_KEYS; i += 2) {
+    mqtt_so_map_remove(m, &items[i].node);
+  }
+  CuAssertTrue(tc, mqtt_so_map_empty(m));
+  CuAssertIntEquals(tc, 1, mqtt_so_map_close(m));
+  CuAssertPtrEquals(tc, NULL, mqtt_so_map_insert(m, &items[0].node));
+
+  mqtt_so_map_destroy(m, NULL);
+  free(items);
+}
+
+#define MAP_THREADS 4
+
+typedef struct {
+  mqtt_so_map_s *m;
+  map_item_s *items;
+} map_worker_s;
+
+static void *map_worker(void *arg) {
+  map_worker_s *w = arg;
+
+  for (int i = 0; i < MAP_KEYS; ++i) {
+    mqtt_so_map_insert(w->m, &w->items[i].node);
+  }
+  /* Nothing is freed while the threads run, so removed nodes need no
+   * deferred reclamation here. */
+  for (int i = 0; i < MAP_KEYS; i += 2) {
+    mqtt_so_map_remove(w->m, &w->items[i].node);
+  }
+  return NULL;
+}
+
+/**
+ * Threads inserting and removing siblings in the same map.
+ */
+void Test_mqtt_so_map_concurrent(CuTest *tc) {
+  mqtt_so_map_s *m = mqtt_so_map_create();
+  pthread_t tids[MAP_THREADS];
+  map_worker_s workers[MAP_THREADS];
+
+  for (int t = 0; t < MAP_THREADS; ++t) {
+    workers[t] = (map_worker_s){ .m = m,
+                                 .items = map_items(MAP_KEYS, t * MAP_KEYS) };
+    pthread_create(&tids[t], NULL, &map_worker, &workers[t]);
+  }
+  for (int t = 0; t < MAP_THREADS; ++t) {
+    pthread_join(tids[t], NULL);
+  }
+
+  CuAssertIntEquals(tc, MAP_THREADS * MAP_KEYS / 2, map_visit(m));
+  for (int t = 0; t < MAP_THREADS; ++t) {
+    for (int i = 0; i < MAP_KEYS; ++i) {
+      CuAssertPtrEquals(tc, i % 2 ? &workers[t].items[i].node : NULL,
+                        mqtt_so_map_find(m, workers[t].items[i].key,
+                                         strlen(workers[t].items[i].key)));
+    }
+  }
+
+  mqtt_so_map_destroy(m, NULL);
+  for (int t = 0; t < MAP_THREADS; ++t) {
+    free(workers[t].items);
+  }
+}
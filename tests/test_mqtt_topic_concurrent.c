@@ -0,0 +1,489 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "CuTest.h"
+
+#include "mqtt_topic_tree.h"
+
+#define CC_WRITERS 4
+#define CC_READERS 2
+#define CC_TOPICS 64
+#define CC_SHARED 8
+#define CC_ROUNDS 20000
+
+/* Writers store the address of their own marker as data, so readers
+ * can tell valid data from garbage. */
+static int cc_markers[CC_WRITERS];
+
+static _Atomic int cc_done;
+
+typedef struct {
+  mqtt_topic_segment_s *root;
+  int id;
+  unsigned int seed;
+  char subscribed[CC_TOPICS];
+} cc_writer_s;
+
+typedef struct {
+  mqtt_topic_segment_s *root;
+  long matches;
+  int bad;
+} cc_reader_s;
+
+static void cc_set(void *data, char *topic, mqtt_topic_segment_s *segment) {
+  segment->data = data;
+}
+
+static void cc_check(void *data, char *topic, mqtt_topic_segment_s *segment) {
+  cc_reader_s *r = data;
+  void *d = segment->data;
+
+  ++r->matches;
+  if (d != NULL && (d < (void *)&cc_markers[0] ||
+                    d > (void *)&cc_markers[CC_WRITERS - 1])) {
+    ++r->bad;
+  }
+  if (topic[0] == '\0') {
+    ++r->bad;
+  }
+}
+
+static void *cc_writer(void *arg) {
+  cc_writer_s *w = arg;
+  mqtt_iter_cb_s cb = { .fn = &cc_set };
+  char topic[64];
+  int i;
+
+  for (int round = 0; round < CC_ROUNDS; ++round) {
+    i = rand_r(&w->seed) % CC_TOPICS;
+    if (rand_r(&w->seed) % 2) {
+      /* Toggle one of this writer's own topics. */
+      sprintf(topic, "w%d/%d/x", w->id, i);
+      cb.data = w->subscribed[i] ? NULL : &cc_markers[w->id];
+      w->subscribed[i] = !w->subscribed[i];
+    } else {
+      /* Fight the other writers over the shared topics. */
+      sprintf(topic, "shared/%d/x", i % CC_SHARED);
+      cb.data = rand_r(&w->seed) % 2 ? NULL : &cc_markers[w->id];
+    }
+    mqtt_topic_update(w->root, topic, &cb);
+  }
+  return NULL;
+}
+
+static void *cc_reader(void *arg) {
+  static char *patterns[] = { "shared/#", "+/+/x", "w0/+/x", "w1/7/x", "#" };
+  cc_reader_s *r = arg;
+  mqtt_iter_cb_s cb = { .data = r, .fn = &cc_check };
+  mqtt_topic_segment_s *segment;
+  char buf[32];
+
+  while (!atomic_load(&cc_done)) {
+    for (int i = 0; i < sizeof(patterns) / sizeof(patterns[0]); ++i) {
+      sprintf(buf, "%s", patterns[i]);
+      mqtt_topic_matching_iter(r->root, buf, &cb);
+    }
+
+    sprintf(buf, "shared/3/x");
+    mqtt_epoch_enter();
+    if (mqtt_topic_find_or_add(&segment, r->root, buf, 0) == 0) {
+      cc_check(r, buf, segment);
+    }
+    mqtt_epoch_exit();
+  }
+  return NULL;
+}
+
+static void cc_count_empty(void *data, char *topic,
+                           mqtt_topic_segment_s *segment) {
+  if (segment->data == NULL && !mqtt_topic_has_children(segment)) {
+    ++(*(int *)data);
+  }
+}
+
+static void cc_copy(void *data, char *topic, mqtt_topic_segment_s *segment) {
+  mqtt_iter_cb_s cb = { .data = segment->data, .fn = &cc_set };
+  char buf[64];
+
+  if (cb.data) {
+    sprintf(buf, "%s", topic);
+    mqtt_topic_update(data, buf, &cb);
+  }
+}
+
+static void cc_run(CuTest *tc, int wide) {
+  mqtt_topic_segment_s *root = mqtt_topic_segment_create(), *segment, *copy;
+  pthread_t writer_tids[CC_WRITERS], reader_tids[CC_READERS];
+  cc_writer_s writers[CC_WRITERS];
+  cc_reader_s readers[CC_READERS];
+  mqtt_iter_cb_s cb;
+  char topic[64];
+  int rc, empty = 0;
+
+  mqtt_topic_concurrent_enable(root);
+  mqtt_topic_digest_enable(root);
+  if (wide) {
+    CuAssertIntEquals(tc, 0, mqtt_topic_make_wide(root));
+  }
+  atomic_store(&cc_done, 0);
+
+  for (int i = 0; i < CC_READERS; ++i) {
+    readers[i] = (cc_reader_s){ .root = root };
+    pthread_create(&reader_tids[i], NULL, &cc_reader, &readers[i]);
+  }
+  for (int i = 0; i < CC_WRITERS; ++i) {
+    writers[i] = (cc_writer_s){ .root = root, .id = i, .seed = i + 1 };
+    pthread_create(&writer_tids[i], NULL, &cc_writer, &writers[i]);
+  }
+  for (int i = 0; i < CC_WRITERS; ++i) {
+    pthread_join(writer_tids[i], NULL);
+  }
+  atomic_store(&cc_done, 1);
+  for (int i = 0; i < CC_READERS; ++i) {
+    pthread_join(reader_tids[i], NULL);
+    CuAssertIntEquals(tc, 0, readers[i].bad);
+    CuAssertTrue(tc, readers[i].matches > 0);
+  }
+
+  /* Every writer's own topics ended up as it left them. */
+  for (int w = 0; w < CC_WRITERS; ++w) {
+    for (int i = 0; i < CC_TOPICS; ++i) {
+      sprintf(topic, "w%d/%d/x", w, i);
+      rc = mqtt_topic_find_or_add(&segment, root, topic, 0);
+      if (writers[w].subscribed[i]) {
+        CuAssertIntEquals(tc, 0, rc);
+        CuAssertPtrEquals(tc, &cc_markers[w], segment->data);
+      } else {
+        CuAssertIntEquals(tc, 1, rc);
+      }
+    }
+  }
+
+  /* Once the shared topics are cleared, no empty segment is left
+   * behind, whatever order the removals raced in. */
+  cb = (mqtt_iter_cb_s){ .data = NULL, .fn = &cc_set };
+  for (int i = 0; i < CC_SHARED; ++i) {
+    sprintf(topic, "shared/%d/x", i);
+    mqtt_topic_update(root, topic, &cb);
+  }
+  cb = (mqtt_iter_cb_s){ .data = &empty, .fn = &cc_count_empty };
+  mqtt_topic_iter(root, &cb);
+  CuAssertIntEquals(tc, 0, empty);
+  sprintf(topic, "shared");
+  CuAssertIntEquals(tc, 1, mqtt_topic_find_or_add(&segment, root, topic, 0));
+
+  /* Digests kept up to date by the racing writers match those of a
+   * copy built by one thread. */
+  copy = mqtt_topic_segment_create();
+  mqtt_topic_digest_enable(copy);
+  cb = (mqtt_iter_cb_s){ .data = copy, .fn = &cc_copy };
+  mqtt_topic_iter(root, &cb);
+  CuAssertTrue(tc, mqtt_topic_digest(root) == mqtt_topic_digest(copy));
+  mqtt_topic_segment_destroy(copy);
+
+  mqtt_epoch_barrier();
+  mqtt_topic_segment_destroy(root);
+}
+
+/**
+ * Writers adding and removing overlapping topics while readers
+ * match against the same tree.
+ */
+void Test_mqtt_topic_concurrent(CuTest *tc) {
+  cc_run(tc, 0);
+}
+
+/**
+ * The same, with the writers' siblings under a wide root.
+ */
+void Test_mqtt_topic_concurrent_wide(CuTest *tc) {
+  cc_run(tc, 1);
+}
+
+#define SNAP_SLOTS 16
+#define SNAP_ROUNDS 20000
+
+/* Round r of the snapshot writer stores &snap_values[r], so that
+ * readers can tell which round a value came from. */
+static int snap_values[SNAP_ROUNDS];
+
+typedef struct {
+  mqtt_topic_segment_s *root;
+  long snapshots;
+  int bad;
+} snap_reader_s;
+
+/**
+ * snap_round_data returns the data round r stores in its slot: every
+ * third pass over the slots clears them instead.
+ */
+static void *snap_round_data(int r) {
+  return (r / SNAP_SLOTS) % 3 == 2 ? NULL : &snap_values[r];
+}
+
+static void *snap_writer(void *arg) {
+  mqtt_iter_cb_s cb = { .fn = &cc_set };
+  char topic[64];
+
+  for (int r = 0; r < SNAP_ROUNDS; ++r) {
+    sprintf(topic, "snap/%d", r % SNAP_SLOTS);
+    cb.data = snap_round_data(r);
+    mqtt_topic_update(arg, topic, &cb);
+  }
+  return NULL;
+}
+
+/* Stores the round of each slot's value, and flags foreign values. */
+static void snap_collect(void *data, const char *topic, void *value) {
+  int *seen = data, i;
+
+  if (sscanf(topic, "snap/%d", &i) != 1) {
+    return;
+  }
+  if ((int *)value < &snap_values[0] ||
+      (int *)value >= &snap_values[SNAP_ROUNDS] || i < 0 || i >= SNAP_SLOTS) {
+    seen[SNAP_SLOTS] = 1;
+    return;
+  }
+  seen[i] = (int *)value - snap_values;
+}
+
+/**
+ * snap_consistent returns 1 if seen holds the slots exactly as the
+ * writer left them after some round.
+ */
+static int snap_consistent(const int *seen) {
+  int max = -1, last, r, i;
+
+  for (i = 0; i < SNAP_SLOTS; ++i) {
+    max = seen[i] > max ? seen[i] : max;
+  }
+  for (last = max; last < SNAP_ROUNDS && last <= max + 3 * SNAP_SLOTS;
+       ++last) {
+    for (i = 0; i < SNAP_SLOTS; ++i) {
+      r = last - ((last - i) % SNAP_SLOTS + SNAP_SLOTS) % SNAP_SLOTS;
+      if (seen[i] != (r >= 0 && snap_round_data(r) ? r : -1)) {
+        break;
+      }
+    }
+    if (i == SNAP_SLOTS) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void *snap_reader(void *arg) {
+  snap_reader_s *reader = arg;
+  mqtt_topic_snapshot_s *snapshot;
+  int seen[SNAP_SLOTS + 1], again[SNAP_SLOTS + 1];
+  mqtt_topic_snapshot_cb_s cb;
+
+  while (!atomic_load(&cc_done)) {
+    snapshot = mqtt_topic_snapshot_begin(reader->root);
+    for (int i = 0; i <= SNAP_SLOTS; ++i) {
+      seen[i] = again[i] = -1;
+    }
+    seen[SNAP_SLOTS] = again[SNAP_SLOTS] = 0;
+    cb = (mqtt_topic_snapshot_cb_s){ .data = seen, .fn = &snap_collect };
+    mqtt_topic_snapshot_iter(snapshot, &cb);
+    cb.data = again;
+    mqtt_topic_snapshot_iter(snapshot, &cb);
+    mqtt_topic_snapshot_end(snapshot);
+
+    if (seen[SNAP_SLOTS] || memcmp(seen, again, sizeof(seen)) ||
+        !snap_consistent(seen)) {
+      ++reader->bad;
+    }
+    ++reader->snapshots;
+  }
+  return NULL;
+}
+
+/**
+ * Readers taking snapshots while a writer steps through known states
+ * and other writers race over unrelated topics. Every snapshot must
+ * see one of the writer's states as a whole, however long it takes
+ * to read.
+ */
+void Test_mqtt_topic_snapshot_concurrent(CuTest *tc) {
+  mqtt_topic_segment_s *root = mqtt_topic_segment_create(), *segment;
+  pthread_t writer_tids[CC_WRITERS + 1], reader_tids[CC_READERS];
+  cc_writer_s writers[CC_WRITERS];
+  snap_reader_s readers[CC_READERS];
+  mqtt_iter_cb_s cb = { .data = NULL, .fn = &cc_set };
+  char topic[64];
+  int empty = 0;
+
+  mqtt_topic_concurrent_enable(root);
+  atomic_store(&cc_done, 0);
+
+  for (int i = 0; i < CC_READERS; ++i) {
+    readers[i] = (snap_reader_s){ .root = root };
+    pthread_create(&reader_tids[i], NULL, &snap_reader, &readers[i]);
+  }
+  for (int i = 0; i < CC_WRITERS; ++i) {
+    writers[i] = (cc_writer_s){ .root = root, .id = i, .seed = i + 1 };
+    pthread_create(&writer_tids[i], NULL, &cc_writer, &writers[i]);
+  }
+  pthread_create(&writer_tids[CC_WRITERS], NULL, &snap_writer, root);
+  for (int i = 0; i <= CC_WRITERS; ++i) {
+    pthread_join(writer_tids[i], NULL);
+  }
+  atomic_store(&cc_done, 1);
+  for (int i = 0; i < CC_READERS; ++i) {
+    pthread_join(reader_tids[i], NULL);
+    CuAssertIntEquals(tc, 0, readers[i].bad);
+    CuAssertTrue(tc, readers[i].snapshots > 0);
+  }
+
+  /* With every snapshot ended, clearing the topics leaves no empty
+   * segment behind. */
+  for (int i = 0; i < SNAP_SLOTS; ++i) {
+    sprintf(topic, "snap/%d", i);
+    mqtt_topic_update(root, topic, &cb);
+  }
+  for (int i = 0; i < CC_SHARED; ++i) {
+    sprintf(topic, "shared/%d/x", i);
+    mqtt_topic_update(root, topic, &cb);
+  }
+  for (int w = 0; w < CC_WRITERS; ++w) {
+    for (int i = 0; i < CC_TOPICS; ++i) {
+      sprintf(topic, "w%d/%d/x", w, i);
+      mqtt_topic_update(root, topic, &cb);
+    }
+  }
+  cb = (mqtt_iter_cb_s){ .data = &empty, .fn = &cc_count_empty };
+  mqtt_topic_iter(root, &cb);
+  CuAssertIntEquals(tc, 0, empty);
+  sprintf(topic, "snap");
+  CuAssertIntEquals(tc, 1, mqtt_topic_find_or_add(&segment, root, topic, 0));
+
+  mqtt_epoch_barrier();
+  mqtt_topic_segment_destroy(root);
+}
+
+#define HOT_TOPICS 4
+
+/* Stores the marker of each hot topic, and flags foreign values. */
+static void hot_collect(void *data, const char *topic, void *value) {
+  void **seen = data;
+  int i;
+
+  if (sscanf(topic, "hot/%d", &i) != 1 || i < 0 || i >= HOT_TOPICS ||
+      (int *)value < &cc_markers[0] ||
+      (int *)value > &cc_markers[CC_WRITERS - 1]) {
+    seen[HOT_TOPICS] = seen;
+    return;
+  }
+  seen[i] = value;
+}
+
+static void *hot_writer(void *arg) {
+  cc_writer_s *w = arg;
+  mqtt_iter_cb_s cb = { .fn = &cc_set };
+  char topic[64];
+
+  for (int round = 0; round < CC_ROUNDS; ++round) {
+    sprintf(topic, "hot/%d", rand_r(&w->seed) % HOT_TOPICS);
+    cb.data = rand_r(&w->seed) % 4 ? &cc_markers[w->id] : NULL;
+    mqtt_topic_update(w->root, topic, &cb);
+  }
+  return NULL;
+}
+
+/**
+ * hot_iter reads snapshot into seen, cleared first.
+ */
+static void hot_iter(mqtt_topic_snapshot_s *snapshot, void **seen) {
+  mqtt_topic_snapshot_cb_s cb = { .data = seen, .fn = &hot_collect };
+
+  memset(seen, 0, (HOT_TOPICS + 1) * sizeof(*seen));
+  mqtt_topic_snapshot_iter(snapshot, &cb);
+}
+
+static void *hot_reader(void *arg) {
+  snap_reader_s *reader = arg;
+  mqtt_topic_snapshot_s *older, *newer;
+  void *first[HOT_TOPICS + 1], *again[HOT_TOPICS + 1];
+  void *second[HOT_TOPICS + 1];
+
+  while (!atomic_load(&cc_done)) {
+    /* Two overlapping snapshots keep records of different ages alive,
+     * so that updates cut the version lists between them. */
+    older = mqtt_topic_snapshot_begin(reader->root);
+    hot_iter(older, first);
+    /* Let the writers in while the snapshots are open, even on a
+     * single core. */
+    sched_yield();
+    newer = mqtt_topic_snapshot_begin(reader->root);
+    hot_iter(newer, second);
+    sched_yield();
+    hot_iter(older, again);
+    mqtt_topic_snapshot_end(older);
+    sched_yield();
+    if (first[HOT_TOPICS] || memcmp(first, again, sizeof(first)) != 0) {
+      ++reader->bad;
+    }
+    /* Records only the older snapshot needed may now go. */
+    hot_iter(newer, again);
+    mqtt_topic_snapshot_end(newer);
+    if (second[HOT_TOPICS] || memcmp(second, again, sizeof(second)) != 0) {
+      ++reader->bad;
+    }
+    ++reader->snapshots;
+  }
+  return NULL;
+}
+
+/**
+ * Writers fighting over a few topics while readers iterate snapshots
+ * that stay open across many updates. Each snapshot must read the
+ * same values every time, however the records behind it are added
+ * and trimmed meanwhile.
+ */
+void Test_mqtt_topic_snapshot_updates(CuTest *tc) {
+  mqtt_topic_segment_s *root = mqtt_topic_segment_create();
+  pthread_t writer_tids[CC_WRITERS], reader_tids[CC_READERS];
+  cc_writer_s writers[CC_WRITERS];
+  snap_reader_s readers[CC_READERS];
+  mqtt_iter_cb_s cb = { .data = NULL, .fn = &cc_set };
+  char topic[64];
+  int empty = 0;
+
+  mqtt_topic_concurrent_enable(root);
+  atomic_store(&cc_done, 0);
+
+  for (int i = 0; i < CC_READERS; ++i) {
+    readers[i] = (snap_reader_s){ .root = root };
+    pthread_create(&reader_tids[i], NULL, &hot_reader, &readers[i]);
+  }
+  for (int i = 0; i < CC_WRITERS; ++i) {
+    writers[i] = (cc_writer_s){ .root = root, .id = i, .seed = i + 1 };
+    pthread_create(&writer_tids[i], NULL, &hot_writer, &writers[i]);
+  }
+  for (int i = 0; i < CC_WRITERS; ++i) {
+    pthread_join(writer_tids[i], NULL);
+  }
+  atomic_store(&cc_done, 1);
+  for (int i = 0; i < CC_READERS; ++i) {
+    pthread_join(reader_tids[i], NULL);
+    CuAssertIntEquals(tc, 0, readers[i].bad);
+    CuAssertTrue(tc, readers[i].snapshots > 0);
+  }
+
+  for (int i = 0; i < HOT_TOPICS; ++i) {
+    sprintf(topic, "hot/%d", i);
+    mqtt_topic_update(root, topic, &cb);
+  }
+  cb = (mqtt_iter_cb_s){ .data = &empty, .fn = &cc_count_empty };
+  mqtt_topic_iter(root, &cb);
+  CuAssertIntEquals(tc, 0, empty);
+
+  mqtt_epoch_barrier();
+  mqtt_topic_segment_destroy(root);
+}
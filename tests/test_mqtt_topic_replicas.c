@@ -0,0 +1,182 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "CuTest.h"
+
+#include "mqtt_topic_replicas.h"
+
+#define REPLICAS 3
+
+static char *replica_topics[] = {
+  "a", "a/b", "a/c", "b/c", "b/c/zoo", "+/c", "b/#", "#", "foo/+/baz",
+};
+
+static char *replica_patterns[] = {
+  "a", "a/b", "b/c", "+/c", "b/#", "#", "foo/bar/baz", "+",
+};
+
+static int replica_marker;
+
+static void replica_count(void *data, char *topic,
+                          mqtt_topic_segment_s *segment) {
+  /* Only topics with data count, as intermediate segments may differ
+   * in when they are pruned. */
+  if (segment->data == &replica_marker) {
+    ++(*(int *)data);
+  }
+}
+
+/**
+ * replicas_agree checks that every replica matches as root does.
+ */
+static void replicas_agree(CuTest *tc, mqtt_topic_replicas_s *t,
+                           mqtt_topic_segment_s *root) {
+  mqtt_iter_cb_s cb = { .fn = &replica_count };
+  int expected, count;
+  char buf[64];
+
+  for (int i = 0; i < sizeof(replica_patterns) / sizeof(replica_patterns[0]);
+       ++i) {
+    expected = 0;
+    cb.data = &expected;
+    strcpy(buf, replica_patterns[i]);
+    mqtt_topic_matching_iter(root, buf, &cb);
+    for (int node = 0; node < REPLICAS; ++node) {
+      count = 0;
+      cb.data = &count;
+      strcpy(buf, replica_patterns[i]);
+      CuAssertIntEquals(tc, 0, mqtt_topic_replicas_matching_iter(t, node, buf,
+                                                                 &cb));
+      CuAssertIntEquals(tc, expected, count);
+    }
+  }
+}
+
+static void replica_set(mqtt_topic_segment_s *root, const char *topic,
+                        void *data) {
+  mqtt_topic_segment_s *seg;
+  char buf[64];
+
+  strcpy(buf, topic);
+  if (mqtt_topic_find_or_add(&seg, root, buf, data != NULL) == 0) {
+    seg->data = data;
+    mqtt_topic_segment_remove(seg);
+  }
+}
+
+/**
+ * Every replica sees the updates logged, however far behind it was.
+ */
+void Test_mqtt_topic_replicas(CuTest *tc) {
+  mqtt_topic_segment_s *root = mqtt_topic_segment_create();
+  mqtt_topic_replicas_s *t = mqtt_topic_replicas_create(REPLICAS);
+  int n = sizeof(replica_topics) / sizeof(replica_topics[0]);
+  char topic[64];
+
+  CuAssertPtrNotNull(tc, t);
+  CuAssertTrue(tc, mqtt_topic_replicas_node_count() >= 1);
+  CuAssertTrue(tc, mqtt_topic_replicas_local_node(t) >= 0 &&
+                   mqtt_topic_replicas_local_node(t) < REPLICAS);
+
+  for (int i = 0; i < n; ++i) {
+    CuAssertIntEquals(tc, 0, mqtt_topic_replicas_update(t, replica_topics[i],
+                                                        &replica_marker));
+    replica_set(root, replica_topics[i], &replica_marker);
+  }
+  replicas_agree(tc, t, root);
+
+  CuAssertIntEquals(tc, 0, mqtt_topic_replicas_update(t, "b/#", NULL));
+  CuAssertIntEquals(tc, 0, mqtt_topic_replicas_update(t, "zz", NULL));
+  replica_set(root, "b/#", NULL);
+  replicas_agree(tc, t, root);
+
+  /* More updates than the log holds, with no match in between. */
+  for (int i = 0; i < 3000; ++i) {
+    sprintf(topic, "dev/%d/temp", i % 700);
+    mqtt_topic_replicas_update(t, topic, i % 3 ? &replica_marker : NULL);
+    replica_set(root, topic, i % 3 ? &replica_marker : NULL);
+  }
+  replicas_agree(tc, t, root);
+
+  mqtt_topic_replicas_destroy(t);
+  mqtt_topic_segment_destroy(root);
+}
+
+#define RC_WRITERS 2
+#define RC_READERS 3
+#define RC_ROUNDS 5100
+
+static _Atomic int rc_done;
+
+typedef struct {
+  mqtt_topic_replicas_s *t;
+  int id;
+} rc_thread_s;
+
+static void *rc_writer(void *arg) {
+  rc_thread_s *w = arg;
+  char topic[64];
+
+  for (int i = 0; i < RC_ROUNDS; ++i) {
+    sprintf(topic, "w%d/%d", w->id, i % 100);
+    mqtt_topic_replicas_update(w->t, topic,
+                               (i / 100) % 2 ? NULL : &replica_marker);
+  }
+  return NULL;
+}
+
+static void *rc_reader(void *arg) {
+  rc_thread_s *r = arg;
+  mqtt_iter_cb_s cb = { .fn = &replica_count };
+  char buf[8];
+  int count;
+
+  while (!atomic_load(&rc_done)) {
+    count = 0;
+    cb.data = &count;
+    strcpy(buf, "+/+");
+    mqtt_topic_replicas_matching_iter(r->t, r->id, buf, &cb);
+  }
+  return NULL;
+}
+
+/**
+ * Writers logging updates while readers match on their own nodes.
+ */
+void Test_mqtt_topic_replicas_concurrent(CuTest *tc) {
+  mqtt_topic_replicas_s *t = mqtt_topic_replicas_create(REPLICAS);
+  pthread_t writers[RC_WRITERS], readers[RC_READERS];
+  rc_thread_s args[RC_WRITERS + RC_READERS];
+  mqtt_iter_cb_s cb = { .fn = &replica_count };
+  char buf[8];
+  int count;
+
+  atomic_store(&rc_done, 0);
+  for (int i = 0; i < RC_READERS; ++i) {
+    args[i] = (rc_thread_s){ .t = t, .id = i };
+    pthread_create(&readers[i], NULL, &rc_reader, &args[i]);
+  }
+  for (int i = 0; i < RC_WRITERS; ++i) {
+    args[RC_READERS + i] = (rc_thread_s){ .t = t, .id = i };
+    pthread_create(&writers[i], NULL, &rc_writer, &args[RC_READERS + i]);
+  }
+  for (int i = 0; i < RC_WRITERS; ++i) {
+    pthread_join(writers[i], NULL);
+  }
+  atomic_store(&rc_done, 1);
+  for (int i = 0; i < RC_READERS; ++i) {
+    pthread_join(readers[i], NULL);
+  }
+
+  /* The last round of each writer set its topics. */
+  for (int node = 0; node < REPLICAS; ++node) {
+    count = 0;
+    cb.data = &count;
+    strcpy(buf, "+/+");
+    mqtt_topic_replicas_matching_iter(t, node, buf, &cb);
+    CuAssertIntEquals(tc, RC_WRITERS * 100, count);
+  }
+  mqtt_topic_replicas_destroy(t);
+}
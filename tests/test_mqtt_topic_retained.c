@@ -0,0 +1,131 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "CuTest.h"
+
+#include "mqtt_topic_retained.h"
+
+#define RETAINED_ROUNDS 20000
+
+typedef struct {
+  char topics[256];
+  mqtt_topic_payload_s *payloads[8];
+  int count;
+} retained_batch_s;
+
+static void retained_collect(void *data, const char *topic,
+                             mqtt_topic_payload_s *p) {
+  retained_batch_s *b = data;
+
+  strcat(b->topics, topic);
+  strcat(b->topics, " ");
+  b->payloads[b->count++] = p;
+}
+
+static void retained_release(retained_batch_s *b) {
+  for (int i = 0; i < b->count; ++i) {
+    mqtt_topic_payload_unref(b->payloads[i]);
+  }
+  b->topics[0] = '\0';
+  b->count = 0;
+}
+
+typedef struct {
+  mqtt_topic_retained_s *store;
+  _Atomic int done;
+  int bad;
+} retained_race_s;
+
+static void retained_check(void *data, const char *topic,
+                           mqtt_topic_payload_s *p) {
+  retained_race_s *r = data;
+
+  /* Every payload written repeats the letter standing for its
+   * length. */
+  for (size_t i = 0; i < p->len; ++i) {
+    if (p->data[i] != 'a' + p->len - 1) {
+      ++r->bad;
+    }
+  }
+  mqtt_topic_payload_unref(p);
+}
+
+static void *retained_reader(void *arg) {
+  retained_race_s *r = arg;
+  mqtt_topic_retained_cb_s cb = { .data = r, .fn = &retained_check };
+
+  while (!atomic_load(&r->done)) {
+    mqtt_topic_retained_match(r->store, "race/#", &cb);
+  }
+  return NULL;
+}
+
+/**
+ * Test retaining, replacing and matching messages, and readers racing
+ * a writer that keeps replacing them.
+ */
+void Test_mqtt_topic_retained(CuTest *tc) {
+  mqtt_topic_retained_cb_s cb;
+  mqtt_topic_retained_s *store;
+  mqtt_topic_payload_s *one, *two, *p;
+  retained_batch_s batch = { .count = 0 };
+  retained_race_s race = { .bad = 0 };
+  pthread_t tid;
+  char buf[32];
+
+  store = mqtt_topic_retained_create();
+  one = mqtt_topic_payload_create("one", 3);
+  two = mqtt_topic_payload_create("two", 3);
+
+  /* The same payload is shared by every topic retaining it. */
+  CuAssertIntEquals(tc, 0, mqtt_topic_retained_set(store, "a/b", one));
+  CuAssertIntEquals(tc, 0, mqtt_topic_retained_set(store, "a/c", one));
+  CuAssertIntEquals(tc, 0, mqtt_topic_retained_set(store, "b", two));
+  p = mqtt_topic_retained_get(store, "a/c");
+  CuAssertPtrEquals(tc, one, p);
+  mqtt_topic_payload_unref(p);
+  CuAssertPtrEquals(tc, NULL, mqtt_topic_retained_get(store, "a"));
+
+  cb = (mqtt_topic_retained_cb_s){ .data = &batch, .fn = &retained_collect };
+  CuAssertIntEquals(tc, 0, mqtt_topic_retained_match(store, "a/+", &cb));
+  CuAssertStrEquals(tc, "a/b a/c ", batch.topics);
+  CuAssertPtrEquals(tc, one, batch.payloads[0]);
+  CuAssertPtrEquals(tc, one, batch.payloads[1]);
+
+  /* References handed out outlive the messages being replaced. */
+  CuAssertIntEquals(tc, 0, mqtt_topic_retained_set(store, "a/b", two));
+  mqtt_topic_payload_unref(one);
+  CuAssertIntEquals(tc, 0, mqtt_topic_retained_set(store, "a/c", NULL));
+  CuAssertIntEquals(tc, 0, memcmp(batch.payloads[1]->data, "one", 3));
+  retained_release(&batch);
+
+  CuAssertIntEquals(tc, 0, mqtt_topic_retained_match(store, "#", &cb));
+  CuAssertStrEquals(tc, "a/b b ", batch.topics);
+  retained_release(&batch);
+
+  /* An empty payload clears the message. */
+  p = mqtt_topic_payload_create("", 0);
+  CuAssertIntEquals(tc, 0, mqtt_topic_retained_set(store, "b", p));
+  mqtt_topic_payload_unref(p);
+  CuAssertPtrEquals(tc, NULL, mqtt_topic_retained_get(store, "b"));
+  mqtt_topic_payload_unref(two);
+
+  race.store = store;
+  pthread_create(&tid, NULL, &retained_reader, &race);
+  for (int i = 0; i < RETAINED_ROUNDS; ++i) {
+    memset(buf, 'a' + i % 26, 1 + i % 26);
+    p = mqtt_topic_payload_create(buf, 1 + i % 26);
+    sprintf(buf, "race/%d", i % 8);
+    mqtt_topic_retained_set(store, buf, i % 5 == 4 ? NULL : p);
+    mqtt_topic_payload_unref(p);
+  }
+  atomic_store(&race.done, 1);
+  pthread_join(tid, NULL);
+  CuAssertIntEquals(tc, 0, race.bad);
+
+  mqtt_topic_retained_destroy(store);
+  mqtt_epoch_barrier();
+}
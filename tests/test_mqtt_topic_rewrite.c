@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "CuTest.h"
+
+#include "mqtt_topic_rewrite.h"
+
+static void rewrite_expect(CuTest *tc, mqtt_topic_rewrite_s *rw,
+                           const char *topic, const char *expected) {
+  char buf[64], out[64];
+  int len;
+
+  strcpy(buf, topic);
+  len = mqtt_topic_rewrite_apply(rw, buf, out, sizeof(out));
+  CuAssertStrEquals(tc, topic, buf);
+  if (expected == NULL) {
+    CuAssertIntEquals(tc, -1, len);
+    return;
+  }
+  CuAssertIntEquals(tc, strlen(expected), len);
+  CuAssertStrEquals(tc, expected, out);
+}
+
+/**
+ * Test rewriting topics with the most specific matching rule.
+ */
+void Test_mqtt_topic_rewrite(CuTest *tc) {
+  mqtt_topic_rewrite_s *rw = mqtt_topic_rewrite_create();
+  mqtt_topic_segment_s *root, *seg;
+  mqtt_topic_span_s spans[2];
+  char topic[64], out[8];
+  int n;
+
+  CuAssertIntEquals(tc, 0, mqtt_topic_rewrite_add(rw, "legacy/+/data",
+                                                  "v2/{1}/telemetry"));
+  CuAssertIntEquals(tc, 0, mqtt_topic_rewrite_add(rw, "legacy/#",
+                                                  "v2/other/{1}"));
+  CuAssertIntEquals(tc, 0, mqtt_topic_rewrite_add(rw, "legacy/42/data",
+                                                  "v2/answer"));
+  CuAssertIntEquals(tc, 0, mqtt_topic_rewrite_add(rw, "+/+/swap",
+                                                  "{2}/{1}/{x}/{0}"));
+  CuAssertIntEquals(tc, 0, mqtt_topic_rewrite_add(rw, "#", "all/{1}"));
+  CuAssertIntEquals(tc, 1, mqtt_topic_rewrite_add(rw, "a/+", "{2}"));
+
+  rewrite_expect(tc, rw, "legacy/7/data", "v2/7/telemetry");
+  rewrite_expect(tc, rw, "legacy/42/data", "v2/answer");
+  rewrite_expect(tc, rw, "legacy/7/data/x", "v2/other/7/data/x");
+  rewrite_expect(tc, rw, "legacy", "v2/other/");
+  rewrite_expect(tc, rw, "ab/cd/swap", "cd/ab/{x}/{0}");
+  rewrite_expect(tc, rw, "other/topic", "all/other/topic");
+  rewrite_expect(tc, rw, "$SYS/x", NULL);
+
+  /* Longer results are measured but not written. */
+  strcpy(topic, "legacy/7/data");
+  CuAssertIntEquals(tc, 14, mqtt_topic_rewrite_apply(rw, topic, out,
+                                                     sizeof(out)));
+
+  /* Replacing and removing rules. */
+  CuAssertIntEquals(tc, 0, mqtt_topic_rewrite_add(rw, "legacy/+/data",
+                                                  "v3/{1}"));
+  rewrite_expect(tc, rw, "legacy/7/data", "v3/7");
+  CuAssertIntEquals(tc, 0, mqtt_topic_rewrite_remove(rw, "legacy/+/data"));
+  CuAssertIntEquals(tc, 1, mqtt_topic_rewrite_remove(rw, "legacy/+/data"));
+  rewrite_expect(tc, rw, "legacy/7/data", "v2/other/7/data");
+  CuAssertIntEquals(tc, 0, mqtt_topic_rewrite_remove(rw, "#"));
+  rewrite_expect(tc, rw, "other/topic", NULL);
+  mqtt_topic_rewrite_destroy(rw);
+
+  /* Backtracking out of a more specific branch that fails deeper. */
+  root = mqtt_topic_segment_create();
+  sprintf(topic, "a/b/c/d");
+  mqtt_topic_find_or_add(&seg, root, topic, 1);
+  sprintf(topic, "a/+/c/+");
+  mqtt_topic_find_or_add(&seg, root, topic, 1);
+  seg->data = root;
+  sprintf(topic, "a/b/c/e");
+  CuAssertPtrEquals(tc, seg, mqtt_topic_best_match(root, topic, spans, 2, &n));
+  CuAssertIntEquals(tc, 2, n);
+  CuAssertIntEquals(tc, 2, spans[0].offset);
+  CuAssertIntEquals(tc, 1, spans[0].len);
+  CuAssertIntEquals(tc, 6, spans[1].offset);
+  CuAssertIntEquals(tc, 1, spans[1].len);
+  sprintf(topic, "a/b/x/e");
+  CuAssertPtrEquals(tc, NULL, mqtt_topic_best_match(root, topic, spans, 2,
+                                                    &n));
+  CuAssertIntEquals(tc, 0, n);
+  mqtt_topic_segment_destroy(root);
+}
@@ -0,0 +1,130 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "CuTest.h"
+
+#include "mqtt_topic_routes.h"
+
+/* Enough peers for node sets of more than one word. */
+#define PEERS 70
+#define FILTERS_PER_PEER 6
+
+static char *route_filters[] = {
+  "a", "a/b", "a/+", "a/#", "+/b", "#", "b/c/d", "b/+/d", "b/#", "c",
+  "+/+", "$SYS/x",
+};
+
+static char *route_topics[] = {
+  "a", "a/b", "a/c", "b/c/d", "b/x/d", "c", "c/b", "$SYS/x", "d/e/f",
+};
+
+#define ROUTE_COUNT(a) (sizeof(a) / sizeof((a)[0]))
+
+static void route_hit(void *data, char *topic, mqtt_topic_segment_s *segment) {
+  if (segment->data) {
+    *(int *)data = 1;
+  }
+}
+
+/**
+ * routes_agree checks the route table against one tree per peer.
+ */
+static void routes_agree(CuTest *tc, mqtt_topic_routes_s *t,
+                         mqtt_topic_segment_s **peers) {
+  uint64_t dest[2];
+  char buf[64];
+  int hit, count;
+
+  for (int i = 0; i < ROUTE_COUNT(route_topics); ++i) {
+    strcpy(buf, route_topics[i]);
+    count = mqtt_topic_routes_match(t, buf, dest);
+    for (int node = 0; node < PEERS; ++node) {
+      mqtt_iter_cb_s cb = { .data = &hit, .fn = &route_hit };
+
+      hit = 0;
+      strcpy(buf, route_topics[i]);
+      mqtt_topic_matching_iter(peers[node], buf, &cb);
+      CuAssertIntEquals(tc, hit, (int)((dest[node / 64] >> (node % 64)) & 1));
+      count -= hit;
+    }
+    CuAssertIntEquals(tc, 0, count);
+  }
+}
+
+static void peer_set(mqtt_topic_segment_s *peer, const char *filter,
+                     void *data) {
+  mqtt_topic_segment_s *seg;
+  char buf[64];
+
+  strcpy(buf, filter);
+  mqtt_topic_find_or_add(&seg, peer, buf, 1);
+  seg->data = data;
+  if (data == NULL) {
+    mqtt_topic_segment_remove(seg);
+  }
+}
+
+/**
+ * Test merging the filters of simulated peers into one route table.
+ */
+void Test_mqtt_topic_routes(CuTest *tc) {
+  mqtt_topic_segment_s *peers[PEERS], *seg;
+  mqtt_topic_routes_s *t;
+  unsigned int seed = 7;
+  const char *filter;
+  uint64_t dest[2];
+  char buf[64];
+  int had;
+
+  t = mqtt_topic_routes_create(PEERS);
+  CuAssertIntEquals(tc, 2, mqtt_topic_routes_words(t));
+  for (int node = 0; node < PEERS; ++node) {
+    peers[node] = mqtt_topic_segment_create();
+    for (int i = 0; i < FILTERS_PER_PEER; ++i) {
+      filter = route_filters[rand_r(&seed) % ROUTE_COUNT(route_filters)];
+      CuAssertIntEquals(tc, 0, mqtt_topic_routes_add(t, filter, node));
+      peer_set(peers[node], filter, peers[node]);
+    }
+  }
+  routes_agree(tc, t, peers);
+
+  /* Node IDs outside the table are refused, leaving it unchanged. */
+  CuAssertIntEquals(tc, 1, mqtt_topic_routes_add(t, "a/b", PEERS));
+  CuAssertIntEquals(tc, 1, mqtt_topic_routes_add(t, "a/b", -1));
+  CuAssertIntEquals(tc, 1, mqtt_topic_routes_remove(t, "a/b", PEERS));
+  CuAssertIntEquals(tc, 1, mqtt_topic_routes_remove_node(t, -1));
+  routes_agree(tc, t, peers);
+
+  /* Peers drop some of their filters... */
+  for (int node = 0; node < PEERS; node += 3) {
+    filter = route_filters[rand_r(&seed) % ROUTE_COUNT(route_filters)];
+    strcpy(buf, filter);
+    had = mqtt_topic_find_or_add(&seg, peers[node], buf, 0) == 0 &&
+          seg->data != NULL;
+    CuAssertIntEquals(tc, had ? 0 : 1,
+                      mqtt_topic_routes_remove(t, filter, node));
+    peer_set(peers[node], filter, NULL);
+  }
+  routes_agree(tc, t, peers);
+
+  /* ...and some leave altogether. */
+  for (int node = 1; node < PEERS; node += 4) {
+    CuAssertIntEquals(tc, 0, mqtt_topic_routes_remove_node(t, node));
+    mqtt_topic_segment_destroy(peers[node]);
+    peers[node] = mqtt_topic_segment_create();
+  }
+  routes_agree(tc, t, peers);
+
+  for (int node = 0; node < PEERS; ++node) {
+    mqtt_topic_routes_remove_node(t, node);
+  }
+  strcpy(buf, "a/b");
+  CuAssertIntEquals(tc, 0, mqtt_topic_routes_match(t, buf, dest));
+  CuAssertIntEquals(tc, 1, mqtt_topic_routes_remove(t, "a/b", 0));
+
+  for (int node = 0; node < PEERS; ++node) {
+    mqtt_topic_segment_destroy(peers[node]);
+  }
+  mqtt_topic_routes_destroy(t);
+}
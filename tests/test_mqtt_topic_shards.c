@@ -0,0 +1,138 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "CuTest.h"
+
+#include "mqtt_topic_shards.h"
+
+static char *shard_topics[] = {
+  "a",
+  "a/b",
+  "a/c",
+  "b/c",
+  "b/c/zoo",
+  "+/c",
+  "b/#",
+  "#",
+  "foo/+/baz",
+  "foo/bar/baz",
+  "$SYS/test",
+};
+
+static char *shard_patterns[] = {
+  "a",
+  "a/b",
+  "b/c",
+  "+/c",
+  "b/#",
+  "#",
+  "foo/bar/baz",
+  "+",
+};
+
+static void set_data(void *data, char *topic, mqtt_topic_segment_s *segment) {
+  segment->data = data;
+}
+
+static void count(void *data, char *topic, mqtt_topic_segment_s *segment) {
+  ++(*(int *)data);
+}
+
+/**
+ * Sharded matching agrees with matching a single tree.
+ */
+void Test_mqtt_topic_shards_matching_iter(CuTest *tc) {
+  mqtt_topic_segment_s *root = mqtt_topic_segment_create(), *seg;
+  mqtt_topic_shards_s *shards = mqtt_topic_shards_create(8, 1);
+  char buf[64], msg[128];
+  CuAssertPtrNotNull(tc, shards);
+  CuAssertPtrEquals(tc, NULL, mqtt_topic_shards_create(0, 1));
+  CuAssertPtrEquals(tc, NULL, mqtt_topic_shards_create(-1, 1));
+
+  for (int i = 0; i < sizeof(shard_topics) / sizeof(shard_topics[0]); ++i) {
+    mqtt_iter_cb_s cb = { .data = root, .fn = &set_data };
+    strcpy(buf, shard_topics[i]);
+    CuAssertIntEquals(tc, 0, mqtt_topic_shards_update(shards, buf, &cb));
+    strcpy(buf, shard_topics[i]);
+    mqtt_topic_find_or_add(&seg, root, buf, 1);
+    seg->data = root;
+  }
+
+  for (int i = 0; i < sizeof(shard_patterns) / sizeof(shard_patterns[0]); ++i) {
+    int expected = 0, actual = 0;
+    mqtt_iter_cb_s cb = { .data = &expected, .fn = &count };
+    strcpy(buf, shard_patterns[i]);
+    mqtt_topic_matching_iter(root, buf, &cb);
+    cb.data = &actual;
+    mqtt_topic_shards_matching_iter(shards, buf, &cb);
+    sprintf(msg, "'%s': sharded match count", shard_patterns[i]);
+    CuAssertIntEquals_Msg(tc, msg, expected, actual);
+  }
+
+  /* Clearing the data unsubscribes. */
+  mqtt_iter_cb_s clear = { .data = NULL, .fn = &set_data };
+  strcpy(buf, "b/c/zoo");
+  mqtt_topic_shards_update(shards, buf, &clear);
+  int total = 0;
+  mqtt_iter_cb_s cb = { .data = &total, .fn = &count };
+  mqtt_topic_shards_iter(shards, &cb);
+  /* The 17 segments of shard_topics, less b/c/zoo. */
+  CuAssertIntEquals(tc, 17 - 1, total);
+
+  mqtt_topic_shards_destroy(shards);
+  mqtt_topic_segment_destroy(root);
+}
+
+#define SHARD_THREADS 4
+#define SHARD_TOPICS 500
+
+typedef struct {
+  mqtt_topic_shards_s *shards;
+  int id;
+} shard_worker_s;
+
+static void *shard_worker(void *arg) {
+  shard_worker_s *w = arg;
+  mqtt_iter_cb_s sub = { .data = w, .fn = &set_data };
+  mqtt_iter_cb_s unsub = { .data = NULL, .fn = &set_data };
+  char topic[64];
+
+  for (int i = 0; i < SHARD_TOPICS; ++i) {
+    sprintf(topic, "t%d/%d/x", w->id, i);
+    mqtt_topic_shards_update(w->shards, topic, &sub);
+  }
+  /* Unsubscribe from every other topic. */
+  for (int i = 0; i < SHARD_TOPICS; i += 2) {
+    sprintf(topic, "t%d/%d/x", w->id, i);
+    mqtt_topic_shards_update(w->shards, topic, &unsub);
+  }
+  return NULL;
+}
+
+/**
+ * Threads updating the sharded tree concurrently.
+ */
+void Test_mqtt_topic_shards_concurrent(CuTest *tc) {
+  mqtt_topic_shards_s *shards = mqtt_topic_shards_create(4, 2);
+  pthread_t tids[SHARD_THREADS];
+  shard_worker_s workers[SHARD_THREADS];
+  char pattern[16];
+
+  for (int i = 0; i < SHARD_THREADS; ++i) {
+    workers[i] = (shard_worker_s){ .shards = shards, .id = i };
+    pthread_create(&tids[i], NULL, &shard_worker, &workers[i]);
+  }
+  for (int i = 0; i < SHARD_THREADS; ++i) {
+    pthread_join(tids[i], NULL);
+  }
+
+  for (int i = 0; i < SHARD_THREADS; ++i) {
+    int matches = 0;
+    mqtt_iter_cb_s cb = { .data = &matches, .fn = &count };
+    sprintf(pattern, "t%d/+/x", i);
+    mqtt_topic_shards_matching_iter(shards, pattern, &cb);
+    CuAssertIntEquals(tc, SHARD_TOPICS / 2, matches);
+  }
+  mqtt_topic_shards_destroy(shards);
+}
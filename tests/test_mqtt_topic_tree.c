@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "CuTest.h"
@@ -300,3 +301,1617 @@ void Test_mqtt_topic_remove(CuTest *tc){
   CuAssertIntEquals_Msg(tc, "A sibling topic should not have been removed.",
                         0, mqtt_topic_find_or_add(&seg, root, topics[7], 0));
 }
+
+/**
+ * Test removal of whole subtrees by prefix.
+ */
+void Test_mqtt_topic_remove_prefix(CuTest *tc) {
+  mqtt_topic_segment_s *seg = NULL;
+  mqtt_topic_segment_s *root = NULL;
+  init();
+
+  root = mqtt_topic_segment_create();
+  CuAssertPtrNotNull(tc, root);
+  for (int i = 0; i < ARRAY_EL_COUNT(topics); ++i) {
+    mqtt_topic_find_or_add(&seg, root, topics[i], 1);
+  }
+
+  int count = 0;
+  mqtt_iter_cb_s cb = {
+    .data = &count,
+    .fn = &counter,
+  };
+  /* b, b/c, b/d, b/c/zoo, b/# and b/$SYS. */
+  CuAssertIntEquals(tc, 0, mqtt_topic_remove_prefix(root, strdup("b/#"), &cb));
+  CuAssertIntEquals(tc, 6, count);
+  CuAssertIntEquals(tc, 1, mqtt_topic_find_or_add(&seg, root, topics[5], 0));
+  CuAssertIntEquals(tc, 0, mqtt_topic_find_or_add(&seg, root, topics[3], 0));
+  CuAssertIntEquals(tc, 1, mqtt_topic_remove_prefix(root, strdup("b/#"), &cb));
+
+  /* Only the a/b subtree goes; a/c keeps a alive. */
+  CuAssertIntEquals(tc, 0, mqtt_topic_remove_prefix(root, strdup("a/b"), NULL));
+  CuAssertIntEquals(tc, 1, mqtt_topic_find_or_add(&seg, root, topics[3], 0));
+  CuAssertIntEquals(tc, 0, mqtt_topic_find_or_add(&seg, root, topics[4], 0));
+
+  /* Empty ancestors are cleaned up, ancestors with data are not. */
+  mqtt_topic_find_or_add(&seg, root, strdup("t/42/x/y"), 1);
+  mqtt_topic_find_or_add(&seg, root, strdup("u"), 1);
+  seg->data = root;
+  mqtt_topic_find_or_add(&seg, root, strdup("u/1/2"), 1);
+  CuAssertIntEquals(tc, 0, mqtt_topic_remove_prefix(root, strdup("t/42/#"), NULL));
+  CuAssertIntEquals(tc, 1, mqtt_topic_find_or_add(&seg, root, strdup("t"), 0));
+  CuAssertIntEquals(tc, 0, mqtt_topic_remove_prefix(root, strdup("u/1/#"), NULL));
+  CuAssertIntEquals(tc, 0, mqtt_topic_find_or_add(&seg, root, strdup("u"), 0));
+
+  count = 0;
+  CuAssertIntEquals(tc, 0, mqtt_topic_remove_prefix(root, strdup("#"), NULL));
+  mqtt_topic_iter(root, &cb);
+  CuAssertIntEquals(tc, 0, count);
+  mqtt_topic_segment_destroy(root);
+}
+
+int has_data(void *data, char *topic, mqtt_topic_segment_s *segment) {
+  return segment->data == data;
+}
+
+/**
+ * Test predicate-based bulk removal.
+ */
+void Test_mqtt_topic_remove_if(CuTest *tc) {
+  mqtt_topic_segment_s *seg = NULL;
+  mqtt_topic_segment_s *root = NULL;
+  int session = 0;
+  init();
+
+  root = mqtt_topic_segment_create();
+  CuAssertPtrNotNull(tc, root);
+  for (int i = 0; i < ARRAY_EL_COUNT(topics); ++i) {
+    mqtt_topic_find_or_add(&seg, root, topics[i], 1);
+  }
+
+  /* Mark foo/+/baz and b/c as belonging to the session. */
+  mqtt_topic_find_or_add(&seg, root, topics[18], 0);
+  seg->data = &session;
+  mqtt_topic_find_or_add(&seg, root, topics[6], 0);
+  seg->data = &session;
+  mqtt_topic_find_or_add(&seg, root, strdup("x/y/z"), 1);
+  seg->data = &session;
+
+  int count = 0;
+  mqtt_iter_cb_s cb = {
+    .data = &count,
+    .fn = &counter,
+  };
+  mqtt_topic_pred_s pred = {
+    .data = &session,
+    .fn = &has_data,
+  };
+  mqtt_topic_remove_if(root, &pred, &cb);
+  /* foo/+/baz, foo/+/baz/#, b/c, b/c/zoo and x/y/z. */
+  CuAssertIntEquals(tc, 5, count);
+
+  CuAssertIntEquals(tc, 1, mqtt_topic_find_or_add(&seg, root, topics[18], 0));
+  CuAssertIntEquals(tc, 1, mqtt_topic_find_or_add(&seg, root, topics[8], 0));
+  CuAssertIntEquals(tc, 0, mqtt_topic_find_or_add(&seg, root, topics[16], 0));
+  CuAssertIntEquals(tc, 0, mqtt_topic_find_or_add(&seg, root, topics[7], 0));
+  CuAssertIntEquals_Msg(tc, "Emptied ancestors should have been removed.",
+                        1, mqtt_topic_find_or_add(&seg, root, topics[17], 0));
+  CuAssertIntEquals_Msg(tc, "Emptied ancestors should have been removed.",
+                        1, mqtt_topic_find_or_add(&seg, root, strdup("x"), 0));
+
+  /* The 25 segments of topics, plus x, x/y and x/y/z, less the
+   * removed subtrees and foo/+, x and x/y. */
+  count = 0;
+  mqtt_topic_iter(root, &cb);
+  CuAssertIntEquals(tc, 28 - 8, count);
+  mqtt_topic_segment_destroy(root);
+}
+
+/**
+ * Test deferred collection of empty segments.
+ */
+void Test_mqtt_topic_gc(CuTest *tc) {
+  mqtt_topic_segment_s *seg = NULL, *leaf = NULL;
+  mqtt_topic_segment_s *root = NULL;
+
+  root = mqtt_topic_segment_create();
+  CuAssertPtrNotNull(tc, root);
+  mqtt_topic_gc_enable(root, 10);
+
+  mqtt_topic_find_or_add(&seg, root, strdup("keep"), 1);
+  seg->data = root;
+  mqtt_topic_find_or_add(&leaf, root, strdup("keep/a/b"), 1);
+  CuAssertFalse(tc, mqtt_topic_segment_remove(leaf));
+  CuAssertIntEquals_Msg(tc, "Removal should be deferred.",
+                        0, mqtt_topic_find_or_add(&seg, root, strdup("keep/a/b"), 0));
+  CuAssertIntEquals(tc, 0, mqtt_topic_gc_sweep(root, 5, 100));
+
+  /* Resubscribing reuses the pending segment. */
+  mqtt_topic_find_or_add(&seg, root, strdup("keep/a/b"), 1);
+  CuAssertPtrEquals(tc, leaf, seg);
+  seg->data = root;
+  CuAssertIntEquals(tc, 0, mqtt_topic_gc_sweep(root, 20, 100));
+  CuAssertIntEquals(tc, 0, mqtt_topic_find_or_add(&seg, root, strdup("keep/a/b"), 0));
+
+  /* Once it stays empty long enough, it goes along with keep/a. */
+  leaf->data = NULL;
+  mqtt_topic_segment_remove(leaf);
+  CuAssertIntEquals(tc, 0, mqtt_topic_gc_sweep(root, 29, 100));
+  CuAssertIntEquals(tc, 2, mqtt_topic_gc_sweep(root, 30, 100));
+  CuAssertIntEquals(tc, 1, mqtt_topic_find_or_add(&seg, root, strdup("keep/a"), 0));
+  CuAssertIntEquals(tc, 0, mqtt_topic_find_or_add(&seg, root, strdup("keep"), 0));
+
+  /* Segments reused by adding a child are not collected. */
+  mqtt_topic_find_or_add(&leaf, root, strdup("x/y"), 1);
+  mqtt_topic_segment_remove(leaf);
+  mqtt_topic_find_or_add(&seg, root, strdup("x/y/z"), 1);
+  CuAssertIntEquals(tc, 0, mqtt_topic_gc_sweep(root, 100, 100));
+  CuAssertIntEquals(tc, 0, mqtt_topic_find_or_add(&seg, root, strdup("x/y/z"), 0));
+
+  /* The budget bounds the work done by a sweep. */
+  mqtt_topic_segment_remove(seg);
+  CuAssertIntEquals(tc, 2, mqtt_topic_gc_sweep(root, 200, 2));
+  CuAssertIntEquals(tc, 1, mqtt_topic_find_or_add(&seg, root, strdup("x/y"), 0));
+  CuAssertIntEquals(tc, 0, mqtt_topic_find_or_add(&seg, root, strdup("x"), 0));
+  CuAssertIntEquals(tc, 1, mqtt_topic_gc_sweep(root, 200, 2));
+  CuAssertIntEquals(tc, 1, mqtt_topic_find_or_add(&seg, root, strdup("x"), 0));
+
+  /* Pending segments are released with the tree. */
+  mqtt_topic_find_or_add(&leaf, root, strdup("p/q"), 1);
+  mqtt_topic_segment_remove(leaf);
+  mqtt_topic_remove_prefix(root, strdup("p/#"), NULL);
+  mqtt_topic_find_or_add(&leaf, root, strdup("r/s"), 1);
+  mqtt_topic_segment_remove(leaf);
+  mqtt_topic_segment_destroy(root);
+}
+
+/**
+ * Test matching through prepared topics.
+ */
+void Test_mqtt_topic_prepared(CuTest *tc) {
+  mqtt_topic_segment_s *seg = NULL;
+  mqtt_topic_segment_s *root = NULL;
+  mqtt_topic_prepared_s *p;
+  init();
+
+  root = mqtt_topic_segment_create();
+  CuAssertPtrNotNull(tc, root);
+  for (int i = 0; i < ARRAY_EL_COUNT(topics); ++i) {
+    mqtt_topic_find_or_add(&seg, root, topics[i], 1);
+  }
+
+  CuAssertPtrEquals(tc, NULL, mqtt_topic_prepare(root, "a/+"));
+  CuAssertPtrEquals(tc, NULL, mqtt_topic_prepare(root, "a/#"));
+
+  /* Prepared matching agrees with mqtt_topic_matching_iter. */
+  char *literals[] = { "", "/", "a", "b/c", "b/c/zoo", "//", "x/y/z",
+                       "foo", "foo/bar", "foo/bar/baz", "foo/bar/baz/q",
+                       "$SYS/test" };
+  for (int i = 0; i < ARRAY_EL_COUNT(literals); ++i) {
+    int expected = 0, actual = 0;
+    mqtt_iter_cb_s cb = { .data = &expected, .fn = &counter };
+    mqtt_topic_matching_iter(root, strdup(literals[i]), &cb);
+
+    p = mqtt_topic_prepare(root, literals[i]);
+    CuAssertPtrNotNull(tc, p);
+    cb.data = &actual;
+    mqtt_topic_prepared_matching_iter(p, &cb);
+    sprintf(msg, "'%s': prepared match count", literals[i]);
+    CuAssertIntEquals_Msg(tc, msg, expected, actual);
+    mqtt_topic_prepared_destroy(p);
+  }
+
+  /* Matches reported through a prepared topic carry topic strings. */
+  p = mqtt_topic_prepare(root, "foo/bar/baz");
+  cb_data_s data = {
+    .count = 0,
+    .match = pattern_matches[9],
+    .tc = tc,
+  };
+  mqtt_iter_cb_s cb = {
+    .data = &data,
+    .fn = &matcher,
+  };
+  mqtt_topic_prepared_matching_iter(p, &cb);
+  CuAssertIntEquals(tc, 3, data.count);
+
+  /* Prepared topics follow changes to the tree. */
+  unsigned long generation = mqtt_topic_generation(root);
+  mqtt_topic_find_or_add(&seg, root, strdup("foo/bar/baz"), 1);
+  CuAssertTrue(tc, generation != mqtt_topic_generation(root));
+  mqtt_topic_find_or_add(&seg, root, topics[19], 0);
+  mqtt_topic_segment_remove(seg);
+  int count = 0;
+  cb.data = &count;
+  cb.fn = &counter;
+  /* foo/# and the new foo/bar/baz. Removing foo/+/baz/# took the
+   * empty foo/+/baz with it. */
+  mqtt_topic_prepared_matching_iter(p, &cb);
+  CuAssertIntEquals(tc, 2, count);
+  mqtt_topic_prepared_destroy(p);
+  mqtt_topic_segment_destroy(root);
+}
+
+/**
+ * Test matching with compiled patterns.
+ */
+void Test_mqtt_topic_pattern_matching_iter(CuTest *tc) {
+  mqtt_topic_segment_s *seg = NULL;
+  mqtt_topic_segment_s *root = NULL;
+  init();
+
+  root = mqtt_topic_segment_create();
+  CuAssertPtrNotNull(tc, root);
+  for (int i = 0; i < ARRAY_EL_COUNT(topics); ++i) {
+    mqtt_topic_find_or_add(&seg, root, topics[i], 1);
+  }
+
+  for (int i = 0; i < ARRAY_EL_COUNT(pattern_matches); ++i) {
+    mqtt_topic_pattern_s *p = mqtt_topic_pattern_compile(pattern_matches[i].pattern);
+    CuAssertPtrNotNull(tc, p);
+    /* Compiled patterns may be matched any number of times. */
+    for (int j = 0; j < 2; ++j) {
+      cb_data_s data = {
+        .count = 0,
+        .match = pattern_matches[i],
+        .tc = tc,
+      };
+      mqtt_iter_cb_s cb = {
+        .data = &data,
+        .fn = &matcher,
+      };
+      mqtt_topic_pattern_matching_iter(root, p, &cb);
+      sprintf(msg, "'%s': compiled pat check", pattern_matches[i].pattern);
+      CuAssertIntEquals_Msg(tc, msg,
+                            expected_count(&pattern_matches[i]), data.count);
+    }
+    mqtt_topic_pattern_destroy(p);
+  }
+  mqtt_topic_segment_destroy(root);
+}
+
+/**
+ * Test trees with wide segments, whose children are kept in a hash
+ * map.
+ */
+void Test_mqtt_topic_wide(CuTest *tc) {
+  mqtt_topic_segment_s *seg = NULL;
+  mqtt_topic_segment_s *root = NULL;
+  init();
+
+  root = mqtt_topic_segment_create();
+  CuAssertPtrNotNull(tc, root);
+  CuAssertIntEquals(tc, 0, mqtt_topic_make_wide(root));
+  mqtt_topic_find_or_add(&seg, root, strdup("b"), 1);
+  CuAssertIntEquals(tc, 0, mqtt_topic_make_wide(seg));
+  CuAssertIntEquals(tc, 0, mqtt_topic_make_wide(seg));
+  for (int i = 0; i < ARRAY_EL_COUNT(topics); ++i) {
+    CuAssertIntEquals(tc, 0, mqtt_topic_find_or_add(&seg, root, topics[i], 1));
+  }
+  /* Segments that already have children stay as they are. */
+  mqtt_topic_find_or_add(&seg, root, strdup("foo"), 0);
+  CuAssertIntEquals(tc, 1, mqtt_topic_make_wide(seg));
+
+  for (int i = 0; i < ARRAY_EL_COUNT(pattern_matches); ++i) {
+    mqtt_topic_pattern_s *p =
+        mqtt_topic_pattern_compile(pattern_matches[i].pattern);
+    cb_data_s data = {
+      .count = 0,
+      .match = pattern_matches[i],
+      .tc = tc,
+    };
+    mqtt_iter_cb_s cb = {
+      .data = &data,
+      .fn = &matcher,
+    };
+    mqtt_topic_matching_iter(root, pattern_matches[i].pattern, &cb);
+    sprintf(msg, "'%s': wide pat check", pattern_matches[i].pattern);
+    CuAssertIntEquals_Msg(tc, msg,
+                          expected_count(&pattern_matches[i]), data.count);
+
+    /* Compiled patterns look children up by the hash of each level. */
+    data.count = 0;
+    mqtt_topic_pattern_matching_iter(root, p, &cb);
+    CuAssertIntEquals_Msg(tc, msg,
+                          expected_count(&pattern_matches[i]), data.count);
+    mqtt_topic_pattern_destroy(p);
+  }
+
+  int count = 0;
+  mqtt_iter_cb_s cb = { .data = &count, .fn = &counter };
+  mqtt_topic_iter(root, &cb);
+  CuAssertIntEquals(tc, 25, count);
+
+  /* So do prepared topics. */
+  char *literals[] = { "b/c", "b/c/zoo", "foo/bar/baz", "$SYS/test" };
+  for (int i = 0; i < ARRAY_EL_COUNT(literals); ++i) {
+    mqtt_topic_prepared_s *p = mqtt_topic_prepare(root, literals[i]);
+    int expected = 0;
+
+    cb.data = &expected;
+    mqtt_topic_matching_iter(root, strdup(literals[i]), &cb);
+    count = 0;
+    cb.data = &count;
+    mqtt_topic_prepared_matching_iter(p, &cb);
+    sprintf(msg, "'%s': wide prepared match count", literals[i]);
+    CuAssertIntEquals_Msg(tc, msg, expected, count);
+    mqtt_topic_prepared_destroy(p);
+  }
+  cb.data = &count;
+
+  /* Removal works through wide parents, and removes wide segments. */
+  mqtt_topic_find_or_add(&seg, root, strdup("b/c/zoo"), 0);
+  mqtt_topic_segment_remove(seg);
+  CuAssertIntEquals(tc, 1, mqtt_topic_find_or_add(&seg, root,
+                                                  strdup("b/c/zoo"), 0));
+  CuAssertIntEquals(tc, 0, mqtt_topic_remove_prefix(root, strdup("b"), NULL));
+  count = 0;
+  mqtt_topic_iter(root, &cb);
+  /* Less b, b/c, b/d, b/#, b/$SYS and b/c/zoo. */
+  CuAssertIntEquals(tc, 25 - 6, count);
+
+  mqtt_topic_segment_destroy(root);
+}
+
+static void collect(void *data, char *topic, mqtt_topic_segment_s *segment) {
+  char *buf = data;
+
+  strcat(buf, topic);
+  strcat(buf, " ");
+}
+
+/**
+ * Test segment strings on either side of the inline length.
+ */
+void Test_mqtt_topic_segment_lengths(CuTest *tc) {
+  /* 19, 20 and 40 characters. */
+  char *keys[] = {
+    "aaaaaaaaaaaaaaaaaaa",
+    "aaaaaaaaaaaaaaaaaaaa",
+    "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa",
+    "b",
+    "ab",
+  };
+  mqtt_topic_segment_s *root, *seg;
+  char topic[64], buf[256] = "";
+
+  root = mqtt_topic_segment_create();
+  for (int i = 0; i < ARRAY_EL_COUNT(keys); ++i) {
+    sprintf(topic, "%s/x", keys[i]);
+    CuAssertIntEquals(tc, 0, mqtt_topic_find_or_add(&seg, root, topic, 1));
+    CuAssertStrEquals(tc, keys[i], seg->parent->str);
+    CuAssertIntEquals(tc, strlen(keys[i]), seg->parent->len);
+    CuAssertTrue(tc, (seg->parent->str == seg->parent->inline_str) ==
+                     (strlen(keys[i]) < MQTT_TOPIC_INLINE_LENGTH));
+    seg->data = keys[i];
+  }
+  for (int i = 0; i < ARRAY_EL_COUNT(keys); ++i) {
+    sprintf(topic, "%s/x", keys[i]);
+    CuAssertIntEquals(tc, 0, mqtt_topic_find_or_add(&seg, root, topic, 0));
+    CuAssertPtrEquals(tc, keys[i], seg->data);
+  }
+  sprintf(topic, "a/x");
+  CuAssertIntEquals(tc, 1, mqtt_topic_find_or_add(&seg, root, topic, 0));
+
+  /* Children are still visited in strcmp order. */
+  mqtt_iter_cb_s cb = { .data = buf, .fn = &collect };
+  sprintf(topic, "+/x");
+  mqtt_topic_matching_iter(root, topic, &cb);
+  CuAssertStrEquals(tc,
+                    "aaaaaaaaaaaaaaaaaaa/x aaaaaaaaaaaaaaaaaaaa/x "
+                    "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa/x ab/x b/x ",
+                    buf);
+
+  sprintf(topic, "%s/x", keys[2]);
+  mqtt_topic_find_or_add(&seg, root, topic, 0);
+  seg->data = NULL;
+  mqtt_topic_segment_remove(seg);
+  CuAssertIntEquals(tc, 1, mqtt_topic_find_or_add(&seg, root, topic, 0));
+
+  mqtt_topic_segment_destroy(root);
+}
+
+/**
+ * Test chains of single-child segments, whose children tree is the
+ * child itself until a branch appears.
+ */
+void Test_mqtt_topic_chains(CuTest *tc) {
+  mqtt_topic_segment_s *root, *seg, *truck;
+  char topic[64];
+  int count = 0;
+  mqtt_iter_cb_s cb = { .data = &count, .fn = &counter };
+
+  root = mqtt_topic_segment_create();
+  sprintf(topic, "fleet/eu/west/truck/8812/can/engine/rpm");
+  CuAssertIntEquals(tc, 0, mqtt_topic_find_or_add(&seg, root, topic, 1));
+  seg->data = topic;
+  for (; seg->parent; seg = seg->parent) {
+    CuAssertPtrEquals(tc, &seg->rb_node,
+                      mqtt_rb_root(&seg->parent->children));
+    CuAssertPtrEquals(tc, NULL, mqtt_rb_left(&seg->rb_node));
+    CuAssertPtrEquals(tc, NULL, mqtt_rb_right(&seg->rb_node));
+  }
+
+  sprintf(topic, "fleet/eu/west/truck/8813");
+  CuAssertIntEquals(tc, 0, mqtt_topic_find_or_add(&seg, root, topic, 1));
+  truck = seg->parent;
+  CuAssertTrue(tc, mqtt_rb_left(mqtt_rb_root(&truck->children)) ||
+                   mqtt_rb_right(mqtt_rb_root(&truck->children)));
+  sprintf(topic, "fleet/eu/west/truck/8812/can/engine/rpm");
+  CuAssertIntEquals(tc, 0, mqtt_topic_find_or_add(&seg, root, topic, 0));
+  CuAssertPtrNotNull(tc, seg->data);
+
+  mqtt_topic_iter(root, &cb);
+  CuAssertIntEquals(tc, 9, count);
+
+  /* Removing the branch leaves the chain whole. */
+  sprintf(topic, "fleet/eu/west/truck/8813");
+  mqtt_topic_find_or_add(&seg, root, topic, 0);
+  mqtt_topic_segment_remove(seg);
+  count = 0;
+  mqtt_topic_iter(root, &cb);
+  CuAssertIntEquals(tc, 8, count);
+  sprintf(topic, "fleet/+/+/truck/+/can/#");
+  count = 0;
+  mqtt_topic_matching_iter(root, topic, &cb);
+  CuAssertIntEquals(tc, 3, count);
+
+  /* And removing the end of the chain removes all of it. */
+  sprintf(topic, "fleet/eu/west/truck/8812/can/engine/rpm");
+  mqtt_topic_find_or_add(&seg, root, topic, 0);
+  seg->data = NULL;
+  mqtt_topic_segment_remove(seg);
+  CuAssertPtrEquals(tc, NULL, mqtt_rb_root(&root->children));
+
+  mqtt_topic_segment_destroy(root);
+}
+
+typedef struct {
+  mqtt_topic_segment_s *segments[ARRAY_EL_COUNT(topics) + 4];
+  int count;
+} segment_set_s;
+
+static void segment_collect(void *data, char *topic,
+                            mqtt_topic_segment_s *segment) {
+  segment_set_s *set = data;
+  mqtt_topic_segment_s *found;
+
+  set->segments[set->count++] = segment;
+  /* The topic passed is the one the segment terminates. */
+  mqtt_topic_find_or_add(&found, set->segments[0], topic, 0);
+  if (found != segment) {
+    set->count = -1000;
+  }
+}
+
+static int segment_cmp(const void *a, const void *b) {
+  const void *pa = *(void *const *)a, *pb = *(void *const *)b;
+  return (pa > pb) - (pa < pb);
+}
+
+/**
+ * automaton_check checks that the automaton and the tree walk find
+ * the same segments for topic.
+ */
+static void automaton_check(CuTest *tc, mqtt_topic_segment_s *root,
+                            mqtt_topic_automaton_s *a, const char *topic) {
+  segment_set_s walked = { .segments = { root }, .count = 1 };
+  segment_set_s run = { .segments = { root }, .count = 1 };
+  mqtt_iter_cb_s cb = { .data = &walked, .fn = &segment_collect };
+  char buf[64];
+
+  strcpy(buf, topic);
+  mqtt_topic_matching_iter(root, buf, &cb);
+  cb.data = &run;
+  CuAssertIntEquals(tc, 0, mqtt_topic_automaton_matching_iter(a, topic, &cb));
+
+  sprintf(msg, "'%s': automaton check", topic);
+  CuAssertIntEquals_Msg(tc, msg, walked.count, run.count);
+  qsort(walked.segments, walked.count, sizeof(void *), &segment_cmp);
+  qsort(run.segments, run.count, sizeof(void *), &segment_cmp);
+  for (int i = 0; i < walked.count; ++i) {
+    CuAssertPtrEquals_Msg(tc, msg, walked.segments[i], run.segments[i]);
+  }
+}
+
+/**
+ * Test matching literal topics with an automaton, as the tree
+ * changes.
+ */
+void Test_mqtt_topic_automaton(CuTest *tc) {
+  char *literals[] = {
+    "", "/", "a", "b/c", "b/c/zoo", "b/d/zoo", "foo/bar/baz",
+    "foo/bar/baz/qux", "foo/x", "$SYS/test", "///", "z/c", "b/c/#",
+  };
+  mqtt_topic_segment_s *root, *seg;
+  mqtt_topic_automaton_s *a;
+  char topic[64];
+  init();
+
+  root = mqtt_topic_segment_create();
+  for (int i = 0; i < ARRAY_EL_COUNT(topics); ++i) {
+    mqtt_topic_find_or_add(&seg, root, topics[i], 1);
+  }
+  a = mqtt_topic_automaton_create(root);
+  CuAssertPtrNotNull(tc, a);
+
+  /* The second round runs on memoized states. */
+  for (int round = 0; round < 2; ++round) {
+    for (int i = 0; i < ARRAY_EL_COUNT(literals); ++i) {
+      automaton_check(tc, root, a, literals[i]);
+    }
+  }
+
+  sprintf(topic, "+/+/zoo");
+  mqtt_topic_find_or_add(&seg, root, topic, 1);
+  sprintf(topic, "b/#");
+  mqtt_topic_find_or_add(&seg, root, topic, 0);
+  mqtt_topic_segment_remove(seg);
+  /* Matches walk the tree for a while after a change, so enough rounds
+   * run for the kept states to be used again. */
+  for (int round = 0; round < 8; ++round) {
+    for (int i = 0; i < ARRAY_EL_COUNT(literals); ++i) {
+      automaton_check(tc, root, a, literals[i]);
+    }
+  }
+
+  /* Removing a pattern removes the segments it leaves empty. */
+  sprintf(topic, "+/+/zoo");
+  mqtt_topic_find_or_add(&seg, root, topic, 0);
+  mqtt_topic_segment_remove(seg);
+  for (int round = 0; round < 8; ++round) {
+    for (int i = 0; i < ARRAY_EL_COUNT(literals); ++i) {
+      automaton_check(tc, root, a, literals[i]);
+    }
+  }
+
+  mqtt_topic_automaton_destroy(a);
+  mqtt_topic_segment_destroy(root);
+}
+
+/**
+ * Test matching literal topics with an automaton on a tree whose
+ * wide segments find children by hash.
+ */
+void Test_mqtt_topic_automaton_wide(CuTest *tc) {
+  char *literals[] = {
+    "a", "b/c", "b/c/zoo", "b/d/zoo", "foo/bar/baz", "devices/42/temp",
+    "devices/7/temp", "devices/42",
+  };
+  mqtt_topic_segment_s *root, *seg;
+  mqtt_topic_automaton_s *a;
+  char topic[64];
+  init();
+
+  root = mqtt_topic_segment_create();
+  CuAssertIntEquals(tc, 0, mqtt_topic_make_wide(root));
+  sprintf(topic, "b");
+  mqtt_topic_find_or_add(&seg, root, topic, 1);
+  CuAssertIntEquals(tc, 0, mqtt_topic_make_wide(seg));
+  sprintf(topic, "devices");
+  mqtt_topic_find_or_add(&seg, root, topic, 1);
+  CuAssertIntEquals(tc, 0, mqtt_topic_make_wide(seg));
+  for (int i = 0; i < ARRAY_EL_COUNT(topics); ++i) {
+    mqtt_topic_find_or_add(&seg, root, topics[i], 1);
+  }
+  sprintf(topic, "devices/42/temp");
+  mqtt_topic_find_or_add(&seg, root, topic, 1);
+  sprintf(topic, "devices/+/temp");
+  mqtt_topic_find_or_add(&seg, root, topic, 1);
+  a = mqtt_topic_automaton_create(root);
+  CuAssertPtrNotNull(tc, a);
+
+  for (int round = 0; round < 2; ++round) {
+    for (int i = 0; i < ARRAY_EL_COUNT(literals); ++i) {
+      automaton_check(tc, root, a, literals[i]);
+    }
+  }
+
+  mqtt_topic_automaton_destroy(a);
+  mqtt_topic_segment_destroy(root);
+}
+
+/**
+ * Test collecting matches into reusable results.
+ */
+void Test_mqtt_topic_results(CuTest *tc) {
+  mqtt_topic_segment_s *root, *seg;
+  mqtt_topic_automaton_s *a;
+  mqtt_topic_results_s r;
+  mqtt_topic_segment_s **segments;
+  mqtt_iter_cb_s cb;
+  char topic[64];
+  init();
+
+  root = mqtt_topic_segment_create();
+  for (int i = 0; i < ARRAY_EL_COUNT(topics); ++i) {
+    mqtt_topic_find_or_add(&seg, root, topics[i], 1);
+  }
+
+  mqtt_topic_results_init(&r);
+  for (int i = 0; i < ARRAY_EL_COUNT(pattern_matches); ++i) {
+    mqtt_topic_results_clear(&r);
+    CuAssertIntEquals(tc, 0, mqtt_topic_matching_collect(
+                                 root, pattern_matches[i].pattern, &r));
+    sprintf(msg, "'%s': results check", pattern_matches[i].pattern);
+    CuAssertIntEquals_Msg(tc, msg, expected_count(&pattern_matches[i]),
+                          r.count);
+    for (int j = 0; pattern_matches[i].matches[j] >= 0; ++j) {
+      int found = 0;
+      mqtt_topic_find_or_add(&seg, root, topics[pattern_matches[i].matches[j]],
+                             0);
+      for (int k = 0; k < r.count; ++k) {
+        found += (r.segments[k] == seg);
+      }
+      CuAssertIntEquals_Msg(tc, msg, 1, found);
+    }
+  }
+
+  /* Results accumulate until cleared, and keep their array. */
+  cb = mqtt_topic_results_cb(&r);
+  mqtt_topic_results_clear(&r);
+  mqtt_topic_iter(root, &cb);
+  CuAssertIntEquals(tc, 25, r.count);
+  mqtt_topic_iter(root, &cb);
+  CuAssertIntEquals(tc, 50, r.count);
+  segments = r.segments;
+  mqtt_topic_results_clear(&r);
+  mqtt_topic_iter(root, &cb);
+  CuAssertPtrEquals(tc, segments, r.segments);
+
+  a = mqtt_topic_automaton_create(root);
+  mqtt_topic_results_clear(&r);
+  sprintf(topic, "foo/bar/baz");
+  CuAssertIntEquals(tc, 0, mqtt_topic_automaton_matching_iter(a, topic, &cb));
+  CuAssertIntEquals(tc, 3, r.count);
+  CuAssertIntEquals(tc, 0, r.failed);
+  mqtt_topic_automaton_destroy(a);
+
+  mqtt_topic_results_free(&r);
+  CuAssertPtrEquals(tc, NULL, r.segments);
+  mqtt_topic_segment_destroy(root);
+}
+
+typedef struct {
+  char topics[256];
+  char last[64];
+} scan_page_s;
+
+static void scan_collect(void *data, char *topic,
+                         mqtt_topic_segment_s *segment) {
+  scan_page_s *page = data;
+
+  strcat(page->topics, topic);
+  strcat(page->topics, " ");
+  strcpy(page->last, topic);
+}
+
+static int scan_page(mqtt_topic_segment_s *root, char *prefix,
+                     const char *after, const char *end, int limit,
+                     scan_page_s *page) {
+  mqtt_iter_cb_s cb = { .data = page, .fn = &scan_collect };
+  char after_buf[64];
+
+  page->topics[0] = '\0';
+  if (after) {
+    strcpy(after_buf, after);
+  }
+  return mqtt_topic_scan(root, prefix, after ? after_buf : NULL, end, limit,
+                         &cb);
+}
+
+/**
+ * Test ordered scans, and paging through them.
+ */
+void Test_mqtt_topic_scan(CuTest *tc) {
+  static char *scan_topics[] = { "b/a", "a/c", "ab/x", "a/b/c", "$sys/x" };
+  mqtt_topic_segment_s *root, *seg;
+  scan_page_s page;
+  char topic[64], prefix[16];
+  int total;
+
+  root = mqtt_topic_segment_create();
+  for (int i = 0; i < ARRAY_EL_COUNT(scan_topics); ++i) {
+    sprintf(topic, "%s", scan_topics[i]);
+    mqtt_topic_find_or_add(&seg, root, topic, 1);
+  }
+
+  CuAssertIntEquals(tc, 10, scan_page(root, NULL, NULL, NULL, 0, &page));
+  CuAssertStrEquals(tc, "$sys $sys/x a a/b a/b/c a/c ab ab/x b b/a ",
+                    page.topics);
+
+  /* Each page picks up after the last topic of the previous one. */
+  CuAssertIntEquals(tc, 3, scan_page(root, NULL, NULL, NULL, 3, &page));
+  CuAssertStrEquals(tc, "$sys $sys/x a ", page.topics);
+  CuAssertIntEquals(tc, 3, scan_page(root, NULL, page.last, NULL, 3, &page));
+  CuAssertStrEquals(tc, "a/b a/b/c a/c ", page.topics);
+  CuAssertIntEquals(tc, 3, scan_page(root, NULL, page.last, NULL, 3, &page));
+  CuAssertStrEquals(tc, "ab ab/x b ", page.topics);
+  CuAssertIntEquals(tc, 1, scan_page(root, NULL, page.last, NULL, 3, &page));
+  CuAssertStrEquals(tc, "b/a ", page.topics);
+  CuAssertIntEquals(tc, 0, scan_page(root, NULL, page.last, NULL, 3, &page));
+
+  /* The topic to resume after need not exist. */
+  CuAssertIntEquals(tc, 2, scan_page(root, NULL, "a/bb", NULL, 2, &page));
+  CuAssertStrEquals(tc, "a/c ab ", page.topics);
+  CuAssertIntEquals(tc, 2, scan_page(root, NULL, "a/a/z", NULL, 2, &page));
+  CuAssertStrEquals(tc, "a/b a/b/c ", page.topics);
+
+  /* Scans stop short of end. */
+  CuAssertIntEquals(tc, 6, scan_page(root, NULL, NULL, "ab", 0, &page));
+  CuAssertStrEquals(tc, "$sys $sys/x a a/b a/b/c a/c ", page.topics);
+  CuAssertIntEquals(tc, 2, scan_page(root, NULL, "a", "a/c", 0, &page));
+  CuAssertStrEquals(tc, "a/b a/b/c ", page.topics);
+
+  /* Prefixes restrict the scan to one subtree. */
+  sprintf(prefix, "a");
+  CuAssertIntEquals(tc, 4, scan_page(root, prefix, NULL, NULL, 0, &page));
+  CuAssertStrEquals(tc, "a a/b a/b/c a/c ", page.topics);
+  sprintf(prefix, "a/#");
+  CuAssertIntEquals(tc, 4, scan_page(root, prefix, "$sys", NULL, 0, &page));
+  CuAssertStrEquals(tc, "a/#", prefix);
+  CuAssertIntEquals(tc, 1, scan_page(root, prefix, "a/b/c", NULL, 0, &page));
+  CuAssertStrEquals(tc, "a/c ", page.topics);
+  CuAssertIntEquals(tc, 3, scan_page(root, prefix, "a", NULL, 0, &page));
+  CuAssertIntEquals(tc, 0, scan_page(root, prefix, "ab", NULL, 0, &page));
+  sprintf(prefix, "c");
+  CuAssertIntEquals(tc, 0, scan_page(root, prefix, NULL, NULL, 0, &page));
+
+  /* Paging through a wide root visits every topic once, though not
+   * in key order. */
+  mqtt_topic_segment_destroy(root);
+  root = mqtt_topic_segment_create();
+  CuAssertIntEquals(tc, 0, mqtt_topic_make_wide(root));
+  for (int i = 0; i < ARRAY_EL_COUNT(scan_topics); ++i) {
+    sprintf(topic, "%s", scan_topics[i]);
+    mqtt_topic_find_or_add(&seg, root, topic, 1);
+  }
+  total = scan_page(root, NULL, NULL, NULL, 2, &page);
+  while (total < 20 && page.topics[0] != '\0') {
+    total += scan_page(root, NULL, page.last, NULL, 2, &page);
+  }
+  CuAssertIntEquals(tc, 10, total);
+
+  mqtt_topic_segment_destroy(root);
+}
+
+typedef struct {
+  char added[256];
+  char removed[256];
+} diff_delta_s;
+
+static void diff_collect(void *data, int kind, char *topic,
+                         mqtt_topic_segment_s *segment) {
+  diff_delta_s *delta = data;
+  char *list = kind == MQTT_TOPIC_DIFF_ADDED ? delta->added : delta->removed;
+
+  strcat(list, topic);
+  strcat(list, " ");
+}
+
+static void diff_run(mqtt_topic_segment_s *from, mqtt_topic_segment_s *to,
+                     diff_delta_s *delta) {
+  mqtt_topic_diff_cb_s cb = { .data = delta, .fn = &diff_collect };
+
+  delta->added[0] = delta->removed[0] = '\0';
+  mqtt_topic_diff(from, to, &cb);
+}
+
+static void diff_set(void *data, char *topic, mqtt_topic_segment_s *segment) {
+  segment->data = data;
+}
+
+/**
+ * diff_update sets the data of topic in tree through mqtt_topic_update,
+ * so that the digests see it.
+ */
+static void diff_update(mqtt_topic_segment_s *tree, const char *topic,
+                        void *data) {
+  mqtt_iter_cb_s cb = { .data = data, .fn = &diff_set };
+  char buf[64];
+
+  sprintf(buf, "%s", topic);
+  mqtt_topic_update(tree, buf, &cb);
+}
+
+/**
+ * diff_apply applies a delta from diff_run to tree, one topic at a
+ * time.
+ */
+static void diff_apply(mqtt_topic_segment_s *tree, diff_delta_s *delta) {
+  char *topic;
+
+  for (topic = strtok(delta->removed, " "); topic; topic = strtok(NULL, " ")) {
+    diff_update(tree, topic, NULL);
+  }
+  for (topic = strtok(delta->added, " "); topic; topic = strtok(NULL, " ")) {
+    diff_update(tree, topic, tree);
+  }
+}
+
+/**
+ * Test comparing trees through their digests.
+ */
+void Test_mqtt_topic_diff(CuTest *tc) {
+  static char *diff_topics[] = { "a/b", "a/c/d", "a/c/e", "b", "c/x/y/z" };
+  mqtt_topic_segment_s *one, *two, *seg;
+  diff_delta_s delta;
+  char topic[64];
+  int n = ARRAY_EL_COUNT(diff_topics);
+
+  /* The same topics, added in opposite orders, before and after
+   * digests are enabled. */
+  one = mqtt_topic_segment_create();
+  two = mqtt_topic_segment_create();
+  mqtt_topic_digest_enable(one);
+  for (int i = 0; i < n; ++i) {
+    diff_update(one, diff_topics[i], one);
+    diff_update(two, diff_topics[n - 1 - i], two);
+  }
+  CuAssertTrue(tc, mqtt_topic_digest(two) == 0);
+  mqtt_topic_digest_enable(two);
+  CuAssertTrue(tc, mqtt_topic_digest(one) != 0);
+  CuAssertTrue(tc, mqtt_topic_digest(one) == mqtt_topic_digest(two));
+  diff_run(one, two, &delta);
+  CuAssertStrEquals(tc, "", delta.added);
+  CuAssertStrEquals(tc, "", delta.removed);
+
+  /* Segments without data count for nothing. */
+  sprintf(topic, "q/r");
+  mqtt_topic_find_or_add(&seg, two, topic, 1);
+  CuAssertTrue(tc, mqtt_topic_digest(one) == mqtt_topic_digest(two));
+  diff_run(one, two, &delta);
+  CuAssertStrEquals(tc, "", delta.added);
+  CuAssertStrEquals(tc, "", delta.removed);
+  mqtt_topic_segment_remove(seg);
+
+  /* Change two, and bring one up to date from the delta. */
+  diff_update(two, "a/c/f/g", two);
+  sprintf(topic, "c/#");
+  mqtt_topic_remove_prefix(two, topic, NULL);
+  diff_update(two, "a/b", NULL);
+  CuAssertTrue(tc, mqtt_topic_digest(one) != mqtt_topic_digest(two));
+
+  diff_run(one, two, &delta);
+  CuAssertStrEquals(tc, "a/c/f/g ", delta.added);
+  CuAssertStrEquals(tc, "a/b c/x/y/z ", delta.removed);
+  diff_apply(one, &delta);
+  CuAssertTrue(tc, mqtt_topic_digest(one) == mqtt_topic_digest(two));
+  diff_run(one, two, &delta);
+  CuAssertStrEquals(tc, "", delta.added);
+  CuAssertStrEquals(tc, "", delta.removed);
+
+  /* Data on a segment both trees have, set directly and then cleared
+   * before removing the segment. */
+  diff_update(two, "a/c", two);
+  CuAssertTrue(tc, mqtt_topic_digest(one) != mqtt_topic_digest(two));
+  diff_run(one, two, &delta);
+  CuAssertStrEquals(tc, "a/c ", delta.added);
+  CuAssertStrEquals(tc, "", delta.removed);
+  diff_run(two, one, &delta);
+  CuAssertStrEquals(tc, "", delta.added);
+  CuAssertStrEquals(tc, "a/c ", delta.removed);
+  sprintf(topic, "a/c");
+  mqtt_topic_find_or_add(&seg, two, topic, 0);
+  seg->data = NULL;
+  mqtt_topic_segment_remove(seg);
+  CuAssertTrue(tc, mqtt_topic_digest(one) == mqtt_topic_digest(two));
+
+  /* Without digests on both sides, every segment is compared. */
+  mqtt_topic_segment_destroy(two);
+  two = mqtt_topic_segment_create();
+  diff_update(two, "b", two);
+  diff_update(two, "a/c/e", two);
+  diff_run(one, two, &delta);
+  CuAssertStrEquals(tc, "", delta.added);
+  CuAssertStrEquals(tc, "a/c/d a/c/f/g ", delta.removed);
+
+  for (int i = 0; i < n; ++i) {
+    diff_update(one, diff_topics[i], NULL);
+    diff_update(two, diff_topics[i], NULL);
+  }
+  mqtt_topic_segment_destroy(one);
+  mqtt_topic_segment_destroy(two);
+}
+
+/**
+ * Test a topic at an intermediate segment of another one is seen by
+ * both the digests and the diff.
+ */
+void Test_mqtt_topic_diff_intermediate(CuTest *tc) {
+  mqtt_topic_segment_s *a = mqtt_topic_segment_create();
+  mqtt_topic_segment_s *b = mqtt_topic_segment_create();
+  diff_delta_s delta;
+
+  mqtt_topic_digest_enable(a);
+  mqtt_topic_digest_enable(b);
+  diff_update(a, "x/y/z", a);
+  diff_update(b, "x/y/z", b);
+  diff_update(b, "x/y", b);
+  CuAssertTrue(tc, mqtt_topic_digest(a) != mqtt_topic_digest(b));
+  diff_run(a, b, &delta);
+  CuAssertStrEquals(tc, "x/y ", delta.added);
+  CuAssertStrEquals(tc, "", delta.removed);
+
+  diff_apply(a, &delta);
+  CuAssertTrue(tc, mqtt_topic_digest(a) == mqtt_topic_digest(b));
+
+  /* Clearing the intermediate topic keeps the segment, as the one
+   * below needs it, but takes it out of the digest. */
+  diff_update(b, "x/y", NULL);
+  diff_run(a, b, &delta);
+  CuAssertStrEquals(tc, "", delta.added);
+  CuAssertStrEquals(tc, "x/y ", delta.removed);
+  diff_apply(a, &delta);
+  CuAssertTrue(tc, mqtt_topic_digest(a) == mqtt_topic_digest(b));
+
+  diff_update(a, "x/y/z", NULL);
+  diff_update(b, "x/y/z", NULL);
+  CuAssertTrue(tc, mqtt_topic_digest(a) == 0);
+  CuAssertTrue(tc, mqtt_topic_digest(b) == 0);
+  mqtt_topic_segment_destroy(a);
+  mqtt_topic_segment_destroy(b);
+}
+
+/**
+ * Test subsumption between filters, and minimal covers of a tree.
+ */
+void Test_mqtt_topic_cover(CuTest *tc) {
+  static char *cover_filters[] = { "a/b", "a/+",   "a/b/c", "x/+/z",
+                                   "x/y/z", "x/#", "$SYS/a", "d" };
+  mqtt_topic_segment_s *root, *seg;
+  mqtt_iter_cb_s cb;
+  char topic[64], buf[256];
+
+  CuAssertIntEquals(tc, 1, mqtt_topic_covers("a/b", "a/b"));
+  CuAssertIntEquals(tc, 1, mqtt_topic_covers("a/+", "a/b"));
+  CuAssertIntEquals(tc, 1, mqtt_topic_covers("a/+", "a/+"));
+  CuAssertIntEquals(tc, 0, mqtt_topic_covers("a/b", "a/+"));
+  CuAssertIntEquals(tc, 0, mqtt_topic_covers("a/+", "a/#"));
+  CuAssertIntEquals(tc, 0, mqtt_topic_covers("a/+", "a/b/c"));
+  CuAssertIntEquals(tc, 1, mqtt_topic_covers("a/#", "a"));
+  CuAssertIntEquals(tc, 1, mqtt_topic_covers("a/#", "a/+/#"));
+  CuAssertIntEquals(tc, 0, mqtt_topic_covers("a/+/#", "a/#"));
+  CuAssertIntEquals(tc, 0, mqtt_topic_covers("a", "a/#"));
+  CuAssertIntEquals(tc, 1, mqtt_topic_covers("#", "+/#"));
+  CuAssertIntEquals(tc, 1, mqtt_topic_covers("+/#", "#"));
+  CuAssertIntEquals(tc, 0, mqtt_topic_covers("#", "$SYS/a"));
+  CuAssertIntEquals(tc, 0, mqtt_topic_covers("+/a", "$SYS/a"));
+  CuAssertIntEquals(tc, 1, mqtt_topic_covers("$SYS/#", "$SYS/a"));
+
+  root = mqtt_topic_segment_create();
+  for (int i = 0; i < ARRAY_EL_COUNT(cover_filters); ++i) {
+    sprintf(topic, "%s", cover_filters[i]);
+    mqtt_topic_find_or_add(&seg, root, topic, 1);
+    seg->data = root;
+  }
+  cb = (mqtt_iter_cb_s){ .data = buf, .fn = &collect };
+
+  buf[0] = '\0';
+  sprintf(topic, "x/y/z");
+  mqtt_topic_covering_iter(root, topic, &cb);
+  CuAssertStrEquals(tc, "x/# x/+/z x/y/z ", buf);
+  CuAssertStrEquals(tc, "x/y/z", topic);
+  buf[0] = '\0';
+  sprintf(topic, "a/+");
+  mqtt_topic_covering_iter(root, topic, &cb);
+  CuAssertStrEquals(tc, "a/+ ", buf);
+
+  buf[0] = '\0';
+  sprintf(topic, "a/+");
+  mqtt_topic_covered_iter(root, topic, &cb);
+  CuAssertStrEquals(tc, "a/+ a/b ", buf);
+  buf[0] = '\0';
+  sprintf(topic, "x/#");
+  mqtt_topic_covered_iter(root, topic, &cb);
+  CuAssertStrEquals(tc, "x x/# x/+ x/+/z x/y x/y/z ", buf);
+  buf[0] = '\0';
+  sprintf(topic, "#");
+  mqtt_topic_covered_iter(root, topic, &cb);
+  CuAssertTrue(tc, strstr(buf, "$SYS") == NULL);
+
+  /* a/b is covered by a/+, and x/... by x/#; a/b/c and $SYS/a are
+   * covered by nothing else. */
+  buf[0] = '\0';
+  CuAssertIntEquals(tc, 0, mqtt_topic_minimal_cover(root, &cb));
+  CuAssertStrEquals(tc, "$SYS/a a/+ a/b/c d x/# ", buf);
+
+  buf[0] = '\0';
+  sprintf(topic, "#");
+  mqtt_topic_covering_iter(root, topic, &cb);
+  CuAssertStrEquals(tc, "", buf);
+
+  /* Of two filters covering each other, one is kept. */
+  sprintf(topic, "#");
+  mqtt_topic_find_or_add(&seg, root, topic, 1);
+  seg->data = root;
+  sprintf(topic, "+/#");
+  mqtt_topic_find_or_add(&seg, root, topic, 1);
+  seg->data = root;
+  buf[0] = '\0';
+  sprintf(topic, "#");
+  mqtt_topic_covering_iter(root, topic, &cb);
+  CuAssertStrEquals(tc, "# +/# ", buf);
+  buf[0] = '\0';
+  mqtt_topic_minimal_cover(root, &cb);
+  CuAssertTrue(tc, strcmp(buf, "# $SYS/a ") == 0 ||
+                   strcmp(buf, "$SYS/a +/# ") == 0);
+
+  mqtt_topic_segment_destroy(root);
+}
+
+#define EXPIRY_TOPICS 512
+
+typedef struct {
+  unsigned long deadlines[EXPIRY_TOPICS];
+  char expired[EXPIRY_TOPICS];
+  unsigned long now;
+  int bad;
+} expiry_state_s;
+
+static void expiry_collect(void *data, char *topic,
+                           mqtt_topic_segment_s *segment) {
+  expiry_state_s *e = data;
+  int i = atoi(topic + 2);
+
+  if (e->expired[i] || e->deadlines[i] == 0 || e->deadlines[i] > e->now) {
+    ++e->bad;
+  }
+  e->expired[i] = 1;
+  segment->data = NULL;
+}
+
+/**
+ * Test expiring topics at their deadlines, checked against the
+ * deadlines themselves.
+ */
+void Test_mqtt_topic_expiry(CuTest *tc) {
+  mqtt_topic_segment_s *root, *seg;
+  expiry_state_s e = { .now = 1000, .bad = 0 };
+  mqtt_iter_cb_s cb = { .data = &e, .fn = &expiry_collect };
+  unsigned int seed = 1;
+  char topic[64];
+  int expired;
+
+  root = mqtt_topic_segment_create();
+  sprintf(topic, "t/0");
+  mqtt_topic_find_or_add(&seg, root, topic, 1);
+  CuAssertIntEquals(tc, 1, mqtt_topic_expire_at(seg, 1));
+  CuAssertIntEquals(tc, 0, mqtt_topic_expiry_enable(root, e.now));
+
+  /* Deadlines already past, near, far, and beyond the whole wheel. */
+  for (int i = 0; i < EXPIRY_TOPICS; ++i) {
+    sprintf(topic, "t/%d", i);
+    mqtt_topic_find_or_add(&seg, root, topic, 1);
+    seg->data = root;
+    switch (i % 8) {
+    case 0:
+      e.deadlines[i] = e.now - rand_r(&seed) % 1000;
+      break;
+    case 1:
+      e.deadlines[i] = 0;
+      break;
+    case 2:
+      e.deadlines[i] = ~0ul - rand_r(&seed) % 1000;
+      break;
+    default:
+      e.deadlines[i] = e.now + 1 + rand_r(&seed) % (1 << (i % 24));
+    }
+    CuAssertIntEquals(tc, 0, mqtt_topic_expire_at(seg, e.deadlines[i]));
+  }
+
+  /* Move a few deadlines, and cancel a few. */
+  for (int i = 3; i < EXPIRY_TOPICS; i += 50) {
+    sprintf(topic, "t/%d", i);
+    mqtt_topic_find_or_add(&seg, root, topic, 0);
+    e.deadlines[i] = i % 100 == 3 ? 0 : e.now + 5000;
+    mqtt_topic_expire_at(seg, e.deadlines[i]);
+  }
+
+  /* Advance in steps of every size, checking that each topic expires
+   * by the first advance past its deadline. */
+  for (int step = 0; step < 64; ++step) {
+    e.now += step % 2 ? rand_r(&seed) % 64 : rand_r(&seed) % (1 << step % 30);
+    mqtt_topic_expiry_advance(root, e.now, &cb);
+    for (int i = 0; i < EXPIRY_TOPICS; ++i) {
+      if (e.deadlines[i] && e.deadlines[i] <= e.now && !e.expired[i]) {
+        ++e.bad;
+      }
+    }
+  }
+  CuAssertIntEquals(tc, 0, e.bad);
+
+  /* The rest either never expire or only at the end of time. */
+  expired = 0;
+  for (int i = 0; i < EXPIRY_TOPICS; ++i) {
+    sprintf(topic, "t/%d", i);
+    if (e.expired[i]) {
+      ++expired;
+      CuAssertIntEquals(tc, 1, mqtt_topic_find_or_add(&seg, root, topic, 0));
+    } else {
+      CuAssertTrue(tc, e.deadlines[i] == 0 || e.deadlines[i] > e.now);
+      CuAssertIntEquals(tc, 0, mqtt_topic_find_or_add(&seg, root, topic, 0));
+    }
+  }
+  CuAssertTrue(tc, expired > EXPIRY_TOPICS / 2);
+
+  /* Removing a topic takes its deadline away with it. */
+  sprintf(topic, "t/#");
+  mqtt_topic_remove_prefix(root, topic, NULL);
+  CuAssertIntEquals(tc, 0, mqtt_topic_expiry_advance(root, ~0ul, &cb));
+
+  mqtt_topic_segment_destroy(root);
+}
+
+typedef struct {
+  unsigned long now;
+  int calls;
+  /* 0 clears data, 1 keeps it, 2 sets a deadline already reached,
+   * 3 cancels the deadline. */
+  int mode;
+} expiry_rearm_s;
+
+static void expiry_rearm(void *data, char *topic,
+                         mqtt_topic_segment_s *segment) {
+  expiry_rearm_s *r = data;
+
+  ++r->calls;
+  switch (r->mode) {
+  case 0:
+    segment->data = NULL;
+    break;
+  case 2:
+    mqtt_topic_expire_at(segment, r->now);
+    break;
+  case 3:
+    mqtt_topic_expire_at(segment, 0);
+    break;
+  }
+}
+
+/**
+ * Test expiring topics whose callback does not clear them: each stays
+ * in the tree and is only counted once its data is cleared.
+ */
+void Test_mqtt_topic_expiry_kept(CuTest *tc) {
+  mqtt_topic_segment_s *root = mqtt_topic_segment_create(), *seg;
+  expiry_rearm_s r = { .now = 10 };
+  mqtt_iter_cb_s cb = { .data = &r, .fn = &expiry_rearm };
+  char topic[64];
+
+  CuAssertIntEquals(tc, 0, mqtt_topic_expiry_enable(root, r.now));
+  strcpy(topic, "k/1");
+  mqtt_topic_find_or_add(&seg, root, topic, 1);
+  seg->data = root;
+  mqtt_topic_expire_at(seg, 5);
+
+  /* Made due again at once: passed to cb once per advance. */
+  r.mode = 2;
+  CuAssertIntEquals(tc, 0, mqtt_topic_expiry_advance(root, r.now, &cb));
+  CuAssertIntEquals(tc, 1, r.calls);
+  CuAssertIntEquals(tc, 0, mqtt_topic_expiry_advance(root, r.now, &cb));
+  CuAssertIntEquals(tc, 2, r.calls);
+
+  /* Left holding data, with or without a callback: still due. */
+  r.mode = 1;
+  r.now = 100;
+  CuAssertIntEquals(tc, 0, mqtt_topic_expiry_advance(root, r.now, &cb));
+  CuAssertIntEquals(tc, 3, r.calls);
+  CuAssertIntEquals(tc, 0, mqtt_topic_expiry_advance(root, r.now, NULL));
+  CuAssertIntEquals(tc, 0, mqtt_topic_expiry_advance(root, r.now, &cb));
+  CuAssertIntEquals(tc, 4, r.calls);
+  CuAssertIntEquals(tc, 0, mqtt_topic_find_or_add(&seg, root, topic, 0));
+
+  /* Cleared at last. */
+  r.mode = 0;
+  CuAssertIntEquals(tc, 1, mqtt_topic_expiry_advance(root, r.now, &cb));
+  CuAssertIntEquals(tc, 1, mqtt_topic_find_or_add(&seg, root, topic, 0));
+
+  /* A cancelled deadline is not made due again. */
+  mqtt_topic_find_or_add(&seg, root, topic, 1);
+  seg->data = root;
+  mqtt_topic_expire_at(seg, r.now);
+  r.mode = 3;
+  CuAssertIntEquals(tc, 0, mqtt_topic_expiry_advance(root, r.now, &cb));
+  CuAssertIntEquals(tc, 0, mqtt_topic_expiry_advance(root, r.now + 1, &cb));
+  CuAssertIntEquals(tc, 6, r.calls);
+  CuAssertIntEquals(tc, 0, mqtt_topic_find_or_add(&seg, root, topic, 0));
+
+  seg->data = NULL;
+  mqtt_topic_segment_remove(seg);
+  mqtt_topic_segment_destroy(root);
+}
+
+/**
+ * fused_expect checks that results hold the same segments as a plain
+ * match of topic against root, or none at all if empty is set.
+ */
+static void fused_expect(CuTest *tc, mqtt_topic_segment_s *root, char *topic,
+                         mqtt_topic_results_s *r, int empty) {
+  mqtt_topic_results_s expected;
+
+  mqtt_topic_results_init(&expected);
+  if (!empty) {
+    mqtt_topic_matching_collect(root, topic, &expected);
+  }
+  CuAssertIntEquals(tc, expected.count, r->count);
+  if (r->count == 0) {
+    mqtt_topic_results_free(&expected);
+    return;
+  }
+  qsort(expected.segments, expected.count, sizeof(void *), &segment_cmp);
+  qsort(r->segments, r->count, sizeof(void *), &segment_cmp);
+  for (int i = 0; i < r->count; ++i) {
+    CuAssertPtrEquals(tc, expected.segments[i], r->segments[i]);
+  }
+  mqtt_topic_results_free(&expected);
+}
+
+/**
+ * Test matching an ACL tree gating a subscription tree in one walk.
+ */
+void Test_mqtt_topic_fused(CuTest *tc) {
+  static char *acls[] = { "a/#", "b/+/c", "$SYS/x", "d/e" };
+  static char *subs[] = { "#", "a/b", "a/+/c", "+/+/c", "b/#", "d/e/f",
+                          "d/+", "$SYS/#", "a/b/c/#" };
+  static char *topics[] = { "a", "a/b", "a/b/c", "b/x/c", "b/x/d", "d/e",
+                            "d/e/f", "$SYS/x", "c", "b" };
+  mqtt_topic_segment_s *acl, *sub, *seg;
+  mqtt_topic_results_s acl_r, sub_r;
+  mqtt_iter_cb_s acl_cb, sub_cb;
+  mqtt_topic_fused_s *f;
+  char topic[64];
+  int rc, allowed;
+
+  acl = mqtt_topic_segment_create();
+  sub = mqtt_topic_segment_create();
+  for (int i = 0; i < ARRAY_EL_COUNT(acls); ++i) {
+    sprintf(topic, "%s", acls[i]);
+    mqtt_topic_find_or_add(&seg, acl, topic, 1);
+    seg->data = acl;
+  }
+  for (int i = 0; i < ARRAY_EL_COUNT(subs); ++i) {
+    sprintf(topic, "%s", subs[i]);
+    mqtt_topic_find_or_add(&seg, sub, topic, 1);
+    seg->data = sub;
+  }
+
+  mqtt_topic_results_init(&acl_r);
+  mqtt_topic_results_init(&sub_r);
+  acl_cb = mqtt_topic_results_cb(&acl_r);
+  sub_cb = mqtt_topic_results_cb(&sub_r);
+  f = mqtt_topic_fused_create();
+  CuAssertIntEquals(tc, 0, mqtt_topic_fused_add(f, sub, &sub_cb, 0));
+  CuAssertIntEquals(tc, 0, mqtt_topic_fused_add(f, acl, &acl_cb, 1));
+
+  for (int i = 0; i < ARRAY_EL_COUNT(topics); ++i) {
+    mqtt_topic_results_clear(&acl_r);
+    mqtt_topic_results_clear(&sub_r);
+    sprintf(topic, "%s", topics[i]);
+    rc = mqtt_topic_fused_matching_iter(f, topic);
+    CuAssertStrEquals(tc, topics[i], topic);
+
+    /* Allowed if a topic with data in the ACL tree matches. */
+    allowed = 0;
+    for (int j = 0; j < acl_r.count; ++j) {
+      allowed |= acl_r.segments[j]->data != NULL;
+    }
+    CuAssertIntEquals(tc, !allowed, rc);
+    fused_expect(tc, sub, topic, &sub_r, !allowed);
+    if (allowed) {
+      fused_expect(tc, acl, topic, &acl_r, 0);
+    }
+  }
+
+  /* Without a gate, every tree is matched in full. */
+  mqtt_topic_fused_destroy(f);
+  f = mqtt_topic_fused_create();
+  mqtt_topic_fused_add(f, sub, &sub_cb, 0);
+  mqtt_topic_fused_add(f, acl, &acl_cb, 0);
+  for (int i = 0; i < ARRAY_EL_COUNT(topics); ++i) {
+    mqtt_topic_results_clear(&acl_r);
+    mqtt_topic_results_clear(&sub_r);
+    sprintf(topic, "%s", topics[i]);
+    CuAssertIntEquals(tc, 0, mqtt_topic_fused_matching_iter(f, topic));
+    fused_expect(tc, sub, topic, &sub_r, 0);
+    fused_expect(tc, acl, topic, &acl_r, 0);
+  }
+
+  mqtt_topic_fused_destroy(f);
+  mqtt_topic_results_free(&acl_r);
+  mqtt_topic_results_free(&sub_r);
+  mqtt_topic_segment_destroy(acl);
+  mqtt_topic_segment_destroy(sub);
+}
+
+#define FIND_MANY_TOPICS 200
+
+/**
+ * Test interleaved lookups against one lookup at a time.
+ */
+void Test_mqtt_topic_find_many(CuTest *tc) {
+  mqtt_topic_segment_s *root, *wide, *found[FIND_MANY_TOPICS], *seg;
+  char *topics[FIND_MANY_TOPICS], buf[64];
+  unsigned int seed = 1;
+  int expected = 0, rc;
+
+  root = mqtt_topic_segment_create();
+  sprintf(buf, "w");
+  mqtt_topic_find_or_add(&wide, root, buf, 1);
+  CuAssertIntEquals(tc, 0, mqtt_topic_make_wide(wide));
+
+  /* Single children, children trees, a wide segment and keys too long
+   * to be inline, half of them present. */
+  for (int i = 0; i < FIND_MANY_TOPICS; ++i) {
+    switch (i % 4) {
+    case 0:
+      sprintf(buf, "only/%d/chain", i);
+      break;
+    case 1:
+      sprintf(buf, "t/%d/%d", rand_r(&seed) % 8, rand_r(&seed) % 8);
+      break;
+    case 2:
+      sprintf(buf, "w/%d", i);
+      break;
+    default:
+      sprintf(buf, "long-segment-key-%d/and-another-long-one", i);
+    }
+    topics[i] = strdup(buf);
+    if (i % 2) {
+      mqtt_topic_find_or_add(&seg, root, buf, 1);
+    }
+  }
+
+  for (int i = 0; i < FIND_MANY_TOPICS; ++i) {
+    expected += mqtt_topic_find_or_add(&seg, root, topics[i], 0) == 0;
+  }
+  CuAssertIntEquals(tc, expected, mqtt_topic_find_many(root, topics,
+                                                       FIND_MANY_TOPICS,
+                                                       found));
+  for (int i = 0; i < FIND_MANY_TOPICS; ++i) {
+    rc = mqtt_topic_find_or_add(&seg, root, topics[i], 0);
+    CuAssertPtrEquals(tc, rc == 0 ? seg : NULL, found[i]);
+  }
+
+  /* Fewer topics than lookups in flight. */
+  CuAssertIntEquals(tc, 1, mqtt_topic_find_many(root, topics + 1, 1, found));
+  CuAssertIntEquals(tc, 0, mqtt_topic_find_many(root, topics, 0, found));
+
+  for (int i = 0; i < FIND_MANY_TOPICS; ++i) {
+    free(topics[i]);
+  }
+  mqtt_topic_segment_destroy(root);
+}
+
+typedef struct {
+  char last[64];
+  int count;
+  int unordered;
+} order_check_s;
+
+static void order_check(void *data, char *topic,
+                        mqtt_topic_segment_s *segment) {
+  order_check_s *check = data;
+
+  if (check->count++ > 0 && strcmp(check->last, topic) >= 0) {
+    ++check->unordered;
+  }
+  strcpy(check->last, topic);
+}
+
+/**
+ * Test children moving between the children tree and a sorted array
+ * as their number changes.
+ */
+void Test_mqtt_topic_child_array(CuTest *tc) {
+  mqtt_topic_segment_s *root, *parent, *seg, *found[300];
+  order_check_s check = { .count = 0 };
+  mqtt_iter_cb_s cb = { .data = &check, .fn = &order_check };
+  char buf[64], *topics[300];
+  int i;
+
+  root = mqtt_topic_segment_create();
+  /* Keep the parent while it has no children. */
+  sprintf(buf, "p");
+  mqtt_topic_find_or_add(&parent, root, buf, 1);
+  parent->data = parent;
+  for (i = 0; i < 300; ++i) {
+    /* Out of key order, with keys too long to be inline as well. */
+    sprintf(buf, i % 3 ? "p/%03d" : "p/%03d-with-a-long-segment-key",
+            (i * 7) % 300);
+    CuAssertIntEquals(tc, 0, mqtt_topic_find_or_add(&seg, root, buf, 1));
+    seg->data = seg;
+    if (i + 1 < 8 || i + 1 > 256) {
+      CuAssertPtrEquals(tc, NULL, parent->child_array);
+    } else {
+      CuAssertPtrNotNull(tc, parent->child_array);
+      CuAssertPtrEquals(tc, NULL, mqtt_rb_root(&parent->children));
+    }
+    topics[i] = strdup(buf);
+  }
+
+  /* Lookups, iteration and batched lookups find every child, whether
+   * the children are in the array or back in the tree. */
+  for (int round = 0; round < 2; ++round) {
+    for (i = 0; i < 300; ++i) {
+      CuAssertIntEquals(tc, round == 0 || i >= 200,
+                        mqtt_topic_find_or_add(&seg, root, topics[i], 0) == 0);
+    }
+    sprintf(buf, "p/999");
+    CuAssertIntEquals(tc, 1, mqtt_topic_find_or_add(&seg, root, buf, 0));
+    CuAssertIntEquals(tc, round ? 100 : 300,
+                      mqtt_topic_find_many(root, topics, 300, found));
+    /* Compiled patterns find children by the hash of each level. */
+    for (i = round ? 200 : 0; i < 300; ++i) {
+      mqtt_topic_pattern_s *p = mqtt_topic_pattern_compile(topics[i]);
+      int count = 0;
+      mqtt_iter_cb_s count_cb = { .data = &count, .fn = &counter };
+
+      mqtt_topic_pattern_matching_iter(root, p, &count_cb);
+      CuAssertIntEquals(tc, 1, count);
+      mqtt_topic_pattern_destroy(p);
+    }
+    check = (order_check_s){ .count = 0 };
+    mqtt_topic_iter(root, &cb);
+    CuAssertIntEquals(tc, round ? 101 : 301, check.count);
+    CuAssertIntEquals(tc, 0, check.unordered);
+
+    if (round == 0) {
+      /* Shrink below ARRAY_MIN, then grow back into an array. */
+      for (i = 0; i < 300; ++i) {
+        mqtt_topic_find_or_add(&seg, root, topics[i], 0);
+        seg->data = NULL;
+        mqtt_topic_segment_remove(seg);
+      }
+      CuAssertPtrEquals(tc, NULL, mqtt_rb_root(&parent->children));
+      CuAssertPtrEquals(tc, NULL, parent->child_array);
+      for (i = 299; i >= 200; --i) {
+        mqtt_topic_find_or_add(&seg, root, topics[i], 1);
+        seg->data = seg;
+      }
+      CuAssertPtrNotNull(tc, parent->child_array);
+    }
+  }
+
+  /* Removals from the array, down past ARRAY_MIN / 2. */
+  for (i = 200; i < 298; ++i) {
+    mqtt_topic_find_or_add(&seg, root, topics[i], 0);
+    seg->data = NULL;
+    mqtt_topic_segment_remove(seg);
+    CuAssertIntEquals(tc, 1, mqtt_topic_find_or_add(&seg, root, topics[i], 0));
+    CuAssertIntEquals(tc, 0, mqtt_topic_find_or_add(&seg, root, topics[299], 0));
+  }
+  CuAssertPtrEquals(tc, NULL, parent->child_array);
+  CuAssertIntEquals(tc, 0, mqtt_topic_find_or_add(&seg, root, topics[298], 0));
+
+  for (i = 0; i < 300; ++i) {
+    free(topics[i]);
+  }
+  mqtt_topic_segment_destroy(root);
+}
+
+#define SNAP_TOPICS 10
+
+static void snap_set(void *data, char *topic, mqtt_topic_segment_s *segment) {
+  segment->data = data;
+}
+
+static void snap_update(mqtt_topic_segment_s *root, const char *topic,
+                        void *data) {
+  mqtt_iter_cb_s cb = { .data = data, .fn = &snap_set };
+  char buf[64];
+
+  sprintf(buf, "%s", topic);
+  mqtt_topic_update(root, buf, &cb);
+}
+
+/* Stores the value of s/<i> at seen[i], and counts other topics. */
+static void snap_collect(void *data, const char *topic, void *value) {
+  void **seen = data;
+  int i;
+
+  if (sscanf(topic, "s/%d", &i) == 1 && i >= 0 && i < SNAP_TOPICS) {
+    seen[i] = value;
+  } else {
+    seen[SNAP_TOPICS] = value;
+  }
+}
+
+static void snap_check(CuTest *tc, mqtt_topic_snapshot_s *snapshot,
+                       void **expect) {
+  void *seen[SNAP_TOPICS + 1] = { NULL };
+  mqtt_topic_snapshot_cb_s cb = { .data = seen, .fn = &snap_collect };
+
+  mqtt_topic_snapshot_iter(snapshot, &cb);
+  for (int i = 0; i <= SNAP_TOPICS; ++i) {
+    CuAssertPtrEquals(tc, expect[i], seen[i]);
+  }
+}
+
+/**
+ * Test snapshots keep seeing the data topics held when they began
+ * while the tree changes, and that what they kept is released once
+ * they end.
+ */
+void Test_mqtt_topic_snapshot(CuTest *tc) {
+  mqtt_topic_segment_s *root = mqtt_topic_segment_create(), *seg;
+  int first[SNAP_TOPICS], second[SNAP_TOPICS], third[SNAP_TOPICS];
+  void *expect1[SNAP_TOPICS + 1] = { NULL }, *expect2[SNAP_TOPICS + 1];
+  mqtt_topic_snapshot_s *snap1, *snap2;
+  char topic[64];
+
+  for (int i = 0; i < 8; ++i) {
+    sprintf(topic, "s/%d", i);
+    snap_update(root, topic, &first[i]);
+    expect1[i] = &first[i];
+  }
+  snap_update(root, "d/e/f", &first[9]);
+  expect1[SNAP_TOPICS] = &first[9];
+
+  snap1 = mqtt_topic_snapshot_begin(root);
+  CuAssertPtrNotNull(tc, snap1);
+  snap_update(root, "s/0", &second[0]);
+  snap_update(root, "s/1", NULL);
+  snap_update(root, "s/2", &second[2]);
+  snap_update(root, "s/2", &third[2]);
+  snap_update(root, "s/8", &second[8]);
+  snap_update(root, "d/e/f", NULL);
+  memcpy(expect2, expect1, sizeof(expect2));
+  expect2[0] = &second[0];
+  expect2[1] = NULL;
+  expect2[2] = &third[2];
+  expect2[8] = &second[8];
+  expect2[SNAP_TOPICS] = NULL;
+
+  snap2 = mqtt_topic_snapshot_begin(root);
+  CuAssertPtrNotNull(tc, snap2);
+  snap_update(root, "s/0", &third[0]);
+  snap_update(root, "s/1", &third[1]);
+  snap_update(root, "s/3", NULL);
+  snap_update(root, "s/8", NULL);
+  snap_update(root, "s/9", &third[9]);
+  snap_check(tc, snap1, expect1);
+  snap_check(tc, snap2, expect2);
+
+  /* Emptied segments stay until no snapshot may need them. */
+  strcpy(topic, "s/3");
+  CuAssertIntEquals(tc, 0, mqtt_topic_find_or_add(&seg, root, topic, 0));
+  CuAssertPtrEquals(tc, NULL, seg->data);
+  strcpy(topic, "d/e/f");
+  CuAssertIntEquals(tc, 0, mqtt_topic_find_or_add(&seg, root, topic, 0));
+
+  mqtt_topic_snapshot_end(snap1);
+  snap_check(tc, snap2, expect2);
+  strcpy(topic, "s/3");
+  CuAssertIntEquals(tc, 0, mqtt_topic_find_or_add(&seg, root, topic, 0));
+  /* No open snapshot needs d/e/f any more, but it stays listed. */
+  strcpy(topic, "d/e/f");
+  CuAssertIntEquals(tc, 0, mqtt_topic_find_or_add(&seg, root, topic, 0));
+
+  mqtt_topic_snapshot_end(snap2);
+  strcpy(topic, "s/3");
+  CuAssertIntEquals(tc, 1, mqtt_topic_find_or_add(&seg, root, topic, 0));
+  strcpy(topic, "s/8");
+  CuAssertIntEquals(tc, 1, mqtt_topic_find_or_add(&seg, root, topic, 0));
+  strcpy(topic, "d");
+  CuAssertIntEquals(tc, 1, mqtt_topic_find_or_add(&seg, root, topic, 0));
+
+  /* Versions left over are dropped by the next change. */
+  strcpy(topic, "s/0");
+  CuAssertIntEquals(tc, 0, mqtt_topic_find_or_add(&seg, root, topic, 0));
+  CuAssertPtrNotNull(tc, seg->versions);
+  snap_update(root, "s/0", &first[0]);
+  CuAssertPtrEquals(tc, NULL, seg->versions);
+
+  /* Without open snapshots, updates keep no versions at all. */
+  snap_update(root, "s/2", &first[2]);
+  strcpy(topic, "s/2");
+  CuAssertIntEquals(tc, 0, mqtt_topic_find_or_add(&seg, root, topic, 0));
+  CuAssertPtrEquals(tc, NULL, seg->versions);
+
+  for (int i = 0; i < SNAP_TOPICS; ++i) {
+    sprintf(topic, "s/%d", i);
+    snap_update(root, topic, NULL);
+  }
+  mqtt_topic_segment_destroy(root);
+}
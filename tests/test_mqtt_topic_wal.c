@@ -0,0 +1,247 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "CuTest.h"
+
+#include "mqtt_topic_wal.h"
+
+#define WAL_THREADS 4
+#define WAL_RECORDS 100
+
+/* Segment data in these tests is a malloc'd int, logged as is. */
+static void *wal_load(void *data, const void *payload, size_t len) {
+  int *value = malloc(sizeof(int));
+
+  if (value) {
+    memcpy(value, payload, sizeof(int));
+  }
+  return value;
+}
+
+static void wal_release(void *data, void *value) {
+  free(value);
+}
+
+static size_t wal_save(void *data, void *value, void *buf, size_t size) {
+  if (size >= sizeof(int)) {
+    memcpy(buf, value, sizeof(int));
+  }
+  return sizeof(int);
+}
+
+static const mqtt_topic_wal_codec_s wal_codec = {
+  .load = &wal_load, .release = &wal_release, .save = &wal_save,
+};
+
+static void wal_free_data(void *data, char *topic,
+                          mqtt_topic_segment_s *segment) {
+  free(segment->data);
+  segment->data = NULL;
+}
+
+static void wal_tree_destroy(mqtt_topic_segment_s *root) {
+  mqtt_iter_cb_s cb = { .fn = &wal_free_data };
+
+  mqtt_topic_iter(root, &cb);
+  mqtt_topic_segment_destroy(root);
+}
+
+/**
+ * wal_value returns the data of topic as an int, -1 if the topic has
+ * no data, or -2 if it is not in the tree.
+ */
+static int wal_value(mqtt_topic_segment_s *root, const char *topic) {
+  mqtt_topic_segment_s *segment;
+  char buf[64];
+
+  strcpy(buf, topic);
+  if (mqtt_topic_find_or_add(&segment, root, buf, 0) != 0) {
+    return -2;
+  }
+  return segment->data ? *(int *)segment->data : -1;
+}
+
+/**
+ * wal_set changes topic in root and logs the change.
+ */
+static void wal_set(CuTest *tc, mqtt_topic_wal_s *w,
+                    mqtt_topic_segment_s *root, int type, const char *topic,
+                    int value) {
+  mqtt_topic_segment_s *segment;
+  char buf[64];
+
+  strcpy(buf, topic);
+  CuAssertIntEquals(tc, 0, mqtt_topic_find_or_add(&segment, root, buf, 1));
+  free(segment->data);
+  segment->data = NULL;
+  if (value >= 0) {
+    segment->data = wal_load(NULL, &value, sizeof(value));
+  }
+  if (type == MQTT_TOPIC_WAL_REMOVE) {
+    mqtt_topic_segment_remove(segment);
+  }
+  CuAssertIntEquals(tc, 0, mqtt_topic_wal_append(
+                               w, type, topic, &value,
+                               value >= 0 ? sizeof(value) : 0, NULL));
+}
+
+static long wal_file_size(const char *path) {
+  struct stat st;
+
+  return stat(path, &st) == 0 ? st.st_size : -1;
+}
+
+static void wal_paths(char *dir, char *log, char *snap) {
+  strcpy(dir, "/tmp/mqtt_topic_wal_XXXXXX");
+  mkdtemp(dir);
+  sprintf(log, "%s/log", dir);
+  sprintf(snap, "%s/log.snap", dir);
+}
+
+/**
+ * Test logging, replaying, checkpointing and recovering from a torn
+ * record.
+ */
+void Test_mqtt_topic_wal(CuTest *tc) {
+  char dir[64], log[80], snap[80];
+  mqtt_topic_segment_s *root, *copy;
+  mqtt_topic_wal_s *w;
+  unsigned long lsn;
+  FILE *f;
+  long size;
+
+  wal_paths(dir, log, snap);
+  root = mqtt_topic_segment_create();
+  w = mqtt_topic_wal_open(log, root, &wal_codec);
+  CuAssertPtrNotNull(tc, w);
+
+  wal_set(tc, w, root, MQTT_TOPIC_WAL_ADD, "a/b", 1);
+  wal_set(tc, w, root, MQTT_TOPIC_WAL_ADD, "a/c", 2);
+  wal_set(tc, w, root, MQTT_TOPIC_WAL_SET, "a/b", 3);
+  wal_set(tc, w, root, MQTT_TOPIC_WAL_ADD, "x/y/z", -1);
+  wal_set(tc, w, root, MQTT_TOPIC_WAL_ADD, "x/y", 5);
+  wal_set(tc, w, root, MQTT_TOPIC_WAL_REMOVE, "a/c", -1);
+  CuAssertIntEquals(tc, 0, mqtt_topic_wal_append(w, MQTT_TOPIC_WAL_SET, "a",
+                                                 NULL, 0, &lsn));
+  CuAssertIntEquals(tc, 7, lsn);
+  CuAssertIntEquals(tc, 0, mqtt_topic_wal_commit(w, lsn));
+  CuAssertIntEquals(tc, 0, mqtt_topic_wal_close(w));
+
+  copy = mqtt_topic_segment_create();
+  w = mqtt_topic_wal_open(log, copy, &wal_codec);
+  CuAssertPtrNotNull(tc, w);
+  CuAssertIntEquals(tc, 3, wal_value(copy, "a/b"));
+  CuAssertIntEquals(tc, -2, wal_value(copy, "a/c"));
+  CuAssertIntEquals(tc, -1, wal_value(copy, "a"));
+  CuAssertIntEquals(tc, -1, wal_value(copy, "x/y/z"));
+  CuAssertIntEquals(tc, 5, wal_value(copy, "x/y"));
+
+  /* A checkpoint empties the log. */
+  CuAssertIntEquals(tc, 0, mqtt_topic_wal_checkpoint(w, copy, &wal_codec));
+  CuAssertIntEquals(tc, 0, wal_file_size(log));
+  CuAssertTrue(tc, wal_file_size(snap) > 0);
+  wal_set(tc, w, copy, MQTT_TOPIC_WAL_SET, "a/b", 4);
+  CuAssertIntEquals(tc, 0, mqtt_topic_wal_close(w));
+  wal_tree_destroy(copy);
+
+  copy = mqtt_topic_segment_create();
+  w = mqtt_topic_wal_open(log, copy, &wal_codec);
+  CuAssertPtrNotNull(tc, w);
+  CuAssertIntEquals(tc, 4, wal_value(copy, "a/b"));
+  CuAssertIntEquals(tc, -1, wal_value(copy, "x/y/z"));
+  CuAssertIntEquals(tc, 5, wal_value(copy, "x/y"));
+  CuAssertIntEquals(tc, 0, mqtt_topic_wal_close(w));
+  wal_tree_destroy(copy);
+
+  /* A record cut short by a crash is dropped, and appends go after
+   * the last whole record. */
+  size = wal_file_size(log);
+  f = fopen(log, "a");
+  fwrite("\x02\x03\x04" "a/", 1, 5, f);
+  fclose(f);
+  copy = mqtt_topic_segment_create();
+  w = mqtt_topic_wal_open(log, copy, &wal_codec);
+  CuAssertPtrNotNull(tc, w);
+  CuAssertIntEquals(tc, size, wal_file_size(log));
+  CuAssertIntEquals(tc, 4, wal_value(copy, "a/b"));
+  wal_set(tc, w, copy, MQTT_TOPIC_WAL_ADD, "a/d", 6);
+  CuAssertIntEquals(tc, 0, mqtt_topic_wal_close(w));
+  wal_tree_destroy(copy);
+
+  copy = mqtt_topic_segment_create();
+  w = mqtt_topic_wal_open(log, copy, &wal_codec);
+  CuAssertPtrNotNull(tc, w);
+  CuAssertIntEquals(tc, 6, wal_value(copy, "a/d"));
+  CuAssertIntEquals(tc, 0, mqtt_topic_wal_close(w));
+  wal_tree_destroy(copy);
+
+  wal_tree_destroy(root);
+  unlink(log);
+  unlink(snap);
+  rmdir(dir);
+}
+
+typedef struct {
+  mqtt_topic_wal_s *w;
+  int id;
+  int failed;
+} wal_thread_s;
+
+static void *wal_appender(void *arg) {
+  wal_thread_s *t = arg;
+  unsigned long lsn;
+  char topic[32];
+
+  for (int i = 0; i < WAL_RECORDS; ++i) {
+    sprintf(topic, "t%d/%d", t->id, i);
+    if (mqtt_topic_wal_append(t->w, MQTT_TOPIC_WAL_SET, topic, &i, sizeof(i),
+                              &lsn) != 0 ||
+        mqtt_topic_wal_commit(t->w, lsn) != 0) {
+      ++t->failed;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Test threads committing at once.
+ */
+void Test_mqtt_topic_wal_group_commit(CuTest *tc) {
+  char dir[64], log[80], snap[80], topic[32];
+  wal_thread_s threads[WAL_THREADS];
+  pthread_t tids[WAL_THREADS];
+  mqtt_topic_segment_s *root;
+  mqtt_topic_wal_s *w;
+
+  wal_paths(dir, log, snap);
+  root = mqtt_topic_segment_create();
+  w = mqtt_topic_wal_open(log, root, &wal_codec);
+  CuAssertPtrNotNull(tc, w);
+  for (int i = 0; i < WAL_THREADS; ++i) {
+    threads[i] = (wal_thread_s){ .w = w, .id = i };
+    pthread_create(&tids[i], NULL, &wal_appender, &threads[i]);
+  }
+  for (int i = 0; i < WAL_THREADS; ++i) {
+    pthread_join(tids[i], NULL);
+    CuAssertIntEquals(tc, 0, threads[i].failed);
+  }
+  CuAssertIntEquals(tc, 0, mqtt_topic_wal_close(w));
+
+  w = mqtt_topic_wal_open(log, root, &wal_codec);
+  CuAssertPtrNotNull(tc, w);
+  for (int i = 0; i < WAL_THREADS; ++i) {
+    for (int j = 0; j < WAL_RECORDS; ++j) {
+      sprintf(topic, "t%d/%d", i, j);
+      CuAssertIntEquals(tc, j, wal_value(root, topic));
+    }
+  }
+  CuAssertIntEquals(tc, 0, mqtt_topic_wal_close(w));
+
+  wal_tree_destroy(root);
+  unlink(log);
+  rmdir(dir);
+}